@@ -0,0 +1,273 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/cbr_model_reader.h"
+
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/types/span.h"
+#include "tensorflow_lite_support/cc/port/status_macros.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+namespace {
+
+// Constant tensors of a model, by name.
+class ConstTensors {
+ public:
+  explicit ConstTensors(const ::tflite::Model& model) : model_(model) {
+    const ::tflite::SubGraph* subgraph = model.subgraphs()->Get(0);
+    if (subgraph->tensors() == nullptr) return;
+    for (const ::tflite::Tensor* tensor : *subgraph->tensors()) {
+      if (tensor->name() != nullptr) tensors_[tensor->name()->str()] = tensor;
+    }
+  }
+
+  // Returns the tensor named `name`, or nullptr.
+  const ::tflite::Tensor* Find(const std::string& name) const {
+    auto itr = tensors_.find(name);
+    return itr == tensors_.end() ? nullptr : itr->second;
+  }
+
+  // Returns the data of `tensor` if it holds `num_elements` elements of type
+  // `type`.
+  template <typename T>
+  tflite::support::StatusOr<absl::Span<const T>> Data(
+      const ::tflite::Tensor& tensor, ::tflite::TensorType type,
+      int64_t num_elements) const {
+    const auto* buffers = model_.buffers();
+    const ::tflite::Buffer* buffer =
+        buffers != nullptr && tensor.buffer() < buffers->size()
+            ? buffers->Get(tensor.buffer())
+            : nullptr;
+    if (tensor.type() != type || buffer == nullptr ||
+        buffer->data() == nullptr ||
+        buffer->data()->size() != num_elements * sizeof(T)) {
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "Unexpected type or size of the constant tensor '%s'.",
+          tensor.name()->str()));
+    }
+    return absl::MakeConstSpan(
+        reinterpret_cast<const T*>(buffer->data()->data()), num_elements);
+  }
+
+ private:
+  const ::tflite::Model& model_;
+  absl::flat_hash_map<std::string, const ::tflite::Tensor*> tensors_;
+};
+
+int64_t NumElements(const ::tflite::Tensor& tensor) {
+  int64_t num_elements = 1;
+  if (tensor.shape() == nullptr) return 0;
+  for (int32_t dim : *tensor.shape()) num_elements *= dim;
+  return num_elements;
+}
+
+int32_t LastDim(const ::tflite::Tensor& tensor) {
+  return tensor.shape() != nullptr && tensor.shape()->size() > 0
+             ? tensor.shape()->Get(tensor.shape()->size() - 1)
+             : 0;
+}
+
+// Reads the rows of a two-stage retrieval layer. The clusters themselves are
+// not read back, as the builder clusters the rows again.
+absl::Status ReadClusters(const ConstTensors& tensors,
+                          const ::tflite::Tensor& centroids,
+                          CbRGallery* gallery) {
+  const ::tflite::Tensor* embeddings = tensors.Find("cluster_embeddings");
+  const ::tflite::Tensor* ids = tensors.Find("embedding_ids");
+  const ::tflite::Tensor* probes = tensors.Find("probes");
+  if (embeddings == nullptr || ids == nullptr || probes == nullptr ||
+      embeddings->shape() == nullptr || embeddings->shape()->size() != 2) {
+    return absl::InvalidArgumentError("Incomplete two-stage retrieval layer.");
+  }
+  const int32_t num_rows = embeddings->shape()->Get(0);
+  const int32_t dim = LastDim(*embeddings);
+  ASSIGN_OR_RETURN(
+      absl::Span<const float> embeddings_data,
+      tensors.Data<float>(*embeddings, ::tflite::TensorType_FLOAT32,
+                          static_cast<int64_t>(num_rows) * dim));
+  ASSIGN_OR_RETURN(absl::Span<const int32_t> ids_data,
+                   tensors.Data<int32_t>(*ids, ::tflite::TensorType_INT32,
+                                         num_rows));
+  gallery->embeddings.Reserve(num_rows, dim);
+  for (int32_t row = 0; row < num_rows; ++row) {
+    RETURN_IF_ERROR(gallery->embeddings.AppendRow(
+        embeddings_data.subspan(static_cast<size_t>(row) * dim, dim)));
+    gallery->row_classes.push_back(ids_data[row]);
+  }
+  gallery->options.num_clusters = centroids.shape()->Get(0);
+  gallery->options.num_probes = LastDim(*probes);
+  return absl::OkStatus();
+}
+
+// Reads the rows of a dense retrieval layer.
+absl::Status ReadRetrievalRows(const ConstTensors& tensors,
+                               const ::tflite::Tensor& retrieval,
+                               CbRGallery* gallery) {
+  const int32_t dim = LastDim(retrieval);
+  if (dim == 0 || retrieval.shape()->size() < 2) {
+    return absl::InvalidArgumentError("Unexpected retrieval tensor shape.");
+  }
+  const int32_t num_rows = retrieval.shape()->Get(0);
+  gallery->embeddings.Reserve(num_rows, dim);
+  if (retrieval.type() == ::tflite::TensorType_FLOAT32) {
+    ASSIGN_OR_RETURN(absl::Span<const float> data,
+                     tensors.Data<float>(retrieval,
+                                         ::tflite::TensorType_FLOAT32,
+                                         static_cast<int64_t>(num_rows) * dim));
+    for (int r = 0; r < num_rows; ++r) {
+      RETURN_IF_ERROR(gallery->embeddings.AppendRow(
+          data.subspan(static_cast<size_t>(r) * dim, dim)));
+    }
+    return absl::OkStatus();
+  }
+
+  // Per-row or per-tensor int8 weights.
+  ASSIGN_OR_RETURN(absl::Span<const int8_t> data,
+                   tensors.Data<int8_t>(retrieval, ::tflite::TensorType_INT8,
+                                        static_cast<int64_t>(num_rows) * dim));
+  const ::tflite::QuantizationParameters* quantization =
+      retrieval.quantization();
+  if (quantization == nullptr || quantization->scale() == nullptr ||
+      (quantization->scale()->size() != 1 &&
+       quantization->scale()->size() != num_rows)) {
+    return absl::InvalidArgumentError(
+        "Unexpected retrieval tensor quantization.");
+  }
+  std::vector<float> row(dim);
+  for (int r = 0; r < num_rows; ++r) {
+    const int param = quantization->scale()->size() == 1 ? 0 : r;
+    const float scale = quantization->scale()->Get(param);
+    const int64_t zero_point =
+        quantization->zero_point() != nullptr &&
+                param < quantization->zero_point()->size()
+            ? quantization->zero_point()->Get(param)
+            : 0;
+    for (int i = 0; i < dim; ++i) {
+      row[i] = (data[static_cast<size_t>(r) * dim + i] - zero_point) * scale;
+    }
+    RETURN_IF_ERROR(gallery->embeddings.AppendRow(row));
+  }
+  gallery->options.quantize_retrieval = true;
+  return absl::OkStatus();
+}
+
+// Reads the class of each retrieval row from the aggregation layer.
+absl::Status ReadRowClasses(const ConstTensors& tensors, int num_classes,
+                            CbRGallery* gallery) {
+  const int num_rows = gallery->embeddings.num_rows();
+  gallery->row_classes.assign(num_rows, -1);
+  auto assign = [&](absl::Span<const int32_t> rows, int class_id) {
+    for (int32_t row : rows) {
+      if (row < 0 || row >= num_rows) {
+        return absl::InvalidArgumentError(
+            absl::StrFormat("Out of range selection row %d.", row));
+      }
+      gallery->row_classes[row] = class_id;
+    }
+    return absl::OkStatus();
+  };
+
+  if (const ::tflite::Tensor* selection = tensors.Find("selection")) {
+    // Padded {num_classes, max_class_size} selection.
+    const int32_t max_class_size = LastDim(*selection);
+    ASSIGN_OR_RETURN(
+        absl::Span<const int32_t> data,
+        tensors.Data<int32_t>(*selection, ::tflite::TensorType_INT32,
+                              static_cast<int64_t>(num_classes) *
+                                  max_class_size));
+    for (int c = 0; c < num_classes; ++c) {
+      RETURN_IF_ERROR(assign(
+          data.subspan(static_cast<size_t>(c) * max_class_size,
+                       max_class_size),
+          c));
+    }
+  } else if (tensors.Find("selection0") != nullptr) {
+    // One selection tensor per class.
+    for (int c = 0; c < num_classes; ++c) {
+      const ::tflite::Tensor* selection =
+          tensors.Find(absl::StrCat("selection", c));
+      if (selection == nullptr) {
+        return absl::InvalidArgumentError(
+            absl::StrFormat("Missing selection tensor of class %d.", c));
+      }
+      ASSIGN_OR_RETURN(absl::Span<const int32_t> data,
+                       tensors.Data<int32_t>(*selection,
+                                             ::tflite::TensorType_INT32,
+                                             NumElements(*selection)));
+      RETURN_IF_ERROR(assign(data, c));
+    }
+  } else {
+    // Classes of equal size, laid out class by class.
+    if (num_classes < 1 || num_rows % num_classes != 0) {
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "%d rows can't be split evenly into %d classes.", num_rows,
+          num_classes));
+    }
+    for (int r = 0; r < num_rows; ++r) {
+      gallery->row_classes[r] = r / (num_rows / num_classes);
+    }
+  }
+
+  for (int32_t class_id : gallery->row_classes) {
+    if (class_id < 0) {
+      return absl::InvalidArgumentError("Retrieval row without class.");
+    }
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+tflite::support::StatusOr<CbRGallery> ReadCbRGallery(
+    const ::tflite::Model& model, int num_classes) {
+  if (model.subgraphs() == nullptr || model.subgraphs()->size() != 1) {
+    return absl::InvalidArgumentError(
+        "The model is required to have a single subgraph");
+  }
+  const ConstTensors tensors(model);
+  CbRGallery gallery;
+  if (const ::tflite::Tensor* indices = tensors.Find("indices")) {
+    gallery.options.top_k = LastDim(*indices);
+  }
+
+  if (const ::tflite::Tensor* centroids = tensors.Find("centroids")) {
+    RETURN_IF_ERROR(ReadClusters(tensors, *centroids, &gallery));
+  } else if (const ::tflite::Tensor* retrieval = tensors.Find("retrieval")) {
+    RETURN_IF_ERROR(ReadRetrievalRows(tensors, *retrieval, &gallery));
+    RETURN_IF_ERROR(ReadRowClasses(tensors, num_classes, &gallery));
+  } else {
+    return absl::InvalidArgumentError(
+        "Not a classification-by-retrieval model: no retrieval layer.");
+  }
+
+  for (int32_t class_id : gallery.row_classes) {
+    if (class_id >= num_classes) {
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "Class %d is out of the %d labels.", class_id, num_classes));
+    }
+  }
+  return gallery;
+}
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
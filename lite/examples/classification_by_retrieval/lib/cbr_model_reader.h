@@ -0,0 +1,55 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_CBR_MODEL_READER_H_
+#define TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_CBR_MODEL_READER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "lib/embedding_matrix.h"
+#include "lib/tflite_cbr_builder.h"
+#include "tensorflow/lite/model.h"
+#include "tensorflow_lite_support/cc/port/statusor.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+// The retrieval rows of a classification-by-retrieval model and the options it
+// was built with.
+struct CbRGallery {
+  // The L2-normalized retrieval rows. Rows of int8 retrieval layers are
+  // dequantized, which quantizes back to the same values.
+  EmbeddingMatrix embeddings;
+  // The class of each row, indexing the labelmap of the model.
+  std::vector<int32_t> row_classes;
+  // The options affecting the graph: top_k, quantize_retrieval, num_clusters
+  // and num_probes. Other fields have their default value.
+  TfLiteCbRBuilder::Options options;
+};
+
+// Reads the gallery of `model`, a model with `num_classes` classes built by
+// TfLiteCbRBuilder, from its constant tensors. Only the tensors of the
+// retrieval and aggregation layers are read, so the cost does not depend on
+// the size of the embedder. Returns an InvalidArgumentError if `model` does
+// not have the expected tensors.
+tflite::support::StatusOr<CbRGallery> ReadCbRGallery(
+    const ::tflite::Model& model, int num_classes);
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_CBR_MODEL_READER_H_
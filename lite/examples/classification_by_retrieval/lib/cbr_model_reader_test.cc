@@ -0,0 +1,339 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/cbr_model_reader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "flatbuffers/flatbuffers.h"
+#include "gtest/gtest.h"
+#include "lib/embedding_matrix.h"
+#include "lib/tflite_cbr_builder.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+namespace {
+
+constexpr int kDim = 16;
+// Largest error of a normalized component quantized to int8, whether with a
+// per-row scale of at most 1/127 or a per-tensor scale of 1/128.
+constexpr float kInt8Tolerance = 0.5f / 127 + 1e-6f;
+constexpr float kFloatTolerance = 1e-6f;
+
+// Returns a minimal embedder: a RESHAPE of a {1, kDim} float image into the
+// {1, kDim} float embedding.
+std::vector<uint8_t> EmbedderModel() {
+  flatbuffers::FlatBufferBuilder fbb;
+  const std::vector<int32_t> shape = {1, kDim};
+  const std::vector<flatbuffers::Offset<::tflite::Tensor>> tensors = {
+      ::tflite::CreateTensor(fbb, fbb.CreateVector(shape),
+                             ::tflite::TensorType_FLOAT32, /*buffer=*/0,
+                             fbb.CreateString("image")),
+      ::tflite::CreateTensor(fbb, fbb.CreateVector(shape),
+                             ::tflite::TensorType_FLOAT32, /*buffer=*/0,
+                             fbb.CreateString("embedding")),
+  };
+  const std::vector<int32_t> inputs = {0};
+  const std::vector<int32_t> outputs = {1};
+  const std::vector<flatbuffers::Offset<::tflite::Operator>> operators = {
+      ::tflite::CreateOperator(fbb, /*opcode_index=*/0,
+                               fbb.CreateVector(inputs),
+                               fbb.CreateVector(outputs))};
+  const std::vector<flatbuffers::Offset<::tflite::SubGraph>> subgraphs = {
+      ::tflite::CreateSubGraph(fbb, fbb.CreateVector(tensors),
+                               fbb.CreateVector(inputs),
+                               fbb.CreateVector(outputs),
+                               fbb.CreateVector(operators))};
+  const std::vector<flatbuffers::Offset<::tflite::OperatorCode>>
+      operator_codes = {::tflite::CreateOperatorCode(
+          fbb, ::tflite::BuiltinOperator_RESHAPE)};
+  const std::vector<flatbuffers::Offset<::tflite::Buffer>> buffers = {
+      ::tflite::CreateBuffer(fbb)};
+  ::tflite::FinishModelBuffer(
+      fbb, ::tflite::CreateModel(
+               fbb, /*version=*/3, fbb.CreateVector(operator_codes),
+               fbb.CreateVector(subgraphs), /*description=*/0,
+               fbb.CreateVector(buffers), /*metadata_buffer=*/0,
+               fbb.CreateVector(
+                   std::vector<flatbuffers::Offset<::tflite::Metadata>>())));
+  return std::vector<uint8_t>(fbb.GetBufferPointer(),
+                              fbb.GetBufferPointer() + fbb.GetSize());
+}
+
+// A gallery of random embeddings, with the labels of classes of
+// `class_sizes` images listed class by class so that the builder keeps the
+// rows in order.
+struct Gallery {
+  EmbeddingMatrix embeddings;
+  std::vector<std::string> labels;
+  // The class of each row.
+  std::vector<int32_t> classes;
+};
+
+Gallery RandomGallery(const std::vector<int>& class_sizes) {
+  std::mt19937 rng(42);
+  std::normal_distribution<float> normal;
+  Gallery gallery;
+  std::vector<float> embedding(kDim);
+  for (int c = 0; c < class_sizes.size(); ++c) {
+    for (int i = 0; i < class_sizes[c]; ++i) {
+      for (float& value : embedding) value = normal(rng);
+      EXPECT_TRUE(gallery.embeddings.AppendRow(embedding).ok());
+      gallery.labels.push_back(absl::StrCat("class", c));
+      gallery.classes.push_back(c);
+    }
+  }
+  return gallery;
+}
+
+// Builds a classification-by-retrieval model of `gallery` and returns it
+// unpacked, to be modified or packed again with Pack().
+std::unique_ptr<::tflite::ModelT> Build(
+    const TfLiteCbRBuilder::Options& options, const Gallery& gallery,
+    bool with_labels = true) {
+  const std::vector<uint8_t> embedder = EmbedderModel();
+  flatbuffers::FlatBufferBuilder fbb;
+  TfLiteCbRBuilder builder(options);
+  const tflite::support::StatusOr<std::vector<std::string>> labels =
+      builder.BuildCbRModel(*::tflite::GetModel(embedder.data()),
+                            gallery.embeddings,
+                            with_labels ? gallery.labels
+                                        : std::vector<std::string>(),
+                            &fbb);
+  EXPECT_TRUE(labels.ok()) << labels.status();
+  if (!labels.ok()) return nullptr;
+  return ::tflite::UnPackModel(fbb.GetBufferPointer());
+}
+
+std::vector<uint8_t> Pack(const ::tflite::ModelT& model) {
+  flatbuffers::FlatBufferBuilder fbb;
+  ::tflite::FinishModelBuffer(fbb, ::tflite::Model::Pack(fbb, &model));
+  return std::vector<uint8_t>(fbb.GetBufferPointer(),
+                              fbb.GetBufferPointer() + fbb.GetSize());
+}
+
+::tflite::TensorT* FindTensor(::tflite::ModelT* model,
+                              const std::string& name) {
+  for (std::unique_ptr<::tflite::TensorT>& tensor :
+       model->subgraphs[0]->tensors) {
+    if (tensor->name == name) return tensor.get();
+  }
+  return nullptr;
+}
+
+// Adds a constant tensor holding `values` to `model`.
+void AddConstTensor(::tflite::ModelT* model, const std::string& name,
+                    const std::vector<int32_t>& values) {
+  auto buffer = std::make_unique<::tflite::BufferT>();
+  buffer->data.resize(values.size() * sizeof(int32_t));
+  std::memcpy(buffer->data.data(), values.data(), buffer->data.size());
+  auto tensor = std::make_unique<::tflite::TensorT>();
+  tensor->name = name;
+  tensor->type = ::tflite::TensorType_INT32;
+  tensor->shape = {static_cast<int32_t>(values.size())};
+  tensor->buffer = model->buffers.size();
+  model->buffers.push_back(std::move(buffer));
+  model->subgraphs[0]->tensors.push_back(std::move(tensor));
+}
+
+// Reads the gallery of `model`, with `num_classes` classes.
+tflite::support::StatusOr<CbRGallery> Read(const ::tflite::ModelT& model,
+                                           int num_classes) {
+  const std::vector<uint8_t> buffer = Pack(model);
+  return ReadCbRGallery(*::tflite::GetModel(buffer.data()), num_classes);
+}
+
+// Expects `read` to hold the normalized embeddings of `gallery` with their
+// classes, in any order, each component within `tolerance`.
+void ExpectSameRows(const CbRGallery& read, const Gallery& gallery,
+                    const std::vector<int32_t>& classes, float tolerance) {
+  const EmbeddingMatrix& expected = gallery.embeddings;
+  ASSERT_EQ(read.embeddings.num_rows(), expected.num_rows());
+  ASSERT_EQ(read.embeddings.dim(), kDim);
+  ASSERT_EQ(read.row_classes.size(), expected.num_rows());
+  std::vector<float> normalized(expected.num_rows() * kDim);
+  L2NormalizeRows(expected.data(), expected.num_rows(), kDim,
+                  normalized.data());
+
+  // Random rows are far apart, so each row read matches the closest one.
+  std::vector<bool> matched(expected.num_rows(), false);
+  for (int r = 0; r < read.embeddings.num_rows(); ++r) {
+    int closest = -1;
+    float closest_dot = -2.0f;
+    for (int e = 0; e < expected.num_rows(); ++e) {
+      float dot = 0.0f;
+      for (int d = 0; d < kDim; ++d) {
+        dot += read.embeddings.row(r)[d] * normalized[e * kDim + d];
+      }
+      if (dot > closest_dot) {
+        closest = e;
+        closest_dot = dot;
+      }
+    }
+    SCOPED_TRACE(absl::StrCat("row ", r, " read as row ", closest));
+    EXPECT_FALSE(matched[closest]);
+    matched[closest] = true;
+    for (int d = 0; d < kDim; ++d) {
+      EXPECT_NEAR(read.embeddings.row(r)[d], normalized[closest * kDim + d],
+                  tolerance);
+    }
+    EXPECT_EQ(read.row_classes[r], classes[closest]);
+  }
+}
+
+TEST(CbRModelReaderTest, RoundTripsDenseLayouts) {
+  const Gallery balanced = RandomGallery({3, 3, 3});
+  const Gallery unbalanced = RandomGallery({1, 4, 2});
+  for (const Gallery* gallery : {&balanced, &unbalanced}) {
+    for (bool with_labels : {true, false}) {
+      for (bool quantize_retrieval : {false, true}) {
+        for (int top_k : {0, 2}) {
+          SCOPED_TRACE(absl::StrCat(
+              gallery == &balanced ? "balanced" : "unbalanced",
+              ", labels: ", with_labels, ", quantized: ", quantize_retrieval,
+              ", top_k: ", top_k));
+          TfLiteCbRBuilder::Options options;
+          options.quantize_retrieval = quantize_retrieval;
+          options.top_k = top_k;
+          std::unique_ptr<::tflite::ModelT> model =
+              Build(options, *gallery, with_labels);
+          ASSERT_NE(model, nullptr);
+
+          // Without labels, each row is its own class.
+          std::vector<int32_t> classes = gallery->classes;
+          if (!with_labels) {
+            for (int r = 0; r < classes.size(); ++r) classes[r] = r;
+          }
+          const int num_classes =
+              *std::max_element(classes.begin(), classes.end()) + 1;
+          const tflite::support::StatusOr<CbRGallery> read =
+              Read(*model, num_classes);
+          ASSERT_TRUE(read.ok()) << read.status();
+          ExpectSameRows(*read, *gallery, classes,
+                         quantize_retrieval ? kInt8Tolerance
+                                            : kFloatTolerance);
+          EXPECT_EQ(read->options.quantize_retrieval, quantize_retrieval);
+          EXPECT_EQ(read->options.top_k, top_k);
+          EXPECT_EQ(read->options.num_clusters, 0);
+        }
+      }
+    }
+  }
+}
+
+TEST(CbRModelReaderTest, ReadsLegacyPerTensorQuantization) {
+  const Gallery gallery = RandomGallery({1, 4, 2});
+  std::unique_ptr<::tflite::ModelT> model =
+      Build(TfLiteCbRBuilder::Options(), gallery);
+  ASSERT_NE(model, nullptr);
+
+  // Older models quantized the normalized rows with a common 1/128 scale.
+  ::tflite::TensorT* retrieval = FindTensor(model.get(), "retrieval");
+  ASSERT_NE(retrieval, nullptr);
+  std::vector<uint8_t>& data = model->buffers[retrieval->buffer]->data;
+  std::vector<float> rows(data.size() / sizeof(float));
+  std::memcpy(rows.data(), data.data(), data.size());
+  data.resize(rows.size());
+  for (int i = 0; i < rows.size(); ++i) {
+    const float quantized =
+        std::min(127.0f, std::max(-128.0f, std::round(rows[i] * 128)));
+    data[i] = static_cast<uint8_t>(static_cast<int8_t>(quantized));
+  }
+  retrieval->type = ::tflite::TensorType_INT8;
+  retrieval->quantization =
+      std::make_unique<::tflite::QuantizationParametersT>();
+  retrieval->quantization->scale = {1.0f / 128};
+  retrieval->quantization->zero_point = {0};
+
+  const tflite::support::StatusOr<CbRGallery> read = Read(*model, 3);
+  ASSERT_TRUE(read.ok()) << read.status();
+  ExpectSameRows(*read, gallery, gallery.classes, kInt8Tolerance);
+  EXPECT_TRUE(read->options.quantize_retrieval);
+}
+
+TEST(CbRModelReaderTest, ReadsLegacySelectionPerClass) {
+  const Gallery gallery = RandomGallery({1, 4, 2});
+  std::unique_ptr<::tflite::ModelT> model =
+      Build(TfLiteCbRBuilder::Options(), gallery);
+  ASSERT_NE(model, nullptr);
+
+  // Older models had one "selection<i>" tensor per class instead of the
+  // padded "selection".
+  ::tflite::TensorT* selection = FindTensor(model.get(), "selection");
+  ASSERT_NE(selection, nullptr);
+  selection->name = "padded_selection";
+  int row = 0;
+  for (int c = 0; c < 3; ++c) {
+    std::vector<int32_t> rows;
+    for (; row < gallery.classes.size() && gallery.classes[row] == c; ++row) {
+      rows.push_back(row);
+    }
+    AddConstTensor(model.get(), absl::StrCat("selection", c), rows);
+  }
+
+  const tflite::support::StatusOr<CbRGallery> read = Read(*model, 3);
+  ASSERT_TRUE(read.ok()) << read.status();
+  ExpectSameRows(*read, gallery, gallery.classes, kFloatTolerance);
+}
+
+TEST(CbRModelReaderTest, RoundTripsTwoStageLayout) {
+  const Gallery gallery = RandomGallery({10, 25, 5});
+  for (bool with_labels : {true, false}) {
+    SCOPED_TRACE(absl::StrCat("labels: ", with_labels));
+    TfLiteCbRBuilder::Options options;
+    options.top_k = 3;
+    options.num_clusters = 4;
+    options.num_probes = 2;
+    std::unique_ptr<::tflite::ModelT> model =
+        Build(options, gallery, with_labels);
+    ASSERT_NE(model, nullptr);
+
+    std::vector<int32_t> classes = gallery.classes;
+    if (!with_labels) {
+      for (int r = 0; r < classes.size(); ++r) classes[r] = r;
+    }
+    const tflite::support::StatusOr<CbRGallery> read =
+        Read(*model, with_labels ? 3 : classes.size());
+    ASSERT_TRUE(read.ok()) << read.status();
+    // The rows are stored cluster by cluster.
+    ExpectSameRows(*read, gallery, classes, kFloatTolerance);
+    EXPECT_EQ(read->options.top_k, 3);
+    EXPECT_GE(read->options.num_clusters, 4);
+    EXPECT_EQ(read->options.num_probes, 2);
+  }
+}
+
+TEST(CbRModelReaderTest, RejectsModelWithoutRetrievalLayer) {
+  const std::vector<uint8_t> embedder = EmbedderModel();
+  EXPECT_EQ(ReadCbRGallery(*::tflite::GetModel(embedder.data()), 1)
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
@@ -0,0 +1,332 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/embedding_cache.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_format.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+namespace {
+
+constexpr char kMagic[8] = {'C', 'B', 'R', 'E', 'M', 'B', 'C', 'C'};
+constexpr uint32_t kVersion = 1;
+// Number of slots an image may be stored in.
+constexpr int kWays = 8;
+
+constexpr uint64_t kMul1 = 0x87c37b91114253d5ULL;
+constexpr uint64_t kMul2 = 0x4cf5ad432745937fULL;
+
+uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// Final avalanche of MurmurHash3.
+uint64_t Avalanche(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+absl::Status ErrnoError(const std::string& operation,
+                        const std::string& path) {
+  return absl::InternalError(absl::StrFormat("Failed to %s %s: %s", operation,
+                                             path, std::strerror(errno)));
+}
+
+}  // namespace
+
+Fingerprinter::Fingerprinter() : high_(kMul1), low_(kMul2) {}
+
+void Fingerprinter::Mix(uint64_t word) {
+  high_ = Rotl(high_ ^ (word * kMul1), 27) * 5 + 0x52dce729;
+  low_ = Rotl(low_ ^ (Rotl(word, 31) * kMul2), 33) * 5 + 0x38495ab5;
+  high_ += low_;
+}
+
+void Fingerprinter::Update(absl::string_view data) {
+  const char* bytes = data.data();
+  size_t num_bytes = data.size();
+  const size_t tail_size = length_ % 8;
+  length_ += num_bytes;
+  if (tail_size > 0) {
+    const size_t count = std::min(8 - tail_size, num_bytes);
+    std::memcpy(tail_ + tail_size, bytes, count);
+    bytes += count;
+    num_bytes -= count;
+    if (tail_size + count < 8) return;
+    uint64_t word;
+    std::memcpy(&word, tail_, 8);
+    Mix(word);
+  }
+  for (; num_bytes >= 8; bytes += 8, num_bytes -= 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes, 8);
+    Mix(word);
+  }
+  std::memcpy(tail_, bytes, num_bytes);
+}
+
+EmbeddingCacheKey Fingerprinter::Finish() const {
+  Fingerprinter state = *this;
+  if (length_ % 8 > 0) {
+    uint64_t word = 0;
+    std::memcpy(&word, tail_, length_ % 8);
+    state.Mix(word);
+  }
+  uint64_t high = state.high_ ^ length_;
+  uint64_t low = state.low_ ^ length_;
+  high += low;
+  low += high;
+  high = Avalanche(high);
+  low = Avalanche(low);
+  high += low;
+  low += high;
+  return {high, low};
+}
+
+EmbeddingCacheKey FingerprintBytes(absl::string_view data) {
+  Fingerprinter fingerprinter;
+  fingerprinter.Update(data);
+  return fingerprinter.Finish();
+}
+
+struct EmbeddingCache::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t dim;
+  uint64_t embedder_high;
+  uint64_t embedder_low;
+  uint64_t num_sets;
+  // Entries of other generations are empty, so that the cache is cleared
+  // without touching them.
+  uint64_t generation;
+  // Incremented on every use, to find the least recently used entries.
+  uint64_t clock;
+  // Number of entries of the current generation.
+  uint64_t size;
+};
+
+// Followed by the embedding, padded to a multiple of 8 bytes.
+struct EmbeddingCache::Entry {
+  uint64_t key_high;
+  uint64_t key_low;
+  uint64_t generation;
+  // Value of the clock on the last use.
+  uint64_t last_use;
+
+  float* embedding() { return reinterpret_cast<float*>(this + 1); }
+};
+
+namespace {
+
+size_t EntrySize(int dim) {
+  return 32 + (sizeof(float) * dim + 7) / 8 * 8;
+}
+
+}  // namespace
+
+/* static */
+tflite::support::StatusOr<std::unique_ptr<EmbeddingCache>>
+EmbeddingCache::Open(const std::string& path,
+                     const EmbeddingCacheKey& embedder_key, int dim,
+                     const EmbeddingCacheOptions& options) {
+  static_assert(sizeof(Header) == 64, "Unexpected header size.");
+  static_assert(sizeof(Entry) == 32, "Unexpected entry size.");
+  if (dim < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Expected a positive dimension, found %d.", dim));
+  }
+  // Compare as signed integers: max_size_bytes - sizeof(Header) would wrap.
+  const int64_t set_size = static_cast<int64_t>(EntrySize(dim)) * kWays;
+  const int64_t header_size = sizeof(Header);
+  if (options.max_size_bytes < header_size + set_size) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "A cache of %d bytes can't hold embeddings of dimension %d.",
+        options.max_size_bytes, dim));
+  }
+  const int64_t num_sets = (options.max_size_bytes - header_size) / set_size;
+  const size_t size = sizeof(Header) + num_sets * kWays * EntrySize(dim);
+
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) return ErrnoError("open", path);
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return absl::UnavailableError(
+        absl::StrFormat("The embedding cache %s is in use.", path));
+  }
+
+  // Reuse the file only if it was written with the same parameters.
+  Header header;
+  struct stat file_stat;
+  const bool valid =
+      fstat(fd, &file_stat) == 0 &&
+      static_cast<size_t>(file_stat.st_size) == size &&
+      pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+      std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+      header.version == kVersion &&
+      header.dim == static_cast<uint32_t>(dim) &&
+      header.embedder_high == embedder_key.high &&
+      header.embedder_low == embedder_key.low &&
+      header.num_sets == static_cast<uint64_t>(num_sets);
+  // Truncating first zeroes the whole file, which is sparse until written.
+  if (!valid && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+    close(fd);
+    return ErrnoError("resize", path);
+  }
+  void* data =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, /*offset=*/0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return ErrnoError("map", path);
+  }
+  auto cache = absl::WrapUnique(new EmbeddingCache(path, fd, data, size));
+  if (!valid) {
+    Header* new_header = cache->header();
+    std::memcpy(new_header->magic, kMagic, sizeof(kMagic));
+    new_header->version = kVersion;
+    new_header->dim = dim;
+    new_header->embedder_high = embedder_key.high;
+    new_header->embedder_low = embedder_key.low;
+    new_header->num_sets = num_sets;
+    new_header->generation = 1;
+    new_header->clock = 0;
+    new_header->size = 0;
+  }
+  return cache;
+}
+
+EmbeddingCache::EmbeddingCache(std::string path, int fd, void* data,
+                               size_t size)
+    : path_(std::move(path)), fd_(fd), data_(data), size_(size) {}
+
+EmbeddingCache::~EmbeddingCache() {
+  Flush().IgnoreError();
+  munmap(data_, size_);
+  close(fd_);
+}
+
+int EmbeddingCache::dim() const { return header()->dim; }
+
+int64_t EmbeddingCache::capacity() const {
+  return header()->num_sets * kWays;
+}
+
+int64_t EmbeddingCache::size() const { return header()->size; }
+
+EmbeddingCache::Entry* EmbeddingCache::entry(int64_t index) const {
+  return reinterpret_cast<Entry*>(static_cast<char*>(data_) + sizeof(Header) +
+                                  index * EntrySize(header()->dim));
+}
+
+EmbeddingCache::Entry* EmbeddingCache::Find(
+    const EmbeddingCacheKey& key) const {
+  const int64_t set = key.low % header()->num_sets;
+  for (int way = 0; way < kWays; ++way) {
+    Entry* candidate = entry(set * kWays + way);
+    if (candidate->generation == header()->generation &&
+        candidate->key_high == key.high && candidate->key_low == key.low) {
+      return candidate;
+    }
+  }
+  return nullptr;
+}
+
+bool EmbeddingCache::Lookup(const EmbeddingCacheKey& key,
+                            absl::Span<float> embedding) {
+  Entry* found = Find(key);
+  if (found == nullptr || embedding.size() != dim()) {
+    stats_.misses++;
+    return false;
+  }
+  std::copy(found->embedding(), found->embedding() + dim(), embedding.begin());
+  found->last_use = ++header()->clock;
+  stats_.hits++;
+  return true;
+}
+
+absl::Status EmbeddingCache::Insert(const EmbeddingCacheKey& key,
+                                    absl::Span<const float> embedding) {
+  if (embedding.size() != dim()) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Expected an embedding of dimension %d, found %d.",
+                        dim(), embedding.size()));
+  }
+  Entry* target = Find(key);
+  if (target == nullptr) {
+    // Use an empty slot of the set, or else the least recently used one.
+    const int64_t set = key.low % header()->num_sets;
+    for (int way = 0; way < kWays; ++way) {
+      Entry* candidate = entry(set * kWays + way);
+      if (candidate->generation != header()->generation) {
+        target = candidate;
+        break;
+      }
+      if (target == nullptr || candidate->last_use < target->last_use) {
+        target = candidate;
+      }
+    }
+    if (target->generation == header()->generation) {
+      stats_.evictions++;
+    } else {
+      header()->size++;
+    }
+  }
+  // The entry is only valid once complete.
+  target->generation = 0;
+  target->key_high = key.high;
+  target->key_low = key.low;
+  std::copy(embedding.begin(), embedding.end(), target->embedding());
+  target->last_use = ++header()->clock;
+  target->generation = header()->generation;
+  stats_.insertions++;
+  return absl::OkStatus();
+}
+
+void EmbeddingCache::Invalidate(const EmbeddingCacheKey& key) {
+  Entry* found = Find(key);
+  if (found != nullptr) {
+    found->generation = 0;
+    header()->size--;
+  }
+}
+
+void EmbeddingCache::Clear() {
+  header()->generation++;
+  header()->size = 0;
+}
+
+absl::Status EmbeddingCache::Flush() {
+  if (msync(data_, size_, MS_SYNC) != 0) return ErrnoError("sync", path_);
+  return absl::OkStatus();
+}
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
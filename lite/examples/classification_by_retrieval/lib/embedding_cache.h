@@ -0,0 +1,160 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_CACHE_H_
+#define TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "tensorflow_lite_support/cc/port/statusor.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+// A 128-bit fingerprint of some content, e.g. an image or an embedder model.
+struct EmbeddingCacheKey {
+  uint64_t high = 0;
+  uint64_t low = 0;
+
+  bool operator==(const EmbeddingCacheKey& other) const {
+    return high == other.high && low == other.low;
+  }
+  bool operator!=(const EmbeddingCacheKey& other) const {
+    return !(*this == other);
+  }
+};
+
+// Computes an EmbeddingCacheKey over content fed in one or more pieces. The
+// result only depends on the concatenation of the pieces, and is stable
+// across processes and runs. It is not a cryptographic hash.
+class Fingerprinter {
+ public:
+  Fingerprinter();
+
+  void Update(absl::string_view data);
+  void Update(const void* data, size_t size) {
+    Update(absl::string_view(static_cast<const char*>(data), size));
+  }
+  EmbeddingCacheKey Finish() const;
+
+ private:
+  void Mix(uint64_t word);
+
+  uint64_t high_;
+  uint64_t low_;
+  uint64_t length_ = 0;
+  // Bytes not yet mixed, fewer than 8.
+  uint8_t tail_[8];
+};
+
+// Returns the fingerprint of `data`.
+EmbeddingCacheKey FingerprintBytes(absl::string_view data);
+
+struct EmbeddingCacheOptions {
+  // Size of the cache file, which bounds the number of embeddings it holds.
+  // Changing it resets the cache.
+  int64_t max_size_bytes = int64_t{256} << 20;
+};
+
+struct EmbeddingCacheStats {
+  int64_t hits = 0;
+  int64_t misses = 0;
+  int64_t insertions = 0;
+  // Insertions that replaced another embedding, the cache being full.
+  int64_t evictions = 0;
+};
+
+// A persistent map from image fingerprints to the embeddings computed by one
+// embedder, stored in a memory-mapped file of fixed size.
+//
+// The file is a set-associative table: an image maps to a set of a few slots
+// and, once they are all used, replaces the least recently used one. Lookups
+// and insertions therefore cost a few comparisons and a copy of the embedding,
+// and the file never grows beyond `max_size_bytes`.
+//
+// The file is locked while open, so it can't be shared by several processes.
+// Instances are not thread-safe.
+class EmbeddingCache {
+ public:
+  // Opens or creates the cache file at `path` for embeddings of dimension
+  // `dim` computed by the embedder fingerprinted by `embedder_key`. The cache
+  // is reset if the file was written for another embedder, dimension or
+  // size, or is not a cache file. Returns an absl::UnavailableError if the
+  // file is used by another process.
+  static tflite::support::StatusOr<std::unique_ptr<EmbeddingCache>> Open(
+      const std::string& path, const EmbeddingCacheKey& embedder_key, int dim,
+      const EmbeddingCacheOptions& options = {});
+
+  // Flushes and unmaps the file.
+  ~EmbeddingCache();
+
+  EmbeddingCache(const EmbeddingCache&) = delete;
+  EmbeddingCache& operator=(const EmbeddingCache&) = delete;
+
+  // Copies the embedding of `key` to `embedding`, of size dim(), and returns
+  // true if there is one.
+  bool Lookup(const EmbeddingCacheKey& key, absl::Span<float> embedding);
+
+  // Stores `embedding` for `key`, replacing any previous one. Returns an
+  // InvalidArgumentError if its size is not dim().
+  absl::Status Insert(const EmbeddingCacheKey& key,
+                      absl::Span<const float> embedding);
+
+  // Removes the embedding of `key`, if any.
+  void Invalidate(const EmbeddingCacheKey& key);
+
+  // Removes all embeddings.
+  void Clear();
+
+  // Writes the changes to disk. This also happens when the cache is
+  // destroyed.
+  absl::Status Flush();
+
+  int dim() const;
+  // Maximum and current number of embeddings.
+  int64_t capacity() const;
+  int64_t size() const;
+  const EmbeddingCacheStats& stats() const { return stats_; }
+
+ private:
+  struct Header;
+  struct Entry;
+
+  EmbeddingCache(std::string path, int fd, void* data, size_t size);
+
+  Header* header() const { return reinterpret_cast<Header*>(data_); }
+  Entry* entry(int64_t index) const;
+  // Returns the entry of `key`, or nullptr.
+  Entry* Find(const EmbeddingCacheKey& key) const;
+
+  std::string path_;
+  int fd_;
+  // The mapped file.
+  void* data_;
+  size_t size_;
+  EmbeddingCacheStats stats_;
+};
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_CACHE_H_
@@ -0,0 +1,195 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/embedding_cache.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "gtest/gtest.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+namespace {
+
+constexpr int kDim = 5;
+
+EmbeddingCacheKey ImageKey(int i) {
+  return FingerprintBytes(absl::StrCat("image ", i));
+}
+
+std::vector<float> ImageEmbedding(int i) {
+  std::vector<float> embedding(kDim);
+  for (int d = 0; d < kDim; ++d) embedding[d] = i * 10 + d;
+  return embedding;
+}
+
+class EmbeddingCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = absl::StrCat(::testing::TempDir(), "/embedding_cache_",
+                         ::testing::UnitTest::GetInstance()
+                             ->current_test_info()
+                             ->name());
+    unlink(path_.c_str());
+    embedder_key_ = FingerprintBytes("embedder");
+  }
+
+  void TearDown() override { unlink(path_.c_str()); }
+
+  std::unique_ptr<EmbeddingCache> Open(
+      const EmbeddingCacheKey& embedder_key, int dim = kDim,
+      const EmbeddingCacheOptions& options = {}) {
+    tflite::support::StatusOr<std::unique_ptr<EmbeddingCache>> cache =
+        EmbeddingCache::Open(path_, embedder_key, dim, options);
+    EXPECT_TRUE(cache.ok()) << cache.status();
+    return cache.ok() ? std::move(*cache) : nullptr;
+  }
+
+  // Returns whether `cache` has the embedding of image `i`.
+  bool HasImage(EmbeddingCache* cache, int i) {
+    std::vector<float> embedding(kDim);
+    if (!cache->Lookup(ImageKey(i), absl::MakeSpan(embedding))) return false;
+    EXPECT_EQ(embedding, ImageEmbedding(i));
+    return true;
+  }
+
+  std::string path_;
+  EmbeddingCacheKey embedder_key_;
+};
+
+TEST_F(EmbeddingCacheTest, ReopenKeepsEntries) {
+  {
+    std::unique_ptr<EmbeddingCache> cache = Open(embedder_key_);
+    ASSERT_NE(cache, nullptr);
+    for (int i = 0; i < 3; ++i) {
+      ASSERT_TRUE(cache->Insert(ImageKey(i), ImageEmbedding(i)).ok());
+    }
+  }
+  std::unique_ptr<EmbeddingCache> cache = Open(embedder_key_);
+  ASSERT_NE(cache, nullptr);
+  EXPECT_EQ(cache->size(), 3);
+  for (int i = 0; i < 3; ++i) EXPECT_TRUE(HasImage(cache.get(), i));
+  EXPECT_FALSE(HasImage(cache.get(), 3));
+  EXPECT_EQ(cache->stats().hits, 3);
+  EXPECT_EQ(cache->stats().misses, 1);
+}
+
+TEST_F(EmbeddingCacheTest, EvictionStaysWithinMaxSize) {
+  EmbeddingCacheOptions options;
+  options.max_size_bytes = 4096;
+  std::unique_ptr<EmbeddingCache> cache =
+      Open(embedder_key_, kDim, options);
+  ASSERT_NE(cache, nullptr);
+  const int num_images = 10 * cache->capacity();
+  for (int i = 0; i < num_images; ++i) {
+    ASSERT_TRUE(cache->Insert(ImageKey(i), ImageEmbedding(i)).ok());
+    // The latest insertion is never evicted.
+    ASSERT_TRUE(HasImage(cache.get(), i));
+  }
+  EXPECT_LE(cache->size(), cache->capacity());
+  EXPECT_GE(cache->stats().evictions, num_images - cache->capacity());
+  ASSERT_TRUE(cache->Flush().ok());
+
+  struct stat file_stat;
+  ASSERT_EQ(stat(path_.c_str(), &file_stat), 0);
+  EXPECT_LE(file_stat.st_size, options.max_size_bytes);
+}
+
+TEST_F(EmbeddingCacheTest, InvalidateAndClear) {
+  std::unique_ptr<EmbeddingCache> cache = Open(embedder_key_);
+  ASSERT_NE(cache, nullptr);
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(cache->Insert(ImageKey(i), ImageEmbedding(i)).ok());
+  }
+
+  cache->Invalidate(ImageKey(1));
+  EXPECT_TRUE(HasImage(cache.get(), 0));
+  EXPECT_FALSE(HasImage(cache.get(), 1));
+  EXPECT_TRUE(HasImage(cache.get(), 2));
+  EXPECT_EQ(cache->size(), 2);
+
+  cache->Clear();
+  EXPECT_EQ(cache->size(), 0);
+  for (int i = 0; i < 3; ++i) EXPECT_FALSE(HasImage(cache.get(), i));
+
+  // The cache is still usable after being cleared.
+  ASSERT_TRUE(cache->Insert(ImageKey(1), ImageEmbedding(1)).ok());
+  EXPECT_TRUE(HasImage(cache.get(), 1));
+}
+
+TEST_F(EmbeddingCacheTest, InsertRejectsWrongDimension) {
+  std::unique_ptr<EmbeddingCache> cache = Open(embedder_key_);
+  ASSERT_NE(cache, nullptr);
+  EXPECT_EQ(cache->Insert(ImageKey(0), std::vector<float>(kDim + 1)).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(cache->size(), 0);
+}
+
+TEST_F(EmbeddingCacheTest, SecondOpenIsUnavailable) {
+  std::unique_ptr<EmbeddingCache> cache = Open(embedder_key_);
+  ASSERT_NE(cache, nullptr);
+  EXPECT_EQ(EmbeddingCache::Open(path_, embedder_key_, kDim).status().code(),
+            absl::StatusCode::kUnavailable);
+}
+
+TEST_F(EmbeddingCacheTest, OtherEmbedderOrDimensionResets) {
+  {
+    std::unique_ptr<EmbeddingCache> cache = Open(embedder_key_);
+    ASSERT_NE(cache, nullptr);
+    ASSERT_TRUE(cache->Insert(ImageKey(0), ImageEmbedding(0)).ok());
+  }
+  {
+    std::unique_ptr<EmbeddingCache> cache =
+        Open(FingerprintBytes("other embedder"));
+    ASSERT_NE(cache, nullptr);
+    EXPECT_EQ(cache->size(), 0);
+    EXPECT_FALSE(HasImage(cache.get(), 0));
+    ASSERT_TRUE(cache->Insert(ImageKey(0), ImageEmbedding(0)).ok());
+  }
+  std::unique_ptr<EmbeddingCache> cache = Open(embedder_key_, kDim + 1);
+  ASSERT_NE(cache, nullptr);
+  EXPECT_EQ(cache->dim(), kDim + 1);
+  EXPECT_EQ(cache->size(), 0);
+}
+
+TEST_F(EmbeddingCacheTest, RejectsTooSmallMaxSize) {
+  EmbeddingCacheOptions options;
+  options.max_size_bytes = 10;
+  EXPECT_EQ(
+      EmbeddingCache::Open(path_, embedder_key_, kDim, options).status().code(),
+      absl::StatusCode::kInvalidArgument);
+  // The file is not created.
+  EXPECT_NE(access(path_.c_str(), F_OK), 0);
+}
+
+TEST(FingerprinterTest, DependsOnlyOnConcatenation) {
+  Fingerprinter fingerprinter;
+  fingerprinter.Update("embed");
+  fingerprinter.Update("ding cache key");
+  EXPECT_EQ(fingerprinter.Finish(), FingerprintBytes("embedding cache key"));
+  EXPECT_NE(FingerprintBytes("a"), FingerprintBytes("b"));
+}
+
+}  // namespace
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
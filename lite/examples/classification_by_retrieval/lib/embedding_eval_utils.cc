@@ -0,0 +1,74 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/embedding_eval_utils.h"
+
+#include <memory>
+#include <utility>
+
+#include "lib/labeled_image_helper.h"
+#include "tensorflow_lite_support/cc/port/status_macros.h"
+#include "tensorflow_lite_support/cc/task/vision/core/frame_buffer.h"
+#include "tensorflow_lite_support/examples/task/vision/desktop/utils/image_utils.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+using ::tflite::task::vision::DecodeImageFromFile;
+using ::tflite::task::vision::FrameBuffer;
+using ::tflite::task::vision::ImageData;
+using ::tflite::task::vision::ImageEmbedder;
+
+tflite::support::StatusOr<std::vector<LabeledImagePath>> ListLabeledImages(
+    const std::string& path) {
+  tflite::support::StatusOr<std::vector<LabeledImagePath>> images =
+      ListImageDirectory(path);
+  if (images.ok()) return images;
+  return ReadImageManifest(path);
+}
+
+void SplitHoldout(int holdout, std::vector<LabeledImagePath>* images,
+                  std::vector<LabeledImagePath>* queries) {
+  std::vector<LabeledImagePath> kept_images;
+  for (int i = 0; i < images->size(); ++i) {
+    (i % holdout == 0 ? queries : &kept_images)
+        ->push_back(std::move((*images)[i]));
+  }
+  images->swap(kept_images);
+}
+
+absl::Status EmbedImageFiles(ImageEmbedder* embedder,
+                             const std::vector<LabeledImagePath>& images,
+                             EmbeddingMatrix* embeddings) {
+  std::vector<float> normalized;
+  for (const LabeledImagePath& image : images) {
+    ASSIGN_OR_RETURN(ImageData decoded, DecodeImageFromFile(image.path));
+    const ScopedImageData image_data(decoded);
+    ASSIGN_OR_RETURN(std::unique_ptr<FrameBuffer> frame_buffer,
+                     BuildFrameBufferFromImageData(image_data.get()));
+    ASSIGN_OR_RETURN(const auto& result, embedder->Embed(*frame_buffer));
+    const auto& feature_vector =
+        embedder->GetEmbeddingByIndex(result, 0).feature_vector();
+    normalized.resize(feature_vector.value_float_size());
+    L2NormalizeRows(feature_vector.value_float().data(), 1, normalized.size(),
+                    normalized.data());
+    RETURN_IF_ERROR(embeddings->AppendRow(normalized));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
@@ -0,0 +1,52 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_EVAL_UTILS_H_
+#define TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_EVAL_UTILS_H_
+
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "lib/embedding_matrix.h"
+#include "lib/gallery_ingestion.h"
+#include "tensorflow_lite_support/cc/port/statusor.h"
+#include "tensorflow_lite_support/cc/task/vision/image_embedder.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+// Helpers shared by the evaluation tools, which work on gallery embeddings
+// rather than on generated models.
+
+// Lists the images of `path`, a directory of per-label subdirectories (see
+// ListImageDirectory()) or a manifest (see ReadImageManifest()).
+tflite::support::StatusOr<std::vector<LabeledImagePath>> ListLabeledImages(
+    const std::string& path);
+
+// Moves every `holdout`-th image of `images` to `queries`.
+void SplitHoldout(int holdout, std::vector<LabeledImagePath>* images,
+                  std::vector<LabeledImagePath>* queries);
+
+// Appends the L2-normalized embedding of each image to `embeddings`.
+absl::Status EmbedImageFiles(::tflite::task::vision::ImageEmbedder* embedder,
+                             const std::vector<LabeledImagePath>& images,
+                             EmbeddingMatrix* embeddings);
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_EVAL_UTILS_H_
@@ -0,0 +1,121 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/embedding_matrix.h"
+
+#include <cmath>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_format.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CBR_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CBR_USE_SSE
+#endif
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+namespace {
+
+// Returns the sum of squares of `values`.
+float SquaredNorm(const float* values, int size) {
+  int i = 0;
+  float sum = 0.0f;
+#if defined(CBR_USE_NEON)
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  for (; i + 8 <= size; i += 8) {
+    const float32x4_t v0 = vld1q_f32(values + i);
+    const float32x4_t v1 = vld1q_f32(values + i + 4);
+    acc0 = vmlaq_f32(acc0, v0, v0);
+    acc1 = vmlaq_f32(acc1, v1, v1);
+  }
+  const float32x4_t acc = vaddq_f32(acc0, acc1);
+  const float32x2_t pair = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+  sum = vget_lane_f32(vpadd_f32(pair, pair), 0);
+#elif defined(CBR_USE_SSE)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  for (; i + 8 <= size; i += 8) {
+    const __m128 v0 = _mm_loadu_ps(values + i);
+    const __m128 v1 = _mm_loadu_ps(values + i + 4);
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(v0, v0));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(v1, v1));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+  for (; i < size; ++i) sum += values[i] * values[i];
+  return sum;
+}
+
+// Writes `input` scaled by `scale` to `output`.
+void Scale(const float* input, int size, float scale, float* output) {
+  int i = 0;
+#if defined(CBR_USE_NEON)
+  for (; i + 4 <= size; i += 4) {
+    vst1q_f32(output + i, vmulq_n_f32(vld1q_f32(input + i), scale));
+  }
+#elif defined(CBR_USE_SSE)
+  const __m128 factor = _mm_set1_ps(scale);
+  for (; i + 4 <= size; i += 4) {
+    _mm_storeu_ps(output + i, _mm_mul_ps(_mm_loadu_ps(input + i), factor));
+  }
+#endif
+  for (; i < size; ++i) output[i] = input[i] * scale;
+}
+
+}  // namespace
+
+absl::Status EmbeddingMatrix::AppendRow(absl::Span<const float> embedding) {
+  if (embedding.empty()) {
+    return absl::InvalidArgumentError("Embedding is empty");
+  }
+  if (num_rows_ > 0 && embedding.size() != dim_) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Expected an embedding of dimension %d, found %d.",
+                        dim_, embedding.size()));
+  }
+  dim_ = embedding.size();
+  values_.insert(values_.end(), embedding.begin(), embedding.end());
+  ++num_rows_;
+  return absl::OkStatus();
+}
+
+void EmbeddingMatrix::Clear() {
+  std::vector<float>().swap(values_);
+  num_rows_ = 0;
+  dim_ = 0;
+}
+
+void L2NormalizeRows(const float* input, int num_rows, int dim,
+                     float* output) {
+  for (int r = 0; r < num_rows; ++r) {
+    const float* in_row = input + static_cast<size_t>(r) * dim;
+    float* out_row = output + static_cast<size_t>(r) * dim;
+    const float norm = SquaredNorm(in_row, dim);
+    // Can't normalize 0 vector.
+    Scale(in_row, dim, norm == 0.0f ? 1.0f : 1.0f / std::sqrt(norm), out_row);
+  }
+}
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
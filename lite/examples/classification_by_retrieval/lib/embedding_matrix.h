@@ -0,0 +1,74 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_MATRIX_H_
+#define TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_MATRIX_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/types/span.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+// Float embeddings of equal dimension, stored row-major in one contiguous
+// arena.
+class EmbeddingMatrix {
+ public:
+  EmbeddingMatrix() = default;
+
+  // Number of embeddings and their dimension. The dimension is set by the
+  // first appended row, and is 0 while the matrix is empty.
+  int num_rows() const { return num_rows_; }
+  int dim() const { return dim_; }
+  bool empty() const { return num_rows_ == 0; }
+
+  // Row-major data of all embeddings.
+  const float* data() const { return values_.data(); }
+  absl::Span<const float> row(int i) const {
+    return absl::MakeConstSpan(values_.data() + static_cast<size_t>(i) * dim_,
+                               dim_);
+  }
+
+  // Appends a copy of `embedding`. Returns an InvalidArgumentError if it is
+  // empty or its dimension differs from the previous rows.
+  absl::Status AppendRow(absl::Span<const float> embedding);
+
+  // Reserves space for `num_rows` embeddings of dimension `dim`.
+  void Reserve(int num_rows, int dim) {
+    values_.reserve(static_cast<size_t>(num_rows) * dim);
+  }
+
+  // Removes all embeddings and releases the arena.
+  void Clear();
+
+ private:
+  std::vector<float> values_;
+  int num_rows_ = 0;
+  int dim_ = 0;
+};
+
+// Writes the L2-normalized rows of the row-major `num_rows` x `dim` matrix
+// `input` to `output`, which may alias `input`. All-zero rows are copied
+// as-is. Vectorized with NEON or SSE when available.
+void L2NormalizeRows(const float* input, int num_rows, int dim, float* output);
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_EMBEDDING_MATRIX_H_
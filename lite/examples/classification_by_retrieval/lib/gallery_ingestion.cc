@@ -0,0 +1,381 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/gallery_ingestion.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
+#include <condition_variable>  // NOLINT(build/c++11)
+#include <fstream>
+#include <memory>
+#include <mutex>   // NOLINT(build/c++11)
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "lib/labeled_image_helper.h"
+#include "tensorflow_lite_support/cc/port/status_macros.h"
+#include "tensorflow_lite_support/cc/task/vision/core/frame_buffer.h"
+#include "tensorflow_lite_support/examples/task/vision/desktop/utils/image_utils.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+namespace {
+
+using ::tflite::task::vision::DecodeImageFromFile;
+using ::tflite::task::vision::FrameBuffer;
+using ::tflite::task::vision::ImageData;
+
+int64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string JoinPath(absl::string_view directory, absl::string_view name) {
+  if (directory.empty()) return std::string(name);
+  if (absl::EndsWith(directory, "/")) return absl::StrCat(directory, name);
+  return absl::StrCat(directory, "/", name);
+}
+
+std::string Dirname(const std::string& path) {
+  const size_t slash = path.find_last_of('/');
+  if (slash == std::string::npos) return "";
+  return path.substr(0, slash + 1);
+}
+
+bool IsDirectory(const std::string& path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+// Returns the sorted non-hidden entries of `directory`.
+tflite::support::StatusOr<std::vector<std::string>> ListEntries(
+    const std::string& directory) {
+  DIR* dir = opendir(directory.c_str());
+  if (dir == nullptr) {
+    return absl::NotFoundError(
+        absl::StrFormat("Unable to open directory '%s'.", directory));
+  }
+  std::vector<std::string> entries;
+  while (const struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') continue;
+    entries.emplace_back(entry->d_name);
+  }
+  closedir(dir);
+  std::sort(entries.begin(), entries.end());
+  return entries;
+}
+
+// Bounded queue handing out items in index order. Item `index` may only be
+// pushed once fewer than `capacity` items precede it, so the queue doubles as
+// the reorder buffer for out-of-order producers and never holds more than
+// `capacity` items.
+template <typename T>
+class OrderedQueue {
+ public:
+  explicit OrderedQueue(int capacity)
+      : slots_(capacity), filled_(capacity, false) {}
+
+  // Blocks until `index` fits in the queue. Returns false if the queue has
+  // been closed, in which case `item` is dropped.
+  bool Push(int index, T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    can_push_.wait(lock, [&] {
+      return closed_ || index < next_pop_ + static_cast<int>(slots_.size());
+    });
+    if (closed_) return false;
+    const int slot = index % slots_.size();
+    slots_[slot] = std::move(item);
+    filled_[slot] = true;
+    ++depth_;
+    ++num_pushes_;
+    depth_sum_ += depth_;
+    max_depth_ = std::max(max_depth_, depth_);
+    can_pop_.notify_all();
+    return true;
+  }
+
+  // Blocks until the next item in index order is available. Returns false if
+  // the queue has been closed.
+  bool Pop(T* item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const int slot = next_pop_ % slots_.size();
+    can_pop_.wait(lock, [&] { return closed_ || filled_[slot]; });
+    if (closed_) return false;
+    *item = std::move(slots_[slot]);
+    filled_[slot] = false;
+    ++next_pop_;
+    --depth_;
+    can_push_.notify_all();
+    return true;
+  }
+
+  // Wakes up and fails all pending and future calls.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    can_push_.notify_all();
+    can_pop_.notify_all();
+  }
+
+  int max_depth() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return max_depth_;
+  }
+  double mean_depth() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_pushes_ > 0 ? static_cast<double>(depth_sum_) / num_pushes_
+                           : 0.0;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::condition_variable can_push_;
+  std::condition_variable can_pop_;
+  std::vector<T> slots_;
+  std::vector<bool> filled_;
+  int next_pop_ = 0;
+  bool closed_ = false;
+  int depth_ = 0;
+  int max_depth_ = 0;
+  int64_t num_pushes_ = 0;
+  int64_t depth_sum_ = 0;
+};
+
+struct DecodedImage {
+  absl::Status status;
+  ScopedImageData image;
+};
+
+// The frame buffer is a view of `image`.
+struct PreparedImage {
+  absl::Status status;
+  ScopedImageData image;
+  std::unique_ptr<FrameBuffer> frame_buffer;
+};
+
+}  // namespace
+
+tflite::support::StatusOr<std::vector<LabeledImagePath>> ReadImageManifest(
+    const std::string& manifest_path) {
+  std::ifstream manifest(manifest_path);
+  if (!manifest) {
+    return absl::NotFoundError(
+        absl::StrFormat("Unable to open manifest '%s'.", manifest_path));
+  }
+  const std::string base_directory = Dirname(manifest_path);
+  std::vector<LabeledImagePath> images;
+  std::string line;
+  for (int line_number = 1; std::getline(manifest, line); ++line_number) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty()) continue;
+    const std::vector<absl::string_view> fields =
+        absl::StrSplit(line, absl::MaxSplits('\t', 1));
+    if (fields.size() != 2 || fields[0].empty() || fields[1].empty()) {
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "%s:%d: expected 'label<TAB>path', found '%s'.", manifest_path,
+          line_number, line));
+    }
+    LabeledImagePath image;
+    image.label = std::string(fields[0]);
+    image.path = absl::StartsWith(fields[1], "/")
+                     ? std::string(fields[1])
+                     : JoinPath(base_directory, fields[1]);
+    images.push_back(std::move(image));
+  }
+  return images;
+}
+
+tflite::support::StatusOr<std::vector<LabeledImagePath>> ListImageDirectory(
+    const std::string& directory) {
+  ASSIGN_OR_RETURN(std::vector<std::string> labels, ListEntries(directory));
+  std::vector<LabeledImagePath> images;
+  for (const std::string& label : labels) {
+    const std::string label_directory = JoinPath(directory, label);
+    if (!IsDirectory(label_directory)) continue;
+    ASSIGN_OR_RETURN(std::vector<std::string> files,
+                     ListEntries(label_directory));
+    for (const std::string& file : files) {
+      const std::string path = JoinPath(label_directory, file);
+      if (IsDirectory(path)) continue;
+      images.push_back({label, path});
+    }
+  }
+  return images;
+}
+
+absl::Status IngestLabeledImages(ModelBuilder* model_builder,
+                                 const std::vector<LabeledImagePath>& images,
+                                 const IngestionOptions& options,
+                                 IngestionStats* stats) {
+  if (options.num_decode_threads < 1 || options.queue_capacity < 1 ||
+      options.embed_batch_size < 1) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Expected positive num_decode_threads, queue_capacity and "
+        "embed_batch_size, found %d, %d and %d.",
+        options.num_decode_threads, options.queue_capacity,
+        options.embed_batch_size));
+  }
+  const int64_t start_us = NowMicros();
+  const int num_images = images.size();
+  OrderedQueue<DecodedImage> decoded_queue(options.queue_capacity);
+  OrderedQueue<PreparedImage> prepared_queue(options.queue_capacity);
+  std::atomic<int64_t> decode_us(0);
+  std::atomic<int64_t> prepare_us(0);
+
+  // Decode stage: indices are claimed in increasing order, so the lowest
+  // index not yet pushed always fits in the decoded queue.
+  std::atomic<int> next_decode(0);
+  std::vector<std::thread> decoders;
+  const int num_decoders = std::min(options.num_decode_threads,
+                                    std::max(num_images, 1));
+  for (int t = 0; t < num_decoders; ++t) {
+    decoders.emplace_back([&] {
+      for (int i = next_decode++; i < num_images; i = next_decode++) {
+        const int64_t begin_us = NowMicros();
+        DecodedImage decoded;
+        tflite::support::StatusOr<ImageData> image_data =
+            DecodeImageFromFile(images[i].path);
+        if (image_data.ok()) {
+          decoded.image = ScopedImageData(*image_data);
+        } else {
+          decoded.status = image_data.status();
+        }
+        decode_us += NowMicros() - begin_us;
+        if (!decoded_queue.Push(i, std::move(decoded))) return;
+      }
+    });
+  }
+
+  // Prepare stage: wraps the decoded pixels in frame buffers.
+  std::thread preparer([&] {
+    for (int i = 0; i < num_images; ++i) {
+      DecodedImage decoded;
+      if (!decoded_queue.Pop(&decoded)) return;
+      const int64_t begin_us = NowMicros();
+      PreparedImage prepared;
+      prepared.status = decoded.status;
+      if (prepared.status.ok()) {
+        tflite::support::StatusOr<std::unique_ptr<FrameBuffer>> frame_buffer =
+            BuildFrameBufferFromImageData(decoded.image.get());
+        if (frame_buffer.ok()) {
+          prepared.frame_buffer = std::move(*frame_buffer);
+          prepared.image = std::move(decoded.image);
+        } else {
+          prepared.status = frame_buffer.status();
+        }
+      }
+      prepare_us += NowMicros() - begin_us;
+      if (!prepared_queue.Push(i, std::move(prepared))) return;
+    }
+  });
+
+  // Embed stage, on the calling thread.
+  absl::Status status;
+  int64_t embed_us = 0;
+  int64_t num_added = 0;
+  std::vector<PreparedImage> batch;
+  std::vector<ModelBuilder::LabeledImage> labeled_batch;
+  // Index in `images` of each image of the batch.
+  std::vector<int> batch_indices;
+  batch.reserve(options.embed_batch_size);
+  labeled_batch.reserve(options.embed_batch_size);
+  batch_indices.reserve(options.embed_batch_size);
+  auto flush = [&]() -> absl::Status {
+    if (batch.empty()) return absl::OkStatus();
+    const int64_t begin_us = NowMicros();
+    absl::Status added = model_builder->AddLabeledImages(labeled_batch);
+    if (added.ok()) {
+      num_added += batch.size();
+    } else {
+      // Nothing of the batch was added: add its images one by one, to keep
+      // the images before the failing one and report the latter.
+      added = absl::OkStatus();
+      for (int j = 0; j < labeled_batch.size() && added.ok(); ++j) {
+        added = model_builder->AddLabeledImage(labeled_batch[j].label,
+                                               *labeled_batch[j].frame_buffer);
+        if (added.ok()) {
+          ++num_added;
+        } else {
+          added = absl::Status(
+              added.code(), absl::StrFormat("%s: %s",
+                                            images[batch_indices[j]].path,
+                                            added.message()));
+        }
+      }
+    }
+    embed_us += NowMicros() - begin_us;
+    batch.clear();
+    labeled_batch.clear();
+    batch_indices.clear();
+    return added;
+  };
+  for (int i = 0; i < num_images && status.ok(); ++i) {
+    PreparedImage prepared;
+    if (!prepared_queue.Pop(&prepared)) break;
+    if (!prepared.status.ok()) {
+      // Keep the images before the failing one.
+      status = flush();
+      if (status.ok()) {
+        status = absl::Status(
+            prepared.status.code(),
+            absl::StrFormat("%s: %s", images[i].path,
+                            prepared.status.message()));
+      }
+      break;
+    }
+    labeled_batch.push_back({images[i].label, prepared.frame_buffer.get()});
+    batch.push_back(std::move(prepared));
+    batch_indices.push_back(i);
+    if (static_cast<int>(batch.size()) == options.embed_batch_size) {
+      status = flush();
+    }
+  }
+  if (status.ok()) status = flush();
+
+  // On error, unblock the upstream stages so they drop their remaining work.
+  decoded_queue.Close();
+  prepared_queue.Close();
+  for (std::thread& decoder : decoders) decoder.join();
+  preparer.join();
+
+  if (stats != nullptr) {
+    stats->images = num_added;
+    stats->decode_us = decode_us;
+    stats->prepare_us = prepare_us;
+    stats->embed_us = embed_us;
+    stats->wall_us = NowMicros() - start_us;
+    stats->max_decoded_queue_depth = decoded_queue.max_depth();
+    stats->max_prepared_queue_depth = prepared_queue.max_depth();
+    stats->mean_decoded_queue_depth = decoded_queue.mean_depth();
+    stats->mean_prepared_queue_depth = prepared_queue.mean_depth();
+  }
+  return status;
+}
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
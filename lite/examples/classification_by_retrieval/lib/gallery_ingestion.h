@@ -0,0 +1,99 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_GALLERY_INGESTION_H_
+#define TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_GALLERY_INGESTION_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "lib/model_builder.h"
+#include "tensorflow_lite_support/cc/port/statusor.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+// An image file and its label.
+struct LabeledImagePath {
+  std::string label;
+  std::string path;
+};
+
+// Reads a manifest of tab-separated `label<TAB>path` lines. Relative paths are
+// resolved against the directory of the manifest. Empty lines are skipped.
+tflite::support::StatusOr<std::vector<LabeledImagePath>> ReadImageManifest(
+    const std::string& manifest_path);
+
+// Lists the files of each subdirectory of `directory`, labeled with the name
+// of the subdirectory. Hidden entries are skipped. The result is sorted by
+// label and path, so that it does not depend on the file system.
+tflite::support::StatusOr<std::vector<LabeledImagePath>> ListImageDirectory(
+    const std::string& directory);
+
+struct IngestionOptions {
+  // Threads decoding image files.
+  int num_decode_threads = 2;
+  // Capacity, in images, of each queue between two stages. Together with the
+  // batch size this caps the number of decoded images held in memory.
+  int queue_capacity = 16;
+  // Images handed to ModelBuilder::AddLabeledImages() at once, which embeds
+  // them on the workers set by ModelBuilder::SetParallelism().
+  int embed_batch_size = 8;
+};
+
+struct IngestionStats {
+  int64_t images = 0;
+  // Time spent in each stage, summed over the threads of the stage.
+  int64_t decode_us = 0;
+  int64_t prepare_us = 0;
+  int64_t embed_us = 0;
+  int64_t wall_us = 0;
+  // Depth of the decoded and prepared image queues, sampled at every push.
+  int max_decoded_queue_depth = 0;
+  int max_prepared_queue_depth = 0;
+  double mean_decoded_queue_depth = 0.0;
+  double mean_prepared_queue_depth = 0.0;
+
+  double images_per_second() const {
+    return wall_us > 0 ? images * 1e6 / wall_us : 0.0;
+  }
+};
+
+// Adds `images` to `model_builder` in order, overlapping file I/O and decoding
+// with inference:
+//
+//   decode (num_decode_threads) -> queue -> frame buffer preparation -> queue
+//   -> embedding (in batches of embed_batch_size)
+//
+// The queues are bounded and keep the input order, so the number of decoded
+// images in memory is capped independently of the gallery size, and the
+// resulting model is the same as adding the images one by one.
+//
+// Returns the error of the first image that fails, in input order, prefixed
+// with its path; the images before it have been added. When a batch fails to
+// embed, its images are added again one by one to find the failing one.
+// `stats` is optional.
+absl::Status IngestLabeledImages(ModelBuilder* model_builder,
+                                 const std::vector<LabeledImagePath>& images,
+                                 const IngestionOptions& options,
+                                 IngestionStats* stats);
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_GALLERY_INGESTION_H_
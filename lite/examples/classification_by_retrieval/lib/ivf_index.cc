@@ -0,0 +1,234 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/ivf_index.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_format.h"
+#include "tensorflow_lite_support/cc/port/status_macros.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+namespace {
+
+float Dot(const float* a, const float* b, int dim) {
+  float sum = 0.0f;
+  for (int i = 0; i < dim; ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+// Returns the index of the row of the `num_rows` x `dim` `matrix` with the
+// highest dot product with `vector`, and that product.
+std::pair<int, float> ArgMaxDot(const float* matrix, int num_rows, int dim,
+                                const float* vector) {
+  std::pair<int, float> best = {0, -std::numeric_limits<float>::infinity()};
+  for (int r = 0; r < num_rows; ++r) {
+    const float score = Dot(matrix + static_cast<size_t>(r) * dim, vector, dim);
+    if (score > best.second) best = {r, score};
+  }
+  return best;
+}
+
+// Returns the `k` best of the `candidates` {score, row} pairs, best first.
+std::vector<int32_t> TopK(std::vector<std::pair<float, int32_t>> candidates,
+                          int k) {
+  k = std::min<int>(k, candidates.size());
+  auto better = [](const std::pair<float, int32_t>& a,
+                   const std::pair<float, int32_t>& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+  };
+  std::partial_sort(candidates.begin(), candidates.begin() + k,
+                    candidates.end(), better);
+  std::vector<int32_t> rows(k);
+  for (int i = 0; i < k; ++i) rows[i] = candidates[i].second;
+  return rows;
+}
+
+}  // namespace
+
+int IvfIndex::max_cluster_size() const {
+  size_t max_size = 0;
+  for (const std::vector<int32_t>& cluster : clusters) {
+    max_size = std::max(max_size, cluster.size());
+  }
+  return max_size;
+}
+
+tflite::support::StatusOr<IvfIndex> BuildIvfIndex(
+    const EmbeddingMatrix& normalized, int num_clusters, int num_iterations) {
+  const int num_rows = normalized.num_rows();
+  const int dim = normalized.dim();
+  if (num_clusters < 1 || num_clusters > num_rows) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Expected a number of clusters in [1, %d], found %d.", num_rows,
+        num_clusters));
+  }
+  IvfIndex index;
+  index.num_clusters = num_clusters;
+  index.dim = dim;
+
+  // Seed the centroids with evenly spaced rows.
+  index.centroids.resize(static_cast<size_t>(num_clusters) * dim);
+  for (int c = 0; c < num_clusters; ++c) {
+    const int row = static_cast<int64_t>(c) * num_rows / num_clusters;
+    std::copy(normalized.row(row).begin(), normalized.row(row).end(),
+              index.centroids.begin() + static_cast<size_t>(c) * dim);
+  }
+
+  std::vector<int32_t> assignments(num_rows, -1);
+  std::vector<float> scores(num_rows);
+  for (int iteration = 0; iteration <= num_iterations; ++iteration) {
+    // Assign each row to its closest centroid.
+    bool changed = false;
+    for (int r = 0; r < num_rows; ++r) {
+      const std::pair<int, float> best = ArgMaxDot(
+          index.centroids.data(), num_clusters, dim, normalized.row(r).data());
+      changed |= assignments[r] != best.first;
+      assignments[r] = best.first;
+      scores[r] = best.second;
+    }
+    if (!changed || iteration == num_iterations) break;
+
+    // Move each centroid to the normalized mean of its rows.
+    std::vector<float> sums(index.centroids.size(), 0.0f);
+    std::vector<int> counts(num_clusters, 0);
+    for (int r = 0; r < num_rows; ++r) {
+      float* sum = sums.data() + static_cast<size_t>(assignments[r]) * dim;
+      const float* row = normalized.row(r).data();
+      for (int i = 0; i < dim; ++i) sum[i] += row[i];
+      counts[assignments[r]]++;
+    }
+    for (int c = 0; c < num_clusters; ++c) {
+      float* centroid = sums.data() + static_cast<size_t>(c) * dim;
+      if (counts[c] == 0) {
+        // Reseed an empty cluster with the row farthest from its centroid.
+        const int row = std::min_element(scores.begin(), scores.end()) -
+                        scores.begin();
+        std::copy(normalized.row(row).begin(), normalized.row(row).end(),
+                  centroid);
+        scores[row] = std::numeric_limits<float>::infinity();
+      }
+    }
+    L2NormalizeRows(sums.data(), num_clusters, dim, index.centroids.data());
+  }
+
+  index.clusters.assign(num_clusters, {});
+  for (int r = 0; r < num_rows; ++r) {
+    index.clusters[assignments[r]].push_back(r);
+  }
+  return index;
+}
+
+absl::Status CapClusterSize(const EmbeddingMatrix& normalized,
+                            int max_cluster_size, int num_iterations,
+                            IvfIndex* index) {
+  if (max_cluster_size < 1) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Expected a positive maximum cluster size, found %d.",
+        max_cluster_size));
+  }
+  const int dim = normalized.dim();
+  std::vector<std::vector<int32_t>> clusters;
+  for (std::vector<int32_t>& rows : index->clusters) {
+    if (rows.size() <= max_cluster_size) {
+      if (!rows.empty()) clusters.push_back(std::move(rows));
+      continue;
+    }
+    // Order the rows along the axis separating the two halves of a 2-means
+    // split of the cluster, then cut them into slabs of nearly equal sizes.
+    EmbeddingMatrix subset;
+    subset.Reserve(rows.size(), dim);
+    for (int32_t row : rows) {
+      RETURN_IF_ERROR(subset.AppendRow(normalized.row(row)));
+    }
+    ASSIGN_OR_RETURN(IvfIndex halves,
+                     BuildIvfIndex(subset, /*num_clusters=*/2, num_iterations));
+    std::vector<float> axis(dim);
+    for (int i = 0; i < dim; ++i) {
+      axis[i] = halves.centroids[i] - halves.centroids[dim + i];
+    }
+    std::vector<std::pair<float, int32_t>> projections(rows.size());
+    for (int i = 0; i < rows.size(); ++i) {
+      projections[i] = {Dot(subset.row(i).data(), axis.data(), dim), rows[i]};
+    }
+    std::sort(projections.begin(), projections.end());
+    const int num_slabs =
+        (rows.size() + max_cluster_size - 1) / max_cluster_size;
+    for (int slab = 0; slab < num_slabs; ++slab) {
+      const size_t begin = rows.size() * slab / num_slabs;
+      const size_t end = rows.size() * (slab + 1) / num_slabs;
+      std::vector<int32_t> slab_rows;
+      slab_rows.reserve(end - begin);
+      for (size_t i = begin; i < end; ++i) {
+        slab_rows.push_back(projections[i].second);
+      }
+      std::sort(slab_rows.begin(), slab_rows.end());
+      clusters.push_back(std::move(slab_rows));
+    }
+  }
+
+  index->num_clusters = clusters.size();
+  std::vector<float> sums(clusters.size() * static_cast<size_t>(dim), 0.0f);
+  for (int c = 0; c < clusters.size(); ++c) {
+    float* sum = sums.data() + static_cast<size_t>(c) * dim;
+    for (int32_t r : clusters[c]) {
+      const float* row = normalized.row(r).data();
+      for (int i = 0; i < dim; ++i) sum[i] += row[i];
+    }
+  }
+  index->centroids.resize(sums.size());
+  L2NormalizeRows(sums.data(), clusters.size(), dim, index->centroids.data());
+  index->clusters = std::move(clusters);
+  return absl::OkStatus();
+}
+
+std::vector<int32_t> SearchExact(const EmbeddingMatrix& normalized,
+                                 const float* query, int k) {
+  std::vector<std::pair<float, int32_t>> candidates(normalized.num_rows());
+  for (int r = 0; r < normalized.num_rows(); ++r) {
+    candidates[r] = {Dot(normalized.row(r).data(), query, normalized.dim()),
+                     r};
+  }
+  return TopK(std::move(candidates), k);
+}
+
+std::vector<int32_t> SearchIvf(const IvfIndex& index,
+                               const EmbeddingMatrix& normalized,
+                               const float* query, int num_probes, int k) {
+  std::vector<std::pair<float, int32_t>> centroids(index.num_clusters);
+  for (int c = 0; c < index.num_clusters; ++c) {
+    centroids[c] = {
+        Dot(index.centroids.data() + static_cast<size_t>(c) * index.dim,
+            query, index.dim),
+        c};
+  }
+  std::vector<std::pair<float, int32_t>> candidates;
+  for (int32_t c : TopK(std::move(centroids), num_probes)) {
+    for (int32_t r : index.clusters[c]) {
+      candidates.push_back(
+          {Dot(normalized.row(r).data(), query, normalized.dim()), r});
+    }
+  }
+  return TopK(std::move(candidates), k);
+}
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
@@ -0,0 +1,80 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_IVF_INDEX_H_
+#define TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_IVF_INDEX_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "lib/embedding_matrix.h"
+#include "tensorflow_lite_support/cc/port/statusor.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+// An inverted file index: the rows of a matrix of L2-normalized embeddings
+// partitioned by their closest (highest cosine) centroid.
+struct IvfIndex {
+  int num_clusters = 0;
+  int dim = 0;
+  // Row-major `num_clusters` x `dim` L2-normalized centroids.
+  std::vector<float> centroids;
+  // Rows of each cluster, in increasing order.
+  std::vector<std::vector<int32_t>> clusters;
+
+  // Size of the largest cluster.
+  int max_cluster_size() const;
+};
+
+// Clusters the rows of `normalized` with `num_iterations` of spherical
+// k-means. The result is deterministic. Returns an InvalidArgumentError if
+// `num_clusters` is not in [1, normalized.num_rows()].
+tflite::support::StatusOr<IvfIndex> BuildIvfIndex(
+    const EmbeddingMatrix& normalized, int num_clusters, int num_iterations);
+
+// The cluster size cap of the two-stage retrieval block of TfLiteCbRBuilder:
+// twice the mean size of `num_clusters` clusters of `num_rows` rows.
+inline int DefaultMaxClusterSize(int num_rows, int num_clusters) {
+  return 2 * ((num_rows + num_clusters - 1) / num_clusters);
+}
+
+// Splits each cluster of `index` with more than `max_cluster_size` rows into
+// the fewest slabs of nearly equal sizes that fit, along the axis of a 2-means
+// split of its rows. Empty clusters are dropped, and the centroids of the
+// slabs are the normalized means of their rows. The number of clusters grows
+// by less than normalized.num_rows() / max_cluster_size.
+absl::Status CapClusterSize(const EmbeddingMatrix& normalized,
+                            int max_cluster_size, int num_iterations,
+                            IvfIndex* index);
+
+// Returns the `k` rows of `normalized` with the highest cosine to the
+// normalized `query`, best first. Ties are broken by row.
+std::vector<int32_t> SearchExact(const EmbeddingMatrix& normalized,
+                                 const float* query, int k);
+
+// Same as SearchExact(), restricted to the rows of the `num_probes` clusters
+// whose centroids are the closest to `query`. This is the search performed by
+// the two-stage retrieval block of TfLiteCbRBuilder.
+std::vector<int32_t> SearchIvf(const IvfIndex& index,
+                               const EmbeddingMatrix& normalized,
+                               const float* query, int num_probes, int k);
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_IVF_INDEX_H_
@@ -0,0 +1,130 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/ivf_index.h"
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "gtest/gtest.h"
+#include "lib/embedding_matrix.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+namespace {
+
+constexpr int kNumRows = 2000;
+constexpr int kDim = 16;
+constexpr int kNumClusters = 20;
+constexpr int kNumIterations = 10;
+
+// Returns kNumRows normalized embeddings, more than half of them close to a
+// common direction so that k-means leaves some clusters oversized.
+EmbeddingMatrix SkewedEmbeddings() {
+  std::mt19937 rng(7);
+  std::normal_distribution<float> normal;
+  std::vector<float> direction(kDim);
+  for (float& value : direction) value = normal(rng);
+  EmbeddingMatrix normalized;
+  normalized.Reserve(kNumRows, kDim);
+  std::vector<float> embedding(kDim);
+  for (int r = 0; r < kNumRows; ++r) {
+    const bool skewed = r % 5 < 3;
+    for (int i = 0; i < kDim; ++i) {
+      embedding[i] = skewed ? direction[i] + 0.2f * normal(rng) : normal(rng);
+    }
+    L2NormalizeRows(embedding.data(), 1, kDim, embedding.data());
+    EXPECT_TRUE(normalized.AppendRow(embedding).ok());
+  }
+  return normalized;
+}
+
+// Builds the index of the two-stage retrieval block of TfLiteCbRBuilder.
+IvfIndex BuildCappedIndex(const EmbeddingMatrix& normalized) {
+  tflite::support::StatusOr<IvfIndex> index =
+      BuildIvfIndex(normalized, kNumClusters, kNumIterations);
+  EXPECT_TRUE(index.ok()) << index.status();
+  if (!index.ok()) return IvfIndex();
+  EXPECT_TRUE(CapClusterSize(normalized,
+                             DefaultMaxClusterSize(kNumRows, kNumClusters),
+                             kNumIterations, &*index)
+                  .ok());
+  return *index;
+}
+
+TEST(IvfIndexTest, CapClusterSizeBoundsAndPartitions) {
+  const EmbeddingMatrix normalized = SkewedEmbeddings();
+  const int max_cluster_size = DefaultMaxClusterSize(kNumRows, kNumClusters);
+  tflite::support::StatusOr<IvfIndex> uncapped =
+      BuildIvfIndex(normalized, kNumClusters, kNumIterations);
+  ASSERT_TRUE(uncapped.ok()) << uncapped.status();
+  // Otherwise there is nothing to split.
+  ASSERT_GT(uncapped->max_cluster_size(), max_cluster_size);
+
+  const IvfIndex index = BuildCappedIndex(normalized);
+  EXPECT_LE(index.max_cluster_size(), max_cluster_size);
+  EXPECT_LT(index.num_clusters,
+            kNumClusters + kNumRows / max_cluster_size);
+  ASSERT_EQ(index.clusters.size(), index.num_clusters);
+  EXPECT_EQ(index.centroids.size(),
+            static_cast<size_t>(index.num_clusters) * kDim);
+
+  // Every row is in exactly one cluster, and no cluster is empty.
+  std::vector<int> row_counts(kNumRows, 0);
+  for (const std::vector<int32_t>& cluster : index.clusters) {
+    EXPECT_FALSE(cluster.empty());
+    for (int32_t row : cluster) row_counts[row]++;
+  }
+  for (int r = 0; r < kNumRows; ++r) {
+    EXPECT_EQ(row_counts[r], 1) << "row " << r;
+  }
+}
+
+TEST(IvfIndexTest, ProbingAllClustersIsExact) {
+  const EmbeddingMatrix normalized = SkewedEmbeddings();
+  const IvfIndex index = BuildCappedIndex(normalized);
+  for (int query = 0; query < kNumRows; query += 37) {
+    const float* query_data = normalized.row(query).data();
+    EXPECT_EQ(SearchIvf(index, normalized, query_data, index.num_clusters,
+                        /*k=*/10),
+              SearchExact(normalized, query_data, /*k=*/10))
+        << "query " << query;
+  }
+}
+
+TEST(IvfIndexTest, IsDeterministic) {
+  const EmbeddingMatrix normalized = SkewedEmbeddings();
+  const IvfIndex index = BuildCappedIndex(normalized);
+  const IvfIndex other_index = BuildCappedIndex(normalized);
+  EXPECT_EQ(other_index.num_clusters, index.num_clusters);
+  EXPECT_EQ(other_index.centroids, index.centroids);
+  EXPECT_EQ(other_index.clusters, index.clusters);
+}
+
+TEST(IvfIndexTest, RejectsInvalidNumClusters) {
+  const EmbeddingMatrix normalized = SkewedEmbeddings();
+  EXPECT_EQ(BuildIvfIndex(normalized, 0, kNumIterations).status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(
+      BuildIvfIndex(normalized, kNumRows + 1, kNumIterations).status().code(),
+      absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
@@ -0,0 +1,178 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the recall@k of the two-stage retrieval block built with
+// TfLiteCbRBuilder::Options::num_clusters against the exact (dense) block.
+//
+// Gallery and query images are listed as a directory of per-label
+// subdirectories or as a `label<TAB>path` manifest. Without queries, every
+// `--holdout`-th gallery image is used as a query instead. The search is the
+// one of the generated graph, evaluated on the embeddings directly, e.g.:
+//
+//   ivf_recall_eval --embedder=mobilenet_v3.tflite --gallery=/data/gallery \
+//       --num_clusters=256 --num_probes=1,4,16 --k=10
+
+#include <algorithm>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "lib/embedding_eval_utils.h"
+#include "lib/embedding_matrix.h"
+#include "lib/gallery_ingestion.h"
+#include "lib/ivf_index.h"
+#include "tensorflow_lite_support/cc/port/status_macros.h"
+#include "tensorflow_lite_support/cc/task/vision/image_embedder.h"
+#include "tensorflow_lite_support/cc/task/vision/proto/image_embedder_options_proto_inc.h"
+
+ABSL_FLAG(std::string, embedder, "", "Path to the image embedder model.");
+ABSL_FLAG(std::string, gallery, "",
+          "Gallery images, as a directory or a manifest.");
+ABSL_FLAG(std::string, queries, "",
+          "Query images, as a directory or a manifest. Optional.");
+ABSL_FLAG(int, holdout, 10,
+          "Without --queries, every holdout-th gallery image is a query.");
+ABSL_FLAG(int, num_clusters, 64, "Number of clusters.");
+ABSL_FLAG(std::string, num_probes, "1,2,4,8,16",
+          "Comma-separated numbers of probed clusters to evaluate.");
+ABSL_FLAG(int, num_kmeans_iterations, 10, "Number of k-means iterations.");
+ABSL_FLAG(int, k, 10, "Number of retrieved embeddings.");
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+namespace {
+
+using ::tflite::task::vision::ImageEmbedder;
+using ::tflite::task::vision::ImageEmbedderOptions;
+
+int64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+absl::Status Run() {
+  const int k = absl::GetFlag(FLAGS_k);
+  std::vector<int> num_probes_list;
+  for (absl::string_view value :
+       absl::StrSplit(absl::GetFlag(FLAGS_num_probes), ',')) {
+    int num_probes;
+    if (!absl::SimpleAtoi(value, &num_probes) || num_probes < 1) {
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Invalid --num_probes value '%s'.", value));
+    }
+    num_probes_list.push_back(num_probes);
+  }
+
+  ImageEmbedderOptions options;
+  options.mutable_model_file_with_metadata()->set_file_name(
+      absl::GetFlag(FLAGS_embedder));
+  ASSIGN_OR_RETURN(std::unique_ptr<ImageEmbedder> embedder,
+                   ImageEmbedder::CreateFromOptions(options));
+
+  ASSIGN_OR_RETURN(std::vector<LabeledImagePath> gallery_images,
+                   ListLabeledImages(absl::GetFlag(FLAGS_gallery)));
+  std::vector<LabeledImagePath> query_images;
+  if (!absl::GetFlag(FLAGS_queries).empty()) {
+    ASSIGN_OR_RETURN(query_images,
+                     ListLabeledImages(absl::GetFlag(FLAGS_queries)));
+  } else {
+    SplitHoldout(std::max(absl::GetFlag(FLAGS_holdout), 2), &gallery_images,
+                 &query_images);
+  }
+
+  EmbeddingMatrix gallery;
+  EmbeddingMatrix queries;
+  RETURN_IF_ERROR(EmbedImageFiles(embedder.get(), gallery_images, &gallery));
+  RETURN_IF_ERROR(EmbedImageFiles(embedder.get(), query_images, &queries));
+  if (queries.empty()) {
+    return absl::InvalidArgumentError("No query images.");
+  }
+
+  int64_t begin_us = NowMicros();
+  ASSIGN_OR_RETURN(IvfIndex index,
+                   BuildIvfIndex(gallery, absl::GetFlag(FLAGS_num_clusters),
+                                 absl::GetFlag(FLAGS_num_kmeans_iterations)));
+  // Split the clusters as TfLiteCbRBuilder does.
+  RETURN_IF_ERROR(CapClusterSize(
+      gallery,
+      DefaultMaxClusterSize(gallery.num_rows(),
+                            absl::GetFlag(FLAGS_num_clusters)),
+      absl::GetFlag(FLAGS_num_kmeans_iterations), &index));
+  absl::PrintF(
+      "%d gallery embeddings, %d queries, %d clusters (largest: %d) built in "
+      "%.1f s\n",
+      gallery.num_rows(), queries.num_rows(), index.num_clusters,
+      index.max_cluster_size(), (NowMicros() - begin_us) * 1e-6);
+
+  std::vector<std::vector<int32_t>> exact(queries.num_rows());
+  begin_us = NowMicros();
+  for (int q = 0; q < queries.num_rows(); ++q) {
+    exact[q] = SearchExact(gallery, queries.row(q).data(), k);
+  }
+  const double exact_us =
+      static_cast<double>(NowMicros() - begin_us) / queries.num_rows();
+  absl::PrintF("exact: %.1f us/query\n", exact_us);
+
+  absl::PrintF("%10s %10s %12s %10s %12s\n", "num_probes", "recall@k",
+               "us/query", "speedup", "graph rows");
+  for (int num_probes : num_probes_list) {
+    num_probes = std::min(num_probes, index.num_clusters);
+    double recall = 0.0;
+    begin_us = NowMicros();
+    for (int q = 0; q < queries.num_rows(); ++q) {
+      const std::vector<int32_t> found =
+          SearchIvf(index, gallery, queries.row(q).data(), num_probes, k);
+      int hits = 0;
+      for (int32_t row : found) {
+        hits += std::count(exact[q].begin(), exact[q].end(), row);
+      }
+      recall += exact[q].empty() ? 1.0
+                                 : static_cast<double>(hits) / exact[q].size();
+    }
+    const double ivf_us =
+        static_cast<double>(NowMicros() - begin_us) / queries.num_rows();
+    // Rows scored by the generated graph, clusters being padded.
+    const int graph_rows =
+        index.num_clusters + num_probes * index.max_cluster_size();
+    absl::PrintF("%10d %10.4f %12.1f %9.1fx %12d\n", num_probes,
+                 recall / queries.num_rows(), ivf_us,
+                 ivf_us > 0 ? exact_us / ivf_us : 0.0, graph_rows);
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  const absl::Status status = tflite::examples::cbr::Run();
+  if (!status.ok()) {
+    absl::FPrintF(stderr, "%s\n", status.ToString());
+    return 1;
+  }
+  return 0;
+}
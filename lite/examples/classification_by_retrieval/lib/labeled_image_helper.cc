@@ -14,10 +14,13 @@
 
 #include "lib/labeled_image_helper.h"
 
+#include <fstream>
+#include <sstream>
 #include <string>
 
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
+#include "lib/embedding_cache.h"
 #include "lib/model_builder.h"
 #include "tensorflow_lite_support/cc/port/status_macros.h"
 #include "tensorflow_lite_support/cc/port/statusor.h"
@@ -36,7 +39,17 @@ using ::tflite::task::vision::CreateFromRgbRawBuffer;
 using ::tflite::task::vision::DecodeImageFromFile;
 using ::tflite::task::vision::FrameBuffer;
 using ::tflite::task::vision::ImageData;
-using ::tflite::task::vision::ImageDataFree;
+
+tflite::support::StatusOr<std::string> ReadFileContent(
+    const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return absl::NotFoundError(absl::StrCat("Failed to open file: ", path));
+  }
+  std::ostringstream content;
+  content << file.rdbuf();
+  return content.str();
+}
 
 }  // namespace
 
@@ -58,15 +71,28 @@ BuildFrameBufferFromImageData(const ImageData& image) {
 absl::Status AddLabeledImageFromPath(ModelBuilder* model_builder,
                                      const std::string& label,
                                      const std::string& image_file_path) {
-  // Decode image and load into a FrameBuffer.
-  ASSIGN_OR_RETURN(ImageData image_data, DecodeImageFromFile(image_file_path));
+  // With an embedding cache, look the image up by the fingerprint of its file,
+  // which also saves decoding it.
+  EmbeddingCacheKey key;
+  if (model_builder->embedding_cache() != nullptr) {
+    ASSIGN_OR_RETURN(const std::string content,
+                     ReadFileContent(image_file_path));
+    key = FingerprintBytes(content);
+    const absl::Status status =
+        model_builder->AddCachedLabeledImage(label, key);
+    if (!absl::IsNotFound(status)) return status;
+  }
+  // Decode image and load into a FrameBuffer. The image data is freed on every
+  // return path.
+  ASSIGN_OR_RETURN(ImageData decoded, DecodeImageFromFile(image_file_path));
+  const ScopedImageData image_data(decoded);
   ASSIGN_OR_RETURN(std::unique_ptr<FrameBuffer> frame_buffer,
-                   BuildFrameBufferFromImageData(image_data));
+                   BuildFrameBufferFromImageData(image_data.get()));
   // Add to model builder.
-  RETURN_IF_ERROR(model_builder->AddLabeledImage(label, *frame_buffer));
-  // Cleanup.
-  ImageDataFree(&image_data);
-  return absl::OkStatus();
+  if (model_builder->embedding_cache() != nullptr) {
+    return model_builder->AddLabeledImage(label, *frame_buffer, key);
+  }
+  return model_builder->AddLabeledImage(label, *frame_buffer);
 }
 
 }  // namespace cbr
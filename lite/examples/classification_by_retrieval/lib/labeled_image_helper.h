@@ -26,12 +26,47 @@ namespace tflite {
 namespace examples {
 namespace cbr {
 
+// Owns decoded image data and releases it with ImageDataFree().
+class ScopedImageData {
+ public:
+  ScopedImageData() : image_{} {}
+  explicit ScopedImageData(const ::tflite::task::vision::ImageData& image)
+      : image_(image) {}
+  ~ScopedImageData() { Reset(); }
+
+  ScopedImageData(ScopedImageData&& other) : image_(other.image_) {
+    other.image_.pixel_data = nullptr;
+  }
+  ScopedImageData& operator=(ScopedImageData&& other) {
+    if (this != &other) {
+      Reset();
+      image_ = other.image_;
+      other.image_.pixel_data = nullptr;
+    }
+    return *this;
+  }
+
+  const ::tflite::task::vision::ImageData& get() const { return image_; }
+
+ private:
+  void Reset() {
+    if (image_.pixel_data != nullptr) {
+      ::tflite::task::vision::ImageDataFree(&image_);
+      image_.pixel_data = nullptr;
+    }
+  }
+
+  ::tflite::task::vision::ImageData image_;
+};
+
 // Returns a FrambeBuffer view of `image`.
 tflite::support::StatusOr<std::unique_ptr<::tflite::task::vision::FrameBuffer>>
 BuildFrameBufferFromImageData(const ::tflite::task::vision::ImageData& image);
 
 // A helper function that reads an image from the given path, converts it to a
 // frame buffer and adds it to the model builder with the provided label.
+// If the model builder has an embedding cache, images are looked up by the
+// fingerprint of their file, and cached images are not decoded.
 absl::Status AddLabeledImageFromPath(ModelBuilder* model_builder,
                                      const std::string& label,
                                      const std::string& image_file_path);
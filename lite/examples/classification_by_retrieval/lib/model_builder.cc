@@ -1,11 +1,21 @@
 #include "lib/model_builder.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+
+#include "absl/container/flat_hash_set.h"
 #include "absl/status/status.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
 #include "flatbuffers/flatbuffers.h"
+#include "lib/cbr_model_reader.h"
 #include "tensorflow_lite_support/cc/port/status_macros.h"
 #include "tensorflow_lite_support/cc/task/vision/proto/embeddings_proto_inc.h"
+#include "tensorflow_lite_support/metadata/cc/metadata_extractor.h"
 #include "tensorflow_lite_support/metadata/cc/metadata_populator.h"
 #include "tensorflow_lite_support/metadata/metadata_schema_generated.h"
 
@@ -16,9 +26,13 @@ namespace cbr {
 namespace {
 
 constexpr char kLabelMapFilename[] = "labelmap.txt";
+// Requested retrieval settings, which the graph only reflects clamped: e.g.
+// the "indices" output has min(top_k, num_classes) entries.
+constexpr char kRetrievalOptionsFilename[] = "retrieval_options.txt";
 
 using ::flatbuffers::FlatBufferBuilder;
 using ::tflite::FlatBufferModel;
+using ::tflite::metadata::ModelMetadataExtractor;
 using ::tflite::metadata::ModelMetadataPopulator;
 using ::tflite::task::core::ExternalFile;
 using ::tflite::task::vision::EmbeddingResult;
@@ -27,12 +41,71 @@ using ::tflite::task::vision::FrameBuffer;
 using ::tflite::task::vision::ImageEmbedder;
 using ::tflite::task::vision::ImageEmbedderOptions;
 
+// Serializes the retrieval settings of `options`, one "name=value" per line.
+std::string RetrievalOptionsFile(const TfLiteCbRBuilder::Options& options) {
+  return absl::StrFormat(
+      "top_k=%d\nquantize_retrieval=%d\nnum_clusters=%d\nnum_probes=%d\n",
+      options.top_k, options.quantize_retrieval ? 1 : 0, options.num_clusters,
+      options.num_probes);
+}
+
+// Parses `content`, written by RetrievalOptionsFile(), into `options`.
+absl::Status ParseRetrievalOptionsFile(absl::string_view content,
+                                       TfLiteCbRBuilder::Options* options) {
+  for (absl::string_view line : absl::StrSplit(content, '\n')) {
+    if (line.empty()) continue;
+    const std::pair<absl::string_view, absl::string_view> field =
+        absl::StrSplit(line, absl::MaxSplits('=', 1));
+    int value;
+    if (!absl::SimpleAtoi(field.second, &value)) {
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Invalid line in %s: '%s'.",
+                          kRetrievalOptionsFilename, line));
+    }
+    if (field.first == "top_k") {
+      options->top_k = value;
+    } else if (field.first == "quantize_retrieval") {
+      options->quantize_retrieval = value != 0;
+    } else if (field.first == "num_clusters") {
+      options->num_clusters = value;
+    } else if (field.first == "num_probes") {
+      options->num_probes = value;
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Fingerprints the pixels of `frame_buffer`, ignoring the padding of its rows.
+EmbeddingCacheKey FingerprintFrameBuffer(const FrameBuffer& frame_buffer) {
+  Fingerprinter fingerprinter;
+  const FrameBuffer::Dimension dimension = frame_buffer.dimension();
+  const int32_t properties[] = {
+      static_cast<int32_t>(frame_buffer.format()),
+      static_cast<int32_t>(frame_buffer.orientation()), dimension.width,
+      dimension.height};
+  fingerprinter.Update(properties, sizeof(properties));
+  for (int p = 0; p < frame_buffer.plane_count(); ++p) {
+    const FrameBuffer::Plane plane = frame_buffer.plane(p);
+    // Chroma planes are subsampled by 2 in both directions.
+    const int width = p == 0 ? dimension.width : (dimension.width + 1) / 2;
+    const int height = p == 0 ? dimension.height : (dimension.height + 1) / 2;
+    for (int y = 0; y < height; ++y) {
+      fingerprinter.Update(
+          plane.buffer + static_cast<size_t>(y) * plane.stride.row_stride_bytes,
+          static_cast<size_t>(width) * plane.stride.pixel_stride_bytes);
+    }
+  }
+  return fingerprinter.Finish();
+}
+
 }  // namespace
 
 ModelBuilder::ModelBuilder(std::unique_ptr<ImageEmbedder> image_embedder,
                            std::unique_ptr<FlatBufferModel> model,
-                           std::unique_ptr<TfLiteCbRBuilder> tflite_cbr_builder)
-    : image_embedder_(std::move(image_embedder)),
+                           std::unique_ptr<TfLiteCbRBuilder> tflite_cbr_builder,
+                           absl::optional<ImageEmbedderOptions> options)
+    : options_(std::move(options)),
+      image_embedder_(std::move(image_embedder)),
       model_(std::move(model)),
       tflite_cbr_builder_(std::move(tflite_cbr_builder)) {}
 
@@ -61,8 +134,9 @@ ModelBuilder::CreateFromImageEmbedderOptions(
     return absl::InvalidArgumentError("Failed to build model from file: " +
                                       model_file);
   }
-  return absl::make_unique<ModelBuilder>(std::move(image_embedder),
-                                         std::move(model));
+  return absl::make_unique<ModelBuilder>(
+      std::move(image_embedder), std::move(model),
+      absl::make_unique<TfLiteCbRBuilder>(), options);
 }
 
 void ModelBuilder::SetMetadata(
@@ -81,15 +155,340 @@ void ModelBuilder::SetMetadata(
 absl::Status ModelBuilder::AddLabeledImage(
     const std::string& label,
     const ::tflite::task::vision::FrameBuffer& frame_buffer) {
+  return AddLabeledImage(label, frame_buffer,
+                         embedding_cache_ != nullptr
+                             ? FingerprintFrameBuffer(frame_buffer)
+                             : EmbeddingCacheKey());
+}
+
+absl::Status ModelBuilder::AddLabeledImage(
+    const std::string& label,
+    const ::tflite::task::vision::FrameBuffer& frame_buffer,
+    const EmbeddingCacheKey& key) {
+  if (embedding_cache_ != nullptr) {
+    const absl::Status status = AddCachedLabeledImage(label, key);
+    if (!absl::IsNotFound(status)) return status;
+  }
   ASSIGN_OR_RETURN(const EmbeddingResult& embedding_result,
                    image_embedder_->Embed(frame_buffer));
-  feature_vectors_.emplace_back(
+  const FeatureVector& feature_vector =
       image_embedder_->GetEmbeddingByIndex(embedding_result, 0)
-          .feature_vector());
+          .feature_vector();
+  // Cache first, so that nothing is added if caching fails.
+  if (embedding_cache_ != nullptr) {
+    RETURN_IF_ERROR(
+        embedding_cache_->Insert(key, feature_vector.value_float()));
+  }
+  RETURN_IF_ERROR(embeddings_.AppendRow(feature_vector.value_float()));
+  labels_.emplace_back(label);
+  return absl::OkStatus();
+}
+
+absl::Status ModelBuilder::AddCachedLabeledImage(
+    const std::string& label, const EmbeddingCacheKey& key) {
+  if (embedding_cache_ == nullptr) {
+    return absl::FailedPreconditionError("No embedding cache is set.");
+  }
+  std::vector<float> embedding(embedding_cache_->dim());
+  if (!embedding_cache_->Lookup(key, absl::MakeSpan(embedding))) {
+    return absl::NotFoundError("No cached embedding for this image.");
+  }
+  RETURN_IF_ERROR(embeddings_.AppendRow(embedding));
   labels_.emplace_back(label);
   return absl::OkStatus();
 }
 
+absl::Status ModelBuilder::SetEmbeddingCache(
+    const std::string& path, const EmbeddingCacheOptions& options) {
+  // Release the file first, in case it is opened again.
+  embedding_cache_.reset();
+
+  // The embeddings depend on the model and on the options of the embedder.
+  Fingerprinter fingerprinter;
+  if (model_->allocation() == nullptr) {
+    return absl::FailedPreconditionError(
+        "The embedding cache requires the content of the embedder model.");
+  }
+  fingerprinter.Update(model_->allocation()->base(),
+                       model_->allocation()->bytes());
+  if (options_.has_value()) {
+    const bool l2_normalize = options_->l2_normalize();
+    fingerprinter.Update(&l2_normalize, sizeof(l2_normalize));
+  }
+
+  ASSIGN_OR_RETURN(embedding_cache_,
+                   EmbeddingCache::Open(path, fingerprinter.Finish(),
+                                        EmbeddingDim(), options));
+  return absl::OkStatus();
+}
+
+int ModelBuilder::EmbeddingDim() const {
+  // The embedding is the flattened output of the embedder.
+  const tflite::SubGraph* subgraph = model_->GetModel()->subgraphs()->Get(0);
+  const tflite::Tensor* output =
+      subgraph->tensors()->Get(subgraph->outputs()->Get(0));
+  int dim = 1;
+  for (int32_t size : *output->shape()) dim *= size;
+  return dim;
+}
+
+absl::Status ModelBuilder::SetParallelism(int num_workers,
+                                          int num_interpreter_threads) {
+  if (num_workers < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Expected at least one worker, found %d.",
+                        num_workers));
+  }
+  if (!options_.has_value()) {
+    return absl::FailedPreconditionError(
+        "Parallel embedding requires the ImageEmbedderOptions of the "
+        "ModelBuilder.");
+  }
+  if (num_interpreter_threads > 0) {
+    options_->set_num_threads(num_interpreter_threads);
+    ASSIGN_OR_RETURN(image_embedder_,
+                     ImageEmbedder::CreateFromOptions(*options_));
+    worker_embedders_.clear();
+  }
+  worker_embedders_.resize(std::min<int>(worker_embedders_.size(),
+                                         num_workers - 1));
+  while (worker_embedders_.size() < num_workers - 1) {
+    ASSIGN_OR_RETURN(std::unique_ptr<ImageEmbedder> embedder,
+                     ImageEmbedder::CreateFromOptions(*options_));
+    worker_embedders_.push_back(std::move(embedder));
+  }
+  return absl::OkStatus();
+}
+
+void ModelBuilder::SetQuantizeRetrieval(bool quantize_retrieval) {
+  TfLiteCbRBuilder::Options options = tflite_cbr_builder_->options();
+  options.quantize_retrieval = quantize_retrieval;
+  tflite_cbr_builder_->set_options(options);
+}
+
+void ModelBuilder::SetTopK(int top_k) {
+  TfLiteCbRBuilder::Options options = tflite_cbr_builder_->options();
+  options.top_k = top_k;
+  tflite_cbr_builder_->set_options(options);
+}
+
+void ModelBuilder::SetTwoStageRetrieval(int num_clusters, int num_probes) {
+  TfLiteCbRBuilder::Options options = tflite_cbr_builder_->options();
+  options.num_clusters = num_clusters;
+  options.num_probes = num_probes;
+  tflite_cbr_builder_->set_options(options);
+}
+
+void ModelBuilder::SetPrototypeCompression(
+    const PrototypeCompressionOptions& compression_options) {
+  TfLiteCbRBuilder::Options options = tflite_cbr_builder_->options();
+  options.prototype_compression = compression_options;
+  tflite_cbr_builder_->set_options(options);
+}
+
+absl::Status ModelBuilder::AddLabeledImages(
+    absl::Span<const LabeledImage> images) {
+  // Check the images before handing them to the workers.
+  for (const LabeledImage& image : images) {
+    if (image.frame_buffer == nullptr) {
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "Missing frame buffer of an image labeled '%s'.", image.label));
+    }
+  }
+  std::vector<ImageEmbedder*> embedders = {image_embedder_.get()};
+  for (const auto& embedder : worker_embedders_) {
+    embedders.push_back(embedder.get());
+  }
+  const int num_workers =
+      std::min<int>(embedders.size(), std::max<size_t>(images.size(), 1));
+
+  // Each worker claims the next image and writes its embedding to the slot of
+  // that image, so the order of the results does not depend on scheduling.
+  std::vector<std::vector<float>> embeddings(images.size());
+  std::vector<absl::Status> statuses(images.size());
+
+  // Take the cached embeddings, which are then skipped by the workers.
+  std::vector<EmbeddingCacheKey> keys;
+  std::vector<bool> cached;
+  if (embedding_cache_ != nullptr) {
+    keys.resize(images.size());
+    cached.resize(images.size());
+    for (int i = 0; i < images.size(); ++i) {
+      keys[i] = FingerprintFrameBuffer(*images[i].frame_buffer);
+      embeddings[i].resize(embedding_cache_->dim());
+      cached[i] = embedding_cache_->Lookup(keys[i],
+                                           absl::MakeSpan(embeddings[i]));
+      if (!cached[i]) embeddings[i].clear();
+    }
+  }
+
+  std::atomic<int> next_image(0);
+  auto embed_images = [&](ImageEmbedder* embedder) {
+    for (int i = next_image++; i < images.size(); i = next_image++) {
+      if (!embeddings[i].empty()) continue;
+      auto embedding_result = embedder->Embed(*images[i].frame_buffer);
+      if (!embedding_result.ok()) {
+        statuses[i] = embedding_result.status();
+        continue;
+      }
+      const FeatureVector& feature_vector =
+          embedder->GetEmbeddingByIndex(*embedding_result, 0).feature_vector();
+      embeddings[i].assign(feature_vector.value_float().begin(),
+                           feature_vector.value_float().end());
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int w = 1; w < num_workers; ++w) {
+    threads.emplace_back(embed_images, embedders[w]);
+  }
+  embed_images(embedders[0]);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (const absl::Status& status : statuses) {
+    RETURN_IF_ERROR(status);
+  }
+  // Check the dimensions before adding anything.
+  for (const std::vector<float>& embedding : embeddings) {
+    const int dim = embeddings_.empty() ? embeddings[0].size()
+                                        : embeddings_.dim();
+    if (embedding.empty() || embedding.size() != dim) {
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Expected an embedding of dimension %d, found %d.",
+                          dim, embedding.size()));
+    }
+  }
+  if (embedding_cache_ != nullptr) {
+    for (int i = 0; i < images.size(); ++i) {
+      if (!cached[i]) {
+        RETURN_IF_ERROR(embedding_cache_->Insert(keys[i], embeddings[i]));
+      }
+    }
+  }
+  if (!embeddings.empty()) {
+    embeddings_.Reserve(embeddings_.num_rows() + embeddings.size(),
+                        embeddings[0].size());
+  }
+  for (int i = 0; i < images.size(); ++i) {
+    RETURN_IF_ERROR(embeddings_.AppendRow(embeddings[i]));
+    labels_.emplace_back(images[i].label);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ModelBuilder::LoadModel(const std::string& model_content) {
+  flatbuffers::Verifier verifier(
+      reinterpret_cast<const uint8_t*>(model_content.data()),
+      model_content.size());
+  if (!tflite::VerifyModelBuffer(verifier)) {
+    return absl::InvalidArgumentError("Invalid TFLite model buffer.");
+  }
+  ASSIGN_OR_RETURN(std::unique_ptr<ModelMetadataExtractor> metadata_extractor,
+                   ModelMetadataExtractor::CreateFromModelBuffer(
+                       model_content.data(), model_content.size()));
+  const tflite::ModelMetadata* model_metadata =
+      metadata_extractor->GetModelMetadata();
+  if (model_metadata == nullptr) {
+    return absl::InvalidArgumentError(
+        "Expected a classification-by-retrieval model with metadata.");
+  }
+  ASSIGN_OR_RETURN(absl::string_view labelmap,
+                   metadata_extractor->GetAssociatedFile(kLabelMapFilename));
+  const std::vector<std::string> class_labels = absl::StrSplit(labelmap, '\n');
+  ASSIGN_OR_RETURN(
+      CbRGallery gallery,
+      ReadCbRGallery(*tflite::GetModel(model_content.data()),
+                     class_labels.size()));
+  const int dim = EmbeddingDim();
+  if (gallery.embeddings.dim() != dim) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "The model has embeddings of dimension %d, but the embedder outputs "
+        "embeddings of dimension %d.",
+        gallery.embeddings.dim(), dim));
+  }
+
+  // Restore the metadata. The labelmap is rebuilt by `BuildModel()` and the
+  // files of the embedder are copied from it again.
+  auto str = [](const flatbuffers::String* value) {
+    return value != nullptr ? value->str() : std::string();
+  };
+  absl::flat_hash_set<std::string> embedder_files;
+  const tflite::ModelMetadata* embedder_metadata =
+      image_embedder_->GetMetadataExtractor()->GetModelMetadata();
+  if (embedder_metadata != nullptr &&
+      embedder_metadata->associated_files() != nullptr) {
+    for (const tflite::AssociatedFile* file :
+         *embedder_metadata->associated_files()) {
+      embedder_files.insert(str(file->name()));
+    }
+  }
+  name_ = str(model_metadata->name());
+  description_ = str(model_metadata->description());
+  author_ = str(model_metadata->author());
+  version_ = str(model_metadata->version());
+  license_ = str(model_metadata->license());
+  associated_files_.clear();
+  if (model_metadata->associated_files() != nullptr) {
+    for (const tflite::AssociatedFile* file :
+         *model_metadata->associated_files()) {
+      const std::string filename = str(file->name());
+      if (filename == kLabelMapFilename ||
+          filename == kRetrievalOptionsFilename ||
+          embedder_files.contains(filename)) {
+        continue;
+      }
+      ASSIGN_OR_RETURN(absl::string_view content,
+                       metadata_extractor->GetAssociatedFile(filename));
+      associated_files_[filename] = std::string(content);
+    }
+  }
+
+  // Restore the retrieval settings, keeping the build-time ones. They are
+  // stored as requested; models without the file only have the clamped
+  // values read from the graph.
+  TfLiteCbRBuilder::Options options = tflite_cbr_builder_->options();
+  tflite::support::StatusOr<absl::string_view> options_file =
+      metadata_extractor->GetAssociatedFile(kRetrievalOptionsFilename);
+  if (options_file.ok()) {
+    RETURN_IF_ERROR(ParseRetrievalOptionsFile(*options_file, &options));
+  } else {
+    options.top_k = gallery.options.top_k;
+    options.quantize_retrieval = gallery.options.quantize_retrieval;
+    options.num_clusters = gallery.options.num_clusters;
+    if (options.num_clusters > 0) {
+      options.num_probes = gallery.options.num_probes;
+    }
+  }
+  tflite_cbr_builder_->set_options(options);
+
+  labels_.clear();
+  labels_.reserve(gallery.row_classes.size());
+  for (int32_t class_id : gallery.row_classes) {
+    labels_.push_back(class_labels[class_id]);
+  }
+  embeddings_ = std::move(gallery.embeddings);
+  return absl::OkStatus();
+}
+
+absl::Status ModelBuilder::RemoveLabel(const std::string& label) {
+  EmbeddingMatrix embeddings;
+  std::vector<std::string> labels;
+  embeddings.Reserve(embeddings_.num_rows(), embeddings_.dim());
+  for (int i = 0; i < labels_.size(); ++i) {
+    if (labels_[i] == label) continue;
+    RETURN_IF_ERROR(embeddings.AppendRow(embeddings_.row(i)));
+    labels.push_back(labels_[i]);
+  }
+  if (labels.size() == labels_.size()) {
+    return absl::NotFoundError(
+        absl::StrFormat("No image labeled '%s' has been added.", label));
+  }
+  embeddings_ = std::move(embeddings);
+  labels_ = std::move(labels);
+  return absl::OkStatus();
+}
+
 tflite::support::StatusOr<std::string> ModelBuilder::PopulateMetadata(
     const char* buffer_data, size_t buffer_size) {
   // Copy metadata from original model.
@@ -124,6 +523,11 @@ tflite::support::StatusOr<std::string> ModelBuilder::PopulateMetadata(
     associated_file_t->type = tflite::AssociatedFileType_DESCRIPTIONS;
     model_metadata_t.associated_files.push_back(std::move(associated_file_t));
   }
+  auto options_file_t = std::make_unique<tflite::AssociatedFileT>();
+  options_file_t->name = kRetrievalOptionsFilename;
+  options_file_t->description = "Retrieval settings of the model builder.";
+  options_file_t->type = tflite::AssociatedFileType_DESCRIPTIONS;
+  model_metadata_t.associated_files.push_back(std::move(options_file_t));
 
   // Build minimalistic output tensor metadata.
   auto tensor_metadata_t = std::make_unique<tflite::TensorMetadataT>();
@@ -132,11 +536,30 @@ tflite::support::StatusOr<std::string> ModelBuilder::PopulateMetadata(
   auto associated_file_t = std::make_unique<tflite::AssociatedFileT>();
   associated_file_t->name = kLabelMapFilename;
   associated_file_t->type = tflite::AssociatedFileType_TENSOR_AXIS_LABELS;
-  tensor_metadata_t->associated_files.push_back(std::move(associated_file_t));
-
-  // Replace output tensor metadata.
-  model_metadata_t.subgraph_metadata[0]->output_tensor_metadata[0] =
-      std::move(tensor_metadata_t);
+  std::vector<std::unique_ptr<tflite::TensorMetadataT>>&
+      output_tensor_metadata =
+          model_metadata_t.subgraph_metadata[0]->output_tensor_metadata;
+  if (tflite_cbr_builder_->options().top_k > 0) {
+    // The labels map the values of the indices output rather than the axis of
+    // the scores.
+    auto scores_metadata_t = std::make_unique<tflite::TensorMetadataT>();
+    scores_metadata_t->name = "scores";
+    scores_metadata_t->description =
+        "Scores of the best classes, in decreasing order.";
+    tensor_metadata_t->name = "indices";
+    tensor_metadata_t->description = "Indices of the best classes.";
+    associated_file_t->type = tflite::AssociatedFileType_TENSOR_VALUE_LABELS;
+    tensor_metadata_t->associated_files.push_back(
+        std::move(associated_file_t));
+    output_tensor_metadata.clear();
+    output_tensor_metadata.push_back(std::move(scores_metadata_t));
+    output_tensor_metadata.push_back(std::move(tensor_metadata_t));
+  } else {
+    tensor_metadata_t->associated_files.push_back(
+        std::move(associated_file_t));
+    // Replace output tensor metadata.
+    output_tensor_metadata[0] = std::move(tensor_metadata_t);
+  }
 
   // Pack metadata.
   FlatBufferBuilder fbb;
@@ -154,26 +577,29 @@ tflite::support::StatusOr<std::string> ModelBuilder::PopulateMetadata(
   // metadata populator.
   std::string labelmap = absl::StrJoin(labels_, "\n");
   associated_files_.insert({{kLabelMapFilename, labelmap}});
+  associated_files_.insert(
+      {{kRetrievalOptionsFilename,
+        RetrievalOptionsFile(tflite_cbr_builder_->options())}});
   metadata_populator->LoadAssociatedFiles(associated_files_);
   return metadata_populator->Populate();
 }
 
 tflite::support::StatusOr<ExternalFile> ModelBuilder::BuildModel() {
   // Sanity checks.
-  if (feature_vectors_.size() < 2) {
+  if (embeddings_.num_rows() < 2) {
     return absl::FailedPreconditionError(
         absl::StrFormat("Expected at least two labeled images to have been "
                         "provided through `AddLabeledImage`, found %d.",
-                        feature_vectors_.size()));
+                        embeddings_.num_rows()));
   }
-  if (labels_.size() != feature_vectors_.size()) {
+  if (labels_.size() != embeddings_.num_rows()) {
     return absl::InternalError(
         "Expected same number of labels and feature vectors.");
   }
   FlatBufferBuilder fbb;
   ASSIGN_OR_RETURN(labels_,
                    tflite_cbr_builder_->BuildCbRModel(
-                       *model_->GetModel(), feature_vectors_, labels_, &fbb));
+                       *model_->GetModel(), embeddings_, labels_, &fbb));
 
   // Populate metadata.
   ExternalFile model_external_file;
@@ -190,7 +616,7 @@ tflite::support::StatusOr<ExternalFile> ModelBuilder::BuildModel() {
   license_ = "";
   associated_files_ = {};
   labels_.clear();
-  feature_vectors_.clear();
+  embeddings_.Clear();
   return model_external_file;
 }
 
@@ -16,10 +16,16 @@
 #define TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_MODEL_BUILDER_H_
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "lib/embedding_cache.h"
+#include "lib/embedding_matrix.h"
+#include "lib/prototype_compression.h"
 #include "lib/tflite_cbr_builder.h"
 #include "tensorflow/lite/model.h"
 #include "tensorflow_lite_support/cc/port/statusor.h"
@@ -38,12 +44,22 @@ namespace cbr {
 // classification-by-retrieval model.
 class ModelBuilder {
  public:
+  // A labeled image for `AddLabeledImages()`. The frame buffer is not owned.
+  struct LabeledImage {
+    std::string label;
+    const ::tflite::task::vision::FrameBuffer* frame_buffer;
+  };
+
   // For testing purposes; prefer using CreateFromImageEmbedderOptions.
+  // `SetParallelism()` requires `options`, the ones `image_embedder` was
+  // created with.
   explicit ModelBuilder(
       std::unique_ptr<::tflite::task::vision::ImageEmbedder> image_embedder,
       std::unique_ptr<::tflite::FlatBufferModel> model,
       std::unique_ptr<TfLiteCbRBuilder> tflite_cbr_builder =
-          absl::make_unique<TfLiteCbRBuilder>());
+          absl::make_unique<TfLiteCbRBuilder>(),
+      absl::optional<::tflite::task::vision::ImageEmbedderOptions> options =
+          absl::nullopt);
 
   // Initializes the ModelBuilder from the provided ImageEmbedderOptions.
   static tflite::support::StatusOr<std::unique_ptr<ModelBuilder>>
@@ -65,11 +81,120 @@ class ModelBuilder {
   // with the provided label. This method is meant to be called multiple times
   // on each labeled image used to create the classification-by-retrieval model
   // before a final call to `BuildModel()` actually creates and returns the
-  // final model.
+  // final model. If an embedding cache is set, the embedding of an image whose
+  // pixels were embedded before is taken from the cache.
   absl::Status AddLabeledImage(
       const std::string& label,
       const ::tflite::task::vision::FrameBuffer& frame_buffer);
 
+  // Same as `AddLabeledImage()` above, with the embedding cached under `key`
+  // rather than under the fingerprint of the pixels of `frame_buffer`, e.g.
+  // under the fingerprint of the encoded image file. `key` is ignored if no
+  // cache is set.
+  absl::Status AddLabeledImage(
+      const std::string& label,
+      const ::tflite::task::vision::FrameBuffer& frame_buffer,
+      const EmbeddingCacheKey& key);
+
+  // Adds the embedding cached under `key` along with `label`, which saves
+  // decoding and embedding the image. Returns an absl::NotFoundError if there
+  // is no such embedding, or an absl::FailedPreconditionError if no cache is
+  // set.
+  absl::Status AddCachedLabeledImage(const std::string& label,
+                                     const EmbeddingCacheKey& key);
+
+  // Sets `AddLabeledImage()` and `AddLabeledImages()` to reuse the embeddings
+  // stored in the cache file at `path`, and to store the new ones there. The
+  // cache is specific to the embedder model and options: it is reset if they
+  // differ from the ones it was written with. See EmbeddingCache for the
+  // layout and size limit of the file. The setting is kept across calls to
+  // `BuildModel()`.
+  absl::Status SetEmbeddingCache(const std::string& path,
+                                 const EmbeddingCacheOptions& options = {});
+
+  // The cache set by `SetEmbeddingCache()`, or nullptr. Use it to invalidate
+  // embeddings or read statistics.
+  EmbeddingCache* embedding_cache() const { return embedding_cache_.get(); }
+
+  // Sets the number of ImageEmbedder instances `AddLabeledImages()` fans out
+  // to, one thread each. With a positive `num_interpreter_threads`, every
+  // embedder, including the one used by `AddLabeledImage()`, is rebuilt to run
+  // its interpreter on that many threads; otherwise the `num_threads` of the
+  // options is kept.
+  //
+  // All embedders are built from the same options, so the embeddings do not
+  // depend on the number of workers. Returns an absl::FailedPreconditionError
+  // if the ModelBuilder was created without ImageEmbedderOptions.
+  absl::Status SetParallelism(int num_workers,
+                              int num_interpreter_threads = -1);
+
+  // Sets whether `BuildModel()` quantizes the retrieval layer to int8 for a
+  // float embedder, which makes it 4x smaller. Models built on a quantized
+  // embedder always have an int8 retrieval layer. The setting is kept across
+  // calls to `BuildModel()`.
+  void SetQuantizeRetrieval(bool quantize_retrieval);
+
+  // Sets the number of best classes `BuildModel()` makes the model output, or
+  // 0 (the default) to output the scores of all classes. With a positive
+  // `top_k`, the model has a "scores" and an "indices" output, the latter
+  // carrying the labelmap as TENSOR_VALUE_LABELS, so it is meant to be run
+  // with a plain interpreter rather than the ImageClassifier Task API. The
+  // setting is kept across calls to `BuildModel()`.
+  void SetTopK(int top_k);
+
+  // Sets `BuildModel()` to use a two-stage retrieval layer scoring the
+  // embeddings of the best `num_probes` of `num_clusters` clusters, or a dense
+  // one if `num_clusters` is 0 (the default). Requires `SetTopK()`. See
+  // TfLiteCbRBuilder::Options::num_clusters. The setting is kept across calls
+  // to `BuildModel()`.
+  void SetTwoStageRetrieval(int num_clusters, int num_probes);
+
+  // Sets how `BuildModel()` compresses the instances of each class into fewer
+  // retrieval rows, see PrototypeCompressionOptions. Compression is disabled
+  // by default. The setting is kept across calls to `BuildModel()`.
+  void SetPrototypeCompression(const PrototypeCompressionOptions& options);
+
+  // Number of instances and of retrieval rows of the last built model.
+  const PrototypeCompressionStats& compression_stats() const {
+    return tflite_cbr_builder_->compression_stats();
+  }
+
+  // Same as calling `AddLabeledImage()` on each image in order, with the
+  // embeddings taken from the embedding cache, if any, or extracted in
+  // parallel as set by `SetParallelism()`. The resulting model is identical
+  // to the one built serially. If any image fails, the error of the first
+  // failing image is returned and none of the images are added. Returns an
+  // absl::InvalidArgumentError if an image has no frame buffer.
+  absl::Status AddLabeledImages(absl::Span<const LabeledImage> images);
+
+  // Replaces the labeled images added so far with the gallery of
+  // `model_content`, a classification-by-retrieval model previously returned
+  // by `BuildModel()` for the same embedder, so that images can be appended
+  // with `AddLabeledImage()` or removed with `RemoveLabel()` without embedding
+  // the gallery again. The metadata and the retrieval settings of the model
+  // (see `SetQuantizeRetrieval()`, `SetTopK()` and `SetTwoStageRetrieval()`)
+  // are restored as well. The model being a flatbuffer, `BuildModel()` still
+  // serializes a new one; only the embedding of the gallery is saved.
+  //
+  // For a model built with prototype compression, the gallery is made of the
+  // prototypes. Returns an absl::InvalidArgumentError if `model_content` is
+  // not a classification-by-retrieval model, or if its embeddings do not have
+  // the dimension of the embedder output.
+  //
+  // The retrieval settings are stored as requested in a "retrieval_options.txt"
+  // associated file. For models without it, they are read from the graph,
+  // where `top_k` is clamped to the number of classes and `num_clusters` is
+  // the number of clusters after splitting.
+  //
+  // The clusters of a two-stage model are not restored: `BuildModel()` runs
+  // k-means again over the whole gallery, not only over the appended images,
+  // so rebuilding costs as much as the first build.
+  absl::Status LoadModel(const std::string& model_content);
+
+  // Removes all the images added with `label`. Returns an absl::NotFoundError
+  // if there is none.
+  absl::Status RemoveLabel(const std::string& label);
+
   // Finalizes the classification-by-retrieval model construction using the
   // feature vectors extracted along the successive (at least two) calls to
   // `AddLabeledImage()`. If less than two labeled images have been added, this
@@ -92,11 +217,22 @@ class ModelBuilder {
   tflite::support::StatusOr<std::string> PopulateMetadata(
       const char* buffer_data, size_t buffer_size);
 
+  // Returns the dimension of the embeddings, the flattened embedder output.
+  int EmbeddingDim() const;
+
+  // The options provided at initialization time, if any.
+  absl::optional<::tflite::task::vision::ImageEmbedderOptions> options_;
   // The ImageEmbedder built from options provided at initialization time.
   std::unique_ptr<::tflite::task::vision::ImageEmbedder> image_embedder_;
+  // Additional embedders built from `options_`, used along `image_embedder_`
+  // by `AddLabeledImages()`.
+  std::vector<std::unique_ptr<::tflite::task::vision::ImageEmbedder>>
+      worker_embedders_;
   // The TfLite embedding model built from options provided at initialization
   // time. This is the identical model that is the used by `image_embedder_`.
   std::unique_ptr<::tflite::FlatBufferModel> model_;
+  // The cache of embeddings set by `SetEmbeddingCache()`, if any.
+  std::unique_ptr<EmbeddingCache> embedding_cache_;
   // The TfLiteCbrBuilder to use for creating the classification-by-retrieval
   // TFLite model.
   std::unique_ptr<TfLiteCbRBuilder> tflite_cbr_builder_;
@@ -112,9 +248,10 @@ class ModelBuilder {
   // The list of currently added labels, filled along successive calls to
   // `AddLabeledImage()` and flushed on final call to `BuildModel()`.
   std::vector<std::string> labels_;
-  // The list of currently extracted feature vectors, filled along successive
-  // calls to `AddLabeledImage()` and flushed on final call to `BuildModel()`.
-  std::vector<::tflite::task::vision::FeatureVector> feature_vectors_;
+  // The currently extracted embeddings, one row per label in `labels_`,
+  // filled along successive calls to `AddLabeledImage()` and flushed on final
+  // call to `BuildModel()`.
+  EmbeddingMatrix embeddings_;
 };
 
 }  // namespace cbr
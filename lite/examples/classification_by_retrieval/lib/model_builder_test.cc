@@ -0,0 +1,225 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/model_builder.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/optional.h"
+#include "flatbuffers/flatbuffers.h"
+#include "gtest/gtest.h"
+#include "lib/tflite_cbr_builder.h"
+#include "tensorflow/lite/model.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow_lite_support/cc/port/statusor.h"
+#include "tensorflow_lite_support/cc/task/core/proto/external_file_proto_inc.h"
+#include "tensorflow_lite_support/cc/task/vision/core/frame_buffer.h"
+#include "tensorflow_lite_support/cc/task/vision/image_embedder.h"
+#include "tensorflow_lite_support/cc/task/vision/proto/image_embedder_options_proto_inc.h"
+#include "tensorflow_lite_support/cc/task/vision/utils/frame_buffer_common_utils.h"
+#include "tensorflow_lite_support/metadata/cc/metadata_populator.h"
+#include "tensorflow_lite_support/metadata/metadata_schema_generated.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+namespace {
+
+using ::tflite::metadata::ModelMetadataPopulator;
+using ::tflite::task::core::ExternalFile;
+using ::tflite::task::vision::CreateFromRgbRawBuffer;
+using ::tflite::task::vision::FrameBuffer;
+using ::tflite::task::vision::ImageEmbedder;
+using ::tflite::task::vision::ImageEmbedderOptions;
+
+constexpr int kImageSize = 4;
+constexpr int kImageBytes = kImageSize * kImageSize * 3;
+
+// Returns an embedder whose embedding is the flattened pixels of its
+// kImageSize x kImageSize RGB image: a CAST of the uint8 image to float and
+// a RESHAPE, with the metadata required by the ModelBuilder.
+std::string EmbedderModel() {
+  flatbuffers::FlatBufferBuilder fbb;
+  const std::vector<int32_t> image_shape = {1, kImageSize, kImageSize, 3};
+  const std::vector<int32_t> embedding_shape = {1, kImageBytes};
+  const std::vector<flatbuffers::Offset<::tflite::Tensor>> tensors = {
+      ::tflite::CreateTensor(fbb, fbb.CreateVector(image_shape),
+                             ::tflite::TensorType_UINT8, /*buffer=*/0,
+                             fbb.CreateString("image")),
+      ::tflite::CreateTensor(fbb, fbb.CreateVector(image_shape),
+                             ::tflite::TensorType_FLOAT32, /*buffer=*/0,
+                             fbb.CreateString("float_image")),
+      ::tflite::CreateTensor(fbb, fbb.CreateVector(embedding_shape),
+                             ::tflite::TensorType_FLOAT32, /*buffer=*/0,
+                             fbb.CreateString("embedding")),
+  };
+  const std::vector<flatbuffers::Offset<::tflite::Operator>> operators = {
+      ::tflite::CreateOperator(fbb, /*opcode_index=*/0,
+                               fbb.CreateVector(std::vector<int32_t>{0}),
+                               fbb.CreateVector(std::vector<int32_t>{1}),
+                               ::tflite::BuiltinOptions_CastOptions,
+                               ::tflite::CreateCastOptions(
+                                   fbb, ::tflite::TensorType_UINT8,
+                                   ::tflite::TensorType_FLOAT32)
+                                   .Union()),
+      ::tflite::CreateOperator(
+          fbb, /*opcode_index=*/1, fbb.CreateVector(std::vector<int32_t>{1}),
+          fbb.CreateVector(std::vector<int32_t>{2}),
+          ::tflite::BuiltinOptions_ReshapeOptions,
+          ::tflite::CreateReshapeOptions(fbb,
+                                         fbb.CreateVector(embedding_shape))
+              .Union()),
+  };
+  const std::vector<flatbuffers::Offset<::tflite::SubGraph>> subgraphs = {
+      ::tflite::CreateSubGraph(fbb, fbb.CreateVector(tensors),
+                               fbb.CreateVector(std::vector<int32_t>{0}),
+                               fbb.CreateVector(std::vector<int32_t>{2}),
+                               fbb.CreateVector(operators))};
+  const std::vector<flatbuffers::Offset<::tflite::OperatorCode>>
+      operator_codes = {
+          ::tflite::CreateOperatorCode(fbb, ::tflite::BuiltinOperator_CAST),
+          ::tflite::CreateOperatorCode(fbb,
+                                       ::tflite::BuiltinOperator_RESHAPE)};
+  const std::vector<flatbuffers::Offset<::tflite::Buffer>> buffers = {
+      ::tflite::CreateBuffer(fbb)};
+  ::tflite::FinishModelBuffer(
+      fbb, ::tflite::CreateModel(
+               fbb, /*version=*/3, fbb.CreateVector(operator_codes),
+               fbb.CreateVector(subgraphs), /*description=*/0,
+               fbb.CreateVector(buffers), /*metadata_buffer=*/0,
+               fbb.CreateVector(
+                   std::vector<flatbuffers::Offset<::tflite::Metadata>>())));
+
+  // One input and one output tensor metadata.
+  ::tflite::ModelMetadataT metadata;
+  auto subgraph_metadata = absl::make_unique<::tflite::SubGraphMetadataT>();
+  auto input_metadata = absl::make_unique<::tflite::TensorMetadataT>();
+  input_metadata->name = "image";
+  subgraph_metadata->input_tensor_metadata.push_back(
+      std::move(input_metadata));
+  auto output_metadata = absl::make_unique<::tflite::TensorMetadataT>();
+  output_metadata->name = "embedding";
+  subgraph_metadata->output_tensor_metadata.push_back(
+      std::move(output_metadata));
+  metadata.subgraph_metadata.push_back(std::move(subgraph_metadata));
+  flatbuffers::FlatBufferBuilder metadata_fbb;
+  metadata_fbb.Finish(::tflite::ModelMetadata::Pack(metadata_fbb, &metadata),
+                      ::tflite::ModelMetadataIdentifier());
+
+  tflite::support::StatusOr<std::unique_ptr<ModelMetadataPopulator>>
+      populator = ModelMetadataPopulator::CreateFromModelBuffer(
+          reinterpret_cast<const char*>(fbb.GetBufferPointer()),
+          fbb.GetSize());
+  EXPECT_TRUE(populator.ok()) << populator.status();
+  if (!populator.ok()) return "";
+  (*populator)->LoadMetadata(
+      reinterpret_cast<const char*>(metadata_fbb.GetBufferPointer()),
+      metadata_fbb.GetSize());
+  tflite::support::StatusOr<std::string> model = (*populator)->Populate();
+  EXPECT_TRUE(model.ok()) << model.status();
+  return model.ok() ? *model : "";
+}
+
+class ModelBuilderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    embedder_ = EmbedderModel();
+    ASSERT_FALSE(embedder_.empty());
+    for (int i = 0; i < 12; ++i) {
+      pixels_.emplace_back(kImageBytes);
+      for (int p = 0; p < kImageBytes; ++p) pixels_[i][p] = i * 17 + p;
+      frame_buffers_.push_back(CreateFromRgbRawBuffer(
+          pixels_[i].data(), {kImageSize, kImageSize}));
+      images_.push_back(
+          {absl::StrCat("class", i % 3), frame_buffers_[i].get()});
+    }
+  }
+
+  // Returns a ModelBuilder on the test embedder, with its options if
+  // `with_options` so that it supports `SetParallelism()`.
+  std::unique_ptr<ModelBuilder> NewModelBuilder(bool with_options = true) {
+    ImageEmbedderOptions options;
+    options.mutable_model_file_with_metadata()->set_file_content(embedder_);
+    tflite::support::StatusOr<std::unique_ptr<ImageEmbedder>> image_embedder =
+        ImageEmbedder::CreateFromOptions(options);
+    EXPECT_TRUE(image_embedder.ok()) << image_embedder.status();
+    if (!image_embedder.ok()) return nullptr;
+    absl::optional<ImageEmbedderOptions> model_builder_options;
+    if (with_options) model_builder_options = options;
+    return absl::make_unique<ModelBuilder>(
+        std::move(*image_embedder),
+        FlatBufferModel::BuildFromBuffer(embedder_.data(), embedder_.size()),
+        absl::make_unique<TfLiteCbRBuilder>(), model_builder_options);
+  }
+
+  // Outlives the FlatBufferModel of the ModelBuilders.
+  std::string embedder_;
+  std::vector<std::vector<uint8_t>> pixels_;
+  std::vector<std::unique_ptr<FrameBuffer>> frame_buffers_;
+  std::vector<ModelBuilder::LabeledImage> images_;
+};
+
+TEST_F(ModelBuilderTest, ParallelEmbeddingBuildsSameModel) {
+  std::unique_ptr<ModelBuilder> serial = NewModelBuilder();
+  ASSERT_NE(serial, nullptr);
+  for (const ModelBuilder::LabeledImage& image : images_) {
+    ASSERT_TRUE(serial->AddLabeledImage(image.label, *image.frame_buffer).ok());
+  }
+  tflite::support::StatusOr<ExternalFile> serial_model = serial->BuildModel();
+  ASSERT_TRUE(serial_model.ok()) << serial_model.status();
+
+  std::unique_ptr<ModelBuilder> parallel = NewModelBuilder();
+  ASSERT_NE(parallel, nullptr);
+  ASSERT_TRUE(parallel->SetParallelism(4).ok());
+  ASSERT_TRUE(parallel->AddLabeledImages(images_).ok());
+  tflite::support::StatusOr<ExternalFile> parallel_model =
+      parallel->BuildModel();
+  ASSERT_TRUE(parallel_model.ok()) << parallel_model.status();
+
+  EXPECT_FALSE(serial_model->file_content().empty());
+  EXPECT_EQ(parallel_model->file_content(), serial_model->file_content());
+}
+
+TEST_F(ModelBuilderTest, AddLabeledImagesRejectsMissingFrameBuffer) {
+  std::unique_ptr<ModelBuilder> model_builder = NewModelBuilder();
+  ASSERT_NE(model_builder, nullptr);
+  ASSERT_TRUE(model_builder->SetParallelism(4).ok());
+  images_[5].frame_buffer = nullptr;
+  EXPECT_EQ(model_builder->AddLabeledImages(images_).code(),
+            absl::StatusCode::kInvalidArgument);
+  // None of the images were added.
+  EXPECT_EQ(model_builder->BuildModel().status().code(),
+            absl::StatusCode::kFailedPrecondition);
+}
+
+TEST_F(ModelBuilderTest, SetParallelismRequiresOptions) {
+  std::unique_ptr<ModelBuilder> model_builder =
+      NewModelBuilder(/*with_options=*/false);
+  ASSERT_NE(model_builder, nullptr);
+  EXPECT_EQ(model_builder->SetParallelism(4).code(),
+            absl::StatusCode::kFailedPrecondition);
+  // Serial embedding still works.
+  EXPECT_TRUE(model_builder->AddLabeledImages(images_).ok());
+}
+
+}  // namespace
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
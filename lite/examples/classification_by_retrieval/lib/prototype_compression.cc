@@ -0,0 +1,148 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lib/prototype_compression.h"
+
+#include <utility>
+
+#include "absl/status/status.h"
+#include "lib/ivf_index.h"
+#include "tensorflow_lite_support/cc/port/status_macros.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+namespace {
+
+float Dot(absl::Span<const float> a, absl::Span<const float> b) {
+  float sum = 0.0f;
+  for (int i = 0; i < a.size(); ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+// Appends the normalized mean of `rows` to `output`.
+absl::Status AppendNormalizedMean(const EmbeddingMatrix& input,
+                                  const std::vector<int32_t>& rows,
+                                  EmbeddingMatrix* output) {
+  std::vector<float> sum(input.dim(), 0.0f);
+  for (int32_t row : rows) {
+    absl::Span<const float> values = input.row(row);
+    for (int i = 0; i < values.size(); ++i) sum[i] += values[i];
+  }
+  L2NormalizeRows(sum.data(), 1, sum.size(), sum.data());
+  return output->AppendRow(sum);
+}
+
+// Greedily groups the `instances` of a class, in order, with the first
+// earlier group whose first instance has a cosine of at least `threshold` to
+// them.
+std::vector<std::vector<int32_t>> GroupNearDuplicates(
+    const EmbeddingMatrix& normalized, const std::vector<int32_t>& instances,
+    float threshold) {
+  std::vector<std::vector<int32_t>> groups;
+  for (int32_t row : instances) {
+    std::vector<int32_t>* group = nullptr;
+    for (std::vector<int32_t>& candidate : groups) {
+      // Compare to the first instance of the group, so that chains of
+      // similar instances do not drift.
+      if (Dot(normalized.row(candidate[0]), normalized.row(row)) >=
+          threshold) {
+        group = &candidate;
+        break;
+      }
+    }
+    if (group == nullptr) {
+      groups.push_back({row});
+    } else {
+      group->push_back(row);
+    }
+  }
+  return groups;
+}
+
+}  // namespace
+
+tflite::support::StatusOr<EmbeddingMatrix> CompressClassPrototypes(
+    const EmbeddingMatrix& embeddings,
+    const std::vector<std::vector<int32_t>>& classes,
+    const PrototypeCompressionOptions& options,
+    std::vector<int32_t>* class_sizes, PrototypeCompressionStats* stats) {
+  const int dim = embeddings.dim();
+  EmbeddingMatrix normalized;
+  normalized.Reserve(embeddings.num_rows(), dim);
+  std::vector<float> normalized_row(dim);
+  for (int i = 0; i < embeddings.num_rows(); ++i) {
+    L2NormalizeRows(embeddings.row(i).data(), 1, dim, normalized_row.data());
+    RETURN_IF_ERROR(normalized.AppendRow(normalized_row));
+  }
+
+  EmbeddingMatrix output;
+  output.Reserve(embeddings.num_rows(), dim);
+  class_sizes->clear();
+  for (const std::vector<int32_t>& instances : classes) {
+    // Each prototype is the normalized mean of a group of instances.
+    std::vector<std::vector<int32_t>> groups;
+    if (options.merge_cosine_threshold > 0.0f) {
+      groups = GroupNearDuplicates(normalized, instances,
+                                   options.merge_cosine_threshold);
+    } else {
+      for (int32_t row : instances) groups.push_back({row});
+    }
+    EmbeddingMatrix prototypes;
+    prototypes.Reserve(groups.size(), dim);
+    for (const std::vector<int32_t>& group : groups) {
+      RETURN_IF_ERROR(AppendNormalizedMean(normalized, group, &prototypes));
+    }
+
+    if (options.max_prototypes_per_class > 0 &&
+        prototypes.num_rows() > options.max_prototypes_per_class) {
+      ASSIGN_OR_RETURN(IvfIndex index,
+                       BuildIvfIndex(prototypes,
+                                     options.max_prototypes_per_class,
+                                     options.num_kmeans_iterations));
+      // The centroids are the normalized means of the instances of their
+      // groups, so that larger groups weigh more.
+      EmbeddingMatrix centroids;
+      centroids.Reserve(index.num_clusters, dim);
+      std::vector<int32_t> members;
+      for (const std::vector<int32_t>& cluster : index.clusters) {
+        // Centroids of clusters emptied by the last iteration are dropped.
+        if (cluster.empty()) continue;
+        members.clear();
+        for (int32_t prototype : cluster) {
+          members.insert(members.end(), groups[prototype].begin(),
+                         groups[prototype].end());
+        }
+        RETURN_IF_ERROR(AppendNormalizedMean(normalized, members, &centroids));
+      }
+      prototypes = std::move(centroids);
+    }
+
+    for (int i = 0; i < prototypes.num_rows(); ++i) {
+      RETURN_IF_ERROR(output.AppendRow(prototypes.row(i)));
+    }
+    class_sizes->push_back(prototypes.num_rows());
+  }
+
+  if (stats != nullptr) {
+    stats->num_instances = embeddings.num_rows();
+    stats->num_prototypes = output.num_rows();
+  }
+  return output;
+}
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
@@ -0,0 +1,72 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_PROTOTYPE_COMPRESSION_H_
+#define TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_PROTOTYPE_COMPRESSION_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "lib/embedding_matrix.h"
+#include "tensorflow_lite_support/cc/port/statusor.h"
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+
+struct PrototypeCompressionOptions {
+  // If positive, instances of a class are merged, in order, into the first
+  // earlier group of the class whose first instance has a cosine of at least
+  // this threshold to them. Comparing to the first instance rather than to the
+  // group mean keeps chains of similar instances from drifting. Typical values
+  // for near-duplicate shots are around 0.95.
+  float merge_cosine_threshold = 0.0f;
+  // If positive, classes left with more prototypes than this are reduced to
+  // this many with spherical k-means. Each centroid is then the normalized mean
+  // of all the instances merged into it, weighting prototypes by their number
+  // of instances.
+  int max_prototypes_per_class = 0;
+  int num_kmeans_iterations = 10;
+
+  bool enabled() const {
+    return merge_cosine_threshold > 0.0f || max_prototypes_per_class > 0;
+  }
+};
+
+struct PrototypeCompressionStats {
+  int num_instances = 0;
+  int num_prototypes = 0;
+
+  double compression_ratio() const {
+    return num_prototypes > 0
+               ? static_cast<double>(num_instances) / num_prototypes
+               : 0.0;
+  }
+};
+
+// Replaces the instances of each class, given as rows of `embeddings`, by
+// fewer L2-normalized prototypes: each a normalized mean of instances. The
+// prototypes are returned class by class, `class_sizes` receiving the number
+// of prototypes of each class. The result is deterministic.
+tflite::support::StatusOr<EmbeddingMatrix> CompressClassPrototypes(
+    const EmbeddingMatrix& embeddings,
+    const std::vector<std::vector<int32_t>>& classes,
+    const PrototypeCompressionOptions& options,
+    std::vector<int32_t>* class_sizes, PrototypeCompressionStats* stats);
+
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_CLASSIFICATION_BY_RETRIEVAL_LIB_PROTOTYPE_COMPRESSION_H_
@@ -0,0 +1,206 @@
+// Copyright 2021 The TensorFlow Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the compression ratio and the top-1 accuracy change of the
+// prototype compression of TfLiteCbRBuilder::Options::prototype_compression
+// on held-out labeled images.
+//
+// Gallery and query images are listed as a directory of per-label
+// subdirectories or as a `label<TAB>path` manifest. Without queries, every
+// `--holdout`-th gallery image is used as a query instead. Queries are
+// classified as the generated model does, by the maximum cosine over the rows
+// of each class, e.g.:
+//
+//   prototype_compression_eval --embedder=mobilenet_v3.tflite \
+//       --gallery=/data/gallery --merge_cosine_threshold=0.95 \
+//       --max_prototypes_per_class=8
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_format.h"
+#include "lib/embedding_eval_utils.h"
+#include "lib/embedding_matrix.h"
+#include "lib/gallery_ingestion.h"
+#include "lib/prototype_compression.h"
+#include "tensorflow_lite_support/cc/port/status_macros.h"
+#include "tensorflow_lite_support/cc/task/vision/image_embedder.h"
+#include "tensorflow_lite_support/cc/task/vision/proto/image_embedder_options_proto_inc.h"
+
+ABSL_FLAG(std::string, embedder, "", "Path to the image embedder model.");
+ABSL_FLAG(std::string, gallery, "",
+          "Gallery images, as a directory or a manifest.");
+ABSL_FLAG(std::string, queries, "",
+          "Query images, as a directory or a manifest. Optional.");
+ABSL_FLAG(int, holdout, 5,
+          "Without --queries, every holdout-th gallery image is a query.");
+ABSL_FLAG(double, merge_cosine_threshold, 0.0,
+          "Cosine above which instances of a class are merged, if positive.");
+ABSL_FLAG(int, max_prototypes_per_class, 0,
+          "Maximum number of rows per class, if positive.");
+ABSL_FLAG(int, num_kmeans_iterations, 10, "Number of k-means iterations.");
+
+namespace tflite {
+namespace examples {
+namespace cbr {
+namespace {
+
+using ::tflite::task::vision::ImageEmbedder;
+using ::tflite::task::vision::ImageEmbedderOptions;
+
+// Returns the class of the row of the class-contiguous `rows` with the highest
+// cosine to the normalized `query`.
+int Classify(const EmbeddingMatrix& rows,
+             const std::vector<int32_t>& class_sizes, const float* query) {
+  int best_class = -1;
+  float best_score = -std::numeric_limits<float>::infinity();
+  int row = 0;
+  for (int c = 0; c < class_sizes.size(); ++c) {
+    for (int j = 0; j < class_sizes[c]; ++j, ++row) {
+      float score = 0.0f;
+      absl::Span<const float> values = rows.row(row);
+      for (int i = 0; i < values.size(); ++i) score += values[i] * query[i];
+      if (score > best_score) {
+        best_score = score;
+        best_class = c;
+      }
+    }
+  }
+  return best_class;
+}
+
+// Returns the fraction of `queries` classified as `query_classes`.
+double Accuracy(const EmbeddingMatrix& rows,
+                const std::vector<int32_t>& class_sizes,
+                const EmbeddingMatrix& queries,
+                const std::vector<int>& query_classes) {
+  int correct = 0;
+  for (int q = 0; q < queries.num_rows(); ++q) {
+    correct += Classify(rows, class_sizes, queries.row(q).data()) ==
+               query_classes[q];
+  }
+  return static_cast<double>(correct) / queries.num_rows();
+}
+
+absl::Status Run() {
+  PrototypeCompressionOptions compression_options;
+  compression_options.merge_cosine_threshold =
+      absl::GetFlag(FLAGS_merge_cosine_threshold);
+  compression_options.max_prototypes_per_class =
+      absl::GetFlag(FLAGS_max_prototypes_per_class);
+  compression_options.num_kmeans_iterations =
+      absl::GetFlag(FLAGS_num_kmeans_iterations);
+  if (!compression_options.enabled()) {
+    return absl::InvalidArgumentError(
+        "Expected a positive --merge_cosine_threshold or "
+        "--max_prototypes_per_class.");
+  }
+
+  ImageEmbedderOptions options;
+  options.mutable_model_file_with_metadata()->set_file_name(
+      absl::GetFlag(FLAGS_embedder));
+  ASSIGN_OR_RETURN(std::unique_ptr<ImageEmbedder> embedder,
+                   ImageEmbedder::CreateFromOptions(options));
+
+  ASSIGN_OR_RETURN(std::vector<LabeledImagePath> gallery_images,
+                   ListLabeledImages(absl::GetFlag(FLAGS_gallery)));
+  std::vector<LabeledImagePath> query_images;
+  if (!absl::GetFlag(FLAGS_queries).empty()) {
+    ASSIGN_OR_RETURN(query_images,
+                     ListLabeledImages(absl::GetFlag(FLAGS_queries)));
+  } else {
+    SplitHoldout(std::max(absl::GetFlag(FLAGS_holdout), 2), &gallery_images,
+                 &query_images);
+  }
+
+  EmbeddingMatrix gallery;
+  EmbeddingMatrix queries;
+  RETURN_IF_ERROR(EmbedImageFiles(embedder.get(), gallery_images, &gallery));
+  RETURN_IF_ERROR(EmbedImageFiles(embedder.get(), query_images, &queries));
+
+  // Group the gallery by class, as TfLiteCbRBuilder does.
+  absl::flat_hash_map<std::string, int> label_to_class_id;
+  std::vector<std::vector<int32_t>> classes;
+  for (int i = 0; i < gallery_images.size(); ++i) {
+    auto inserted =
+        label_to_class_id.insert({gallery_images[i].label, classes.size()});
+    if (inserted.second) classes.push_back({});
+    classes[inserted.first->second].push_back(i);
+  }
+  std::vector<int> query_classes;
+  for (const LabeledImagePath& image : query_images) {
+    auto itr = label_to_class_id.find(image.label);
+    if (itr == label_to_class_id.end()) {
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "Query label '%s' is not in the gallery.", image.label));
+    }
+    query_classes.push_back(itr->second);
+  }
+  if (queries.empty()) {
+    return absl::InvalidArgumentError("No query images.");
+  }
+
+  EmbeddingMatrix instances;
+  std::vector<int32_t> class_sizes;
+  instances.Reserve(gallery.num_rows(), gallery.dim());
+  for (const std::vector<int32_t>& rows : classes) {
+    for (int32_t row : rows) {
+      RETURN_IF_ERROR(instances.AppendRow(gallery.row(row)));
+    }
+    class_sizes.push_back(rows.size());
+  }
+  const double accuracy =
+      Accuracy(instances, class_sizes, queries, query_classes);
+
+  std::vector<int32_t> prototype_class_sizes;
+  PrototypeCompressionStats stats;
+  ASSIGN_OR_RETURN(
+      EmbeddingMatrix prototypes,
+      CompressClassPrototypes(gallery, classes, compression_options,
+                              &prototype_class_sizes, &stats));
+  const double compressed_accuracy =
+      Accuracy(prototypes, prototype_class_sizes, queries, query_classes);
+
+  absl::PrintF("%d classes, %d queries\n", classes.size(),
+               queries.num_rows());
+  absl::PrintF("rows: %d -> %d (compression ratio %.2fx)\n",
+               stats.num_instances, stats.num_prototypes,
+               stats.compression_ratio());
+  absl::PrintF("top-1 accuracy: %.4f -> %.4f (delta %+.4f)\n", accuracy,
+               compressed_accuracy, compressed_accuracy - accuracy);
+  return absl::OkStatus();
+}
+
+}  // namespace
+}  // namespace cbr
+}  // namespace examples
+}  // namespace tflite
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  const absl::Status status = tflite::examples::cbr::Run();
+  if (!status.ok()) {
+    absl::FPrintF(stderr, "%s\n", status.ToString());
+    return 1;
+  }
+  return 0;
+}
@@ -51,7 +51,8 @@ Offset<QuantizationParameters> CreateQuantizationParameters(
       *fbb, params.min.empty() ? 0 : fbb->CreateVector(params.min),
       params.max.empty() ? 0 : fbb->CreateVector(params.max),
       params.scale.empty() ? 0 : fbb->CreateVector(params.scale),
-      params.zero_point.empty() ? 0 : fbb->CreateVector(params.zero_point));
+      params.zero_point.empty() ? 0 : fbb->CreateVector(params.zero_point),
+      QuantizationDetails_NONE, /*details=*/0, params.quantized_dimension);
 }
 
 // A convenience class for adding layers to a TF Lite model.
@@ -97,8 +98,15 @@ class TfLiteBuilderImpl : public TfLiteBuilder {
                    int output_tensor_index, BuiltinOptions option_code,
                    const flatbuffers::Offset<void>& options) override;
 
-  void Build(const std::vector<int32_t>& inputs, int32_t output_tensor_index,
-             const std::string& name, uint32_t version,
+  void AddOperator(BuiltinOperator op_code,
+                   const std::vector<int>& input_tensor_indices,
+                   const std::vector<int>& output_tensor_indices,
+                   BuiltinOptions option_code,
+                   const flatbuffers::Offset<void>& options) override;
+
+  void Build(const std::vector<int32_t>& inputs,
+             const std::vector<int32_t>& outputs, const std::string& name,
+             uint32_t version,
              const std::string& description) override;
 
  private:
@@ -294,6 +302,14 @@ void TfLiteBuilderImpl::AddOperator(
     BuiltinOperator op_code, const std::vector<int32_t>& input_tensor_indices,
     int output_tensor_index, BuiltinOptions option_code,
     const flatbuffers::Offset<void>& options) {
+  AddOperator(op_code, input_tensor_indices,
+              std::vector<int32_t>{output_tensor_index}, option_code, options);
+}
+
+void TfLiteBuilderImpl::AddOperator(
+    BuiltinOperator op_code, const std::vector<int32_t>& input_tensor_indices,
+    const std::vector<int32_t>& output_tensor_indices,
+    BuiltinOptions option_code, const flatbuffers::Offset<void>& options) {
   auto iter = op_index_.find(op_code);
   int index;
   if (iter != op_index_.end()) {
@@ -306,18 +322,17 @@ void TfLiteBuilderImpl::AddOperator(
   Offset<Vector<int32_t>> input_vector =
       fbb_->CreateVector<int32_t>(input_tensor_indices);
   Offset<Vector<int32_t>> output_vector =
-      fbb_->CreateVector<int32_t>({output_tensor_index});
+      fbb_->CreateVector<int32_t>(output_tensor_indices);
   op_vector_.push_back(CreateOperator(*fbb_, index, input_vector, output_vector,
                                       option_code, options));
 }
 
 void TfLiteBuilderImpl::Build(const std::vector<int32_t>& inputs,
-                              int32_t output_tensor_index,
+                              const std::vector<int32_t>& outputs,
                               const std::string& name, uint32_t version,
                               const std::string& description) {
   Offset<Vector<int32_t>> input_vector = fbb_->CreateVector<int32_t>(inputs);
-  Offset<Vector<int32_t>> output_vector =
-      fbb_->CreateVector<int32_t>({output_tensor_index});
+  Offset<Vector<int32_t>> output_vector = fbb_->CreateVector<int32_t>(outputs);
   Offset<Vector<Offset<Tensor>>> tensors = fbb_->CreateVector(tensor_vector_);
   Offset<Vector<Offset<Operator>>> ops = fbb_->CreateVector(op_vector_);
   Offset<SubGraph> subgraph =
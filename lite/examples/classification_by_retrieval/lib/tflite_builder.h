@@ -68,8 +68,16 @@ class TfLiteBuilder {
                            int output_tensor_index, BuiltinOptions option_code,
                            const flatbuffers::Offset<void>& options) = 0;
 
+  // AddOperator for an operator with several outputs.
+  virtual void AddOperator(BuiltinOperator op_code,
+                           const std::vector<int>& input_tensor_indices,
+                           const std::vector<int>& output_tensor_indices,
+                           BuiltinOptions option_code,
+                           const flatbuffers::Offset<void>& options) = 0;
+
   virtual void Build(const std::vector<int32_t>& inputs,
-                     int32_t output_tensor_index, const std::string& name,
+                     const std::vector<int32_t>& outputs,
+                     const std::string& name,
                      uint32_t schema_version,
                      const std::string& description) = 0;
 };
@@ -14,7 +14,10 @@
 
 #include "lib/tflite_cbr_builder.h"
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
+#include <numeric>
 #include <string>
 #include <vector>
 
@@ -22,6 +25,9 @@
 #include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_format.h"
+#include "lib/embedding_matrix.h"
+#include "lib/ivf_index.h"
+#include "lib/prototype_compression.h"
 #include "lib/tflite_builder.h"
 #include "tensorflow_lite_support/cc/port/status_macros.h"
 
@@ -32,41 +38,30 @@ namespace cbr {
 namespace {
 
 using ::flatbuffers::FlatBufferBuilder;
-using ::tflite::task::vision::FeatureVector;
-
-FeatureVector Normalize(const FeatureVector& fv) {
-  float norm = 0.0f;
-  for (float val : fv.value_float()) norm += val * val;
-  if (norm == 0.0f) return fv;  // Can't normalize 0 vector.
-  FeatureVector normalized;
-  float inv_norm = 1.0f / std::sqrt(norm);
-  for (float val : fv.value_float()) {
-    normalized.add_value_float(val * inv_norm);
-  }
-  return normalized;
-}
 
 int AddRetrievalBlock(flatbuffers::FlatBufferBuilder* fb_builder,
                       TfLiteBuilder* tflite_builder,
                       int32_t embedding_output_index,
-                      const std::vector<FeatureVector>& embeddings,
+                      const EmbeddingMatrix& embeddings,
+                      const std::vector<int32_t>& row_order,
                       const std::string& output_tensor_name) {
-  const int32_t embedding_dim = embeddings[0].value_float_size();
-  const int32_t num_instances = embeddings.size();
+  const int32_t embedding_dim = embeddings.dim();
+  const int32_t num_instances = embeddings.num_rows();
 
   // Add a normalization layer.
   const int32_t norm_tensor_index = tflite_builder->AddTensor(
       "normalization", tflite::TensorType_FLOAT32, {1, embedding_dim});
 
-  // Add a weights tensor for the fully-connected retrieval layer.
+  // Add a weights tensor for the fully-connected retrieval layer, with the
+  // rows in `row_order`.
   // NOTE: We only support a float embedding layer.
-  std::vector<float> weights_vec;
-  weights_vec.reserve(num_instances * embedding_dim);
-  for (const FeatureVector& embedding : embeddings) {
-    FeatureVector normalized_embedding = Normalize(embedding);
-    for (float val : normalized_embedding.value_float()) {
-      weights_vec.push_back(val);
-    }
+  std::vector<float> weights_vec(static_cast<size_t>(num_instances) *
+                                 embedding_dim);
+  for (int i = 0; i < num_instances; ++i) {
+    float* weights_row =
+        weights_vec.data() + static_cast<size_t>(i) * embedding_dim;
+    L2NormalizeRows(embeddings.row(row_order[i]).data(), 1, embedding_dim,
+                    weights_row);
   }
   const int32_t weight_tensor_index = tflite_builder->AddConstTensor(
       "retrieval", tflite::TensorType_FLOAT32, {num_instances, embedding_dim},
@@ -98,37 +93,73 @@ int AddRetrievalBlock(flatbuffers::FlatBufferBuilder* fb_builder,
   return instances_tensor_index;
 }
 
+// Scale of the normalized query and of the retrieval scores, both in [-1, 1].
+constexpr float kUnitScale = 1.0f / 127.0f;
+
+tflite::QuantizationParametersT UnitQuantizationParameters() {
+  tflite::QuantizationParametersT params;
+  params.min.push_back(-1.0f);
+  params.max.push_back(1.0f);
+  params.scale.push_back(kUnitScale);
+  params.zero_point.push_back(0);
+  return params;
+}
+
+// Adds an int8 retrieval layer and returns its {1, num_instances} int8 output,
+// quantized with UnitQuantizationParameters(). `embedding_tensor`, the
+// embedder output, may be float or quantized.
 int AddQuantizedRetrievalBlock(flatbuffers::FlatBufferBuilder* fb_builder,
                                TfLiteBuilder* tflite_builder,
                                int32_t embedding_output_index,
-                               const std::vector<FeatureVector>& embeddings,
-                               const std::string& output_tensor_name) {
-  const int32_t embedding_dim = embeddings[0].value_float_size();
-  const int32_t num_instances = embeddings.size();
-
-  const int32_t float_embedding_tensor_index = tflite_builder->AddTensor(
-      "dequantized_embedding", tflite::TensorType_FLOAT32, {1, embedding_dim});
+                               const tflite::TensorT& embedding_tensor,
+                               const EmbeddingMatrix& embeddings,
+                               const std::vector<int32_t>& row_order) {
+  const int32_t embedding_dim = embeddings.dim();
+  const int32_t num_instances = embeddings.num_rows();
+  const bool float_embedding =
+      embedding_tensor.type == tflite::TensorType_FLOAT32;
+
+  // The retrieval is a 1x1 convolution rather than a fully-connected layer, as
+  // only the former supports per-channel (here per-row) weight scales.
+  std::vector<int32_t> image_shape = {1, 1, 1, embedding_dim};
+  const int32_t image_embedding_tensor_index =
+      embedding_tensor.quantization != nullptr
+          ? tflite_builder->AddQuantizedTensor("image_embedding",
+                                               embedding_tensor.type,
+                                               image_shape,
+                                               *embedding_tensor.quantization)
+          : tflite_builder->AddTensor("image_embedding", embedding_tensor.type,
+                                      image_shape);
+  const int32_t float_embedding_tensor_index =
+      float_embedding ? image_embedding_tensor_index
+                      : tflite_builder->AddTensor("dequantized_embedding",
+                                                  tflite::TensorType_FLOAT32,
+                                                  image_shape);
   const int32_t normalized_embedding_tensor_index = tflite_builder->AddTensor(
-      "normalized_embedding", tflite::TensorType_FLOAT32, {1, embedding_dim});
-  tflite::QuantizationParametersT embedding_qparams;
-  embedding_qparams.min.push_back(-1.0f);
-  embedding_qparams.max.push_back(1.0f);
-  embedding_qparams.zero_point.push_back(0);
-  // See the retrieval layer's quantization parameter setting below.
-  embedding_qparams.scale.push_back(1.0f / 128.0f);
+      "normalized_embedding", tflite::TensorType_FLOAT32, image_shape);
   const int32_t nq_embedding_tensor_index = tflite_builder->AddQuantizedTensor(
-      "normalized_quantized_embd", tflite::TensorType_INT8, {1, embedding_dim},
-      embedding_qparams);
+      "normalized_quantized_embd", tflite::TensorType_INT8, image_shape,
+      UnitQuantizationParameters());
+
+  // Add a reshaping operation to the convolution input layout. Reshaping
+  // preserves the quantization of the embedding.
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_RESHAPE, {embedding_output_index},
+      image_embedding_tensor_index, tflite::BuiltinOptions_ReshapeOptions,
+      tflite::CreateReshapeOptions(*fb_builder,
+                                   fb_builder->CreateVector(image_shape))
+          .Union());
 
   // Add a dequantization operation.
   // Note that the normalization and matmul operations don't honor the
   // zero-point in a UINT8 tensor (i.e., it doesn't deal with negative values).
   // Therefore, we do: UINT8 --dequantize--> FLOAT32 --normalize-->
-  //                   FLOAT32 --quantize--> INT8 --matmul(retrieval)-->
-  //                   INT8 --dequantize--> FLOAT32
-  tflite_builder->AddOperator(
-      tflite::BuiltinOperator_DEQUANTIZE, {embedding_output_index},
-      float_embedding_tensor_index, tflite::BuiltinOptions_NONE, 0);
+  //                   FLOAT32 --quantize--> INT8 --conv(retrieval)--> INT8
+  if (!float_embedding) {
+    tflite_builder->AddOperator(
+        tflite::BuiltinOperator_DEQUANTIZE, {image_embedding_tensor_index},
+        float_embedding_tensor_index, tflite::BuiltinOptions_NONE, 0);
+  }
 
   // Add a normalization operation. This operation is necessary if we want the
   // final score be meaningful.
@@ -144,170 +175,454 @@ int AddQuantizedRetrievalBlock(flatbuffers::FlatBufferBuilder* fb_builder,
       tflite::BuiltinOperator_QUANTIZE, {normalized_embedding_tensor_index},
       nq_embedding_tensor_index, tflite::BuiltinOptions_NONE, 0);
 
-  // Add a weights tensor for the fully-connected retrieval layer.
-  // NOTE: We only support a float embedding layer.
+  // Add a weights tensor for the retrieval layer, with the rows in
+  // `row_order`. Each row gets the scale mapping its largest magnitude to 127:
+  // normalized rows rarely have components close to 1, so a common 1/128
+  // scale would leave most of the int8 range unused.
   std::vector<int8_t> weights_vec;
-  weights_vec.reserve(num_instances * embedding_dim);
-
-  // Most efficient quantization scale would be something like 1/(sqrt(d)*64.0)
-  // (calculated with average norm) when d is the embedding dimension. However,
-  // if the scale is too big, the matmul (fully-connected) operation would
-  // overflow (become larger than 128) and the result would be less accurate
-  // for similar embeddings. Therefore, we use the standard scale which is
-  // 1/128 for now.
-  float scale = 1.0f / 128.0f;
-  float scale_inv = 1.0f / scale;
-  float zero_point = 0;
-  for (const FeatureVector& embedding : embeddings) {
-    FeatureVector normalized_embedding = Normalize(embedding);
-    for (float val : normalized_embedding.value_float()) {
-      float quantized_val = std::round(val * scale_inv) + zero_point;
-      if (quantized_val < -128) quantized_val = -128;
+  weights_vec.reserve(static_cast<size_t>(num_instances) * embedding_dim);
+  tflite::QuantizationParametersT weight_qparams;
+  weight_qparams.quantized_dimension = 0;
+  // Rows are normalized one at a time so that no float copy of the whole
+  // matrix is needed.
+  std::vector<float> normalized_embedding(embedding_dim);
+  for (int i = 0; i < num_instances; ++i) {
+    L2NormalizeRows(embeddings.row(row_order[i]).data(), 1, embedding_dim,
+                    normalized_embedding.data());
+    float max_abs = 0.0f;
+    for (float val : normalized_embedding) {
+      max_abs = std::max(max_abs, std::abs(val));
+    }
+    // All-zero rows quantize to zero whatever the scale.
+    const float scale = max_abs > 0.0f ? max_abs / 127.0f : kUnitScale;
+    const float scale_inv = 1.0f / scale;
+    for (float val : normalized_embedding) {
+      float quantized_val = std::round(val * scale_inv);
+      if (quantized_val < -127) quantized_val = -127;
       if (quantized_val > 127) quantized_val = 127;
       weights_vec.push_back(static_cast<int8_t>(quantized_val));
     }
+    weight_qparams.min.push_back(-max_abs);
+    weight_qparams.max.push_back(max_abs);
+    weight_qparams.scale.push_back(scale);
+    weight_qparams.zero_point.push_back(0);
   }
-  tflite::QuantizationParametersT weight_qparams;
-  weight_qparams.min.push_back(-1.0f);
-  weight_qparams.max.push_back(1.0f);
-  weight_qparams.zero_point.push_back(zero_point);
-  weight_qparams.scale.push_back(scale);
   const int32_t weight_tensor_index = tflite_builder->AddQuantizedConstTensor(
-      "retrieval", tflite::TensorType_INT8, {num_instances, embedding_dim},
+      "retrieval", tflite::TensorType_INT8,
+      {num_instances, 1, 1, embedding_dim},
       reinterpret_cast<const uint8_t*>(weights_vec.data()), weights_vec.size(),
       weight_qparams);
 
   // Add a quantized retrieval result tensor.
-  tflite::QuantizationParametersT instances_qparams;
-  instances_qparams.min.push_back(-1.0f);
-  instances_qparams.max.push_back(1.0f);
-  instances_qparams.zero_point.push_back(0);
-  instances_qparams.scale.push_back(scale);
+  std::vector<int32_t> instances_shape = {1, num_instances};
+  const int32_t image_instances_tensor_index =
+      tflite_builder->AddQuantizedTensor(
+          "image_instances", tflite::TensorType_INT8,
+          {1, 1, 1, num_instances}, UnitQuantizationParameters());
   const int32_t quantized_instances_tensor_index =
-      tflite_builder->AddQuantizedTensor("quantized_instances",
-                                         tflite::TensorType_INT8,
-                                         {1, num_instances}, instances_qparams);
+      tflite_builder->AddQuantizedTensor(
+          "quantized_instances", tflite::TensorType_INT8, instances_shape,
+          UnitQuantizationParameters());
 
   // Add a retrieval operation.
   tflite_builder->AddOperator(
-      tflite::BuiltinOperator_FULLY_CONNECTED,
+      tflite::BuiltinOperator_CONV_2D,
       {nq_embedding_tensor_index, weight_tensor_index},
-      quantized_instances_tensor_index,
-      tflite::BuiltinOptions_FullyConnectedOptions,
-      tflite::CreateFullyConnectedOptions(*fb_builder,
-                                          tflite::ActivationFunctionType_NONE)
+      image_instances_tensor_index, tflite::BuiltinOptions_Conv2DOptions,
+      tflite::CreateConv2DOptions(*fb_builder, tflite::Padding_VALID,
+                                  /*stride_w=*/1, /*stride_h=*/1,
+                                  tflite::ActivationFunctionType_NONE)
           .Union());
 
-  // Add a float retrieval result tensor.
-  // TODO(b/187715553): this is a temporary solution. Converting the result back
-  // to FLOAT32 is not an optimal solution, but we do that because the
-  // aggregation block and the final output does not support INT8. We will need
-  // to find a better way to support INT8 in the later stage.
-  const int32_t instances_tensor_index = tflite_builder->AddTensor(
-      output_tensor_name, tflite::TensorType_FLOAT32, {1, num_instances});
-
-  // Add a dequantization operation.
+  // Add a flattening operation.
   tflite_builder->AddOperator(
-      tflite::BuiltinOperator_DEQUANTIZE, {quantized_instances_tensor_index},
-      instances_tensor_index, tflite::BuiltinOptions_NONE, 0);
+      tflite::BuiltinOperator_RESHAPE, {image_instances_tensor_index},
+      quantized_instances_tensor_index, tflite::BuiltinOptions_ReshapeOptions,
+      tflite::CreateReshapeOptions(*fb_builder,
+                                   fb_builder->CreateVector(instances_shape))
+          .Union());
 
-  return instances_tensor_index;
+  return quantized_instances_tensor_index;
 }
 
+// Aggregates the retrieval results into one score per class, the maximum
+// over the class instances. `class_sizes` is the number of instances of each
+// class, whose rows are expected to be contiguous in the retrieval results.
+//
+// The block has a constant number of operators whatever the number of
+// classes: the instances are laid out as a {1, num_classes, max_class_size}
+// tensor, then reduced along the last axis. If all classes have the same size
+// this is a mere reshape; otherwise a gather pads the shorter classes by
+// repeating their last instance, which does not change the maximum.
+//
+// If `quantization` is set, the retrieval results are int8 with these
+// parameters, and so is the output: the maximum commutes with dequantization.
 int AddAggregationBlock(flatbuffers::FlatBufferBuilder* fb_builder,
-                        TfLiteBuilder* tflite_builder, int num_instances,
+                        TfLiteBuilder* tflite_builder,
                         int instances_tensor_index,
-                        const std::vector<std::vector<int32_t>>& classes,
+                        const std::vector<int32_t>& class_sizes,
+                        const tflite::QuantizationParametersT* quantization,
                         const std::string& output_tensor_name) {
-  int32_t num_classes = classes.size();
+  auto add_tensor = [&](const std::string& name,
+                        const std::vector<int32_t>& shape) {
+    return quantization != nullptr
+               ? tflite_builder->AddQuantizedTensor(
+                     name, tflite::TensorType_INT8, shape, *quantization)
+               : tflite_builder->AddTensor(name, tflite::TensorType_FLOAT32,
+                                           shape);
+  };
+  const int32_t num_classes = class_sizes.size();
+  int32_t max_class_size = 0;
+  bool balanced = true;
+  for (int32_t class_size : class_sizes) {
+    balanced &= class_size == class_sizes[0];
+    max_class_size = std::max(max_class_size, class_size);
+  }
 
-  // Add a flattened retrieval result tensor.
-  std::vector<int32_t> flat_instances_shape = {num_instances, 1};
-  const int flat_instances_index = tflite_builder->AddTensor(
-      "flat_instances", tflite::TensorType_FLOAT32, flat_instances_shape);
+  // Add the padded class instances tensor.
+  std::vector<int32_t> class_instances_shape = {1, num_classes,
+                                                max_class_size};
+  const int class_instances_index =
+      add_tensor("class_instances", class_instances_shape);
 
-  // Add a flattening operation.
-  tflite_builder->AddOperator(
-      tflite::BuiltinOperator_RESHAPE, {instances_tensor_index},
-      flat_instances_index, tflite::BuiltinOptions_ReshapeOptions,
-      tflite::CreateReshapeOptions(
-          *fb_builder, fb_builder->CreateVector(flat_instances_shape))
-          .Union());
+  if (balanced) {
+    // Add a reshaping operation.
+    tflite_builder->AddOperator(
+        tflite::BuiltinOperator_RESHAPE, {instances_tensor_index},
+        class_instances_index, tflite::BuiltinOptions_ReshapeOptions,
+        tflite::CreateReshapeOptions(
+            *fb_builder, fb_builder->CreateVector(class_instances_shape))
+            .Union());
+  } else {
+    // Add a padded selection tensor.
+    std::vector<int32_t> selection_vec;
+    selection_vec.reserve(static_cast<size_t>(num_classes) * max_class_size);
+    int32_t offset = 0;
+    for (int32_t class_size : class_sizes) {
+      for (int32_t j = 0; j < max_class_size; ++j) {
+        selection_vec.push_back(offset + std::min(j, class_size - 1));
+      }
+      offset += class_size;
+    }
+    const int selection_tensor_index = tflite_builder->AddConstTensor(
+        "selection", tflite::TensorType_INT32, {num_classes, max_class_size},
+        reinterpret_cast<const uint8_t*>(selection_vec.data()),
+        sizeof(int32_t) * selection_vec.size());
+
+    // Add a class selection operation.
+    tflite_builder->AddOperator(
+        tflite::BuiltinOperator_GATHER,
+        {instances_tensor_index, selection_tensor_index},
+        class_instances_index, tflite::BuiltinOptions_GatherOptions,
+        tflite::CreateGatherOptions(*fb_builder, /*axis=*/1).Union());
+  }
 
   // Add a class aggregation axis tensor.
-  std::vector<int32_t> aggregation_axis_vec = {0};
+  std::vector<int32_t> aggregation_axis_vec = {2};
   const int aggregation_axis_tensor_index = tflite_builder->AddConstTensor(
       "aggregation_axis", tflite::TensorType_INT32, {1},
       reinterpret_cast<const uint8_t*>(aggregation_axis_vec.data()),
       sizeof(int32_t) * aggregation_axis_vec.size());
 
-  // Add an aggregation block per class.
-  std::vector<int32_t> class_aggregation_indices;
-  for (int i = 0; i < classes.size(); ++i) {
-    const std::string index_str = std::to_string(i);
-    const std::vector<int32_t>& instances = classes[i];
-    int32_t num_instances = instances.size();
+  // Add the final classes tensor (with dimension {1, num_classes}).
+  const int classes_index = add_tensor(output_tensor_name, {1, num_classes});
 
-    // Add a selection tensor.
-    const int selection_tensor_index = tflite_builder->AddConstTensor(
-        "selection" + index_str, tflite::TensorType_INT32, {num_instances},
-        reinterpret_cast<const uint8_t*>(instances.data()),
-        sizeof(int32_t) * num_instances);
+  // Add a class aggregation operation.
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_REDUCE_MAX,
+      {class_instances_index, aggregation_axis_tensor_index}, classes_index,
+      tflite::BuiltinOptions_ReducerOptions,
+      tflite::CreateReducerOptions(*fb_builder, /*keep_dims=*/false).Union());
 
-    // Add a class instances tensor.
-    const int class_instances_tensor_index = tflite_builder->AddTensor(
-        "class_instances" + index_str, tflite::TensorType_FLOAT32,
-        {1, num_instances});
+  return classes_index;
+}
 
-    // Add a class aggregation tensor.
-    int class_aggregation_tensor_index = tflite_builder->AddTensor(
-        "class_aggregation" + index_str, tflite::TensorType_FLOAT32, {1});
+// Adds a TOPK_V2 operator on the {1, num_classes} `classes_tensor_index`
+// scores and returns the indices of the {1, k} float "scores" and int32
+// "indices" outputs. If the scores are `quantized`, i.e. int8 quantized with
+// UnitQuantizationParameters(), only the k selected ones are dequantized.
+std::vector<int32_t> AddTopKBlock(flatbuffers::FlatBufferBuilder* fb_builder,
+                                  TfLiteBuilder* tflite_builder,
+                                  int classes_tensor_index, bool quantized,
+                                  int32_t k) {
+  // Add a k tensor.
+  std::vector<int32_t> k_vec = {k};
+  const int k_tensor_index = tflite_builder->AddConstTensor(
+      "top_k", tflite::TensorType_INT32, {},
+      reinterpret_cast<const uint8_t*>(k_vec.data()),
+      sizeof(int32_t) * k_vec.size());
+
+  // Add the output tensors.
+  const int scores_index = tflite_builder->AddTensor(
+      "scores", tflite::TensorType_FLOAT32, {1, k});
+  const int indices_index = tflite_builder->AddTensor(
+      "indices", tflite::TensorType_INT32, {1, k});
+
+  if (!quantized) {
+    // Add a top k operation.
+    tflite_builder->AddOperator(
+        tflite::BuiltinOperator_TOPK_V2, {classes_tensor_index, k_tensor_index},
+        {scores_index, indices_index}, tflite::BuiltinOptions_TopKV2Options,
+        tflite::CreateTopKV2Options(*fb_builder).Union());
+    return {scores_index, indices_index};
+  }
 
-    // Add a class selection operation.
-    tflite_builder->AddOperator(tflite::BuiltinOperator_EMBEDDING_LOOKUP,
-                                {selection_tensor_index, flat_instances_index},
-                                class_instances_tensor_index,
-                                tflite::BuiltinOptions_NONE, 0);
+  // Add a quantized top k tensor, with the quantization of the classes.
+  const int quantized_scores_index = tflite_builder->AddQuantizedTensor(
+      "quantized_scores", tflite::TensorType_INT8, {1, k},
+      UnitQuantizationParameters());
 
-    // Add a class aggregation operation.
-    tflite_builder->AddOperator(
-        tflite::BuiltinOperator_REDUCE_MAX,
-        {class_instances_tensor_index, aggregation_axis_tensor_index},
-        class_aggregation_tensor_index, tflite::BuiltinOptions_NONE, 0);
+  // Add a top k operation.
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_TOPK_V2,
+      {classes_tensor_index, k_tensor_index},
+      {quantized_scores_index, indices_index},
+      tflite::BuiltinOptions_TopKV2Options,
+      tflite::CreateTopKV2Options(*fb_builder).Union());
 
-    class_aggregation_indices.push_back(class_aggregation_tensor_index);
+  // Add a dequantization operation.
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_DEQUANTIZE, {quantized_scores_index},
+      scores_index, tflite::BuiltinOptions_NONE, 0);
+  return {scores_index, indices_index};
+}
+
+// Adds a two-stage retrieval layer as described by
+// TfLiteCbRBuilder::Options::num_clusters, followed by a top k. Returns the
+// indices of the {1, k} float "scores" and int32 "indices" outputs, the latter
+// holding the `row_ids` of the best rows.
+//
+// The normalized embeddings are stored once, cluster by cluster, in a
+// {num_rows, dim} tensor. The rows of the probed clusters are gathered through
+// a {num_clusters, max_cluster_size} table of row indices, padded by repeating
+// the first row of each cluster. Padding slots get a score bias of -2, below
+// any cosine, so they only show up if fewer than k rows are probed.
+//
+// Clusters larger than DefaultMaxClusterSize() are split (see
+// CapClusterSize()) into fewer than 1.5 * num_clusters clusters, so besides
+// the num_rows * dim floats of the embeddings the model stores fewer than
+// 6 * (num_rows + num_clusters) table entries, and the fine stage scores at
+// most num_probes * DefaultMaxClusterSize() rows.
+tflite::support::StatusOr<std::vector<int32_t>> AddTwoStageRetrievalBlock(
+    flatbuffers::FlatBufferBuilder* fb_builder, TfLiteBuilder* tflite_builder,
+    int32_t embedding_output_index, const tflite::TensorT& embedding_tensor,
+    const EmbeddingMatrix& embeddings, const std::vector<int32_t>& row_ids,
+    const TfLiteCbRBuilder::Options& options) {
+  const int32_t embedding_dim = embeddings.dim();
+
+  // Cluster the normalized embeddings.
+  EmbeddingMatrix normalized;
+  normalized.Reserve(embeddings.num_rows(), embedding_dim);
+  std::vector<float> normalized_embedding(embedding_dim);
+  for (int i = 0; i < embeddings.num_rows(); ++i) {
+    L2NormalizeRows(embeddings.row(i).data(), 1, embedding_dim,
+                    normalized_embedding.data());
+    RETURN_IF_ERROR(normalized.AppendRow(normalized_embedding));
+  }
+  ASSIGN_OR_RETURN(IvfIndex index,
+                   BuildIvfIndex(normalized, options.num_clusters,
+                                 options.num_kmeans_iterations));
+  RETURN_IF_ERROR(CapClusterSize(
+      normalized,
+      DefaultMaxClusterSize(normalized.num_rows(), options.num_clusters),
+      options.num_kmeans_iterations, &index));
+  const int32_t num_clusters = index.num_clusters;
+  const int32_t cluster_size = index.max_cluster_size();
+  const int32_t num_probes = std::min(options.num_probes, num_clusters);
+  const int32_t num_candidates = num_probes * cluster_size;
+  const int32_t k = std::min(options.top_k, num_candidates);
+
+  // Add a dequantization operation if needed.
+  int32_t float_embedding_tensor_index = embedding_output_index;
+  if (embedding_tensor.type != tflite::TensorType_FLOAT32) {
+    float_embedding_tensor_index = tflite_builder->AddTensor(
+        "dequantized_embedding", tflite::TensorType_FLOAT32,
+        {1, embedding_dim});
+    tflite_builder->AddOperator(
+        tflite::BuiltinOperator_DEQUANTIZE, {embedding_output_index},
+        float_embedding_tensor_index, tflite::BuiltinOptions_NONE, 0);
   }
 
-  // Add the concatenated classes tensor (with dimension {num_classes}).
-  const int flat_classes_index = tflite_builder->AddTensor(
-      "flat_classes", tflite::TensorType_FLOAT32, {num_classes});
+  // Add a normalization layer and operation.
+  const int32_t norm_tensor_index = tflite_builder->AddTensor(
+      "normalization", tflite::TensorType_FLOAT32, {1, embedding_dim});
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_L2_NORMALIZATION, {float_embedding_tensor_index},
+      norm_tensor_index, tflite::BuiltinOptions_L2NormOptions,
+      tflite::CreateL2NormOptions(*fb_builder,
+                                  tflite::ActivationFunctionType_NONE)
+          .Union());
 
-  // Add the final classes tensor (with dimension {1, num_classes}).
-  std::vector<int32_t> classes_shape = {1, num_classes};
-  const int classes_index = tflite_builder->AddTensor(
-      output_tensor_name, tflite::TensorType_FLOAT32, classes_shape);
+  // Coarse stage: score the centroids and pick the best clusters.
+  const int32_t centroids_tensor_index = tflite_builder->AddConstTensor(
+      "centroids", tflite::TensorType_FLOAT32, {num_clusters, embedding_dim},
+      reinterpret_cast<const uint8_t*>(index.centroids.data()),
+      sizeof(float) * index.centroids.size());
+  const int32_t centroid_scores_tensor_index = tflite_builder->AddTensor(
+      "centroid_scores", tflite::TensorType_FLOAT32, {1, num_clusters});
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_FULLY_CONNECTED,
+      {norm_tensor_index, centroids_tensor_index}, centroid_scores_tensor_index,
+      tflite::BuiltinOptions_FullyConnectedOptions,
+      tflite::CreateFullyConnectedOptions(*fb_builder,
+                                          tflite::ActivationFunctionType_NONE)
+          .Union());
 
-  // Add a result concatenation operation.
-  tflite_builder->AddOperator(tflite::BuiltinOperator_CONCATENATION,
-                              class_aggregation_indices, flat_classes_index,
-                              tflite::BuiltinOptions_NONE, 0);
+  std::vector<int32_t> num_probes_vec = {num_probes};
+  const int32_t num_probes_tensor_index = tflite_builder->AddConstTensor(
+      "num_probes", tflite::TensorType_INT32, {},
+      reinterpret_cast<const uint8_t*>(num_probes_vec.data()),
+      sizeof(int32_t) * num_probes_vec.size());
+  const int32_t probe_scores_tensor_index = tflite_builder->AddTensor(
+      "probe_scores", tflite::TensorType_FLOAT32, {1, num_probes});
+  const int32_t probes_tensor_index = tflite_builder->AddTensor(
+      "probes", tflite::TensorType_INT32, {1, num_probes});
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_TOPK_V2,
+      {centroid_scores_tensor_index, num_probes_tensor_index},
+      {probe_scores_tensor_index, probes_tensor_index},
+      tflite::BuiltinOptions_TopKV2Options,
+      tflite::CreateTopKV2Options(*fb_builder).Union());
+
+  // Lay out the rows cluster by cluster, and the padded clusters.
+  const int32_t num_rows = normalized.num_rows();
+  const size_t num_slots = static_cast<size_t>(num_clusters) * cluster_size;
+  std::vector<float> cluster_embeddings_vec;
+  cluster_embeddings_vec.reserve(static_cast<size_t>(num_rows) *
+                                 embedding_dim);
+  std::vector<int32_t> embedding_ids_vec;
+  embedding_ids_vec.reserve(num_rows);
+  std::vector<int32_t> cluster_rows_vec(num_slots);
+  std::vector<float> cluster_biases_vec(num_slots, -2.0f);
+  for (int c = 0; c < num_clusters; ++c) {
+    const int32_t first_row = embedding_ids_vec.size();
+    for (int j = 0; j < cluster_size; ++j) {
+      const size_t slot = static_cast<size_t>(c) * cluster_size + j;
+      if (j >= index.clusters[c].size()) {
+        cluster_rows_vec[slot] = first_row;
+        continue;
+      }
+      const int32_t row = index.clusters[c][j];
+      cluster_embeddings_vec.insert(cluster_embeddings_vec.end(),
+                                    normalized.row(row).begin(),
+                                    normalized.row(row).end());
+      cluster_rows_vec[slot] = embedding_ids_vec.size();
+      cluster_biases_vec[slot] = 0.0f;
+      embedding_ids_vec.push_back(row_ids[row]);
+    }
+  }
 
-  // Add a flattening operation.
+  // Gathers the probed clusters of the constant {num_clusters, cluster_size}
+  // `name` table and flattens them to `flat_shape`.
+  auto add_probed_tensor = [&](const std::string& name, tflite::TensorType type,
+                               const void* data, size_t size,
+                               const std::vector<int32_t>& flat_shape) {
+    const int32_t const_tensor_index = tflite_builder->AddConstTensor(
+        "cluster_" + name, type, {num_clusters, cluster_size},
+        reinterpret_cast<const uint8_t*>(data), size);
+    const int32_t probed_tensor_index = tflite_builder->AddTensor(
+        "probed_" + name, type, {1, num_probes, cluster_size});
+    tflite_builder->AddOperator(
+        tflite::BuiltinOperator_GATHER,
+        {const_tensor_index, probes_tensor_index}, probed_tensor_index,
+        tflite::BuiltinOptions_GatherOptions,
+        tflite::CreateGatherOptions(*fb_builder, /*axis=*/0).Union());
+    const int32_t flat_tensor_index =
+        tflite_builder->AddTensor("candidate_" + name, type, flat_shape);
+    tflite_builder->AddOperator(
+        tflite::BuiltinOperator_RESHAPE, {probed_tensor_index},
+        flat_tensor_index, tflite::BuiltinOptions_ReshapeOptions,
+        tflite::CreateReshapeOptions(*fb_builder,
+                                     fb_builder->CreateVector(flat_shape))
+            .Union());
+    return flat_tensor_index;
+  };
+
+  // Fine stage: score the embeddings of the probed clusters.
+  const int32_t candidate_rows_tensor_index = add_probed_tensor(
+      "rows", tflite::TensorType_INT32, cluster_rows_vec.data(),
+      sizeof(int32_t) * cluster_rows_vec.size(), {num_candidates});
+  const int32_t candidate_biases_tensor_index = add_probed_tensor(
+      "biases", tflite::TensorType_FLOAT32, cluster_biases_vec.data(),
+      sizeof(float) * cluster_biases_vec.size(), {1, num_candidates});
+  const int32_t cluster_embeddings_tensor_index =
+      tflite_builder->AddConstTensor(
+          "cluster_embeddings", tflite::TensorType_FLOAT32,
+          {num_rows, embedding_dim},
+          reinterpret_cast<const uint8_t*>(cluster_embeddings_vec.data()),
+          sizeof(float) * cluster_embeddings_vec.size());
+  const int32_t candidate_embeddings_tensor_index = tflite_builder->AddTensor(
+      "candidate_embeddings", tflite::TensorType_FLOAT32,
+      {num_candidates, embedding_dim});
   tflite_builder->AddOperator(
-      tflite::BuiltinOperator_RESHAPE, {flat_classes_index}, classes_index,
-      tflite::BuiltinOptions_ReshapeOptions,
-      tflite::CreateReshapeOptions(*fb_builder,
-                                   fb_builder->CreateVector(classes_shape))
+      tflite::BuiltinOperator_GATHER,
+      {cluster_embeddings_tensor_index, candidate_rows_tensor_index},
+      candidate_embeddings_tensor_index, tflite::BuiltinOptions_GatherOptions,
+      tflite::CreateGatherOptions(*fb_builder, /*axis=*/0).Union());
+
+  const int32_t candidate_scores_tensor_index = tflite_builder->AddTensor(
+      "candidate_scores", tflite::TensorType_FLOAT32, {1, num_candidates});
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_FULLY_CONNECTED,
+      {norm_tensor_index, candidate_embeddings_tensor_index},
+      candidate_scores_tensor_index,
+      tflite::BuiltinOptions_FullyConnectedOptions,
+      tflite::CreateFullyConnectedOptions(*fb_builder,
+                                          tflite::ActivationFunctionType_NONE)
+          .Union());
+  const int32_t masked_scores_tensor_index = tflite_builder->AddTensor(
+      "masked_candidate_scores", tflite::TensorType_FLOAT32,
+      {1, num_candidates});
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_ADD,
+      {candidate_scores_tensor_index, candidate_biases_tensor_index},
+      masked_scores_tensor_index, tflite::BuiltinOptions_AddOptions,
+      tflite::CreateAddOptions(*fb_builder,
+                               tflite::ActivationFunctionType_NONE)
           .Union());
 
-  return classes_index;
+  // Add a top k operation, then map the best candidates to their ids.
+  std::vector<int32_t> k_vec = {k};
+  const int32_t k_tensor_index = tflite_builder->AddConstTensor(
+      "top_k", tflite::TensorType_INT32, {},
+      reinterpret_cast<const uint8_t*>(k_vec.data()),
+      sizeof(int32_t) * k_vec.size());
+  const int32_t scores_index = tflite_builder->AddTensor(
+      "scores", tflite::TensorType_FLOAT32, {1, k});
+  const int32_t positions_index = tflite_builder->AddTensor(
+      "candidate_positions", tflite::TensorType_INT32, {1, k});
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_TOPK_V2,
+      {masked_scores_tensor_index, k_tensor_index},
+      {scores_index, positions_index}, tflite::BuiltinOptions_TopKV2Options,
+      tflite::CreateTopKV2Options(*fb_builder).Union());
+  const int32_t best_rows_index = tflite_builder->AddTensor(
+      "best_rows", tflite::TensorType_INT32, {1, k});
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_GATHER,
+      {candidate_rows_tensor_index, positions_index}, best_rows_index,
+      tflite::BuiltinOptions_GatherOptions,
+      tflite::CreateGatherOptions(*fb_builder, /*axis=*/0).Union());
+  const int32_t embedding_ids_tensor_index = tflite_builder->AddConstTensor(
+      "embedding_ids", tflite::TensorType_INT32, {num_rows},
+      reinterpret_cast<const uint8_t*>(embedding_ids_vec.data()),
+      sizeof(int32_t) * embedding_ids_vec.size());
+  const int32_t indices_index = tflite_builder->AddTensor(
+      "indices", tflite::TensorType_INT32, {1, k});
+  tflite_builder->AddOperator(
+      tflite::BuiltinOperator_GATHER,
+      {embedding_ids_tensor_index, best_rows_index}, indices_index,
+      tflite::BuiltinOptions_GatherOptions,
+      tflite::CreateGatherOptions(*fb_builder, /*axis=*/0).Union());
+
+  return std::vector<int32_t>{scores_index, indices_index};
 }
 
 }  // namespace
 
 tflite::support::StatusOr<std::vector<std::string>>
 TfLiteCbRBuilder::BuildCbRModel(const tflite::Model& model,
-                                const std::vector<FeatureVector>& embeddings,
+                                const EmbeddingMatrix& embeddings,
                                 const std::vector<std::string>& labels,
                                 flatbuffers::FlatBufferBuilder* builder) {
   // Check input arguments.
@@ -325,6 +640,18 @@ TfLiteCbRBuilder::BuildCbRModel(const tflite::Model& model,
   if (embeddings.empty()) {
     return absl::InvalidArgumentError("Provided embeddings is empty");
   }
+  if (options_.top_k < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Expected a non-negative top_k, found %d.",
+                        options_.top_k));
+  }
+  if (options_.num_clusters > 0 &&
+      (options_.top_k == 0 || options_.num_probes < 1)) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Two-stage retrieval requires positive top_k and num_probes, found %d "
+        "and %d.",
+        options_.top_k, options_.num_probes));
+  }
   tflite::SubGraphT subgraph_t;
   (*model.subgraphs())[0]->UnPackTo(&subgraph_t);
   if (subgraph_t.outputs.empty()) {
@@ -338,31 +665,26 @@ TfLiteCbRBuilder::BuildCbRModel(const tflite::Model& model,
   const std::string kClassesTensorName = "classes";
   int output_index;
 
-  // Check if the embedding is quantized.
-  tflite::TensorT* embedding_tensor_t =
-      subgraph_t.tensors[embedding_output].get();
-  if (!embedding_tensor_t) {
-    return absl::InvalidArgumentError("Empty embedding tensor");
-  }
-  if (embedding_tensor_t->type == tflite::TensorType_FLOAT32) {
-    output_index = AddRetrievalBlock(
-        builder, tflite_builder.get(), embedding_output, embeddings,
-        labels.empty() ? kClassesTensorName : kInstancesTensorName);
-  } else {
-    // If the embedding is quantized, add a quantized retrieval block which is
-    // 4x smaller. Note that the embeddings will be normalized -- which means
-    // that the quantization parameter will change.
-    output_index = AddQuantizedRetrievalBlock(
-        builder, tflite_builder.get(), embedding_output, embeddings,
-        labels.empty() ? kClassesTensorName : kInstancesTensorName);
-  }
-
+  // Group the embeddings by class, in order of first appearance of the labels.
+  // The retrieval rows are laid out class by class so that each class is a
+  // contiguous range of the retrieval results.
   std::vector<std::string> class_labels;
-  if (!labels.empty()) {
-    if (embeddings.size() != labels.size()) {
+  std::vector<int32_t> class_sizes;
+  std::vector<int32_t> row_order;
+  // The rows of the retrieval layer, which are the embeddings unless they are
+  // compressed into prototypes.
+  const EmbeddingMatrix* retrieval_rows = &embeddings;
+  EmbeddingMatrix prototypes;
+  compression_stats_.num_instances = embeddings.num_rows();
+  compression_stats_.num_prototypes = embeddings.num_rows();
+  if (labels.empty()) {
+    row_order.resize(embeddings.num_rows());
+    std::iota(row_order.begin(), row_order.end(), 0);
+  } else {
+    if (embeddings.num_rows() != labels.size()) {
       return absl::InvalidArgumentError(absl::StrCat(
-          "Labels are not consistent with the embeddings: ", embeddings.size(),
-          " vs ", labels.size()));
+          "Labels are not consistent with the embeddings: ",
+          embeddings.num_rows(), " vs ", labels.size()));
     }
     absl::flat_hash_map<std::string, int> label_to_class_id;
     std::vector<std::vector<int32_t>> classes;
@@ -381,16 +703,111 @@ TfLiteCbRBuilder::BuildCbRModel(const tflite::Model& model,
       }
       classes[class_id].push_back(i);
     }
+    row_order.reserve(labels.size());
+    for (const std::vector<int32_t>& instances : classes) {
+      class_sizes.push_back(instances.size());
+      row_order.insert(row_order.end(), instances.begin(), instances.end());
+    }
+
+    if (options_.prototype_compression.enabled()) {
+      // The prototypes are laid out class by class already.
+      ASSIGN_OR_RETURN(prototypes, CompressClassPrototypes(
+                                       embeddings, classes,
+                                       options_.prototype_compression,
+                                       &class_sizes, &compression_stats_));
+      retrieval_rows = &prototypes;
+      row_order.resize(prototypes.num_rows());
+      std::iota(row_order.begin(), row_order.end(), 0);
+    }
+  }
+
+  // Check if the embedding is quantized.
+  tflite::TensorT* embedding_tensor_t =
+      subgraph_t.tensors[embedding_output].get();
+  if (!embedding_tensor_t) {
+    return absl::InvalidArgumentError("Empty embedding tensor");
+  }
+  const bool float_embedding =
+      embedding_tensor_t->type == tflite::TensorType_FLOAT32;
+
+  if (options_.num_clusters > 0) {
+    // Map each row to the class, or instance, the model outputs for it.
+    std::vector<int32_t> row_ids(retrieval_rows->num_rows());
+    if (labels.empty()) {
+      std::iota(row_ids.begin(), row_ids.end(), 0);
+    } else {
+      int row = 0;
+      for (int c = 0; c < class_sizes.size(); ++c) {
+        for (int j = 0; j < class_sizes[c]; ++j) row_ids[row_order[row++]] = c;
+      }
+    }
+    ASSIGN_OR_RETURN(
+        std::vector<int32_t> outputs,
+        AddTwoStageRetrievalBlock(builder, tflite_builder.get(),
+                                  embedding_output, *embedding_tensor_t,
+                                  *retrieval_rows, row_ids, options_));
+    tflite_builder->Build(
+        subgraph_t.inputs, outputs, subgraph_t.name, model.version(),
+        (model.description() ? model.description()->str() : ""));
+    return class_labels;
+  }
+
+  const int32_t num_outputs =
+      labels.empty() ? embeddings.num_rows() : class_labels.size();
+  // Whether `output_index` holds int8 scores, left for the top k block to
+  // dequantize.
+  bool quantized_output = false;
+  if (float_embedding && !options_.quantize_retrieval) {
+    output_index = AddRetrievalBlock(
+        builder, tflite_builder.get(), embedding_output, *retrieval_rows,
+        row_order,
+        labels.empty() ? kClassesTensorName : kInstancesTensorName);
+    if (!labels.empty()) {
+      // Add aggregation block and update output index
+      output_index = AddAggregationBlock(
+          builder, tflite_builder.get(), output_index, class_sizes,
+          /*quantization=*/nullptr, kClassesTensorName);
+    }
+  } else {
+    // If the embedding is quantized, or if requested, add a quantized
+    // retrieval block which is 4x smaller. Note that the embeddings will be
+    // normalized -- which means that the quantization parameter will change.
+    output_index = AddQuantizedRetrievalBlock(builder, tflite_builder.get(),
+                                              embedding_output,
+                                              *embedding_tensor_t,
+                                              *retrieval_rows, row_order);
+    if (!labels.empty()) {
+      // The aggregation runs on int8 scores.
+      const tflite::QuantizationParametersT scores_qparams =
+          UnitQuantizationParameters();
+      output_index = AddAggregationBlock(builder, tflite_builder.get(),
+                                         output_index, class_sizes,
+                                         &scores_qparams, "quantized_classes");
+    }
+
+    if (options_.top_k > 0) {
+      quantized_output = true;
+    } else {
+      // Add the final float output and a dequantization operation.
+      const int float_output_index = tflite_builder->AddTensor(
+          kClassesTensorName, tflite::TensorType_FLOAT32, {1, num_outputs});
+      tflite_builder->AddOperator(tflite::BuiltinOperator_DEQUANTIZE,
+                                  {output_index}, float_output_index,
+                                  tflite::BuiltinOptions_NONE, 0);
+      output_index = float_output_index;
+    }
+  }
 
-    // Add aggregation block and update output index
-    output_index =
-        AddAggregationBlock(builder, tflite_builder.get(), embeddings.size(),
-                            output_index, classes, kClassesTensorName);
+  std::vector<int32_t> outputs = {output_index};
+  if (options_.top_k > 0) {
+    outputs = AddTopKBlock(builder, tflite_builder.get(), output_index,
+                           quantized_output,
+                           std::min<int32_t>(options_.top_k, num_outputs));
   }
 
   // Finalize.
   tflite_builder->Build(
-      subgraph_t.inputs, output_index, subgraph_t.name, model.version(),
+      subgraph_t.inputs, outputs, subgraph_t.name, model.version(),
       (model.description() ? model.description()->str() : ""));
 
   return class_labels;
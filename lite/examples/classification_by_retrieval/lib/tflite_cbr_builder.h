@@ -19,9 +19,10 @@
 #include <vector>
 
 #include "flatbuffers/flatbuffers.h"
+#include "lib/embedding_matrix.h"
+#include "lib/prototype_compression.h"
 #include "tensorflow/lite/model.h"
 #include "tensorflow_lite_support/cc/port/statusor.h"
-#include "tensorflow_lite_support/cc/task/vision/proto/embeddings_proto_inc.h"
 
 namespace tflite {
 namespace examples {
@@ -30,18 +31,63 @@ namespace cbr {
 // Wrapper class around BuildCbRModel() function for dependency injection.
 class TfLiteCbRBuilder {
  public:
+  struct Options {
+    // Whether to build an int8 retrieval layer, with per-row weight scales,
+    // for a float embedder. Quantized embedders always get one.
+    bool quantize_retrieval = false;
+    // If positive, the model ends with a TOPK_V2 operator and has two outputs
+    // instead of the {1, num_classes} "classes" scores: the float "scores" of
+    // the best min(top_k, num_classes) classes in decreasing order, and their
+    // int32 "indices", both of shape {1, min(top_k, num_classes)}.
+    int top_k = 0;
+
+    // If positive, the dense retrieval layer is replaced by a two-stage one,
+    // for galleries too large to be scored exhaustively: the normalized
+    // embeddings are clustered into `num_clusters` centroids (see
+    // BuildIvfIndex()), the query is scored against the centroids, and only
+    // the embeddings of the `num_probes` best clusters are scored. More probes
+    // trade latency for recall. Clusters of more than twice the mean size are
+    // split, so the model may have up to 1.5 * num_clusters clusters; it stores
+    // each embedding once, plus fewer than 6 * (num_embeddings + num_clusters)
+    // int32 and float table entries.
+    //
+    // The top k embeddings are output without class aggregation, so `top_k`
+    // must be set and "indices" may repeat a class. `quantize_retrieval` is
+    // ignored.
+    int num_clusters = 0;
+    int num_probes = 8;
+    int num_kmeans_iterations = 10;
+
+    // Optional compression of the instances of each class into fewer
+    // retrieval rows. Ignored if no labels are given.
+    PrototypeCompressionOptions prototype_compression;
+  };
+
   TfLiteCbRBuilder() = default;
+  explicit TfLiteCbRBuilder(const Options& options) : options_(options) {}
   virtual ~TfLiteCbRBuilder() = default;
 
+  const Options& options() const { return options_; }
+  void set_options(const Options& options) { options_ = options; }
+
+  // Number of instances and of retrieval rows of the last model built.
+  const PrototypeCompressionStats& compression_stats() const {
+    return compression_stats_;
+  }
+
   // Performs modifications on the provided embedder model to turn it into a
-  // classification-by-retrieval model based on the provided list of embeddings.
-  // On success, it returns the updated class labels after aggregation or an
-  // empty vector if `labels` is empty.
+  // classification-by-retrieval model based on the provided embeddings, one
+  // per row. On success, it returns the updated class labels after aggregation
+  // or an empty vector if `labels` is empty. Returns an InvalidArgumentError if
+  // `options()` are invalid.
   virtual tflite::support::StatusOr<std::vector<std::string>> BuildCbRModel(
-      const ::tflite::Model& model,
-      const std::vector<::tflite::task::vision::FeatureVector>& embeddings,
+      const ::tflite::Model& model, const EmbeddingMatrix& embeddings,
       const std::vector<std::string>& labels,
       ::flatbuffers::FlatBufferBuilder* builder);
+
+ private:
+  Options options_;
+  PrototypeCompressionStats compression_stats_;
 };
 
 }  // namespace cbr
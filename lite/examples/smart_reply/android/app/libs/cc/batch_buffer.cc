@@ -0,0 +1,88 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/batch_buffer.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+namespace {
+
+// Reads a non-negative int32 at the front of `buffer` and consumes it.
+bool ReadCount(absl::string_view* buffer, int32_t* value) {
+  if (buffer->size() < sizeof(int32_t)) {
+    return false;
+  }
+  memcpy(value, buffer->data(), sizeof(int32_t));
+  buffer->remove_prefix(sizeof(int32_t));
+  return *value >= 0;
+}
+
+template <typename T>
+void Append(T value, std::string* buffer) {
+  buffer->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+}  // namespace
+
+bool ParseBatchRequest(absl::string_view buffer,
+                       std::vector<std::vector<std::string>>* conversations) {
+  int32_t num_conversations;
+  if (!ReadCount(&buffer, &num_conversations)) {
+    return false;
+  }
+  // Every conversation takes at least four bytes, which bounds the resize
+  // below for malformed requests.
+  if (num_conversations > buffer.size() / sizeof(int32_t)) {
+    return false;
+  }
+  conversations->resize(num_conversations);
+  for (std::vector<std::string>& messages : *conversations) {
+    int32_t num_messages;
+    if (!ReadCount(&buffer, &num_messages) ||
+        num_messages > buffer.size() / sizeof(int32_t)) {
+      return false;
+    }
+    messages.resize(num_messages);
+    for (std::string& message : messages) {
+      int32_t length;
+      if (!ReadCount(&buffer, &length) || length > buffer.size()) {
+        return false;
+      }
+      message.assign(buffer.data(), length);
+      buffer.remove_prefix(length);
+    }
+  }
+  return buffer.empty();
+}
+
+void AppendBatchResponse(const std::vector<PredictorResponse>& responses,
+                         std::string* buffer) {
+  Append<int32_t>(responses.size(), buffer);
+  for (const PredictorResponse& response : responses) {
+    const std::string& text = response.GetText();
+    Append<float>(response.GetScore(), buffer);
+    Append<int32_t>(text.size(), buffer);
+    buffer->append(text);
+  }
+}
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
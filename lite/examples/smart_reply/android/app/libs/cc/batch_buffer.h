@@ -0,0 +1,57 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_BATCH_BUFFER_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_BATCH_BUFFER_H_
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "cc/predictor.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+// Flat buffers exchanged by the batch JNI entry point, so that a whole batch
+// of conversations crosses JNI in one call. All integers are int32 and floats
+// are float32, in native byte order; strings are UTF-8.
+//
+// Request:
+//   int32 num_conversations
+//   for each conversation:
+//     int32 num_messages
+//     for each message: int32 length, `length` bytes
+//
+// Response:
+//   for each conversation:
+//     int32 num_replies
+//     for each reply: float32 score, int32 length, `length` bytes
+
+// Parses a batch request into `conversations`, reusing its storage. Returns
+// false if the buffer is truncated, has negative counts or trailing bytes.
+bool ParseBatchRequest(absl::string_view buffer,
+                       std::vector<std::vector<std::string>>* conversations);
+
+// Appends the replies of one conversation to a batch response.
+void AppendBatchResponse(const std::vector<PredictorResponse>& responses,
+                         std::string* buffer);
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_BATCH_BUFFER_H_
@@ -0,0 +1,107 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/batch_buffer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+namespace {
+
+using ::testing::ElementsAre;
+
+void AppendInt(int32_t value, std::string* buffer) {
+  buffer->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+std::string EncodeRequest(
+    const std::vector<std::vector<std::string>>& conversations) {
+  std::string buffer;
+  AppendInt(conversations.size(), &buffer);
+  for (const auto& conversation : conversations) {
+    AppendInt(conversation.size(), &buffer);
+    for (const std::string& message : conversation) {
+      AppendInt(message.size(), &buffer);
+      buffer += message;
+    }
+  }
+  return buffer;
+}
+
+TEST(BatchBufferTest, ParsesRequest) {
+  const std::vector<std::vector<std::string>> expected = {
+      {"Hello", "How are you?"}, {}, {""}, {"caf\xc3\xa9"}};
+  std::vector<std::vector<std::string>> conversations = {{"stale"}};
+  ASSERT_TRUE(ParseBatchRequest(EncodeRequest(expected), &conversations));
+  EXPECT_EQ(conversations, expected);
+}
+
+TEST(BatchBufferTest, RejectsMalformedRequests) {
+  const std::string request = EncodeRequest({{"Hello"}, {"Hi", "there"}});
+  std::vector<std::vector<std::string>> conversations;
+  // Every strict prefix is truncated.
+  for (int i = 0; i < request.size(); i++) {
+    EXPECT_FALSE(ParseBatchRequest(request.substr(0, i), &conversations));
+  }
+  EXPECT_FALSE(ParseBatchRequest(request + "x", &conversations));
+
+  std::string negative;
+  AppendInt(1, &negative);
+  AppendInt(-1, &negative);
+  EXPECT_FALSE(ParseBatchRequest(negative, &conversations));
+
+  std::string huge;
+  AppendInt(1 << 30, &huge);
+  EXPECT_FALSE(ParseBatchRequest(huge, &conversations));
+}
+
+TEST(BatchBufferTest, AppendsResponses) {
+  std::string buffer;
+  AppendBatchResponse({{"Thanks", 0.5f}, {"Ok", 0.25f}}, &buffer);
+  AppendBatchResponse({}, &buffer);
+
+  int32_t num_replies;
+  float score;
+  int32_t length;
+  const char* p = buffer.data();
+  memcpy(&num_replies, p, 4);
+  EXPECT_EQ(num_replies, 2);
+  memcpy(&score, p + 4, 4);
+  memcpy(&length, p + 8, 4);
+  EXPECT_EQ(score, 0.5f);
+  EXPECT_EQ(std::string(p + 12, length), "Thanks");
+  p += 12 + length;
+  memcpy(&score, p, 4);
+  memcpy(&length, p + 4, 4);
+  EXPECT_EQ(score, 0.25f);
+  EXPECT_EQ(std::string(p + 8, length), "Ok");
+  p += 8 + length;
+  memcpy(&num_replies, p, 4);
+  EXPECT_EQ(num_replies, 0);
+  EXPECT_EQ(p + 4, buffer.data() + buffer.size());
+}
+
+}  // namespace
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
@@ -21,8 +21,10 @@ limitations under the License.
 //     Output[0]: Hashed features. int32[num of input]
 //     Output[1]: Weights. float[num of input]
 
+#include "cc/ops/extract_feature.h"
+
 #include <algorithm>
-#include <map>
+#include <cstring>
 
 #include "tensorflow/lite/context.h"
 #include "tensorflow/lite/kernels/kernel_util.h"
@@ -36,43 +38,233 @@ namespace custom {
 namespace extract {
 
 static const int kMaxDimension = 1000000;
-static const std::vector<string> kBlacklistNgram = {"<S>", "<E>", "<S> <E>"};
+// Number of ngrams hashed together.
+static const int kBatchSize = 64;
+// Longer ngrams are rare and are hashed by ::util::Fingerprint64 directly.
+static const int kMaxBatchedLength = 32;
+
+// Constants of ::util::Fingerprint64, which is farmhashna::Hash64.
+static const uint64_t k0 = 0xc3a5c85c97cb3127ULL;
+static const uint64_t k1 = 0xb492b66fbe98f273ULL;
+static const uint64_t k2 = 0x9ae16a3b2f90404fULL;
+
+inline uint64_t Fetch64(const char* p) {
+  uint64_t result;
+  memcpy(&result, p, sizeof(result));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  result = __builtin_bswap64(result);
+#endif
+  return result;
+}
 
-bool Equals(const string& x, const tflite::StringRef& strref) {
-  if (strref.len != x.length()) {
-    return false;
+inline uint32_t Fetch32(const char* p) {
+  uint32_t result;
+  memcpy(&result, p, sizeof(result));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  result = __builtin_bswap32(result);
+#endif
+  return result;
+}
+
+// Only called with non-zero shifts.
+inline uint64_t Rotate(uint64_t val, int shift) {
+  return (val >> shift) | (val << (64 - shift));
+}
+
+inline uint64_t ShiftMix(uint64_t val) { return val ^ (val >> 47); }
+
+inline uint64_t HashLen16(uint64_t u, uint64_t v, uint64_t mul) {
+  uint64_t a = (u ^ v) * mul;
+  a ^= (a >> 47);
+  uint64_t b = (v ^ a) * mul;
+  b ^= (b >> 47);
+  b *= mul;
+  return b;
+}
+
+// Returns the number of spaces in `word`, ignoring its `skip` lowest bytes,
+// i.e. the first `skip` characters of a fetched word.
+inline int CountSpaces(uint64_t word, int skip) {
+  static const uint64_t kSpaces = 0x2020202020202020ULL;
+  static const uint64_t kLow7 = 0x7f7f7f7f7f7f7f7fULL;
+  if (skip >= 8) {
+    return 0;
   }
-  if (strref.len > 0) {
-    int r = memcmp(strref.str, x.data(), strref.len);
-    return r == 0;
+  // Spaces are the zero bytes of x; their high bit is set in `zeros`.
+  const uint64_t x = word ^ kSpaces;
+  uint64_t zeros = ~(((x & kLow7) + kLow7) | x | kLow7);
+  zeros &= ~0ULL << (8 * skip);
+  return __builtin_popcountll(zeros);
+}
+
+// Number of spaces of an arbitrary string, eight bytes at a time.
+int CountSpaces(const char* s, int len) {
+  int count = 0;
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    count += CountSpaces(Fetch64(s + i), 0);
   }
-  return true;
+  if (i < len) {
+    // Zero padding never matches a space.
+    uint64_t word = 0;
+    memcpy(&word, s + i, len - i);
+    count += CountSpaces(word, 0);
+  }
+  return count;
 }
 
 bool IsValidNgram(const tflite::StringRef& strref) {
-  for (const auto& s : kBlacklistNgram) {
-    if (Equals(s, strref)) {
-      return false;
-    }
+  // The blacklist is "<S>", "<E>" and "<S> <E>".
+  if (strref.len == 3) {
+    return !(strref.str[0] == '<' && strref.str[2] == '>' &&
+             (strref.str[1] == 'S' || strref.str[1] == 'E'));
+  }
+  if (strref.len == 7) {
+    return memcmp(strref.str, "<S> <E>", 7) != 0;
   }
   return true;
 }
 
-TfLiteStatus Prepare(TfLiteContext* context, TfLiteNode* node) {
-  const TfLiteTensor* input = GetInput(context, node, 0);
-  TF_LITE_ENSURE(context, input != nullptr);
-  int dim = input->dims->data[0];
+// Extracts up to kBatchSize ngrams.
+//
+// The first pass reads every short ngram once: the words it loads both feed
+// Fingerprint64 and are used to count spaces. It stops before the final
+// HashLen16 mix, which the second pass runs over all pending ngrams at once.
+// The mixes are independent, so their multiply chains overlap instead of
+// running back to back, and they vectorize where 64-bit lane multiplies exist.
+void ExtractBatch(const tflite::StringRef* ngrams, int count, int32_t* features,
+                  float* weights) {
+  uint64_t u[kBatchSize];
+  uint64_t v[kBatchSize];
+  uint64_t mul[kBatchSize];
+  uint64_t fingerprints[kBatchSize];
+  bool valid[kBatchSize];
+  int pending[kBatchSize];
+  int num_pending = 0;
+
+  for (int i = 0; i < count; i++) {
+    const char* s = ngrams[i].str;
+    const int len = ngrams[i].len;
+    valid[i] = IsValidNgram(ngrams[i]);
+    if (!valid[i]) {
+      features[i] = 0;
+      if (weights != nullptr) weights[i] = 0;
+      continue;
+    }
+
+    int spaces = 0;
+    if (len > kMaxBatchedLength) {
+      fingerprints[i] = ::util::Fingerprint64(s, len);
+      spaces = CountSpaces(s, len);
+    } else if (len > 16) {
+      const uint64_t m = k2 + len * 2;
+      const uint64_t w0 = Fetch64(s);
+      const uint64_t w1 = Fetch64(s + 8);
+      const uint64_t w2 = Fetch64(s + len - 16);
+      const uint64_t w3 = Fetch64(s + len - 8);
+      const uint64_t a = w0 * k1;
+      const uint64_t c = w3 * m;
+      const uint64_t d = w2 * k2;
+      u[num_pending] = Rotate(a + w1, 43) + Rotate(c, 30) + d;
+      v[num_pending] = a + Rotate(w1 + k2, 18) + c;
+      mul[num_pending] = m;
+      pending[num_pending++] = i;
+      // w0 and w1 cover [0, 16); w2 and w3 overlap them.
+      spaces = CountSpaces(w0, 0) + CountSpaces(w1, 0) +
+               CountSpaces(w2, 32 - len) +
+               CountSpaces(w3, std::max(24 - len, 0));
+    } else if (len >= 8) {
+      const uint64_t m = k2 + len * 2;
+      const uint64_t w0 = Fetch64(s);
+      const uint64_t w1 = Fetch64(s + len - 8);
+      const uint64_t a = w0 + k2;
+      u[num_pending] = Rotate(w1, 37) * m + a;
+      v[num_pending] = (Rotate(a, 25) + w1) * m;
+      mul[num_pending] = m;
+      pending[num_pending++] = i;
+      spaces = CountSpaces(w0, 0) + CountSpaces(w1, 16 - len);
+    } else if (len >= 4) {
+      const uint32_t w0 = Fetch32(s);
+      const uint32_t w1 = Fetch32(s + len - 4);
+      u[num_pending] = len + (static_cast<uint64_t>(w0) << 3);
+      v[num_pending] = w1;
+      mul[num_pending] = k2 + len * 2;
+      pending[num_pending++] = i;
+      // Zero-extended high bytes never match a space.
+      spaces = CountSpaces(w0, 0) + CountSpaces(w1, 8 - len);
+    } else if (len > 0) {
+      const uint8_t a = s[0];
+      const uint8_t b = s[len >> 1];
+      const uint8_t c = s[len - 1];
+      const uint32_t y =
+          static_cast<uint32_t>(a) + (static_cast<uint32_t>(b) << 8);
+      const uint32_t z = len + (static_cast<uint32_t>(c) << 2);
+      fingerprints[i] = ShiftMix(y * k2 ^ z * k0) * k2;
+      spaces = std::count(s, s + len, ' ');
+    } else {
+      fingerprints[i] = k2;
+    }
+    if (weights != nullptr) weights[i] = spaces + 1;
+  }
+
+  uint64_t mixed[kBatchSize];
+  for (int j = 0; j < num_pending; j++) {
+    mixed[j] = HashLen16(u[j], v[j], mul[j]);
+  }
+  for (int j = 0; j < num_pending; j++) {
+    fingerprints[pending[j]] = mixed[j];
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (valid[i]) {
+      features[i] = static_cast<int32_t>(fingerprints[i] % kMaxDimension);
+    }
+  }
+}
+
+void ExtractFeatures(const tflite::StringRef* ngrams, int count,
+                     int32_t* features, float* weights) {
+  for (int begin = 0; begin < count; begin += kBatchSize) {
+    ExtractBatch(ngrams + begin, std::min(kBatchSize, count - begin),
+                 features + begin,
+                 weights == nullptr ? nullptr : weights + begin);
+  }
+}
+
+// Resizes both outputs to hold one entry per input string. Outputs are only
+// reallocated when their size actually changes.
+TfLiteStatus ResizeOutputs(TfLiteContext* context, TfLiteNode* node,
+                           int num_strings) {
+  int dim = num_strings;
   if (dim == 0) {
     // TFLite non-string output should have size greater than 0.
     dim = 1;
   }
+  for (int i = 0; i < 2; i++) {
+    TfLiteTensor* output = GetOutput(context, node, i);
+    TF_LITE_ENSURE(context, output != nullptr);
+    if (output->data.raw != nullptr && output->dims->size == 1 &&
+        output->dims->data[0] == dim) {
+      continue;
+    }
+    TfLiteIntArray* output_size = TfLiteIntArrayCreate(1);
+    output_size->data[0] = dim;
+    TF_LITE_ENSURE_OK(context,
+                      context->ResizeTensor(context, output, output_size));
+  }
+  return kTfLiteOk;
+}
+
+TfLiteStatus Prepare(TfLiteContext* context, TfLiteNode* node) {
+  const TfLiteTensor* input = GetInput(context, node, 0);
+  TF_LITE_ENSURE(context, input != nullptr);
   TF_LITE_ENSURE_EQ(context, input->type, kTfLiteString);
-  TfLiteIntArray* outputSize1 = TfLiteIntArrayCreate(1);
-  TfLiteIntArray* outputSize2 = TfLiteIntArrayCreate(1);
-  outputSize1->data[0] = dim;
-  outputSize2->data[0] = dim;
-  context->ResizeTensor(context, GetOutput(context, node, 0), outputSize1);
-  context->ResizeTensor(context, GetOutput(context, node, 1), outputSize2);
+  // String tensors are always dynamic: their length is only known once the
+  // preceding op has run, so the outputs are sized in Eval. This keeps the op
+  // correct when the interpreter is invoked repeatedly without re-running
+  // AllocateTensors().
+  SetTensorToDynamic(GetOutput(context, node, 0));
+  SetTensorToDynamic(GetOutput(context, node, 1));
   return kTfLiteOk;
 }
 
@@ -84,22 +276,16 @@ TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
   TF_LITE_ENSURE(context, label != nullptr);
   TfLiteTensor* weight = GetOutput(context, node, 1);
   TF_LITE_ENSURE(context, weight != nullptr);
+  TF_LITE_ENSURE_OK(context, ResizeOutputs(context, node, num_strings));
 
-  std::map<int64_t, int> feature_id_counts;
-  for (int i = 0; i < num_strings; i++) {
-    // Use fingerprint of feature name as id.
-    auto strref = tflite::GetString(input, i);
-    if (!IsValidNgram(strref)) {
-      label->data.i32[i] = 0;
-      weight->data.i32[i] = 0;
-      continue;
+  tflite::StringRef ngrams[kBatchSize];
+  for (int begin = 0; begin < num_strings; begin += kBatchSize) {
+    const int count = std::min(kBatchSize, num_strings - begin);
+    for (int i = 0; i < count; i++) {
+      ngrams[i] = tflite::GetString(input, begin + i);
     }
-
-    int64_t feature_id =
-        ::util::Fingerprint64(strref.str, strref.len) % kMaxDimension;
-    label->data.i32[i] = static_cast<int32_t>(feature_id);
-    weight->data.f[i] =
-        std::count(strref.str, strref.str + strref.len, ' ') + 1;
+    ExtractBatch(ngrams, count, label->data.i32 + begin,
+                 weight->data.f + begin);
   }
   // Explicitly set an empty result to make preceding ops run.
   if (num_strings == 0) {
@@ -0,0 +1,44 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_EXTRACT_FEATURE_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_EXTRACT_FEATURE_H_
+
+#include <cstdint>
+
+#include "tensorflow/lite/string_util.h"
+
+namespace tflite {
+namespace ops {
+namespace custom {
+namespace extract {
+
+// Returns false for ngrams that only hold start/end tokens. They produce a
+// zero feature with zero weight.
+bool IsValidNgram(const tflite::StringRef& strref);
+
+// Computes the feature ids and weights of `count` ngrams, as
+// EXTRACT_FEATURES does: the feature id is ::util::Fingerprint64 of the ngram
+// modulo the feature dimension, the weight its number of tokens. Invalid
+// ngrams get zero for both. `weights` may be null.
+void ExtractFeatures(const tflite::StringRef* ngrams, int count,
+                     int32_t* features, float* weights);
+
+}  // namespace extract
+}  // namespace custom
+}  // namespace ops
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_EXTRACT_FEATURE_H_
@@ -13,6 +13,11 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include "cc/ops/extract_feature.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -20,6 +25,8 @@ limitations under the License.
 #include "tensorflow/lite/kernels/register.h"
 #include "tensorflow/lite/kernels/test_util.h"
 #include "tensorflow/lite/model.h"
+#include "tensorflow/lite/string_util.h"
+#include "tensorflow/lite/testing/util.h"
 #include <farmhash.h>
 
 namespace tflite {
@@ -32,6 +39,8 @@ namespace {
 
 using ::testing::ElementsAre;
 
+const int kNumRandomNgrams = 100000;
+
 class ExtractFeatureOpModel : public SingleOpModel {
  public:
   explicit ExtractFeatureOpModel(const std::vector<string>& input) {
@@ -57,6 +66,77 @@ int CalcFeature(const string& str) {
   return ::util::Fingerprint64(str) % 1000000;
 }
 
+// The per-ngram loop EXTRACT_FEATURES used before batching, kept as the
+// reference implementation.
+void ReferenceExtract(const std::vector<StringRef>& ngrams, int32_t* features,
+                      float* weights) {
+  static const std::vector<string>* kBlacklistNgram =
+      new std::vector<string>({"<S>", "<E>", "<S> <E>"});
+  for (int i = 0; i < ngrams.size(); i++) {
+    const StringRef& strref = ngrams[i];
+    bool valid = true;
+    for (const string& s : *kBlacklistNgram) {
+      if (strref.len == s.length() &&
+          memcmp(strref.str, s.data(), strref.len) == 0) {
+        valid = false;
+      }
+    }
+    if (!valid) {
+      features[i] = 0;
+      weights[i] = 0;
+      continue;
+    }
+    features[i] = ::util::Fingerprint64(strref.str, strref.len) % 1000000;
+    weights[i] = std::count(strref.str, strref.str + strref.len, ' ') + 1;
+  }
+}
+
+// Random strings of every length the batched path special-cases, biased
+// towards spaces and blacklist characters.
+std::vector<string> RandomStrings(int count) {
+  static const char kAlphabet[] = "  ab<>SE<S> <E>xyz";
+  std::mt19937 rng(1234);
+  std::vector<string> strings = {"<S>",   "<E>", "<S> <E>", "<S", "<X>",
+                                 "<S> <F>", "",  " ",       "        "};
+  for (int i = 0; i < count; i++) {
+    const int len = rng() % 100;
+    string s;
+    for (int j = 0; j < len; j++) {
+      s += rng() % 8 == 0 ? static_cast<char>(rng())
+                          : kAlphabet[rng() % (sizeof(kAlphabet) - 1)];
+    }
+    strings.push_back(s);
+  }
+  return strings;
+}
+
+// Typical ngrams: one to three words joined by spaces.
+std::vector<string> RandomNgrams(int count) {
+  static const char* const kWords[] = {
+      "<S>", "<E>", "hi", "how", "are", "you", "doing", "today",
+      "thanks", "great", "ok", "see", "you", "tomorrow", "?", "!"};
+  const int num_words = sizeof(kWords) / sizeof(kWords[0]);
+  std::mt19937 rng(42);
+  std::vector<string> ngrams;
+  for (int i = 0; i < count; i++) {
+    string ngram = kWords[rng() % num_words];
+    for (int j = rng() % 3; j > 0; j--) {
+      ngram += " ";
+      ngram += kWords[rng() % num_words];
+    }
+    ngrams.push_back(ngram);
+  }
+  return ngrams;
+}
+
+std::vector<StringRef> ToStringRefs(const std::vector<string>& strings) {
+  std::vector<StringRef> refs;
+  for (const string& s : strings) {
+    refs.push_back({s.data(), static_cast<int>(s.size())});
+  }
+  return refs;
+}
+
 TEST(ExtractFeatureOpTest, RegularInput) {
   ExtractFeatureOpModel m({"<S>", "<S> Hi", "Hi", "Hi !", "!", "! <E>", "<E>"});
   m.Invoke();
@@ -88,6 +168,23 @@ TEST(ExtractFeatureOpTest, AllBlacklistInput) {
   EXPECT_THAT(m.GetWeight(), ElementsAre(0, 0));
 }
 
+TEST(ExtractFeatureOpTest, BatchedMatchesReference) {
+  const std::vector<string> strings = RandomStrings(kNumRandomNgrams);
+  const std::vector<StringRef> ngrams = ToStringRefs(strings);
+  std::vector<int32_t> expected_features(ngrams.size());
+  std::vector<float> expected_weights(ngrams.size());
+  ReferenceExtract(ngrams, expected_features.data(), expected_weights.data());
+
+  std::vector<int32_t> features(ngrams.size());
+  std::vector<float> weights(ngrams.size());
+  extract::ExtractFeatures(ngrams.data(), ngrams.size(), features.data(),
+                           weights.data());
+  for (int i = 0; i < ngrams.size(); i++) {
+    EXPECT_EQ(features[i], expected_features[i]) << "input: " << strings[i];
+    EXPECT_EQ(weights[i], expected_weights[i]) << "input: " << strings[i];
+  }
+}
+
 }  // namespace
 }  // namespace custom
 }  // namespace ops
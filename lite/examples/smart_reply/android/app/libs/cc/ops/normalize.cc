@@ -22,12 +22,14 @@ limitations under the License.
 //     Output[0]: Normalized sentence. string[1]
 //
 
+#include "cc/ops/normalize.h"
+
 #include <algorithm>
+#include <cstring>
 #include <string>
 
-#include "absl/strings/str_cat.h"
-#include "absl/strings/strip.h"
-#include "re2/re2.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/string_view.h"
 #include "tensorflow/lite/context.h"
 #include "tensorflow/lite/kernels/kernel_util.h"
 #include "tensorflow/lite/string_util.h"
@@ -38,59 +40,283 @@ namespace custom {
 
 namespace normalize {
 
-// Predictor transforms.
-const char kPunctuationsRegex[] = "[.*()\"]";
+// Contractions that are attached to the preceding word, in the order of the
+// original regex alternation.
+const char* const kContractions[] = {"'t", "'nt", "n't", "'d", "'ll",
+                                     "'s", "'m",  "'ve", "'re"};
 
-const std::map<string, string>* kRegexTransforms =
-    new std::map<string, string>({
-        {"([^\\s]+)n't", "\\1 not"},
-        {"([^\\s]+)'nt", "\\1 not"},
-        {"([^\\s]+)'ll", "\\1 will"},
-        {"([^\\s]+)'re", "\\1 are"},
-        {"([^\\s]+)'ve", "\\1 have"},
-        {"i'm", "i am"},
-    });
+// Word suffixes expanded into a separate word, applied in this order.
+struct SuffixExpansion {
+  const char* suffix;
+  const char* expansion;
+};
+const SuffixExpansion kSuffixExpansions[] = {
+    {"'ll", "will"}, {"'nt", "not"}, {"'re", "are"},
+    {"'ve", "have"}, {"n't", "not"},
+};
 
 static const char kStartToken[] = "<S>";
 static const char kEndToken[] = "<E>";
 static const int32_t kMaxInputChars = 300;
 
-TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
-  const TfLiteTensor* input_tensor = GetInput(context, node, 0);
-  TF_LITE_ENSURE(context, input_tensor != nullptr);
-  tflite::StringRef input = tflite::GetString(input_tensor, 0);
+// Whitespace as matched by RE2's \s. Unlike absl's, it does not include \v.
+inline bool IsRegexSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+// Do not remove commas, semi-colons or colons from the sentences as they can
+// indicate the beginning of a new clause.
+inline bool IsRemovedPunctuation(char c) {
+  return c == '.' || c == '*' || c == '(' || c == ')' || c == '"';
+}
+
+inline bool IsContractionDelimiter(char c) {
+  return IsRegexSpace(c) || c == ',' || c == ';' || c == ':' || c == '/';
+}
+
+inline bool IsQuestionOrInterjection(char c) { return c == '?' || c == '!'; }
+
+// Characters trimmed from both ends of the normalized sentence.
+inline bool IsEdgeCharacter(char c) {
+  return IsRegexSpace(c) || c == ',' || c == ':' || c == ';' || c == '-' ||
+         c == '&' || c == '\'' || c == '"';
+}
+
+// Returns the length of the UTF-8 character starting at `pos`, or 0 if the
+// byte at `pos` does not start one. Lead and continuation bytes are checked as
+// RE2 compiles a negated character class, so overlong 3 and 4-byte forms are
+// characters. RE2 never matches the other bytes with a character class, so
+// they end words and runs of text.
+int Utf8CharLength(const std::string& s, size_t pos) {
+  const unsigned char lead = s[pos];
+  int len;
+  if (lead < 0x80) {
+    return 1;
+  } else if (lead >= 0xc2 && lead <= 0xdf) {
+    len = 2;
+  } else if (lead >= 0xe0 && lead <= 0xef) {
+    len = 3;
+  } else if (lead >= 0xf0 && lead <= 0xf4) {
+    len = 4;
+  } else {
+    return 0;
+  }
+  if (pos + len > s.size()) return 0;
+  for (int i = 1; i < len; i++) {
+    if ((static_cast<unsigned char>(s[pos + i]) & 0xc0) != 0x80) return 0;
+  }
+  return len;
+}
+
+// Returns the length of the character at `pos` if it is part of a word, i.e.
+// a valid character other than whitespace, or 0.
+int WordCharLength(const std::string& s, size_t pos) {
+  return IsRegexSpace(s[pos]) ? 0 : Utf8CharLength(s, pos);
+}
+
+inline bool HasAt(const std::string& s, size_t pos, absl::string_view token) {
+  return pos + token.size() <= s.size() &&
+         memcmp(s.data() + pos, token.data(), token.size()) == 0;
+}
+
+// Returns the length of the contraction starting at `pos`, or 0 if none.
+int ContractionAt(const std::string& s, size_t pos) {
+  for (const char* contraction : kContractions) {
+    if (HasAt(s, pos, contraction)) {
+      return strlen(contraction);
+    }
+  }
+  return 0;
+}
+
+// Lower-cases and trims `input` and drops the punctuation that carries no
+// meaning for the model.
+void LowerAndRemovePunctuation(absl::string_view input, std::string* out) {
+  out->clear();
+  for (char c : absl::StripAsciiWhitespace(input)) {
+    if (!IsRemovedPunctuation(c)) {
+      out->push_back(absl::ascii_tolower(c));
+    }
+  }
+}
+
+// Removes the space before a contraction followed by a delimiter, then the
+// space before a contraction ending the sentence, e.g. "it 's" -> "it's".
+void AttachContractions(const std::string& in, std::string* out) {
+  out->clear();
+  size_t i = 0;
+  while (i < in.size()) {
+    if (IsRegexSpace(in[i])) {
+      const int len = ContractionAt(in, i + 1);
+      const size_t delimiter = i + 1 + len;
+      if (len > 0 && delimiter < in.size() &&
+          IsContractionDelimiter(in[delimiter])) {
+        out->append(in, i + 1, len + 1);
+        i = delimiter + 1;
+        continue;
+      }
+    }
+    out->push_back(in[i++]);
+  }
+
+  for (const char* contraction : kContractions) {
+    const size_t len = strlen(contraction);
+    if (out->size() > len && HasAt(*out, out->size() - len, contraction) &&
+        IsRegexSpace((*out)[out->size() - len - 1])) {
+      out->erase(out->size() - len - 1, 1);
+      break;
+    }
+  }
+}
+
+// Splits `suffix` off every word ending with it, e.g. "you'll" -> "you will".
+// A word is a run of valid non-space characters; as the original greedy match,
+// the last occurrence of the suffix that is not at the start of the word is
+// used.
+void ExpandSuffix(const std::string& in, const SuffixExpansion& rule,
+                  std::string* out) {
+  const absl::string_view suffix(rule.suffix);
+  out->clear();
+  size_t i = 0;
+  while (i < in.size()) {
+    if (WordCharLength(in, i) == 0) {
+      out->push_back(in[i++]);
+      continue;
+    }
+    size_t end = i;
+    for (int len; end < in.size() && (len = WordCharLength(in, end)) > 0;) {
+      end += len;
+    }
+    const absl::string_view word(in.data() + i, end - i);
+    const size_t pos = word.rfind(suffix);
+    if (pos != absl::string_view::npos && pos > 0) {
+      out->append(word.data(), pos);
+      out->push_back(' ');
+      out->append(rule.expansion);
+      out->append(word.data() + pos + suffix.size(),
+                  word.size() - pos - suffix.size());
+    } else {
+      out->append(word.data(), word.size());
+    }
+    i = end;
+  }
+}
+
+// Replaces every "i'm" with "i am".
+void ExpandIAm(const std::string& in, std::string* out) {
+  out->clear();
+  size_t i = 0;
+  while (i < in.size()) {
+    if (HasAt(in, i, "i'm")) {
+      out->append("i am");
+      i += 3;
+    } else {
+      out->push_back(in[i++]);
+    }
+  }
+}
 
-  string result(absl::AsciiStrToLower(absl::string_view(input.str, input.len)));
-  absl::StripAsciiWhitespace(&result);
-  // Do not remove commas, semi-colons or colons from the sentences as they can
-  // indicate the beginning of a new clause.
-  RE2::GlobalReplace(&result, kPunctuationsRegex, "");
-  RE2::GlobalReplace(&result, "\\s('t|'nt|n't|'d|'ll|'s|'m|'ve|'re)([\\s,;:/])",
-                     "\\1\\2");
-  RE2::GlobalReplace(&result, "\\s('t|'nt|n't|'d|'ll|'s|'m|'ve|'re)$", "\\1");
-  for (auto iter = kRegexTransforms->begin(); iter != kRegexTransforms->end();
-       iter++) {
-    RE2::GlobalReplace(&result, iter->first, iter->second);
+// Treats questions & interjections as special cases: repeated marks are
+// collapsed, a mark following other text is surrounded by spaces, and the
+// remaining adjacent marks are separated pairwise. Text ending with a byte
+// that is not part of a valid character does not count as text.
+void SeparateQuestionsAndInterjections(const std::string& in,
+                                       std::string* out) {
+  out->clear();
+  char prev = '\0';
+  // Number of marks kept so far in the current run of marks.
+  int marks_in_run = 0;
+  // Whether the current run of marks follows other text.
+  bool run_follows_text = false;
+  // Start of the next character, and whether the previous byte was part of a
+  // valid character.
+  size_t next_char = 0;
+  bool prev_valid = false;
+  for (size_t i = 0; i < in.size(); i++) {
+    const char c = in[i];
+    bool valid = true;
+    if (i >= next_char) {
+      const int len = Utf8CharLength(in, i);
+      valid = len > 0;
+      next_char = i + std::max(len, 1);
+    }
+    if (!IsQuestionOrInterjection(c)) {
+      out->push_back(c);
+      marks_in_run = 0;
+    } else if (c != prev) {
+      if (marks_in_run == 0) {
+        run_follows_text = i > 0 && prev_valid;
+      }
+      if (marks_in_run == 0 && run_follows_text) {
+        out->push_back(' ');
+        out->push_back(c);
+        out->push_back(' ');
+      } else {
+        const int pair_index = marks_in_run - (run_follows_text ? 1 : 0);
+        if (pair_index % 2 == 1) {
+          out->push_back(' ');
+        }
+        out->push_back(c);
+      }
+      marks_in_run++;
+    }
+    prev = c;
+    prev_valid = valid;
   }
+}
 
-  // Treat questions & interjections as special cases.
-  RE2::GlobalReplace(&result, "([?])+", "\\1");
-  RE2::GlobalReplace(&result, "([!])+", "\\1");
-  RE2::GlobalReplace(&result, "([^?!]+)([?!])", "\\1 \\2 ");
-  RE2::GlobalReplace(&result, "([?!])([?!])", "\\1 \\2");
+absl::string_view Normalizer::Normalize(absl::string_view input) {
+  LowerAndRemovePunctuation(input, &buffer_);
+  AttachContractions(buffer_, &scratch_);
+  buffer_.swap(scratch_);
+  for (const SuffixExpansion& rule : kSuffixExpansions) {
+    ExpandSuffix(buffer_, rule, &scratch_);
+    buffer_.swap(scratch_);
+  }
+  ExpandIAm(buffer_, &scratch_);
+  buffer_.swap(scratch_);
+  SeparateQuestionsAndInterjections(buffer_, &scratch_);
+  buffer_.swap(scratch_);
 
-  RE2::GlobalReplace(&result, "[\\s,:;\\-&'\"]+$", "");
-  RE2::GlobalReplace(&result, "^[\\s,:;\\-&'\"]+", "");
-  absl::StripAsciiWhitespace(&result);
+  // Trim trailing then leading separators, then any remaining whitespace.
+  absl::string_view result(buffer_);
+  size_t end = result.size();
+  while (end > 0 && IsEdgeCharacter(result[end - 1])) end--;
+  size_t begin = 0;
+  while (begin < end && IsEdgeCharacter(result[begin])) begin++;
+  result = absl::StripAsciiWhitespace(result.substr(begin, end - begin));
 
   // Add start and end token.
   // Truncate input to maximum allowed size.
+  scratch_.assign(kStartToken);
+  scratch_.push_back(' ');
   if (result.length() <= kMaxInputChars) {
-    absl::StrAppend(&result, " ", kEndToken);
+    scratch_.append(result.data(), result.size());
+    scratch_.push_back(' ');
+    scratch_.append(kEndToken);
   } else {
-    result = result.substr(0, kMaxInputChars);
+    scratch_.append(result.data(), kMaxInputChars);
   }
-  result = absl::StrCat(kStartToken, " ", result);
+  buffer_.swap(scratch_);
+  return buffer_;
+}
+
+void* Init(TfLiteContext* context, const char* buffer, size_t length) {
+  return new Normalizer;
+}
+
+void Free(TfLiteContext* context, void* buffer) {
+  delete reinterpret_cast<Normalizer*>(buffer);
+}
+
+TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
+  const TfLiteTensor* input_tensor = GetInput(context, node, 0);
+  TF_LITE_ENSURE(context, input_tensor != nullptr);
+  tflite::StringRef input = tflite::GetString(input_tensor, 0);
+
+  Normalizer* normalizer = reinterpret_cast<Normalizer*>(node->user_data);
+  absl::string_view result =
+      normalizer->Normalize(absl::string_view(input.str, input.len));
 
   tflite::DynamicBuffer buf;
   buf.AddString(result.data(), result.length());
@@ -101,7 +327,8 @@ TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
 }  // namespace normalize
 
 TfLiteRegistration* Register_NORMALIZE() {
-  static TfLiteRegistration r = {nullptr, nullptr, nullptr, normalize::Eval};
+  static TfLiteRegistration r = {normalize::Init, normalize::Free, nullptr,
+                                 normalize::Eval};
   return &r;
 }
 
@@ -0,0 +1,53 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_NORMALIZE_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_NORMALIZE_H_
+
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace tflite {
+namespace ops {
+namespace custom {
+namespace normalize {
+
+// Sentence normalizer used by the NORMALIZE op.
+//
+// Produces the same bytes as the original RE2 pipeline: lower-casing,
+// punctuation removal, contraction expansion, question/interjection spacing,
+// trimming, truncation to kMaxInputChars and "<S>"/"<E>" tokens. Each rewrite
+// is a hand-written linear scan, and the scans ping-pong between two buffers
+// owned by the normalizer, so steady-state calls do not allocate.
+//
+// A Normalizer is not thread-safe.
+class Normalizer {
+ public:
+  // Returns the normalized `input`. The view points into an internal buffer
+  // and is valid until the next call to Normalize().
+  absl::string_view Normalize(absl::string_view input);
+
+ private:
+  std::string buffer_;
+  std::string scratch_;
+};
+
+}  // namespace normalize
+}  // namespace custom
+}  // namespace ops
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_NORMALIZE_H_
@@ -13,9 +13,19 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include "cc/ops/normalize.h"
+
+#include <fstream>
+#include <map>
+#include <random>
 #include <vector>
 
 #include <gtest/gtest.h>
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "re2/re2.h"
 #include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/kernels/register.h"
 #include "tensorflow/lite/kernels/test_util.h"
@@ -31,6 +41,89 @@ TfLiteRegistration* Register_NORMALIZE();
 namespace {
 
 using ::testing::ElementsAreArray;
+using normalize::Normalizer;
+
+const char kSamples[] = "cc/testdata/smartreply_samples.tsv";  // NOLINT
+const int kNumFuzzInputs = 20000;
+
+// The RE2 pipeline NORMALIZE used before Normalizer, kept as the reference
+// implementation for differential testing.
+string RegexNormalize(const string& input) {
+  static const std::map<string, string>* kRegexTransforms =
+      new std::map<string, string>({
+          {"([^\\s]+)n't", "\\1 not"},
+          {"([^\\s]+)'nt", "\\1 not"},
+          {"([^\\s]+)'ll", "\\1 will"},
+          {"([^\\s]+)'re", "\\1 are"},
+          {"([^\\s]+)'ve", "\\1 have"},
+          {"i'm", "i am"},
+      });
+
+  string result(absl::AsciiStrToLower(input));
+  absl::StripAsciiWhitespace(&result);
+  RE2::GlobalReplace(&result, "[.*()\"]", "");
+  RE2::GlobalReplace(&result, "\\s('t|'nt|n't|'d|'ll|'s|'m|'ve|'re)([\\s,;:/])",
+                     "\\1\\2");
+  RE2::GlobalReplace(&result, "\\s('t|'nt|n't|'d|'ll|'s|'m|'ve|'re)$", "\\1");
+  for (auto iter = kRegexTransforms->begin(); iter != kRegexTransforms->end();
+       iter++) {
+    RE2::GlobalReplace(&result, iter->first, iter->second);
+  }
+  RE2::GlobalReplace(&result, "([?])+", "\\1");
+  RE2::GlobalReplace(&result, "([!])+", "\\1");
+  RE2::GlobalReplace(&result, "([^?!]+)([?!])", "\\1 \\2 ");
+  RE2::GlobalReplace(&result, "([?!])([?!])", "\\1 \\2");
+  RE2::GlobalReplace(&result, "[\\s,:;\\-&'\"]+$", "");
+  RE2::GlobalReplace(&result, "^[\\s,:;\\-&'\"]+", "");
+  absl::StripAsciiWhitespace(&result);
+  if (result.length() <= 300) {
+    absl::StrAppend(&result, " <E>");
+  } else {
+    result = result.substr(0, 300);
+  }
+  return absl::StrCat("<S> ", result);
+}
+
+// Returns every field of the sample file, messages and replies alike.
+std::vector<string> ReadSampleSentences() {
+  std::vector<string> sentences;
+  string line;
+  std::ifstream fin(kSamples);
+  while (std::getline(fin, line)) {
+    for (absl::string_view field : absl::StrSplit(line, '\t')) {
+      sentences.emplace_back(field);
+    }
+  }
+  return sentences;
+}
+
+// Random sentences built from the tokens the normalizer treats specially,
+// including bytes that are not valid UTF-8, as found in raw logs.
+std::vector<string> FuzzSentences(int count) {
+  static const char* const kPieces[] = {
+      " ",   "\t",  "\n",  "\v",  "\f",  "\r",  "'",   "t",   "n",   "d",
+      "l",   "s",   "m",   "v",   "e",   "r",   "i",   "I",   "N",   "?",
+      "!",   ".",   "*",   "(",   ")",   "\"",  ",",   ";",   ":",   "/",
+      "-",   "&",   "a",   "o",   "'ll", "n't", "'nt", "'re", "'ve", "i'm",
+      "'s",  "'m",  "'d",  "'t",  "LL",  "\xc3\xa9",
+      // A valid 3-byte character, then stray, truncated, overlong and
+      // out-of-range sequences.
+      "\xe2\x80\x99", "\xff", "\x80", "\xc3", "\xe2\x80", "\xc0\xaf",
+      "\xed\xa0\x80", "\xf5"};
+  const int num_pieces = sizeof(kPieces) / sizeof(kPieces[0]);
+  std::mt19937 rng(1234);
+  std::vector<string> sentences;
+  for (int i = 0; i < count; i++) {
+    // Some inputs exceed kMaxInputChars to cover truncation.
+    const int num_tokens = rng() % (i % 100 == 0 ? 200 : 16);
+    string sentence;
+    for (int j = 0; j < num_tokens; j++) {
+      sentence += kPieces[rng() % num_pieces];
+    }
+    sentences.push_back(sentence);
+  }
+  return sentences;
+}
 
 class NormalizeOpModel : public SingleOpModel {
  public:
@@ -72,12 +165,37 @@ TEST(NormalizeOpTest, OneInput) {
   EXPECT_THAT(m.GetStringOutput(), ElementsAreArray({"<S> hi ! <E>"}));
 }
 
+TEST(NormalizerTest, InvalidUtf8BreaksWords) {
+  Normalizer normalizer;
+  EXPECT_EQ(string(normalizer.Normalize("\xff'll")), "<S> \xff'll <E>");
+  EXPECT_EQ(string(normalizer.Normalize("x\xff?")), "<S> x\xff? <E>");
+  EXPECT_EQ(string(normalizer.Normalize("x\xffy?")), "<S> x\xffy ? <E>");
+}
+
 TEST(NormalizeOpTest, EmptyInput) {
   NormalizeOpModel m("");
   m.Invoke();
   EXPECT_THAT(m.GetStringOutput(), ElementsAreArray({"<S>  <E>"}));
 }
 
+TEST(NormalizerTest, MatchesRegexPipelineOnSamples) {
+  const std::vector<string> sentences = ReadSampleSentences();
+  ASSERT_FALSE(sentences.empty());
+  Normalizer normalizer;
+  for (const string& sentence : sentences) {
+    EXPECT_EQ(string(normalizer.Normalize(sentence)), RegexNormalize(sentence))
+        << "input: " << sentence;
+  }
+}
+
+TEST(NormalizerTest, MatchesRegexPipelineOnFuzzedInputs) {
+  Normalizer normalizer;
+  for (const string& sentence : FuzzSentences(kNumFuzzInputs)) {
+    EXPECT_EQ(string(normalizer.Normalize(sentence)), RegexNormalize(sentence))
+        << "input: " << sentence;
+  }
+}
+
 }  // namespace
 }  // namespace custom
 }  // namespace ops
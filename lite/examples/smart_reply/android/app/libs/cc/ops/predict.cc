@@ -19,21 +19,28 @@ limitations under the License.
 // Input:
 //     Input[0]: A list of hash signatures. int32[num of input]
 //     Input[1]: Hash signature keys in the model. int32[keys of model]
-//     Input[2]: Labels in the model. int32[keys of model, item per entry]
-//     Input[3]: Weights in the model. float[keys of model, item per entry]
+//     Input[2]: Labels in the model. int32 or int16
+//               [keys of model, item per entry]
+//     Input[3]: Weights in the model. float32, float16 or int8
+//               [keys of model, item per entry]
 //
 // Output:
 //     Output[0]: Predicted labels. int32[num of output]
 //     Output[1]: Predicted weights. float[num of output]
 //
+// Compact weight and label tables are decoded on the fly; their error bounds
+// are documented at MaxWeightError() in predict.h.
+//
+
+#include "cc/ops/predict.h"
 
 #include <algorithm>
 #include <cstdlib>
 #include <cstdio>
 #include <unordered_map>
-#include <vector>
 
 #include "tensorflow/lite/context.h"
+#include "tensorflow/lite/kernels/kernel_util.h"
 
 namespace tflite {
 namespace ops {
@@ -41,37 +48,262 @@ namespace custom {
 
 namespace predict {
 
-struct PredictOption {
-  int32_t num_output;
-  float weight_threshold;
+inline uint32_t HashKey(int32_t key) {
+  uint32_t h = static_cast<uint32_t>(key) * 0x9E3779B1u;
+  return h ^ (h >> 16);
+}
+
+// Returns the row of `key` in the model tables, or -1 if it is absent.
+inline int32_t FindRow(const OpData& data, int32_t key) {
+  uint32_t pos = HashKey(key) & data.key_index_mask;
+  while (true) {
+    const KeyEntry& entry = data.key_index[pos];
+    if (entry.row < 0) return -1;
+    if (entry.key == key) return entry.row;
+    pos = (pos + 1) & data.key_index_mask;
+  }
+}
+
+void BuildIndex(const TfLiteTensor* model_key, const TfLiteTensor* model_label,
+                OpData* data) {
+  const int num_rows = model_key->dims->data[0];
+  const int items = model_label->dims->data[1];
 
-  static PredictOption* Cast(void* ptr) {
-    return reinterpret_cast<PredictOption*>(ptr);
+  uint32_t capacity = 2;
+  while (capacity < 2 * static_cast<uint32_t>(num_rows)) capacity <<= 1;
+  data->key_index.assign(capacity, KeyEntry{0, -1});
+  data->key_index_mask = capacity - 1;
+  for (int row = 0; row < num_rows; row++) {
+    const int32_t key = model_key->data.i32[row];
+    uint32_t pos = HashKey(key) & data->key_index_mask;
+    while (data->key_index[pos].row >= 0 && data->key_index[pos].key != key) {
+      pos = (pos + 1) & data->key_index_mask;
+    }
+    // Keep the first row of duplicated keys, as a lower bound search would.
+    if (data->key_index[pos].row < 0) {
+      data->key_index[pos] = KeyEntry{key, row};
+    }
   }
-};
 
-bool WeightGreater(const std::pair<int32_t, float>& a,
-                   const std::pair<int32_t, float>& b) {
-  return a.second > b.second;
+  std::unordered_map<int32_t, int32_t> label_to_slot;
+  data->label_slots.resize(num_rows * items);
+  data->slot_labels.clear();
+  for (int i = 0; i < num_rows * items; i++) {
+    const int32_t label = model_label->type == kTfLiteInt16
+                              ? model_label->data.i16[i]
+                              : model_label->data.i32[i];
+    auto inserted = label_to_slot.emplace(label, data->slot_labels.size());
+    if (inserted.second) {
+      data->slot_labels.push_back(label);
+    }
+    data->label_slots[i] = inserted.first->second;
+  }
+
+  data->slot_weights.assign(data->slot_labels.size(), 0.0f);
+  data->slot_touched.assign(data->slot_labels.size(), false);
+  data->touched_slots.clear();
+  data->touched_slots.reserve(data->slot_labels.size());
+}
+
+// Aggregates the weights of matched rows by label. `find_row` returns the row
+// of a key or -1, `slot_at` the slot of a label table entry and `weight_at`
+// the float value of a weight table entry.
+template <typename FindRowFn, typename SlotAt, typename WeightAt>
+void Aggregate(const int32_t* lookup, int num_input, int items,
+               FindRowFn find_row, SlotAt slot_at, WeightAt weight_at,
+               OpData* data) {
+  // Only slots of matched rows are visited, so the cost depends on the number
+  // of hits rather than on the model size.
+  std::vector<int32_t>& touched = data->touched_slots;
+  for (int i = 0; i < num_input; i++) {
+    const int32_t row = find_row(lookup[i]);
+    if (row < 0) continue;
+    for (int j = 0; j < items; j++) {
+      const int idx = row * items + j;
+      const int32_t slot = slot_at(idx);
+      if (!data->slot_touched[slot]) {
+        data->slot_touched[slot] = true;
+        touched.push_back(slot);
+      }
+      data->slot_weights[slot] += weight_at(idx) / num_input;
+    }
+  }
+}
+
+// Dispatches Aggregate on the storage type of `model_weight`.
+template <typename FindRowFn, typename SlotAt>
+void AggregateWeights(const int32_t* lookup, int num_input,
+                      const WeightTable& model_weight, int items,
+                      FindRowFn find_row, SlotAt slot_at, OpData* data) {
+  switch (model_weight.type) {
+    case kTfLiteFloat16: {
+      const uint16_t* weights =
+          static_cast<const uint16_t*>(model_weight.data);
+      Aggregate(
+          lookup, num_input, items, find_row, slot_at,
+          [weights](int idx) { return HalfToFloat(weights[idx]); }, data);
+      break;
+    }
+    case kTfLiteInt8: {
+      const int8_t* weights = static_cast<const int8_t*>(model_weight.data);
+      const float scale = model_weight.scale;
+      const int32_t zero_point = model_weight.zero_point;
+      Aggregate(
+          lookup, num_input, items, find_row, slot_at,
+          [weights, scale, zero_point](int idx) {
+            return scale * (weights[idx] - zero_point);
+          },
+          data);
+      break;
+    }
+    default: {
+      const float* weights = static_cast<const float*>(model_weight.data);
+      Aggregate(
+          lookup, num_input, items, find_row, slot_at,
+          [weights](int idx) { return weights[idx]; }, data);
+      break;
+    }
+  }
+}
+
+// Writes the `num_output` top weighted slots aggregated by Aggregate to
+// `output_label`/`output_weight`, and resets the scratch for the next call.
+void SelectTopLabels(int num_output, OpData* data, int32_t* output_label,
+                     float* output_weight) {
+  std::vector<int32_t>& touched = data->touched_slots;
+  // Select the top weighted labels. Ties are broken by label for a
+  // deterministic output.
+  const int num_selected = std::min<int>(num_output, touched.size());
+  std::partial_sort(touched.begin(), touched.begin() + num_selected,
+                    touched.end(), [data](int32_t a, int32_t b) {
+                      const float weight_a = data->slot_weights[a];
+                      const float weight_b = data->slot_weights[b];
+                      if (weight_a != weight_b) return weight_a > weight_b;
+                      return data->slot_labels[a] < data->slot_labels[b];
+                    });
+
+  for (int i = 0; i < num_output; i++) {
+    if (i >= num_selected ||
+        data->slot_weights[touched[i]] < data->option.weight_threshold) {
+      // Set -1 to avoid lookup message with id 0, which is set for backoff.
+      output_label[i] = -1;
+      output_weight[i] = 0.0f;
+    } else {
+      output_label[i] = data->slot_labels[touched[i]];
+      output_weight[i] = data->slot_weights[touched[i]];
+    }
+  }
+
+  for (int32_t slot : touched) {
+    data->slot_weights[slot] = 0.0f;
+    data->slot_touched[slot] = false;
+  }
+  touched.clear();
+}
+
+WeightTable GetWeightTable(const TfLiteTensor* model_weight) {
+  WeightTable table;
+  table.type = model_weight->type;
+  table.data = model_weight->data.raw_const;
+  table.scale = model_weight->params.scale;
+  table.zero_point = model_weight->params.zero_point;
+  return table;
+}
+
+void Predict(const int32_t* lookup, int num_input,
+             const WeightTable& model_weight, int items, int num_output,
+             OpData* data, int32_t* output_label, float* output_weight) {
+  AggregateWeights(
+      lookup, num_input, model_weight, items,
+      [data](int32_t key) { return FindRow(*data, key); },
+      [data](int idx) { return data->label_slots[idx]; }, data);
+  SelectTopLabels(num_output, data, output_label, output_weight);
+}
+
+void PredictUnindexed(const int32_t* lookup, int num_input,
+                      const TfLiteTensor* model_key,
+                      const TfLiteTensor* model_label,
+                      const WeightTable& model_weight, int num_output,
+                      OpData* data, int32_t* output_label,
+                      float* output_weight) {
+  const int32_t* keys_begin = model_key->data.i32;
+  const int32_t* keys_end = keys_begin + model_key->dims->data[0];
+  auto find_row = [keys_begin, keys_end](int32_t key) -> int32_t {
+    const int32_t* it = std::lower_bound(keys_begin, keys_end, key);
+    return it != keys_end && *it == key ? it - keys_begin : -1;
+  };
+  // Only the labels of matched rows get a slot.
+  auto slot_at = [model_label, data](int idx) {
+    const int32_t label = model_label->type == kTfLiteInt16
+                              ? model_label->data.i16[idx]
+                              : model_label->data.i32[idx];
+    auto inserted =
+        data->label_to_slot.emplace(label, data->slot_labels.size());
+    if (inserted.second) {
+      data->slot_labels.push_back(label);
+      data->slot_weights.push_back(0.0f);
+      data->slot_touched.push_back(false);
+    }
+    return inserted.first->second;
+  };
+  AggregateWeights(lookup, num_input, model_weight,
+                   model_label->dims->data[1], find_row, slot_at, data);
+  SelectTopLabels(num_output, data, output_label, output_weight);
+
+  // The slots are only valid for this call.
+  data->label_to_slot.clear();
+  data->slot_labels.clear();
+  data->slot_weights.clear();
+  data->slot_touched.clear();
+}
+
+TfLiteStatus CheckModelTensors(TfLiteContext* context,
+                               const TfLiteTensor* model_key,
+                               const TfLiteTensor* model_label,
+                               const TfLiteTensor* model_weight) {
+  TF_LITE_ENSURE_EQ(context, model_key->type, kTfLiteInt32);
+  TF_LITE_ENSURE(context, model_label->type == kTfLiteInt32 ||
+                              model_label->type == kTfLiteInt16);
+  TF_LITE_ENSURE(context, model_weight->type == kTfLiteFloat32 ||
+                              model_weight->type == kTfLiteFloat16 ||
+                              model_weight->type == kTfLiteInt8);
+  if (model_weight->type == kTfLiteInt8) {
+    TF_LITE_ENSURE(context, model_weight->params.scale > 0.0f);
+  }
+  TF_LITE_ENSURE_EQ(context, model_key->dims->size, 1);
+  TF_LITE_ENSURE_EQ(context, model_label->dims->size, 2);
+  TF_LITE_ENSURE_EQ(context, model_weight->dims->size, 2);
+  TF_LITE_ENSURE_EQ(context, model_key->dims->data[0],
+                    model_label->dims->data[0]);
+  TF_LITE_ENSURE_EQ(context, model_key->dims->data[0],
+                    model_weight->dims->data[0]);
+  TF_LITE_ENSURE_EQ(context, model_label->dims->data[1],
+                    model_weight->dims->data[1]);
+  return kTfLiteOk;
+}
+
+bool ParseOption(const char* buffer, size_t length, PredictOption* option) {
+  if (buffer == nullptr || length != sizeof(PredictOption)) {
+    return false;
+  }
+  int offset = 0;
+  option->num_output = *reinterpret_cast<const int32_t*>(buffer + offset);
+  offset += sizeof(int32_t);
+  option->weight_threshold = *reinterpret_cast<const float*>(buffer + offset);
+  return true;
 }
 
 void* Init(TfLiteContext* context, const char* custom_option, size_t length) {
-  if (custom_option == nullptr || length != sizeof(PredictOption)) {
+  OpData* data = new OpData;
+  if (!ParseOption(custom_option, length, &data->option)) {
     fprintf(stderr, "No Custom option set\n");
     exit(1);
   }
-  PredictOption* option = new PredictOption;
-  int offset = 0;
-  option->num_output =
-      *reinterpret_cast<const int32_t*>(custom_option + offset);
-  offset += sizeof(int32_t);
-  option->weight_threshold =
-      *reinterpret_cast<const float*>(custom_option + offset);
-  return reinterpret_cast<void*>(option);
+  return reinterpret_cast<void*>(data);
 }
 
 void Free(TfLiteContext* context, void* buffer) {
-  delete PredictOption::Cast(buffer);
+  delete OpData::Cast(buffer);
 }
 
 TfLiteStatus Prepare(TfLiteContext* context, TfLiteNode* node) {
@@ -83,30 +315,28 @@ TfLiteStatus Prepare(TfLiteContext* context, TfLiteNode* node) {
   TfLiteTensor* model_label = &context->tensors[node->inputs->data[2]];
   TfLiteTensor* model_weight = &context->tensors[node->inputs->data[3]];
   TF_LITE_ENSURE_EQ(context, lookup->type, kTfLiteInt32);
-  TF_LITE_ENSURE_EQ(context, model_key->type, kTfLiteInt32);
-  TF_LITE_ENSURE_EQ(context, model_label->type, kTfLiteInt32);
-  TF_LITE_ENSURE_EQ(context, model_weight->type, kTfLiteFloat32);
   TF_LITE_ENSURE_EQ(context, lookup->dims->size, 1);
-  TF_LITE_ENSURE_EQ(context, model_key->dims->size, 1);
-  TF_LITE_ENSURE_EQ(context, model_label->dims->size, 2);
-  TF_LITE_ENSURE_EQ(context, model_weight->dims->size, 2);
-  TF_LITE_ENSURE_EQ(context, model_key->dims->data[0],
-                    model_label->dims->data[0]);
-  TF_LITE_ENSURE_EQ(context, model_key->dims->data[0],
-                    model_weight->dims->data[0]);
-  TF_LITE_ENSURE_EQ(context, model_label->dims->data[1],
-                    model_weight->dims->data[1]);
+  TF_LITE_ENSURE_OK(context, CheckModelTensors(context, model_key, model_label,
+                                               model_weight));
 
-  PredictOption* option = PredictOption::Cast(node->user_data);
+  OpData* data = OpData::Cast(node->user_data);
   TfLiteTensor* output_label = &context->tensors[node->outputs->data[0]];
   TfLiteTensor* output_weight = &context->tensors[node->outputs->data[1]];
   TF_LITE_ENSURE_EQ(context, output_label->type, kTfLiteInt32);
   TF_LITE_ENSURE_EQ(context, output_weight->type, kTfLiteFloat32);
 
+  // Keys and labels are constant in a converted model, so index them once.
+  // Prepare runs again on every AllocateTensors(), hence the flag.
+  if (!data->has_constant_index && IsConstantTensor(model_key) &&
+      IsConstantTensor(model_label)) {
+    BuildIndex(model_key, model_label, data);
+    data->has_constant_index = true;
+  }
+
   TfLiteIntArray* label_size = TfLiteIntArrayCreate(1);
-  label_size->data[0] = option->num_output;
+  label_size->data[0] = data->option.num_output;
   TfLiteIntArray* weight_size = TfLiteIntArrayCreate(1);
-  weight_size->data[0] = option->num_output;
+  weight_size->data[0] = data->option.num_output;
   TfLiteStatus status =
       context->ResizeTensor(context, output_label, label_size);
   if (status != kTfLiteOk) {
@@ -121,45 +351,20 @@ TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
   TfLiteTensor* model_label = &context->tensors[node->inputs->data[2]];
   TfLiteTensor* model_weight = &context->tensors[node->inputs->data[3]];
 
-  // Aggregate by key
-  std::unordered_map<int32_t, float> aggregation;
-  const int num_input = lookup->dims->data[0];
-  const int num_rows = model_key->dims->data[0];
-  const int items = model_label->dims->data[1];
-  int* model_key_end = model_key->data.i32 + num_rows;
-
-  for (int i = 0; i < num_input; i++) {
-    int* ptr = std::lower_bound(model_key->data.i32, model_key_end,
-                                lookup->data.i32[i]);
-    if (ptr != nullptr && ptr != model_key_end && *ptr == lookup->data.i32[i]) {
-      int idx = ptr - model_key->data.i32;
-      for (int j = 0; j < items; j++) {
-        aggregation[model_label->data.i32[idx * items + j]] +=
-            model_weight->data.f[idx * items + j] / num_input;
-      }
-    }
-  }
-
-  // Sort by value
-  std::vector<std::pair<int32_t, float>> sorted_labels(aggregation.begin(),
-                                                       aggregation.end());
-  std::sort(sorted_labels.begin(), sorted_labels.end(), WeightGreater);
-
-  PredictOption* option = PredictOption::Cast(node->user_data);
+  OpData* data = OpData::Cast(node->user_data);
   TfLiteTensor* output_label = &context->tensors[node->outputs->data[0]];
   TfLiteTensor* output_weight = &context->tensors[node->outputs->data[1]];
-  for (int i = 0; i < output_label->dims->data[0]; i++) {
-    if (i >= sorted_labels.size() ||
-        sorted_labels[i].second < option->weight_threshold) {
-      // Set -1 to avoid lookup message with id 0, which is set for backoff.
-      output_label->data.i32[i] = -1;
-      output_weight->data.f[i] = 0.0f;
-    } else {
-      output_label->data.i32[i] = sorted_labels[i].first;
-      output_weight->data.f[i] = sorted_labels[i].second;
-    }
+  if (data->has_constant_index) {
+    Predict(lookup->data.i32, lookup->dims->data[0],
+            GetWeightTable(model_weight), model_label->dims->data[1],
+            output_label->dims->data[0], data, output_label->data.i32,
+            output_weight->data.f);
+  } else {
+    PredictUnindexed(lookup->data.i32, lookup->dims->data[0], model_key,
+                     model_label, GetWeightTable(model_weight),
+                     output_label->dims->data[0], data,
+                     output_label->data.i32, output_weight->data.f);
   }
-
   return kTfLiteOk;
 }
 
@@ -0,0 +1,175 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_PREDICT_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_PREDICT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "tensorflow/lite/context.h"
+
+namespace tflite {
+namespace ops {
+namespace custom {
+namespace predict {
+
+struct PredictOption {
+  int32_t num_output;
+  float weight_threshold;
+};
+
+// Open-addressing entry mapping a model key to its row in the model tables.
+struct KeyEntry {
+  int32_t key;
+  // Row of `key` in the model tables, or -1 if the entry is empty.
+  int32_t row;
+};
+
+// Model weight table in one of the supported storage types. int8 weights are
+// dequantized as scale * (q - zero_point).
+struct WeightTable {
+  // kTfLiteFloat32, kTfLiteFloat16 or kTfLiteInt8.
+  TfLiteType type;
+  const void* data;
+  float scale;
+  int32_t zero_point;
+};
+
+// Compact weight tables trade precision for size. Each output weight is the
+// mean of at most num of input table entries, so its error is bounded by the
+// per-entry error returned here, for a float32 table whose largest absolute
+// weight is `max_abs_weight`:
+//   - int8 weights are dequantized as scale * (q - zero_point). Rounding to
+//     the nearest step errs by at most scale / 2; with the symmetric scale
+//     max|w| / 127 written by quantize_predict_weights, that is max|w| / 254.
+//   - float16 weights err by at most 2^-11 relative to the weight, i.e.
+//     max|w| / 2048.
+//   - float32 weights are exact.
+// Labels that may be ties after quantization can swap places in the output.
+// int16 labels are exact.
+inline float MaxWeightError(TfLiteType type, float max_abs_weight) {
+  switch (type) {
+    case kTfLiteInt8:
+      return max_abs_weight / 254;
+    case kTfLiteFloat16:
+      return max_abs_weight / 2048;
+    default:
+      return 0.0f;
+  }
+}
+
+// Converts an IEEE half precision value to float.
+inline float HalfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // Subnormal half, normal float.
+    exponent = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Per-node state kept in user_data.
+struct OpData {
+  PredictOption option;
+
+  // True once the index below was built from constant model tensors. When the
+  // model tensors are not constant, Eval does not index them: keys are found
+  // by binary search and labels get slots as they are matched, per call (see
+  // PredictUnindexed).
+  bool has_constant_index = false;
+  // Linear-probing hash table over the model keys. Its size is a power of two
+  // at least twice the number of keys.
+  std::vector<KeyEntry> key_index;
+  uint32_t key_index_mask = 0;
+  // Labels are remapped to dense slots so that aggregation is a flat array
+  // indexed by slot. label_slots has the shape of the label table,
+  // slot_labels maps a slot back to its label.
+  std::vector<int32_t> label_slots;
+  std::vector<int32_t> slot_labels;
+  // Label to slot map of the matched labels, only used by PredictUnindexed.
+  std::unordered_map<int32_t, int32_t> label_to_slot;
+
+  // Reusable aggregation scratch, one entry per slot. Every entry is zero
+  // outside of Eval; `touched_slots` lists the slots written by the current
+  // Eval.
+  std::vector<float> slot_weights;
+  std::vector<bool> slot_touched;
+  std::vector<int32_t> touched_slots;
+
+  static OpData* Cast(void* ptr) { return reinterpret_cast<OpData*>(ptr); }
+};
+
+// Parses the PREDICT custom options. Returns false if they are malformed.
+bool ParseOption(const char* buffer, size_t length, PredictOption* option);
+
+// Checks the types and shapes of the model tables: int32 keys, int32 or int16
+// labels, and float32, float16 or int8 weights. int8 weights need a positive
+// scale.
+TfLiteStatus CheckModelTensors(TfLiteContext* context,
+                               const TfLiteTensor* model_key,
+                               const TfLiteTensor* model_label,
+                               const TfLiteTensor* model_weight);
+
+// Returns the weight table backed by `model_weight`.
+WeightTable GetWeightTable(const TfLiteTensor* model_weight);
+
+// Indexes the model keys and labels into `data`.
+void BuildIndex(const TfLiteTensor* model_key, const TfLiteTensor* model_label,
+                OpData* data);
+
+// Aggregates the model weights of the `num_input` hash signatures in `lookup`
+// by label, and writes the `num_output` top weighted labels to
+// `output_label`/`output_weight`. The index in `data` must be built.
+void Predict(const int32_t* lookup, int num_input,
+             const WeightTable& model_weight, int items, int num_output,
+             OpData* data, int32_t* output_label, float* output_weight);
+
+// Same as Predict, on model tables that are not indexed in `data`. Keys are
+// found with a binary search of `model_key`, which must be sorted; duplicated
+// keys match their first row, as with the index. This avoids indexing every
+// model key on each call when the tables are not constant.
+void PredictUnindexed(const int32_t* lookup, int num_input,
+                      const TfLiteTensor* model_key,
+                      const TfLiteTensor* model_label,
+                      const WeightTable& model_weight, int num_output,
+                      OpData* data, int32_t* output_label,
+                      float* output_weight);
+
+}  // namespace predict
+}  // namespace custom
+}  // namespace ops
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_PREDICT_H_
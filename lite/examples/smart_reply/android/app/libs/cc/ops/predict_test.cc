@@ -13,9 +13,15 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
 #include <vector>
 
 #include <gtest/gtest.h>
+#include "cc/ops/predict.h"
 #include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/kernels/register.h"
 #include "tensorflow/lite/kernels/test_util.h"
@@ -74,7 +80,7 @@ class PredictOpModel : public SingleOpModel {
     return ExtractVector<float>(output_weight_);
   }
 
-  void writeFloat32(float value, std::vector<uint8_t>* data) {
+  static void writeFloat32(float value, std::vector<uint8_t>* data) {
     union {
       float v;
       uint8_t r[4];
@@ -85,7 +91,7 @@ class PredictOpModel : public SingleOpModel {
     }
   }
 
-  void writeInt32(int32_t value, std::vector<uint8_t>* data) {
+  static void writeInt32(int32_t value, std::vector<uint8_t>* data) {
     union {
       int32_t v;
       uint8_t r[4];
@@ -105,6 +111,254 @@ class PredictOpModel : public SingleOpModel {
   int output_weight_;
 };
 
+// Same op with constant model tensors, as in a converted model. Keys and labels
+// are then indexed once at Prepare time.
+class ConstPredictOpModel : public SingleOpModel {
+ public:
+  ConstPredictOpModel(std::initializer_list<int> input_signature,
+                      std::initializer_list<int> model_key,
+                      std::initializer_list<int> model_label,
+                      std::initializer_list<float> model_weight,
+                      std::initializer_list<int> labelweight_shape,
+                      int num_output, float threshold) {
+    AddConstInput(
+        {TensorType_INT32, {static_cast<int>(input_signature.size())}},
+        input_signature);
+    AddConstInput({TensorType_INT32, {static_cast<int>(model_key.size())}},
+                  model_key);
+    AddConstInput({TensorType_INT32, labelweight_shape}, model_label);
+    AddConstInput({TensorType_FLOAT32, labelweight_shape}, model_weight);
+    output_label_ = AddOutput(TensorType_INT32);
+    output_weight_ = AddOutput(TensorType_FLOAT32);
+
+    std::vector<uint8_t> predict_option;
+    PredictOpModel::writeInt32(num_output, &predict_option);
+    PredictOpModel::writeFloat32(threshold, &predict_option);
+    SetCustomOp("Predict", predict_option, Register_PREDICT);
+    BuildInterpreter({});
+  }
+
+  std::vector<int> GetLabel() { return ExtractVector<int>(output_label_); }
+  std::vector<float> GetWeight() {
+    return ExtractVector<float>(output_weight_);
+  }
+
+ private:
+  int output_label_;
+  int output_weight_;
+};
+
+// Op over a random model, with label and weight tables in any of the supported
+// storage types.
+class CompactPredictOpModel : public SingleOpModel {
+ public:
+  CompactPredictOpModel(int num_input, int num_rows, int items,
+                        TensorType label_type, const TensorData& weight,
+                        int num_output)
+      : label_type_(label_type) {
+    input_signature_ = AddInput(TensorType_INT32);
+    model_key_ = AddInput(TensorType_INT32);
+    model_label_ = AddInput(label_type);
+    model_weight_ = AddInput(weight);
+    output_label_ = AddOutput(TensorType_INT32);
+    output_weight_ = AddOutput(TensorType_FLOAT32);
+
+    std::vector<uint8_t> predict_option;
+    PredictOpModel::writeInt32(num_output, &predict_option);
+    PredictOpModel::writeFloat32(0.0f, &predict_option);
+    SetCustomOp("Predict", predict_option, Register_PREDICT);
+    BuildInterpreter(
+        {{num_input}, {num_rows}, {num_rows, items}, {num_rows, items}});
+  }
+
+  void SetInputSignature(const std::vector<int32_t>& data) {
+    SetRaw(input_signature_, data);
+  }
+  void SetModelKey(const std::vector<int32_t>& data) {
+    SetRaw(model_key_, data);
+  }
+  void SetModelLabel(const std::vector<int32_t>& data) {
+    if (label_type_ == TensorType_INT16) {
+      SetRaw(model_label_, std::vector<int16_t>(data.begin(), data.end()));
+    } else {
+      SetRaw(model_label_, data);
+    }
+  }
+  template <typename T>
+  void SetModelWeight(const std::vector<T>& data) {
+    SetRaw(model_weight_, data);
+  }
+
+  std::vector<int> GetLabel() { return ExtractVector<int>(output_label_); }
+  std::vector<float> GetWeight() {
+    return ExtractVector<float>(output_weight_);
+  }
+
+ private:
+  template <typename T>
+  void SetRaw(int index, const std::vector<T>& data) {
+    TfLiteTensor* tensor = interpreter_->tensor(index);
+    ASSERT_EQ(tensor->bytes, data.size() * sizeof(T));
+    memcpy(tensor->data.raw, data.data(), tensor->bytes);
+  }
+
+  TensorType label_type_;
+  int input_signature_;
+  int model_key_;
+  int model_label_;
+  int model_weight_;
+  int output_label_;
+  int output_weight_;
+};
+
+const int kNumInput = 64;
+const int kNumRows = 500;
+const int kItems = 4;
+const int kNumOutput = 8;
+
+// Random model whose weights are multiples of 1/64 in [0, 2), which int8 with
+// scale 1/64 and float16 both represent exactly.
+struct RandomModel {
+  std::vector<int32_t> lookup;
+  std::vector<int32_t> keys;
+  std::vector<int32_t> labels;
+  std::vector<int> steps;
+
+  RandomModel() {
+    std::mt19937 rng(42);
+    for (int i = 0; i < kNumRows; i++) {
+      keys.push_back(i * 7);
+    }
+    std::uniform_int_distribution<int> key_dist(0, kNumRows * 7 * 2);
+    for (int i = 0; i < kNumInput; i++) {
+      lookup.push_back(key_dist(rng));
+    }
+    std::uniform_int_distribution<int> label_dist(-300, 300);
+    std::uniform_int_distribution<int> step_dist(0, 127);
+    for (int i = 0; i < kNumRows * kItems; i++) {
+      labels.push_back(label_dist(rng));
+      steps.push_back(step_dist(rng));
+    }
+  }
+
+  std::vector<float> Weights() const {
+    std::vector<float> weights;
+    for (int step : steps) {
+      weights.push_back(step / 64.0f);
+    }
+    return weights;
+  }
+
+  template <typename Model>
+  void Populate(Model* m) const {
+    m->SetInputSignature(lookup);
+    m->SetModelKey(keys);
+    m->SetModelLabel(labels);
+  }
+};
+
+// Runs the op over `model` with float32 weights and int32 labels.
+void RunFloatReference(const RandomModel& model, std::vector<int>* labels,
+                       std::vector<float>* weights) {
+  CompactPredictOpModel m(kNumInput, kNumRows, kItems, TensorType_INT32,
+                          {TensorType_FLOAT32, {}}, kNumOutput);
+  model.Populate(&m);
+  m.SetModelWeight(model.Weights());
+  m.Invoke();
+  *labels = m.GetLabel();
+  *weights = m.GetWeight();
+}
+
+TEST(PredictOpTest, CompactTablesAreExactWhenRepresentable) {
+  const RandomModel model;
+  std::vector<int> expected_labels;
+  std::vector<float> expected_weights;
+  RunFloatReference(model, &expected_labels, &expected_weights);
+  ASSERT_NE(expected_labels[0], -1);
+
+  CompactPredictOpModel int16_labels(kNumInput, kNumRows, kItems,
+                                     TensorType_INT16, {TensorType_FLOAT32, {}},
+                                     kNumOutput);
+  model.Populate(&int16_labels);
+  int16_labels.SetModelWeight(model.Weights());
+  int16_labels.Invoke();
+  EXPECT_EQ(int16_labels.GetLabel(), expected_labels);
+  EXPECT_EQ(int16_labels.GetWeight(), expected_weights);
+
+  CompactPredictOpModel int8_weights(
+      kNumInput, kNumRows, kItems, TensorType_INT16,
+      {TensorType_INT8, {}, 0.0f, 0.0f, 1.0f / 64, 0}, kNumOutput);
+  model.Populate(&int8_weights);
+  int8_weights.SetModelWeight(
+      std::vector<int8_t>(model.steps.begin(), model.steps.end()));
+  int8_weights.Invoke();
+  EXPECT_EQ(int8_weights.GetLabel(), expected_labels);
+  EXPECT_EQ(int8_weights.GetWeight(), expected_weights);
+
+  // n / 64 in half precision, for n < 128.
+  std::vector<uint16_t> halves;
+  for (int step : model.steps) {
+    if (step == 0) {
+      halves.push_back(0);
+      continue;
+    }
+    int exponent = 0;
+    while ((step << exponent) < 64) exponent++;
+    // step * 2^exponent is in [64, 128), so step / 64 = 1.m * 2^-exponent.
+    const int mantissa = ((step << exponent) - 64) << 4;
+    halves.push_back(((15 - exponent) << 10) | mantissa);
+  }
+  CompactPredictOpModel float16_weights(kNumInput, kNumRows, kItems,
+                                        TensorType_INT32,
+                                        {TensorType_FLOAT16, {}}, kNumOutput);
+  model.Populate(&float16_weights);
+  float16_weights.SetModelWeight(halves);
+  float16_weights.Invoke();
+  EXPECT_EQ(float16_weights.GetLabel(), expected_labels);
+  EXPECT_EQ(float16_weights.GetWeight(), expected_weights);
+}
+
+TEST(PredictOpTest, Int8WeightsAreWithinTolerance) {
+  // Weights off the int8 grid.
+  RandomModel model;
+  std::vector<float> weights = model.Weights();
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> jitter(0.0f, 1.0f / 64);
+  for (float& weight : weights) {
+    weight += jitter(rng);
+  }
+  const float max_weight = *std::max_element(weights.begin(), weights.end());
+  const float scale = max_weight / 127;
+
+  CompactPredictOpModel reference(kNumInput, kNumRows, kItems,
+                                  TensorType_INT32, {TensorType_FLOAT32, {}},
+                                  kNumOutput);
+  model.Populate(&reference);
+  reference.SetModelWeight(weights);
+  reference.Invoke();
+
+  std::vector<int8_t> quantized;
+  for (float weight : weights) {
+    quantized.push_back(std::round(weight / scale));
+  }
+  CompactPredictOpModel m(kNumInput, kNumRows, kItems, TensorType_INT32,
+                          {TensorType_INT8, {}, 0.0f, 0.0f, scale, 0},
+                          kNumOutput);
+  model.Populate(&m);
+  m.SetModelWeight(quantized);
+  m.Invoke();
+
+  // Every aggregated weight moves by at most the documented bound, and so
+  // does the k-th largest one.
+  const std::vector<float> expected = reference.GetWeight();
+  const std::vector<float> actual = m.GetWeight();
+  ASSERT_EQ(actual.size(), expected.size());
+  for (int i = 0; i < expected.size(); i++) {
+    EXPECT_NEAR(actual[i], expected[i],
+                predict::MaxWeightError(kTfLiteInt8, max_weight) * 1.001f);
+  }
+}
+
 TEST(PredictOpTest, AllLabelsAreValid) {
   PredictOpModel m({4}, {5}, {5, 2}, 2, 0.0001);
   m.SetInputSignature({1, 3, 7, 9});
@@ -171,6 +425,18 @@ TEST(PredictOpTest, NoLabelGenerated) {
   EXPECT_THAT(m.GetWeight(), ElementsAreArray(ArrayFloatNear({0, 0})));
 }
 
+TEST(PredictOpTest, ConstantModelIsIndexedAtPrepare) {
+  ConstPredictOpModel m({1, 3, 7, 9}, {1, 2, 4, 6, 7},
+                        {11, 12, 11, 12, 11, 12, 11, 12, 11, 12},
+                        {0.1, 0.2, 0.1, 0.2, 0.1, 0.2, 0.1, 0.2, 0.1, 0.2},
+                        {5, 2}, 3, 0.0001);
+  // Invoke twice to check that the aggregation scratch is reset.
+  m.Invoke();
+  m.Invoke();
+  EXPECT_THAT(m.GetLabel(), ElementsAreArray({12, 11, -1}));
+  EXPECT_THAT(m.GetWeight(), ElementsAreArray(ArrayFloatNear({0.1, 0.05, 0})));
+}
+
 }  // namespace
 }  // namespace custom
 }  // namespace ops
@@ -0,0 +1,434 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Fused SmartReply kernel: NORMALIZE, SKIP_GRAM, EXTRACT_FEATURES and PREDICT
+// in one pass.
+//
+// Input:
+//     Input[0]: Sentence to normalize. string[1]
+//     Plus the model keys, labels and weights of PREDICT.
+//
+// Output:
+//     The predicted labels and weights of PREDICT.
+//
+// Every stage reuses the code of the corresponding op, and the skip-grams are
+// enumerated in the order SKIP_GRAM writes them, so the PREDICT accumulation
+// runs over the same values in the same order as the unfused graph.
+
+#include "cc/ops/smartreply_fused.h"
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "cc/ops/extract_feature.h"
+#include "cc/ops/normalize.h"
+#include "cc/ops/predict.h"
+#include "tensorflow/lite/builtin_ops.h"
+#include "tensorflow/lite/c/builtin_op_data.h"
+#include "tensorflow/lite/kernels/kernel_util.h"
+#include "tensorflow/lite/string_util.h"
+
+namespace tflite {
+namespace ops {
+namespace custom {
+
+TfLiteRegistration* Register_NORMALIZE();
+TfLiteRegistration* Register_EXTRACT_FEATURES();
+TfLiteRegistration* Register_PREDICT();
+
+namespace fused {
+
+// One NORMALIZE -> SKIP_GRAM -> EXTRACT_FEATURES -> PREDICT chain.
+struct Chain {
+  int normalize_node;
+  int skip_gram_node;
+  int extract_node;
+  int predict_node;
+
+  // Tensors read and written by the fused kernel.
+  int input;
+  int model_key;
+  int model_label;
+  int model_weight;
+  int output_label;
+  int output_weight;
+
+  TfLiteSkipGramParams skip_gram;
+  predict::OpData predict;
+};
+
+// Per-node state kept in user_data.
+struct OpData {
+  std::vector<Chain> chains;
+  // False if the replaced nodes are not made of whole chains.
+  bool valid = false;
+
+  // Scratch reused across invocations.
+  normalize::Normalizer normalizer;
+  std::vector<tflite::StringRef> words;
+  std::vector<int> stack;
+  // The ngrams back to back, and the end offset of each of them.
+  std::string ngram_bytes;
+  std::vector<int> ngram_ends;
+  std::vector<tflite::StringRef> ngrams;
+  std::vector<int32_t> features;
+};
+
+bool IsCustomKernel(const TfLiteRegistration* registration,
+                    const TfLiteRegistration* kernel) {
+  return registration->builtin_code == kTfLiteBuiltinCustom &&
+         registration->invoke == kernel->invoke;
+}
+
+// Finds the chains made of `nodes`. Intermediate tensors of a chain must only
+// be read by the next op of the chain, and must not be `preserved`.
+TfLiteStatus FindChains(TfLiteContext* context, const TfLiteIntArray* nodes,
+                        const std::vector<int>& preserved,
+                        std::vector<Chain>* chains) {
+  std::unordered_map<int, int> producers;
+  std::unordered_map<int, int> num_readers;
+  for (int tensor : preserved) {
+    num_readers[tensor]++;
+  }
+  for (int i = 0; i < nodes->size; i++) {
+    TfLiteNode* node;
+    TfLiteRegistration* registration;
+    TF_LITE_ENSURE_STATUS(context->GetNodeAndRegistration(
+        context, nodes->data[i], &node, &registration));
+    for (int j = 0; j < node->outputs->size; j++) {
+      producers[node->outputs->data[j]] = nodes->data[i];
+    }
+    for (int j = 0; j < node->inputs->size; j++) {
+      num_readers[node->inputs->data[j]]++;
+    }
+  }
+
+  // Returns the node writing `tensor`, and fetches it, if `tensor` has a
+  // single reader. Returns -1 otherwise.
+  auto single_use_producer = [&](int tensor, TfLiteNode** node,
+                                 TfLiteRegistration** registration) {
+    auto it = producers.find(tensor);
+    if (it == producers.end() || num_readers[tensor] != 1) {
+      return -1;
+    }
+    if (context->GetNodeAndRegistration(context, it->second, node,
+                                        registration) != kTfLiteOk) {
+      return -1;
+    }
+    return it->second;
+  };
+
+  for (int i = 0; i < nodes->size; i++) {
+    Chain chain;
+    TfLiteNode* predict;
+    TfLiteRegistration* registration;
+    TF_LITE_ENSURE_STATUS(context->GetNodeAndRegistration(
+        context, nodes->data[i], &predict, &registration));
+    if (!IsCustomKernel(registration, Register_PREDICT()) ||
+        predict->inputs->size != 4 || predict->outputs->size != 2 ||
+        !predict::ParseOption(
+            reinterpret_cast<const char*>(predict->custom_initial_data),
+            predict->custom_initial_data_size, &chain.predict.option)) {
+      continue;
+    }
+    chain.predict_node = nodes->data[i];
+
+    TfLiteNode* extract;
+    const int lookup = predict->inputs->data[0];
+    chain.extract_node = single_use_producer(lookup, &extract, &registration);
+    if (chain.extract_node < 0 ||
+        !IsCustomKernel(registration, Register_EXTRACT_FEATURES()) ||
+        extract->inputs->size != 1 || extract->outputs->size != 2 ||
+        extract->outputs->data[0] != lookup ||
+        num_readers[extract->outputs->data[1]] != 0) {
+      continue;
+    }
+
+    TfLiteNode* skip_gram;
+    chain.skip_gram_node = single_use_producer(extract->inputs->data[0],
+                                               &skip_gram, &registration);
+    if (chain.skip_gram_node < 0 ||
+        registration->builtin_code != kTfLiteBuiltinSkipGram ||
+        skip_gram->builtin_data == nullptr || skip_gram->inputs->size != 1) {
+      continue;
+    }
+    chain.skip_gram =
+        *reinterpret_cast<TfLiteSkipGramParams*>(skip_gram->builtin_data);
+
+    TfLiteNode* normalize;
+    chain.normalize_node = single_use_producer(skip_gram->inputs->data[0],
+                                               &normalize, &registration);
+    if (chain.normalize_node < 0 ||
+        !IsCustomKernel(registration, Register_NORMALIZE()) ||
+        normalize->inputs->size != 1) {
+      continue;
+    }
+
+    chain.input = normalize->inputs->data[0];
+    chain.model_key = predict->inputs->data[1];
+    chain.model_label = predict->inputs->data[2];
+    chain.model_weight = predict->inputs->data[3];
+    chain.output_label = predict->outputs->data[0];
+    chain.output_weight = predict->outputs->data[1];
+    chains->push_back(std::move(chain));
+  }
+  return kTfLiteOk;
+}
+
+// Splits `sentence` into words exactly as SKIP_GRAM does.
+void SplitWords(absl::string_view sentence,
+                std::vector<tflite::StringRef>* words) {
+  words->clear();
+  const char* str = sentence.data();
+  const int len = sentence.size();
+  int prev_idx = 0;
+  for (int i = 1; i < len; i++) {
+    if (isspace(str[i])) {
+      if (i > prev_idx && !isspace(str[prev_idx])) {
+        words->push_back({str + prev_idx, i - prev_idx});
+      }
+      prev_idx = i + 1;
+    }
+  }
+  if (len > prev_idx) {
+    words->push_back({str + prev_idx, len - prev_idx});
+  }
+}
+
+bool ShouldIncludeCurrentNgram(const TfLiteSkipGramParams& params, int size) {
+  if (size <= 0) {
+    return false;
+  }
+  if (params.include_all_ngrams) {
+    return size <= params.ngram_size;
+  } else {
+    return size == params.ngram_size;
+  }
+}
+
+bool ShouldStepInRecursion(const TfLiteSkipGramParams& params,
+                           const std::vector<int>& stack, int stack_idx,
+                           int num_words) {
+  if (stack_idx < params.ngram_size && stack[stack_idx] + 1 < num_words) {
+    if (stack_idx == 0) {
+      return true;
+    }
+    if (stack[stack_idx] - stack[stack_idx - 1] <= params.max_skip_size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Writes the skip-grams of data->words to data->ngrams, in SKIP_GRAM order.
+void GenerateSkipGrams(const TfLiteSkipGramParams& params, OpData* data) {
+  const std::vector<tflite::StringRef>& words = data->words;
+  std::string& bytes = data->ngram_bytes;
+  bytes.clear();
+  data->ngram_ends.clear();
+  data->ngrams.clear();
+  if (static_cast<int>(words.size()) < params.ngram_size) {
+    return;
+  }
+  std::vector<int>& stack = data->stack;
+  stack.assign(params.ngram_size, 0);
+  int stack_idx = 1;
+  const int num_words = words.size();
+  while (stack_idx >= 0) {
+    if (ShouldStepInRecursion(params, stack, stack_idx, num_words)) {
+      stack[stack_idx]++;
+      stack_idx++;
+      if (stack_idx < params.ngram_size) {
+        stack[stack_idx] = stack[stack_idx - 1];
+      }
+    } else {
+      if (ShouldIncludeCurrentNgram(params, stack_idx)) {
+        // Joined the way DynamicBuffer::AddJoinedString would, but into
+        // reusable scratch.
+        for (int i = 0; i < stack_idx; i++) {
+          if (i > 0) {
+            bytes.push_back(' ');
+          }
+          bytes.append(words[stack[i]].str, words[stack[i]].len);
+        }
+        data->ngram_ends.push_back(bytes.size());
+      }
+      stack_idx--;
+    }
+  }
+
+  // `bytes` is complete, so its data no longer moves.
+  int begin = 0;
+  for (int end : data->ngram_ends) {
+    data->ngrams.push_back({bytes.data() + begin, end - begin});
+    begin = end;
+  }
+}
+
+void* Init(TfLiteContext* context, const char* buffer, size_t length) {
+  const TfLiteDelegateParams* params =
+      reinterpret_cast<const TfLiteDelegateParams*>(buffer);
+  OpData* data = new OpData;
+  if (FindChains(context, params->nodes_to_replace, /*preserved=*/{},
+                 &data->chains) == kTfLiteOk) {
+    std::unordered_set<int> fused_nodes;
+    for (const Chain& chain : data->chains) {
+      fused_nodes.insert({chain.normalize_node, chain.skip_gram_node,
+                          chain.extract_node, chain.predict_node});
+    }
+    data->valid = !data->chains.empty() &&
+                  static_cast<int>(fused_nodes.size()) ==
+                      params->nodes_to_replace->size;
+  }
+  return data;
+}
+
+void Free(TfLiteContext* context, void* buffer) {
+  delete reinterpret_cast<OpData*>(buffer);
+}
+
+TfLiteStatus Prepare(TfLiteContext* context, TfLiteNode* node) {
+  OpData* data = reinterpret_cast<OpData*>(node->user_data);
+  TF_LITE_ENSURE(context, data->valid);
+
+  for (Chain& chain : data->chains) {
+    const TfLiteTensor* input = &context->tensors[chain.input];
+    const TfLiteTensor* model_key = &context->tensors[chain.model_key];
+    const TfLiteTensor* model_label = &context->tensors[chain.model_label];
+    const TfLiteTensor* model_weight = &context->tensors[chain.model_weight];
+    TfLiteTensor* output_label = &context->tensors[chain.output_label];
+    TfLiteTensor* output_weight = &context->tensors[chain.output_weight];
+    TF_LITE_ENSURE_EQ(context, input->type, kTfLiteString);
+    TF_LITE_ENSURE_OK(context,
+                      predict::CheckModelTensors(context, model_key,
+                                                 model_label, model_weight));
+    TF_LITE_ENSURE_EQ(context, output_label->type, kTfLiteInt32);
+    TF_LITE_ENSURE_EQ(context, output_weight->type, kTfLiteFloat32);
+
+    if (!chain.predict.has_constant_index && IsConstantTensor(model_key) &&
+        IsConstantTensor(model_label)) {
+      predict::BuildIndex(model_key, model_label, &chain.predict);
+      chain.predict.has_constant_index = true;
+    }
+
+    const int num_output = chain.predict.option.num_output;
+    TfLiteIntArray* label_size = TfLiteIntArrayCreate(1);
+    label_size->data[0] = num_output;
+    TfLiteIntArray* weight_size = TfLiteIntArrayCreate(1);
+    weight_size->data[0] = num_output;
+    TF_LITE_ENSURE_OK(context,
+                      context->ResizeTensor(context, output_label, label_size));
+    TF_LITE_ENSURE_OK(
+        context, context->ResizeTensor(context, output_weight, weight_size));
+  }
+  return kTfLiteOk;
+}
+
+TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
+  OpData* data = reinterpret_cast<OpData*>(node->user_data);
+  for (Chain& chain : data->chains) {
+    const TfLiteTensor* input = &context->tensors[chain.input];
+    const tflite::StringRef sentence = tflite::GetString(input, 0);
+    SplitWords(data->normalizer.Normalize(
+                   absl::string_view(sentence.str, sentence.len)),
+               &data->words);
+
+    GenerateSkipGrams(chain.skip_gram, data);
+    // EXTRACT_FEATURES outputs a single zero feature when there is no ngram.
+    const int num_ngrams = data->ngrams.size();
+    data->features.resize(std::max(num_ngrams, 1));
+    data->features[0] = 0;
+    extract::ExtractFeatures(data->ngrams.data(), num_ngrams,
+                             data->features.data(), /*weights=*/nullptr);
+
+    const TfLiteTensor* model_key = &context->tensors[chain.model_key];
+    const TfLiteTensor* model_label = &context->tensors[chain.model_label];
+    const TfLiteTensor* model_weight = &context->tensors[chain.model_weight];
+    TfLiteTensor* output_label = &context->tensors[chain.output_label];
+    TfLiteTensor* output_weight = &context->tensors[chain.output_weight];
+    if (chain.predict.has_constant_index) {
+      predict::Predict(data->features.data(), data->features.size(),
+                       predict::GetWeightTable(model_weight),
+                       model_label->dims->data[1],
+                       output_label->dims->data[0], &chain.predict,
+                       output_label->data.i32, output_weight->data.f);
+    } else {
+      predict::PredictUnindexed(
+          data->features.data(), data->features.size(), model_key,
+          model_label, predict::GetWeightTable(model_weight),
+          output_label->dims->data[0], &chain.predict,
+          output_label->data.i32, output_weight->data.f);
+    }
+  }
+  return kTfLiteOk;
+}
+
+TfLiteRegistration GetRegistration() {
+  TfLiteRegistration registration = {Init, Free, Prepare, Eval};
+  registration.builtin_code = kTfLiteBuiltinDelegate;
+  registration.custom_name = SmartReplyFusionDelegate::kKernelName;
+  registration.version = 1;
+  return registration;
+}
+
+}  // namespace fused
+
+const char SmartReplyFusionDelegate::kKernelName[] = "SmartReplyFused";
+
+SmartReplyFusionDelegate::SmartReplyFusionDelegate(
+    const std::vector<int>& preserved_tensors)
+    : delegate_(TfLiteDelegateCreate()),
+      preserved_tensors_(preserved_tensors) {
+  delegate_.data_ = this;
+  delegate_.Prepare = &SmartReplyFusionDelegate::Prepare;
+  // String tensors are always dynamic.
+  delegate_.flags = kTfLiteDelegateFlagsAllowDynamicTensors;
+}
+
+/* static */
+TfLiteStatus SmartReplyFusionDelegate::Prepare(TfLiteContext* context,
+                                               TfLiteDelegate* delegate) {
+  SmartReplyFusionDelegate* self =
+      reinterpret_cast<SmartReplyFusionDelegate*>(delegate->data_);
+  TfLiteIntArray* plan;
+  TF_LITE_ENSURE_STATUS(context->GetExecutionPlan(context, &plan));
+  std::vector<fused::Chain> chains;
+  TF_LITE_ENSURE_STATUS(
+      fused::FindChains(context, plan, self->preserved_tensors_, &chains));
+  if (chains.empty()) {
+    return kTfLiteOk;
+  }
+
+  TfLiteIntArray* nodes = TfLiteIntArrayCreate(4 * chains.size());
+  for (int i = 0; i < chains.size(); i++) {
+    nodes->data[4 * i] = chains[i].normalize_node;
+    nodes->data[4 * i + 1] = chains[i].skip_gram_node;
+    nodes->data[4 * i + 2] = chains[i].extract_node;
+    nodes->data[4 * i + 3] = chains[i].predict_node;
+  }
+  const TfLiteStatus status = context->ReplaceNodeSubsetsWithDelegateKernels(
+      context, fused::GetRegistration(), nodes, delegate);
+  TfLiteIntArrayFree(nodes);
+  return status;
+}
+
+}  // namespace custom
+}  // namespace ops
+}  // namespace tflite
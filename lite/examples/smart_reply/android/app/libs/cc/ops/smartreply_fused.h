@@ -0,0 +1,68 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_SMARTREPLY_FUSED_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_SMARTREPLY_FUSED_H_
+
+#include <vector>
+
+#include "tensorflow/lite/context.h"
+
+namespace tflite {
+namespace ops {
+namespace custom {
+
+// Graph rewrite fusing the SmartReply pipeline into a single kernel.
+//
+// Every NORMALIZE -> SKIP_GRAM -> EXTRACT_FEATURES -> PREDICT chain of the
+// graph is replaced by one kernel that normalizes the sentence, generates the
+// skip-grams, fingerprints them and looks them up in the model without writing
+// the intermediate string tensors. Its outputs are bit-exact with the unfused
+// chain. Chains whose intermediate tensors are read elsewhere are left as is,
+// so applying the delegate to an unrelated graph is a no-op.
+//
+// The delegate must outlive the interpreter it is applied to:
+//
+//   SmartReplyFusionDelegate delegate(interpreter->outputs());
+//   interpreter->ModifyGraphWithDelegate(delegate.get());
+class SmartReplyFusionDelegate {
+ public:
+  // `preserved_tensors` are read by the caller after Invoke(), typically the
+  // interpreter outputs. They are never fused away.
+  explicit SmartReplyFusionDelegate(const std::vector<int>& preserved_tensors);
+
+  SmartReplyFusionDelegate(const SmartReplyFusionDelegate&) = delete;
+  SmartReplyFusionDelegate& operator=(const SmartReplyFusionDelegate&) =
+      delete;
+
+  TfLiteDelegate* get() { return &delegate_; }
+
+  // custom_name of the fused kernel's registration. Its outputs are the
+  // PREDICT outputs of the chain it replaces.
+  static const char kKernelName[];
+
+ private:
+  static TfLiteStatus Prepare(TfLiteContext* context,
+                              TfLiteDelegate* delegate);
+
+  TfLiteDelegate delegate_;
+  std::vector<int> preserved_tensors_;
+};
+
+}  // namespace custom
+}  // namespace ops
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_OPS_SMARTREPLY_FUSED_H_
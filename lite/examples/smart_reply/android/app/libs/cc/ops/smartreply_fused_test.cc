@@ -0,0 +1,260 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/ops/smartreply_fused.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "absl/strings/str_split.h"
+#include "tensorflow/lite/c/builtin_op_data.h"
+#include "tensorflow/lite/interpreter.h"
+#include "tensorflow/lite/kernels/register.h"
+#include "tensorflow/lite/string_util.h"
+#include "tensorflow/lite/testing/util.h"
+
+namespace tflite {
+
+namespace ops {
+namespace custom {
+TfLiteRegistration* Register_NORMALIZE();
+TfLiteRegistration* Register_EXTRACT_FEATURES();
+TfLiteRegistration* Register_PREDICT();
+
+namespace {
+
+const char kSamples[] = "cc/testdata/smartreply_samples.tsv";  // NOLINT
+const int kNumOutput = 5;
+const int kItemsPerKey = 3;
+const int kNumLabels = 40;
+
+// Tensor indices of SmartReplyGraph.
+enum {
+  kInput = 0,
+  kNormalized,
+  kNgrams,
+  kFeatures,
+  kFeatureWeights,
+  kModelKey,
+  kModelLabel,
+  kModelWeight,
+  kOutputLabel,
+  kOutputWeight,
+  kNumTensors,
+};
+
+// Model tables of PREDICT.
+struct ModelTables {
+  std::vector<int32_t> keys;
+  std::vector<int32_t> labels;
+  std::vector<float> weights;
+};
+
+// NORMALIZE -> SKIP_GRAM -> EXTRACT_FEATURES -> PREDICT over constant model
+// tables, optionally rewritten by SmartReplyFusionDelegate.
+class SmartReplyGraph {
+ public:
+  SmartReplyGraph(const ModelTables& tables, bool fused,
+                  const std::vector<int>& preserved = {kOutputLabel,
+                                                       kOutputWeight})
+      : tables_(tables), delegate_(preserved) {
+    const int num_keys = tables_.keys.size();
+    interpreter_.AddTensors(kNumTensors);
+    interpreter_.SetInputs({kInput});
+    interpreter_.SetOutputs({kOutputLabel, kOutputWeight});
+    SetReadWrite(kInput, kTfLiteString, {1});
+    SetReadWrite(kNormalized, kTfLiteString, {1});
+    SetReadWrite(kNgrams, kTfLiteString, {1});
+    SetReadWrite(kFeatures, kTfLiteInt32, {1});
+    SetReadWrite(kFeatureWeights, kTfLiteFloat32, {1});
+    SetReadWrite(kOutputLabel, kTfLiteInt32, {kNumOutput});
+    SetReadWrite(kOutputWeight, kTfLiteFloat32, {kNumOutput});
+    interpreter_.SetTensorParametersReadOnly(
+        kModelKey, kTfLiteInt32, "", {num_keys}, TfLiteQuantizationParams(),
+        reinterpret_cast<const char*>(tables_.keys.data()),
+        tables_.keys.size() * sizeof(int32_t));
+    interpreter_.SetTensorParametersReadOnly(
+        kModelLabel, kTfLiteInt32, "", {num_keys, kItemsPerKey},
+        TfLiteQuantizationParams(),
+        reinterpret_cast<const char*>(tables_.labels.data()),
+        tables_.labels.size() * sizeof(int32_t));
+    interpreter_.SetTensorParametersReadOnly(
+        kModelWeight, kTfLiteFloat32, "", {num_keys, kItemsPerKey},
+        TfLiteQuantizationParams(),
+        reinterpret_cast<const char*>(tables_.weights.data()),
+        tables_.weights.size() * sizeof(float));
+
+    interpreter_.AddNodeWithParameters({kInput}, {kNormalized}, nullptr, 0,
+                                       nullptr, Register_NORMALIZE());
+    TfLiteSkipGramParams* skip_gram = reinterpret_cast<TfLiteSkipGramParams*>(
+        malloc(sizeof(TfLiteSkipGramParams)));
+    skip_gram->ngram_size = 3;
+    skip_gram->max_skip_size = 1;
+    skip_gram->include_all_ngrams = true;
+    interpreter_.AddNodeWithParameters(
+        {kNormalized}, {kNgrams}, nullptr, 0, skip_gram,
+        resolver_.FindOp(BuiltinOperator_SKIP_GRAM, 1));
+    interpreter_.AddNodeWithParameters({kNgrams}, {kFeatures, kFeatureWeights},
+                                       nullptr, 0, nullptr,
+                                       Register_EXTRACT_FEATURES());
+    const int32_t num_output = kNumOutput;
+    const float threshold = 0.001;
+    char options[8];
+    memcpy(options, &num_output, sizeof(num_output));
+    memcpy(options + sizeof(num_output), &threshold, sizeof(threshold));
+    interpreter_.AddNodeWithParameters(
+        {kFeatures, kModelKey, kModelLabel, kModelWeight},
+        {kOutputLabel, kOutputWeight}, options, sizeof(options), nullptr,
+        Register_PREDICT());
+
+    if (fused) {
+      EXPECT_EQ(interpreter_.ModifyGraphWithDelegate(delegate_.get()),
+                kTfLiteOk);
+    }
+    EXPECT_EQ(interpreter_.AllocateTensors(), kTfLiteOk);
+  }
+
+  void Invoke(const string& sentence) {
+    DynamicBuffer buf;
+    buf.AddString(sentence.data(), sentence.length());
+    buf.WriteToTensorAsVector(interpreter_.tensor(kInput));
+    ASSERT_EQ(interpreter_.Invoke(), kTfLiteOk);
+  }
+
+  std::vector<int32_t> GetFeatures() { return GetValues<int32_t>(kFeatures); }
+  std::vector<int32_t> GetLabels() { return GetValues<int32_t>(kOutputLabel); }
+  std::vector<float> GetWeights() { return GetValues<float>(kOutputWeight); }
+  int num_nodes() const { return interpreter_.execution_plan().size(); }
+
+ private:
+  void SetReadWrite(int tensor, TfLiteType type, const std::vector<int>& dims) {
+    interpreter_.SetTensorParametersReadWrite(tensor, type, "", dims,
+                                              TfLiteQuantizationParams());
+  }
+
+  template <typename T>
+  std::vector<T> GetValues(int tensor) {
+    const TfLiteTensor* t = interpreter_.tensor(tensor);
+    const T* data = reinterpret_cast<const T*>(t->data.raw);
+    return std::vector<T>(data, data + t->bytes / sizeof(T));
+  }
+
+  ModelTables tables_;
+  ops::builtin::BuiltinOpResolver resolver_;
+  SmartReplyFusionDelegate delegate_;
+  Interpreter interpreter_;
+};
+
+std::vector<string> ReadSampleSentences() {
+  std::vector<string> sentences = {
+      "", "   ", "a", "Hi", "Hi!!", "<S> <E>", "don't you'll i'm",
+      string(400, 'x') + " tail words here"};
+  string line;
+  std::ifstream fin(kSamples);
+  while (std::getline(fin, line)) {
+    for (absl::string_view field : absl::StrSplit(line, '\t')) {
+      sentences.emplace_back(field);
+    }
+  }
+  return sentences;
+}
+
+// Builds model tables keyed by features the sentences actually produce, plus
+// unmatched keys and the zero feature, with duplicated labels across rows.
+ModelTables BuildTables(const std::vector<string>& sentences) {
+  SmartReplyGraph probe({{1}, {1, 2, 3}, {0.1, 0.2, 0.3}}, /*fused=*/false);
+  std::set<int32_t> features = {0, 123456789};
+  for (const string& sentence : sentences) {
+    probe.Invoke(sentence);
+    for (int32_t feature : probe.GetFeatures()) {
+      features.insert(feature);
+    }
+  }
+
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> weight(0.0f, 1.0f);
+  ModelTables tables;
+  for (int32_t feature : features) {
+    tables.keys.push_back(feature);
+    for (int i = 0; i < kItemsPerKey; i++) {
+      tables.labels.push_back(rng() % kNumLabels);
+      tables.weights.push_back(weight(rng));
+    }
+  }
+  return tables;
+}
+
+TEST(SmartReplyFusedTest, FusesChainIntoOneNode) {
+  const ModelTables tables = {{1}, {1, 2, 3}, {0.1, 0.2, 0.3}};
+  SmartReplyGraph unfused(tables, /*fused=*/false);
+  SmartReplyGraph fused(tables, /*fused=*/true);
+  EXPECT_EQ(unfused.num_nodes(), 4);
+  EXPECT_EQ(fused.num_nodes(), 1);
+}
+
+TEST(SmartReplyFusedTest, PreservedIntermediateIsNotFused) {
+  const ModelTables tables = {{1}, {1, 2, 3}, {0.1, 0.2, 0.3}};
+  SmartReplyGraph graph(tables, /*fused=*/true,
+                        {kFeatures, kOutputLabel, kOutputWeight});
+  EXPECT_EQ(graph.num_nodes(), 4);
+  graph.Invoke("how are you");
+  EXPECT_GT(graph.GetFeatures().size(), 1);
+}
+
+TEST(SmartReplyFusedTest, MatchesUnfusedGraph) {
+  const std::vector<string> sentences = ReadSampleSentences();
+  ASSERT_GT(sentences.size(), 8);
+  const ModelTables tables = BuildTables(sentences);
+  SmartReplyGraph unfused(tables, /*fused=*/false);
+  SmartReplyGraph fused(tables, /*fused=*/true);
+  ASSERT_EQ(fused.num_nodes(), 1);
+
+  int num_predicted = 0;
+  for (const string& sentence : sentences) {
+    unfused.Invoke(sentence);
+    fused.Invoke(sentence);
+    const std::vector<int32_t> labels = unfused.GetLabels();
+    const std::vector<float> weights = unfused.GetWeights();
+    EXPECT_EQ(fused.GetLabels(), labels) << "input: " << sentence;
+    // Bit-exact, not approximately equal.
+    const std::vector<float> fused_weights = fused.GetWeights();
+    ASSERT_EQ(fused_weights.size(), weights.size());
+    EXPECT_EQ(memcmp(fused_weights.data(), weights.data(),
+                     weights.size() * sizeof(float)),
+              0)
+        << "input: " << sentence;
+    if (labels[0] >= 0) {
+      num_predicted++;
+    }
+  }
+  // The tables are keyed by real features, so most sentences match.
+  EXPECT_GT(num_predicted, sentences.size() / 2);
+}
+
+}  // namespace
+}  // namespace custom
+}  // namespace ops
+}  // namespace tflite
+
+int main(int argc, char** argv) {
+  ::tflite::LogToStderr();
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,218 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/predict_weight_quantizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "cc/ops/predict.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+const char kPredictOp[] = "Predict";
+
+namespace {
+
+// Converts a float to IEEE half precision, rounding to nearest even.
+uint16_t FloatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude >= 0x7f800000) {
+    // Infinity or NaN.
+    return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+  }
+  if (magnitude >= 0x477ff000) {
+    // At least 65520, which rounds to infinity.
+    return sign | 0x7c00;
+  }
+  if (magnitude < 0x38800000) {
+    // Below 2^-14: a multiple of 2^-24 in half precision.
+    float abs_value;
+    memcpy(&abs_value, &magnitude, sizeof(abs_value));
+    return sign |
+           static_cast<uint16_t>(std::nearbyint(abs_value * 16777216.0f));
+  }
+  magnitude += 0xfff + ((magnitude >> 13) & 1);
+  return sign | static_cast<uint16_t>((magnitude - (112u << 23)) >> 13);
+}
+
+// Returns the float32 contents of `buffer`.
+std::vector<float> ReadFloats(const BufferT& buffer) {
+  std::vector<float> values(buffer.data.size() / sizeof(float));
+  memcpy(values.data(), buffer.data.data(), values.size() * sizeof(float));
+  return values;
+}
+
+template <typename T>
+void WriteValues(const std::vector<T>& values, BufferT* buffer) {
+  buffer->data.resize(values.size() * sizeof(T));
+  memcpy(buffer->data.data(), values.data(), buffer->data.size());
+}
+
+// Points `tensor` at a new buffer, so that buffers shared with other tensors
+// are left untouched.
+BufferT* NewBuffer(ModelT* model, TensorT* tensor) {
+  model->buffers.emplace_back(new BufferT);
+  tensor->buffer = model->buffers.size() - 1;
+  return model->buffers.back().get();
+}
+
+// Converts a float32 weight table to int8. Returns the largest absolute
+// dequantization error.
+float QuantizeInt8(ModelT* model, TensorT* tensor) {
+  const std::vector<float> weights =
+      ReadFloats(*model->buffers[tensor->buffer]);
+  float max_abs = 0.0f;
+  for (float w : weights) {
+    max_abs = std::max(max_abs, std::abs(w));
+  }
+  // An all-zero table still needs a positive scale.
+  const float scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+
+  std::vector<int8_t> quantized(weights.size());
+  float max_error = 0.0f;
+  for (int i = 0; i < weights.size(); i++) {
+    const float q = std::round(weights[i] / scale);
+    quantized[i] = static_cast<int8_t>(std::min(127.0f, std::max(-127.0f, q)));
+    max_error =
+        std::max(max_error, std::abs(scale * quantized[i] - weights[i]));
+  }
+
+  WriteValues(quantized, NewBuffer(model, tensor));
+  tensor->type = TensorType_INT8;
+  tensor->quantization.reset(new QuantizationParametersT);
+  tensor->quantization->scale = {scale};
+  tensor->quantization->zero_point = {0};
+  return max_error;
+}
+
+// Converts a float32 weight table to float16. Returns the largest absolute
+// conversion error.
+float ConvertFloat16(ModelT* model, TensorT* tensor) {
+  const std::vector<float> weights =
+      ReadFloats(*model->buffers[tensor->buffer]);
+  std::vector<uint16_t> halves(weights.size());
+  float max_error = 0.0f;
+  for (int i = 0; i < weights.size(); i++) {
+    halves[i] = FloatToHalf(weights[i]);
+    max_error = std::max(
+        max_error,
+        std::abs(ops::custom::predict::HalfToFloat(halves[i]) - weights[i]));
+  }
+
+  WriteValues(halves, NewBuffer(model, tensor));
+  tensor->type = TensorType_FLOAT16;
+  return max_error;
+}
+
+// Converts an int32 label table to int16 if all labels fit. Returns whether
+// the table was converted.
+bool NarrowLabels(ModelT* model, TensorT* tensor) {
+  const BufferT& buffer = *model->buffers[tensor->buffer];
+  std::vector<int32_t> labels(buffer.data.size() / sizeof(int32_t));
+  memcpy(labels.data(), buffer.data.data(), labels.size() * sizeof(int32_t));
+  std::vector<int16_t> narrowed(labels.size());
+  for (int i = 0; i < labels.size(); i++) {
+    if (labels[i] < std::numeric_limits<int16_t>::min() ||
+        labels[i] > std::numeric_limits<int16_t>::max()) {
+      return false;
+    }
+    narrowed[i] = labels[i];
+  }
+
+  WriteValues(narrowed, NewBuffer(model, tensor));
+  tensor->type = TensorType_INT16;
+  return true;
+}
+
+// Drops the data of buffers that no tensor refers to anymore. Buffer 0 is the
+// empty sentinel.
+void DropUnusedBuffers(ModelT* model) {
+  std::vector<bool> used(model->buffers.size(), false);
+  used[0] = true;
+  for (const std::unique_ptr<SubGraphT>& subgraph : model->subgraphs) {
+    for (const std::unique_ptr<TensorT>& tensor : subgraph->tensors) {
+      used[tensor->buffer] = true;
+    }
+  }
+  for (int i = 0; i < model->buffers.size(); i++) {
+    if (!used[i]) {
+      model->buffers[i]->data.clear();
+    }
+  }
+}
+
+bool HasConstantData(const ModelT& model, const TensorT& tensor) {
+  return tensor.buffer > 0 && tensor.buffer < model.buffers.size() &&
+         !model.buffers[tensor.buffer]->data.empty();
+}
+
+}  // namespace
+
+int QuantizePredictTables(PredictWeightType weight_type, ModelT* model,
+                          std::vector<ConvertedTable>* tables) {
+  // Tables shared by several PREDICT ops are converted once.
+  std::set<const TensorT*> converted;
+  int num_ops = 0;
+  for (const std::unique_ptr<SubGraphT>& subgraph : model->subgraphs) {
+    for (const std::unique_ptr<OperatorT>& op : subgraph->operators) {
+      const OperatorCodeT& opcode = *model->operator_codes[op->opcode_index];
+      if (opcode.custom_code != kPredictOp || op->inputs.size() != 4) {
+        continue;
+      }
+      num_ops++;
+      TensorT* label = subgraph->tensors[op->inputs[2]].get();
+      TensorT* weight = subgraph->tensors[op->inputs[3]].get();
+
+      if (label->type == TensorType_INT32 && HasConstantData(*model, *label) &&
+          converted.insert(label).second) {
+        NarrowLabels(model, label);
+        if (tables != nullptr) {
+          tables->push_back({label->name, TensorType_INT32, label->type});
+        }
+      }
+
+      if (weight->type == TensorType_FLOAT32 &&
+          HasConstantData(*model, *weight) && converted.insert(weight).second) {
+        const float max_error = weight_type == PredictWeightType::kInt8
+                                    ? QuantizeInt8(model, weight)
+                                    : ConvertFloat16(model, weight);
+        if (tables != nullptr) {
+          tables->push_back(
+              {weight->name, TensorType_FLOAT32, weight->type, max_error});
+        }
+      }
+    }
+  }
+  if (num_ops > 0) {
+    DropUnusedBuffers(model);
+  }
+  return num_ops;
+}
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
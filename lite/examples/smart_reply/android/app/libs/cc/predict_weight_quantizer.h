@@ -0,0 +1,61 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICT_WEIGHT_QUANTIZER_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICT_WEIGHT_QUANTIZER_H_
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/lite/schema/schema_generated.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+// Custom code of the PREDICT op in the model.
+extern const char kPredictOp[];
+
+// Storage type of the converted PREDICT weight tables.
+enum class PredictWeightType { kInt8, kFloat16 };
+
+// One PREDICT table visited by QuantizePredictTables().
+struct ConvertedTable {
+  std::string name;
+  TensorType from;
+  // Same as `from` when the table was kept, i.e. labels that do not fit int16.
+  TensorType to;
+  // Largest absolute error of a weight table entry. Labels are exact.
+  float max_error = 0.0f;
+};
+
+// Rewrites the constant weight and label tables of the PREDICT ops of `model`
+// into their compact storage types. Float32 weights become `weight_type`:
+// int8 with a symmetric per-tensor scale of max|w| / 127, or float16. int32
+// labels become int16 when all of them fit, and stay int32 otherwise. Tables
+// shared by several PREDICT ops are converted once, into new buffers, and the
+// data of buffers no tensor refers to anymore is dropped. The resulting score
+// error bounds are documented at predict::MaxWeightError().
+//
+// Returns the number of PREDICT ops; `model` is left untouched if there is
+// none. Each visited table is appended to `tables` when not null.
+int QuantizePredictTables(PredictWeightType weight_type, ModelT* model,
+                          std::vector<ConvertedTable>* tables);
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICT_WEIGHT_QUANTIZER_H_
@@ -0,0 +1,242 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/predict_weight_quantizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "cc/ops/predict.h"
+#include "flatbuffers/flatbuffers.h"
+#include "tensorflow/lite/interpreter.h"
+#include "tensorflow/lite/model.h"
+#include "tensorflow/lite/op_resolver.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow/lite/string_util.h"
+#include "tensorflow/lite/testing/util.h"
+
+void RegisterSelectedOps(::tflite::MutableOpResolver* resolver);
+
+namespace tflite {
+namespace ops {
+namespace custom {
+TfLiteRegistration* Register_PREDICT();
+}  // namespace custom
+}  // namespace ops
+
+namespace custom {
+namespace smartreply {
+namespace {
+
+const char kSmartReply[] = "cc/testdata/";  // NOLINT
+const char kModel[] = "smartreply.tflite";
+const char kSamples[] = "smartreply_samples.tsv";
+
+string GetModelFilePath() { return absl::StrCat(kSmartReply, kModel); }
+
+string GetSamplesFilePath() { return absl::StrCat(kSmartReply, kSamples); }
+
+TensorT* FindTensor(const ModelT& model, const string& name) {
+  for (const std::unique_ptr<SubGraphT>& subgraph : model.subgraphs) {
+    for (const std::unique_ptr<TensorT>& tensor : subgraph->tensors) {
+      if (tensor->name == name) {
+        return tensor.get();
+      }
+    }
+  }
+  return nullptr;
+}
+
+float MaxAbsWeight(const ModelT& model, const TensorT& tensor) {
+  const BufferT& buffer = *model.buffers[tensor.buffer];
+  std::vector<float> weights(buffer.data.size() / sizeof(float));
+  memcpy(weights.data(), buffer.data.data(), weights.size() * sizeof(float));
+  float max_abs = 0.0f;
+  for (float weight : weights) {
+    max_abs = std::max(max_abs, std::abs(weight));
+  }
+  return max_abs;
+}
+
+// Returns the weight output of the only PREDICT node of `interpreter`, or -1.
+int FindPredictWeightTensor(const Interpreter& interpreter) {
+  const TfLiteRegistration* predict = ::tflite::ops::custom::Register_PREDICT();
+  int weight_tensor = -1;
+  for (int node_index : interpreter.execution_plan()) {
+    const auto* node_and_registration =
+        interpreter.node_and_registration(node_index);
+    if (node_and_registration->second.invoke != predict->invoke) {
+      continue;
+    }
+    if (weight_tensor != -1) {
+      return -1;
+    }
+    weight_tensor = node_and_registration->first.outputs->data[1];
+  }
+  return weight_tensor;
+}
+
+// Returns the PREDICT output weights of `model` on each of `messages`.
+std::vector<std::vector<float>> PredictWeights(
+    const FlatBufferModel& model, const std::vector<string>& messages) {
+  MutableOpResolver resolver;
+  RegisterSelectedOps(&resolver);
+  std::unique_ptr<Interpreter> interpreter;
+  InterpreterBuilder(model, resolver)(&interpreter);
+  EXPECT_NE(interpreter.get(), nullptr);
+  if (!interpreter) return {};
+  const int weight_tensor = FindPredictWeightTensor(*interpreter);
+  EXPECT_NE(weight_tensor, -1);
+  if (weight_tensor == -1) return {};
+
+  std::vector<std::vector<float>> weights;
+  for (const string& message : messages) {
+    DynamicBuffer buf;
+    buf.AddString(message.data(), message.size());
+    buf.WriteToTensorAsVector(interpreter->tensor(interpreter->inputs()[0]));
+    if (interpreter->AllocateTensors() != kTfLiteOk ||
+        interpreter->Invoke() != kTfLiteOk) {
+      ADD_FAILURE() << "Failed to predict '" << message << "'";
+      return {};
+    }
+    const TfLiteTensor* output = interpreter->tensor(weight_tensor);
+    weights.emplace_back(output->data.f,
+                         output->data.f + output->dims->data[0]);
+  }
+  return weights;
+}
+
+class PredictWeightQuantizerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    model_ = FlatBufferModel::BuildFromFile(GetModelFilePath().c_str());
+    ASSERT_NE(model_.get(), nullptr);
+
+    string line;
+    std::ifstream fin(GetSamplesFilePath());
+    while (std::getline(fin, line)) {
+      const std::vector<string> fields = absl::StrSplit(line, '\t');
+      if (!fields.empty()) {
+        messages_.push_back(fields[0]);
+      }
+    }
+    ASSERT_FALSE(messages_.empty());
+  }
+
+  // Converts the test model to `weight_type`, and checks that the PREDICT
+  // output weights of the converted model are within the documented
+  // tolerance of the original ones on every sample message.
+  void ExpectScoresWithinTolerance(PredictWeightType weight_type,
+                                   TfLiteType compact_type) {
+    std::unique_ptr<ModelT> original(model_->GetModel()->UnPack());
+    std::unique_ptr<ModelT> converted(model_->GetModel()->UnPack());
+    std::vector<ConvertedTable> tables;
+    EXPECT_EQ(QuantizePredictTables(weight_type, converted.get(), &tables), 1);
+
+    float tolerance = 0.0f;
+    int num_weight_tables = 0;
+    for (const ConvertedTable& table : tables) {
+      const TensorT* tensor = FindTensor(*converted, table.name);
+      ASSERT_NE(tensor, nullptr) << table.name;
+      EXPECT_EQ(tensor->type, table.to) << table.name;
+      if (table.from == TensorType_INT32) {
+        // Labels are narrowed only when they fit.
+        EXPECT_TRUE(table.to == TensorType_INT16 ||
+                    table.to == TensorType_INT32);
+        continue;
+      }
+      num_weight_tables++;
+      EXPECT_EQ(table.from, TensorType_FLOAT32);
+      EXPECT_EQ(table.to, weight_type == PredictWeightType::kInt8
+                              ? TensorType_INT8
+                              : TensorType_FLOAT16);
+      const TensorT* original_tensor = FindTensor(*original, table.name);
+      ASSERT_NE(original_tensor, nullptr) << table.name;
+      const float max_error = ops::custom::predict::MaxWeightError(
+          compact_type, MaxAbsWeight(*original, *original_tensor));
+      EXPECT_LE(table.max_error, max_error) << table.name;
+      tolerance = std::max(tolerance, max_error);
+    }
+    EXPECT_EQ(num_weight_tables, 1);
+
+    flatbuffers::FlatBufferBuilder builder;
+    builder.Finish(Model::Pack(builder, converted.get()), ModelIdentifier());
+    std::unique_ptr<FlatBufferModel> quantized =
+        FlatBufferModel::BuildFromBuffer(
+            reinterpret_cast<const char*>(builder.GetBufferPointer()),
+            builder.GetSize());
+    ASSERT_NE(quantized.get(), nullptr);
+    EXPECT_LT(builder.GetSize(), model_->allocation()->bytes());
+
+    const std::vector<std::vector<float>> expected =
+        PredictWeights(*model_, messages_);
+    const std::vector<std::vector<float>> actual =
+        PredictWeights(*quantized, messages_);
+    ASSERT_EQ(expected.size(), messages_.size());
+    ASSERT_EQ(actual.size(), messages_.size());
+    int num_scores = 0;
+    for (int i = 0; i < messages_.size(); i++) {
+      ASSERT_EQ(actual[i].size(), expected[i].size());
+      // Labels may swap places, but the k-th largest weight moves by at most
+      // the tolerance, as every aggregated weight does.
+      for (int k = 0; k < expected[i].size(); k++) {
+        EXPECT_NEAR(actual[i][k], expected[i][k], tolerance * 1.01f + 1e-6f)
+            << "message '" << messages_[i] << "', output " << k;
+        if (expected[i][k] > 0.0f) num_scores++;
+      }
+    }
+    EXPECT_GT(num_scores, 0);
+  }
+
+  std::unique_ptr<FlatBufferModel> model_;
+  std::vector<string> messages_;
+};
+
+TEST_F(PredictWeightQuantizerTest, Int8ScoresAreWithinTolerance) {
+  ExpectScoresWithinTolerance(PredictWeightType::kInt8, kTfLiteInt8);
+}
+
+TEST_F(PredictWeightQuantizerTest, Float16ScoresAreWithinTolerance) {
+  ExpectScoresWithinTolerance(PredictWeightType::kFloat16, kTfLiteFloat16);
+}
+
+TEST(QuantizePredictTablesTest, ModelWithoutPredictIsUntouched) {
+  ModelT model;
+  model.buffers.emplace_back(new BufferT);
+  model.subgraphs.emplace_back(new SubGraphT);
+  std::vector<ConvertedTable> tables;
+  EXPECT_EQ(
+      QuantizePredictTables(PredictWeightType::kInt8, &model, &tables), 0);
+  EXPECT_TRUE(tables.empty());
+  EXPECT_EQ(model.buffers.size(), 1u);
+}
+
+}  // namespace
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+int main(int argc, char** argv) {
+  ::tflite::LogToStderr();
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -15,9 +15,11 @@ limitations under the License.
 
 #include "cc/predictor.h"
 
-#include "absl/strings/str_split.h"
-#include "re2/re2.h"
+#include <algorithm>
+#include <cstring>
+
 #include "tensorflow/lite/interpreter.h"
+#include "tensorflow/lite/kernels/kernel_util.h"
 #include "tensorflow/lite/kernels/register.h"
 #include "tensorflow/lite/model.h"
 #include "tensorflow/lite/op_resolver.h"
@@ -26,84 +28,361 @@ limitations under the License.
 void RegisterSelectedOps(::tflite::MutableOpResolver* resolver);
 
 namespace tflite {
+namespace ops {
+namespace custom {
+TfLiteRegistration* Register_PREDICT();
+}  // namespace custom
+}  // namespace ops
+
 namespace custom {
 namespace smartreply {
 
-// Split sentence into segments (using punctuation).
-std::vector<std::string> SplitSentence(const std::string& input) {
-  string result(input);
+// Returns the int32 label output of the only PREDICT node of the interpreter,
+// fused or not, or -1 if there is no single such node.
+int FindLabelTensor(const ::tflite::Interpreter& interpreter) {
+  const TfLiteRegistration* predict = ::tflite::ops::custom::Register_PREDICT();
+  int label_tensor = -1;
+  for (int node_index : interpreter.execution_plan()) {
+    const auto* node_and_registration =
+        interpreter.node_and_registration(node_index);
+    const TfLiteNode& node = node_and_registration->first;
+    const TfLiteRegistration& registration = node_and_registration->second;
+    const bool is_fused =
+        registration.custom_name != nullptr &&
+        strcmp(registration.custom_name,
+               ::tflite::ops::custom::SmartReplyFusionDelegate::kKernelName) ==
+            0;
+    if (registration.invoke != predict->invoke && !is_fused) {
+      continue;
+    }
+    if (label_tensor != -1 || node.outputs->size != 2) {
+      return -1;
+    }
+    label_tensor = node.outputs->data[0];
+  }
+  if (label_tensor != -1 &&
+      interpreter.tensor(label_tensor)->type != kTfLiteInt32) {
+    return -1;
+  }
+  return label_tensor;
+}
+
+// Returns the number of labels of the constant label table of the only
+// PREDICT node of the interpreter, one more than its largest label, or -1 if
+// there is no single such node or its label table is not constant. Must be
+// called before the PREDICT node is fused.
+int FindNumModelLabels(const ::tflite::Interpreter& interpreter) {
+  const TfLiteRegistration* predict = ::tflite::ops::custom::Register_PREDICT();
+  const TfLiteTensor* label_table = nullptr;
+  for (int node_index : interpreter.execution_plan()) {
+    const auto* node_and_registration =
+        interpreter.node_and_registration(node_index);
+    const TfLiteNode& node = node_and_registration->first;
+    if (node_and_registration->second.invoke != predict->invoke) {
+      continue;
+    }
+    if (label_table != nullptr || node.inputs->size != 4) {
+      return -1;
+    }
+    label_table = interpreter.tensor(node.inputs->data[2]);
+  }
+  if (label_table == nullptr || !::tflite::IsConstantTensor(label_table) ||
+      (label_table->type != kTfLiteInt32 &&
+       label_table->type != kTfLiteInt16)) {
+    return -1;
+  }
+  int max_label = -1;
+  const int num_entries = ::tflite::NumElements(label_table);
+  for (int i = 0; i < num_entries; i++) {
+    max_label = std::max<int>(max_label, label_table->type == kTfLiteInt16
+                                             ? label_table->data.i16[i]
+                                             : label_table->data.i32[i]);
+  }
+  return max_label + 1;
+}
+
+// Profiles a request when `profiler` is set, attaching its op profiler to
+// `interpreter`, if any, for the duration of the request.
+class ScopedRequestProfile {
+ public:
+  ScopedRequestProfile(SmartReplyProfiler* profiler,
+                       ::tflite::Interpreter* interpreter)
+      : profiler_(profiler), interpreter_(interpreter) {
+    if (profiler_ == nullptr) return;
+    profiler_->BeginRequest();
+    if (interpreter_ != nullptr) {
+      interpreter_->SetProfiler(profiler_->op_profiler());
+    }
+  }
+
+  ~ScopedRequestProfile() {
+    if (profiler_ == nullptr) return;
+    if (interpreter_ != nullptr) {
+      interpreter_->SetProfiler(nullptr);
+    }
+    profiler_->EndRequest();
+  }
+
+ private:
+  SmartReplyProfiler* profiler_;
+  ::tflite::Interpreter* interpreter_;
+};
+
+// Punctuation splitting a sentence into segments.
+inline bool IsSegmentPunctuation(char c) {
+  return c == '?' || c == '.' || c == '!' || c == ',';
+}
+
+// Whitespace as matched by RE2's \s.
+inline bool IsRegexSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+void SplitSentence(absl::string_view input, SentenceSegments* segments) {
+  std::vector<absl::string_view>& pieces = segments->pieces_;
+  std::vector<int>& segment_ends = segments->segment_ends_;
+  const size_t first_segment = segment_ends.size();
+
+  // The current piece is pieces.back(). Pieces start empty, pointing into
+  // `input`, and grow over contiguous characters of it.
+  pieces.push_back(input.substr(0, 0));
+  bool after_space = false;
+  auto add_space = [&](size_t pos) {
+    if (!after_space) {
+      pieces.push_back(input.substr(pos, 0));
+      after_space = true;
+    }
+  };
+  auto add_char = [&](size_t pos) {
+    absl::string_view& piece = pieces.back();
+    piece = piece.empty() ? input.substr(pos, 1)
+                          : absl::string_view(piece.data(), piece.size() + 1);
+    after_space = false;
+  };
+  auto end_segment = [&](size_t pos) {
+    segment_ends.push_back(pieces.size());
+    pieces.push_back(input.substr(pos, 0));
+    after_space = false;
+  };
+
+  // Whether the segment was ended by punctuation followed by whitespace. The
+  // space put before a punctuation run directly following it is then part of
+  // the segment break.
+  bool after_break = false;
+  size_t i = 0;
+  while (i < input.size()) {
+    const char c = input[i];
+    if (IsSegmentPunctuation(c)) {
+      size_t end = i;
+      while (end < input.size() && IsSegmentPunctuation(input[end])) end++;
+      if (!after_break) {
+        add_space(end - 1);
+      }
+      add_char(end - 1);
+      i = end;
+      after_break = false;
+      if (i < input.size() && IsRegexSpace(input[i])) {
+        while (i < input.size() && IsRegexSpace(input[i])) i++;
+        end_segment(i);
+        after_break = true;
+      }
+      continue;
+    }
+    if (c == '\t') {
+      end_segment(i + 1);
+    } else if (c == ' ') {
+      add_space(i + 1);
+    } else {
+      add_char(i);
+    }
+    after_break = false;
+    i++;
+  }
+  segment_ends.push_back(pieces.size());
+
+  // Drop trailing empty segments, but always keep one segment per input.
+  while (segment_ends.size() > first_segment + 1 &&
+         segment_ends.back() - segment_ends[segment_ends.size() - 2] == 1 &&
+         pieces.back().empty()) {
+    segment_ends.pop_back();
+    pieces.pop_back();
+  }
+}
 
-  RE2::GlobalReplace(&result, "([?.!,])+", " \\1");
-  RE2::GlobalReplace(&result, "([?.!,])+\\s+", "\\1\t");
-  RE2::GlobalReplace(&result, "[ ]+", " ");
-  RE2::GlobalReplace(&result, "\t+$", "");
+/* static */
+std::unique_ptr<SmartReplyPredictor> SmartReplyPredictor::Create(
+    const ::tflite::FlatBufferModel& model, bool use_fused_kernel) {
+  if (!model.initialized()) {
+    fprintf(stderr, "Failed to mmap model \n");
+    return nullptr;
+  }
 
-  return absl::StrSplit(result, '\t');
+  // Initialize interpreter
+  std::unique_ptr<SmartReplyPredictor> predictor(new SmartReplyPredictor);
+  RegisterSelectedOps(&predictor->resolver_);
+  ::tflite::InterpreterBuilder(model, predictor->resolver_)(
+      &predictor->interpreter_);
+  if (!predictor->interpreter_) {
+    fprintf(stderr, "Failed to build interpreter \n");
+    return nullptr;
+  }
+  const int num_model_labels = FindNumModelLabels(*predictor->interpreter_);
+  if (use_fused_kernel) {
+    predictor->fusion_delegate_.reset(
+        new ::tflite::ops::custom::SmartReplyFusionDelegate(
+            predictor->interpreter_->outputs()));
+    if (predictor->interpreter_->ModifyGraphWithDelegate(
+            predictor->fusion_delegate_->get()) != kTfLiteOk) {
+      fprintf(stderr, "Failed to fuse SmartReply ops \n");
+      return nullptr;
+    }
+  }
+  if (num_model_labels >= 0) {
+    predictor->label_tensor_ = FindLabelTensor(*predictor->interpreter_);
+    predictor->label_texts_.set_num_model_labels(num_model_labels);
+  }
+  return predictor;
 }
 
 // Predict with TfLite model.
-void ExecuteTfLite(const std::string& sentence,
-                   ::tflite::Interpreter* interpreter,
-                   std::map<std::string, float>* response_map) {
+bool SmartReplyPredictor::ExecuteTfLite(
+    absl::Span<const absl::string_view> segment,
+    SegmentResponses* responses) {
+  responses->Clear();
   {
-    TfLiteTensor* input = interpreter->tensor(interpreter->inputs()[0]);
+    // Write the segment spans straight into the input tensor.
+    TfLiteTensor* input = interpreter_->tensor(interpreter_->inputs()[0]);
+    segment_pieces_.clear();
+    for (absl::string_view piece : segment) {
+      segment_pieces_.push_back(
+          {piece.data(), static_cast<int>(piece.size())});
+    }
     tflite::DynamicBuffer buf;
-    buf.AddString(sentence.data(), sentence.length());
+    buf.AddJoinedString(segment_pieces_, ' ');
     buf.WriteToTensorAsVector(input);
-    interpreter->AllocateTensors();
 
-    interpreter->Invoke();
+    // The string payload lives in a dynamic buffer owned by the tensor, so the
+    // arena only needs re-planning when the number of input strings changes.
+    // Downstream string tensors are dynamic and resized during Invoke().
+    const int input_size = input->dims->data[0];
+    if (input_size != allocated_input_size_) {
+      if (interpreter_->AllocateTensors() != kTfLiteOk) {
+        allocated_input_size_ = -1;
+        return false;
+      }
+      allocated_input_size_ = input_size;
+    }
+
+    if (interpreter_->Invoke() != kTfLiteOk) {
+      return false;
+    }
+
+    TfLiteTensor* messages = interpreter_->tensor(interpreter_->outputs()[0]);
+    TfLiteTensor* confidence = interpreter_->tensor(interpreter_->outputs()[1]);
 
-    TfLiteTensor* messages = interpreter->tensor(interpreter->outputs()[0]);
-    TfLiteTensor* confidence = interpreter->tensor(interpreter->outputs()[1]);
+    const TfLiteTensor* labels =
+        label_tensor_ == -1 ? nullptr : interpreter_->tensor(label_tensor_);
 
     for (int i = 0; i < confidence->dims->data[0]; i++) {
       float weight = confidence->data.f[i];
-      auto response_text = tflite::GetString(messages, i);
-      if (response_text.len > 0) {
-        (*response_map)[string(response_text.str, response_text.len)] += weight;
+      const int label = ResolveLabel(messages, labels, i);
+      if (label >= 0) {
+        responses->labels.push_back(label);
+        responses->scores.push_back(weight);
       }
     }
   }
+  return true;
 }
 
-void GetSegmentPredictions(
-    const std::vector<std::string>& input,
-    const ::tflite::FlatBufferModel& model, const SmartReplyConfig& config,
-    std::vector<PredictorResponse>* predictor_responses) {
-  // Initialize interpreter
-  std::unique_ptr<::tflite::Interpreter> interpreter;
-  ::tflite::MutableOpResolver resolver;
-  RegisterSelectedOps(&resolver);
-  ::tflite::InterpreterBuilder(model, resolver)(&interpreter);
+int SmartReplyPredictor::ResolveLabel(const TfLiteTensor* messages,
+                                      const TfLiteTensor* labels, int i) {
+  auto response_text = tflite::GetString(messages, i);
+  const absl::string_view text(response_text.str, response_text.len);
+  if (labels != nullptr && i < labels->dims->data[0]) {
+    const int label = labels->data.i32[i];
+    if (label < 0) {
+      return -1;
+    }
+    // Labels outside of the label table are interned like unlabeled outputs.
+    if (label < label_texts_.num_model_labels()) {
+      if (!label_texts_.Get(label)) {
+        label_texts_.SetModelLabel(label,
+                                   std::make_shared<const std::string>(text));
+      }
+      return label_texts_.Get(label)->empty() ? -1 : label;
+    }
+  }
+  return text.empty() ? -1 : label_texts_.Intern(text);
+}
 
-  if (!model.initialized()) {
-    fprintf(stderr, "Failed to mmap model \n");
-    return;
+const SegmentResponses* SmartReplyPredictor::GetResponses(
+    absl::Span<const absl::string_view> segment,
+    const SmartReplyConfig& config) {
+  const size_t cache_bytes = config.response_cache_bytes;
+  if (cache_bytes == 0) {
+    return ExecuteTfLite(segment, &segment_responses_) ? &segment_responses_
+                                                       : nullptr;
+  }
+  if (!response_cache_) {
+    response_cache_.reset(new ResponseCache(cache_bytes));
+  } else if (response_cache_->memory_budget() != cache_bytes) {
+    response_cache_->set_memory_budget(cache_bytes);
   }
 
-  // Execute Tflite Model
-  std::map<std::string, float> response_map;
-  std::vector<std::string> sentences;
-  for (const std::string& str : input) {
-    std::vector<std::string> splitted_str = SplitSentence(str);
-    sentences.insert(sentences.end(), splitted_str.begin(), splitted_str.end());
+  segment_text_.clear();
+  for (int i = 0; i < segment.size(); i++) {
+    if (i > 0) segment_text_.push_back(' ');
+    segment_text_.append(segment[i].data(), segment[i].size());
   }
-  for (const auto& sentence : sentences) {
-    ExecuteTfLite(sentence, interpreter.get(), &response_map);
+  const absl::string_view key = normalizer_.Normalize(segment_text_);
+  const SegmentResponses* cached = response_cache_->Lookup(key);
+  if (cached != nullptr) {
+    if (config.profiler != nullptr) {
+      config.profiler->mutable_profile()->cache_hits++;
+    }
+    return cached;
+  }
+  if (!ExecuteTfLite(segment, &segment_responses_)) {
+    return nullptr;
   }
+  response_cache_->Insert(key, segment_responses_);
+  return &segment_responses_;
+}
 
-  // Generate the result.
-  for (const auto& iter : response_map) {
-    PredictorResponse prediction(iter.first, iter.second);
-    predictor_responses->emplace_back(prediction);
+void SmartReplyPredictor::CollectResponses(
+    const std::vector<std::string>& input, const SmartReplyConfig& config,
+    SegmentResponses* responses) {
+  {
+    ScopedStageTimer timer(config.profiler,
+                           &PredictionProfile::split_sentence_us);
+    segments_.Clear();
+    for (const std::string& str : input) {
+      SplitSentence(str, &segments_);
+    }
+  }
+  ScopedStageTimer timer(config.profiler, &PredictionProfile::model_us);
+  if (config.profiler != nullptr) {
+    config.profiler->mutable_profile()->num_segments += segments_.size();
+  }
+  for (int i = 0; i < segments_.size(); i++) {
+    const SegmentResponses* segment_responses =
+        GetResponses(segments_.segment(i), config);
+    if (segment_responses == nullptr) {
+      continue;
+    }
+    responses->labels.insert(responses->labels.end(),
+                             segment_responses->labels.begin(),
+                             segment_responses->labels.end());
+    responses->scores.insert(responses->scores.end(),
+                             segment_responses->scores.begin(),
+                             segment_responses->scores.end());
   }
-  std::sort(predictor_responses->begin(), predictor_responses->end(),
-            [](const PredictorResponse& a, const PredictorResponse& b) {
-              return a.GetScore() > b.GetScore();
-            });
+}
 
-  // Add backoff response.
+// Fills the remaining slots of `predictor_responses` with backoff responses.
+void AddBackoffResponses(const SmartReplyConfig& config,
+                         std::vector<PredictorResponse>* predictor_responses) {
   for (const auto& backoff : config.backoff_responses) {
     if (predictor_responses->size() >= config.num_response) {
       break;
@@ -112,6 +391,159 @@ void GetSegmentPredictions(
   }
 }
 
+void SmartReplyPredictor::GetSegmentPredictions(
+    const std::vector<std::string>& input, const SmartReplyConfig& config,
+    std::vector<PredictorResponse>* predictor_responses) {
+  ScopedRequestProfile profile(config.profiler, interpreter_.get());
+
+  // Execute Tflite Model
+  input_responses_.Clear();
+  CollectResponses(input, config, &input_responses_);
+
+  // Generate the result.
+  {
+    ScopedStageTimer timer(config.profiler, &PredictionProfile::merge_us);
+    label_scores_.Add(input_responses_);
+    label_scores_.TakeBest(config.num_response, label_texts_,
+                           predictor_responses);
+  }
+
+  // Add backoff response.
+  ScopedStageTimer timer(config.profiler, &PredictionProfile::backoff_us);
+  AddBackoffResponses(config, predictor_responses);
+}
+
+void SmartReplyPredictor::AddMessage(const std::string& message,
+                                     const SmartReplyConfig& config,
+                                     SmartReplyConversation* conversation) {
+  ScopedRequestProfile profile(config.profiler, interpreter_.get());
+  SegmentResponses responses;
+  CollectResponses({message}, config, &responses);
+
+  LabelTexts& texts = conversation->label_texts_;
+  texts.set_num_model_labels(label_texts_.num_model_labels());
+  for (int& label : responses.labels) {
+    if (label >= label_texts_.num_model_labels()) {
+      // Interned labels depend on the predictor: renumber them by text.
+      label = texts.Intern(label_texts_.Get(label));
+    } else if (!texts.Get(label)) {
+      texts.SetModelLabel(label, label_texts_.Get(label));
+    }
+  }
+  conversation->messages_.push_back(std::move(responses));
+  if (conversation->max_messages_ > 0 &&
+      conversation->messages_.size() > conversation->max_messages_) {
+    conversation->DropOldestMessage();
+  }
+}
+
+void SmartReplyConversation::DropOldestMessage() {
+  if (!messages_.empty()) {
+    messages_.pop_front();
+  }
+}
+
+void SmartReplyConversation::GetPredictions(
+    const SmartReplyConfig& config,
+    std::vector<PredictorResponse>* predictor_responses) {
+  ScopedRequestProfile profile(config.profiler, /*interpreter=*/nullptr);
+  {
+    ScopedStageTimer timer(config.profiler, &PredictionProfile::merge_us);
+    for (const SegmentResponses& responses : messages_) {
+      label_scores_.Add(responses);
+    }
+    label_scores_.TakeBest(config.num_response, label_texts_,
+                           predictor_responses);
+  }
+  ScopedStageTimer timer(config.profiler, &PredictionProfile::backoff_us);
+  AddBackoffResponses(config, predictor_responses);
+}
+
+const std::shared_ptr<const std::string>& LabelTexts::Get(int label) const {
+  static const auto* const kNoText = new std::shared_ptr<const std::string>();
+  if (label < num_model_labels_) {
+    return label < model_texts_.size() ? model_texts_[label] : *kNoText;
+  }
+  label -= num_model_labels_;
+  return label < interned_texts_.size() ? interned_texts_[label] : *kNoText;
+}
+
+void LabelTexts::SetModelLabel(int label,
+                               std::shared_ptr<const std::string> text) {
+  if (label >= model_texts_.size()) {
+    model_texts_.resize(label + 1);
+  }
+  model_texts_[label] = std::move(text);
+}
+
+int LabelTexts::Intern(absl::string_view text) {
+  auto it = interned_labels_.find(text);
+  if (it != interned_labels_.end()) {
+    return it->second;
+  }
+  return Intern(std::make_shared<const std::string>(text));
+}
+
+int LabelTexts::Intern(const std::shared_ptr<const std::string>& text) {
+  auto inserted = interned_labels_.emplace(
+      *text, num_model_labels_ + interned_texts_.size());
+  if (inserted.second) {
+    interned_texts_.push_back(text);
+  }
+  return inserted.first->second;
+}
+
+void LabelScores::Add(const SegmentResponses& responses) {
+  for (int i = 0; i < responses.labels.size(); i++) {
+    const int label = responses.labels[i];
+    if (label >= scores_.size()) {
+      scores_.resize(label + 1, 0);
+      touched_.resize(label + 1, false);
+    }
+    if (!touched_[label]) {
+      touched_[label] = true;
+      touched_labels_.push_back(label);
+    }
+    scores_[label] += responses.scores[i];
+  }
+}
+
+void LabelScores::TakeBest(
+    int num_response, const LabelTexts& label_texts,
+    std::vector<PredictorResponse>* predictor_responses) {
+  // Only the best labels are sorted and turned into responses.
+  const int num_predicted =
+      std::min<int>(touched_labels_.size(), std::max(num_response, 0));
+  std::partial_sort(touched_labels_.begin(),
+                    touched_labels_.begin() + num_predicted,
+                    touched_labels_.end(), [this](int a, int b) {
+                      return scores_[a] > scores_[b] ||
+                             (scores_[a] == scores_[b] && a < b);
+                    });
+  for (int i = 0; i < num_predicted; i++) {
+    const int label = touched_labels_[i];
+    predictor_responses->emplace_back(label_texts.Get(label), label,
+                                      scores_[label]);
+  }
+  for (int label : touched_labels_) {
+    scores_[label] = 0;
+    touched_[label] = false;
+  }
+  touched_labels_.clear();
+}
+
+void GetSegmentPredictions(
+    const std::vector<std::string>& input,
+    const ::tflite::FlatBufferModel& model, const SmartReplyConfig& config,
+    std::vector<PredictorResponse>* predictor_responses) {
+  std::unique_ptr<SmartReplyPredictor> predictor =
+      SmartReplyPredictor::Create(model);
+  if (!predictor) {
+    return;
+  }
+  predictor->GetSegmentPredictions(input, config, predictor_responses);
+}
+
 }  // namespace smartreply
 }  // namespace custom
 }  // namespace tflite
@@ -16,10 +16,23 @@ limitations under the License.
 #ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICTOR_H_
 #define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICTOR_H_
 
+#include <deque>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "cc/ops/normalize.h"
+#include "cc/ops/smartreply_fused.h"
+#include "cc/predictor_profiler.h"
+#include "cc/response_cache.h"
+#include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/model.h"
+#include "tensorflow/lite/op_resolver.h"
+#include "tensorflow/lite/string_util.h"
 
 namespace tflite {
 namespace custom {
@@ -29,31 +42,268 @@ const int kDefaultNumResponse = 10;
 const float kDefaultBackoffConfidence = 1e-4;
 
 class PredictorResponse;
+class SmartReplyConversation;
 struct SmartReplyConfig;
 
+// Texts of response labels, shared with the predicted responses. Labels below
+// num_model_labels() are the labels of the PREDICT op of the model. Responses
+// without such a label are interned by text as the following labels, in the
+// order they are first seen.
+class LabelTexts {
+ public:
+  int num_model_labels() const { return num_model_labels_; }
+  void set_num_model_labels(int num_model_labels) {
+    num_model_labels_ = num_model_labels;
+  }
+
+  // Text of `label`, or nullptr if it has none yet.
+  const std::shared_ptr<const std::string>& Get(int label) const;
+
+  // Sets the text of model label `label`.
+  void SetModelLabel(int label, std::shared_ptr<const std::string> text);
+
+  // Returns the label of `text`, interning it first if needed. The second
+  // overload shares `text` instead of copying it.
+  int Intern(absl::string_view text);
+  int Intern(const std::shared_ptr<const std::string>& text);
+
+ private:
+  int num_model_labels_ = 0;
+  // Grown on demand, up to num_model_labels_ entries.
+  std::vector<std::shared_ptr<const std::string>> model_texts_;
+  std::vector<std::shared_ptr<const std::string>> interned_texts_;
+  absl::flat_hash_map<std::string, int> interned_labels_;
+};
+
+// Flat accumulator of response scores by label.
+class LabelScores {
+ public:
+  // Adds the scores of `responses` to their labels.
+  void Add(const SegmentResponses& responses);
+
+  // Appends the `num_response` best labels to `predictor_responses`, best
+  // first and ties broken by label, then resets every score to zero.
+  // `label_texts` holds the text of each label.
+  void TakeBest(int num_response, const LabelTexts& label_texts,
+                std::vector<PredictorResponse>* predictor_responses);
+
+ private:
+  // Indexed by label. Every entry is zero after TakeBest().
+  std::vector<float> scores_;
+  std::vector<bool> touched_;
+  std::vector<int> touched_labels_;
+};
+
+// Sentence segments of one or more messages, as produced by SplitSentence().
+// A segment is stored as spans into the original message: its text is the
+// spans joined with single spaces. The spans do not own their data, so the
+// messages must outlive the segments.
+class SentenceSegments {
+ public:
+  // Number of segments.
+  int size() const { return segment_ends_.size(); }
+
+  // Spans of the i-th segment.
+  absl::Span<const absl::string_view> segment(int i) const {
+    const int begin = i == 0 ? 0 : segment_ends_[i - 1];
+    return absl::MakeConstSpan(pieces_.data() + begin,
+                               segment_ends_[i] - begin);
+  }
+
+  // Removes all segments, keeping the allocated capacity.
+  void Clear() {
+    pieces_.clear();
+    segment_ends_.clear();
+  }
+
+ private:
+  friend void SplitSentence(absl::string_view input,
+                            SentenceSegments* segments);
+
+  std::vector<absl::string_view> pieces_;
+  // Segment i spans pieces_[segment_ends_[i - 1], segment_ends_[i]).
+  std::vector<int> segment_ends_;
+};
+
+// Splits `input` into segments on punctuation and appends them to `segments`.
+// A run of '?', '.', '!' or ',' is reduced to its last character, which is
+// separated from the preceding word by a space; a segment ends after such a
+// run when it is followed by whitespace, and at every tab. Runs of spaces are
+// collapsed and trailing empty segments are dropped.
+void SplitSentence(absl::string_view input, SentenceSegments* segments);
+
 // With a given string as input, predict the response with a Tflite model.
-// When config.backoff_response is not empty, predictor_responses will be filled
-// with messagees from backoff response.
+// At most config.num_response responses are appended to predictor_responses,
+// best first. When config.backoff_response is not empty, remaining slots are
+// filled with messagees from backoff response.
+//
+// This builds a new interpreter on every call; prefer SmartReplyPredictor when
+// predicting more than once with the same model.
 void GetSegmentPredictions(const std::vector<std::string>& input,
                            const ::tflite::FlatBufferModel& model,
                            const SmartReplyConfig& config,
                            std::vector<PredictorResponse>* predictor_responses);
 
+// Long-lived prediction session over a SmartReply model. The op resolver and
+// interpreter are built once and reused across calls; tensors are only
+// re-allocated when the shape of the input tensor changes.
+//
+// A SmartReplyPredictor is not thread-safe. The model must outlive it.
+class SmartReplyPredictor {
+ public:
+  // Returns nullptr if the model is not initialized or the interpreter cannot
+  // be built. With `use_fused_kernel`, the model ops are rewritten into the
+  // fused SmartReply kernel (see SmartReplyFusionDelegate), which gives the
+  // same predictions without materializing the intermediate string tensors.
+  static std::unique_ptr<SmartReplyPredictor> Create(
+      const ::tflite::FlatBufferModel& model, bool use_fused_kernel = false);
+
+  // Same as the free function GetSegmentPredictions(), using the interpreter
+  // owned by this predictor.
+  //
+  // With a positive config.response_cache_bytes, the responses of each segment
+  // are cached under its normalized text, and segments seen before skip the
+  // model entirely. The cache lives as long as the predictor and is not
+  // shared with other predictors.
+  void GetSegmentPredictions(
+      const std::vector<std::string>& input, const SmartReplyConfig& config,
+      std::vector<PredictorResponse>* predictor_responses);
+
+  // Runs the model on the segments of `message` only, and appends the message
+  // to `conversation`. See SmartReplyConversation.
+  void AddMessage(const std::string& message, const SmartReplyConfig& config,
+                  SmartReplyConversation* conversation);
+
+  // Counters of the response cache; all zero if it was never enabled.
+  ResponseCacheStats response_cache_stats() const {
+    return response_cache_ ? response_cache_->stats() : ResponseCacheStats();
+  }
+
+ private:
+  SmartReplyPredictor() = default;
+
+  // Runs the model on one segment and stores the weighted response labels in
+  // `responses`. Returns false if the model could not be run.
+  bool ExecuteTfLite(absl::Span<const absl::string_view> segment,
+                     SegmentResponses* responses);
+
+  // Returns the label of the i-th model output, recording its text the first
+  // time the label is seen. Returns -1 for outputs without a response.
+  int ResolveLabel(const TfLiteTensor* messages, const TfLiteTensor* labels,
+                   int i);
+
+  // Returns the responses for one segment, from the cache when enabled.
+  // Returns nullptr if the model could not be run.
+  const SegmentResponses* GetResponses(
+      absl::Span<const absl::string_view> segment,
+      const SmartReplyConfig& config);
+
+  // Splits `input` and appends the responses of all its segments to
+  // `responses`, in order.
+  void CollectResponses(const std::vector<std::string>& input,
+                        const SmartReplyConfig& config,
+                        SegmentResponses* responses);
+
+  ::tflite::MutableOpResolver resolver_;
+  // Must outlive the interpreter it is applied to.
+  std::unique_ptr<::tflite::ops::custom::SmartReplyFusionDelegate>
+      fusion_delegate_;
+  std::unique_ptr<::tflite::Interpreter> interpreter_;
+  // Number of strings in the input tensor when tensors were last allocated,
+  // or -1 if AllocateTensors() has not succeeded yet.
+  int allocated_input_size_ = -1;
+  // Scratch reused across calls to avoid per-request allocations.
+  SentenceSegments segments_;
+  std::vector<::tflite::StringRef> segment_pieces_;
+  SegmentResponses segment_responses_;
+
+  // Responses come from a fixed vocabulary in the model. They are aggregated
+  // by label, and the text of a label is copied out of the output tensor only
+  // the first time it is predicted.
+  //
+  // Int32 tensor holding the PREDICT labels of the model outputs, or -1 if the
+  // model has no such tensor or its label table is not constant; labels are
+  // then assigned by interning texts. Model labels are bounded by the label
+  // table, as label_texts_.num_model_labels().
+  int label_tensor_ = -1;
+  LabelTexts label_texts_;
+  LabelScores label_scores_;
+  SegmentResponses input_responses_;
+
+  // Created on the first call with a positive config.response_cache_bytes.
+  std::unique_ptr<ResponseCache> response_cache_;
+  // Produces the cache keys: segments that normalize to the same text get
+  // the same predictions, as NORMALIZE is the first op of the model.
+  ::tflite::ops::custom::normalize::Normalizer normalizer_;
+  std::string segment_text_;
+};
+
+// Conversation scored incrementally, one message at a time.
+//
+// The responses of each message are computed once, when the message is added
+// with SmartReplyPredictor::AddMessage(), and kept with the message. Getting
+// predictions then only sums the kept responses, and dropping the oldest
+// messages of a sliding window just removes theirs. Sums are taken in message
+// order, so predictions are bit-exact with GetSegmentPredictions() on the same
+// messages rather than drifting through repeated float subtraction.
+//
+// Messages may be added with any predictor over the same model, e.g. from a
+// SmartReplyPredictorPool. Responses are aggregated by the labels of the
+// PREDICT op; responses without such a label, which each predictor numbers in
+// the order it first sees them, are aggregated by text instead. A
+// SmartReplyConversation is not thread-safe.
+class SmartReplyConversation {
+ public:
+  // Keeps at most the `max_messages` latest messages, or all messages if
+  // `max_messages` is 0.
+  explicit SmartReplyConversation(int max_messages = 0)
+      : max_messages_(max_messages) {}
+
+  int num_messages() const { return messages_.size(); }
+
+  // Drops the oldest message, if any.
+  void DropOldestMessage();
+
+  // Same as GetSegmentPredictions() over the messages of the conversation.
+  void GetPredictions(const SmartReplyConfig& config,
+                      std::vector<PredictorResponse>* predictor_responses);
+
+ private:
+  friend class SmartReplyPredictor;
+
+  int max_messages_;
+  // Responses of every segment of each message, oldest message first.
+  std::deque<SegmentResponses> messages_;
+  // Text of each label predicted so far.
+  LabelTexts label_texts_;
+  LabelScores label_scores_;
+};
+
 // Data object used to hold a single predictor response.
 // It includes messages, and confidence.
+//
+// Predicted responses share their text with the predictor's label vocabulary
+// instead of copying it, and stay valid after the predictor is destroyed.
 class PredictorResponse {
  public:
-  PredictorResponse(const std::string& response_text, float score) {
-    response_text_ = response_text;
-    prediction_score_ = score;
-  }
+  PredictorResponse(const std::string& response_text, float score)
+      : response_text_(std::make_shared<const std::string>(response_text)),
+        prediction_score_(score) {}
+  PredictorResponse(std::shared_ptr<const std::string> response_text,
+                    int label, float score)
+      : response_text_(std::move(response_text)),
+        label_(label),
+        prediction_score_(score) {}
 
   // Accessor methods.
-  const std::string& GetText() const { return response_text_; }
+  const std::string& GetText() const { return *response_text_; }
   float GetScore() const { return prediction_score_; }
+  // Label of the response (see LabelTexts), or -1 for backoff responses.
+  int GetLabel() const { return label_; }
 
  private:
-  std::string response_text_ = "";
+  std::shared_ptr<const std::string> response_text_;
+  int label_ = -1;
   float prediction_score_ = 0.0;
 };
 
@@ -66,11 +316,21 @@ struct SmartReplyConfig {
   // Backoff responses are used when predicted responses cannot fulfill the
   // list.
   std::vector<std::string> backoff_responses;
+  // Memory budget in bytes of the per-segment response cache of a
+  // SmartReplyPredictor; 0 disables the cache. Each predictor has its own
+  // cache, so a SmartReplyPredictorPool of N predictors, or one predictor per
+  // thread, uses up to N times this budget.
+  size_t response_cache_bytes;
+  // When set, every request records its stage and op timings in the profiler.
+  // Not owned.
+  SmartReplyProfiler* profiler;
 
   SmartReplyConfig(const std::vector<std::string>& backoff_responses)
       : num_response(kDefaultNumResponse),
         backoff_confidence(kDefaultBackoffConfidence),
-        backoff_responses(backoff_responses) {}
+        backoff_responses(backoff_responses),
+        response_cache_bytes(0),
+        profiler(nullptr) {}
 };
 
 }  // namespace smartreply
@@ -0,0 +1,111 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/predictor_pool.h"
+
+#include <utility>
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+SmartReplyPredictorPool::Lease::Lease(Lease&& other)
+    : pool_(other.pool_), slot_(other.slot_) {
+  other.pool_ = nullptr;
+  other.slot_ = -1;
+}
+
+SmartReplyPredictorPool::Lease& SmartReplyPredictorPool::Lease::operator=(
+    Lease&& other) {
+  if (this != &other) {
+    Release();
+    pool_ = other.pool_;
+    slot_ = other.slot_;
+    other.pool_ = nullptr;
+    other.slot_ = -1;
+  }
+  return *this;
+}
+
+SmartReplyPredictorPool::Lease::~Lease() { Release(); }
+
+SmartReplyPredictor* SmartReplyPredictorPool::Lease::operator->() const {
+  return pool_->predictors_[slot_].get();
+}
+
+SmartReplyPredictor& SmartReplyPredictorPool::Lease::operator*() const {
+  return *pool_->predictors_[slot_];
+}
+
+void SmartReplyPredictorPool::Lease::Release() {
+  if (pool_ != nullptr) {
+    pool_->in_use_[slot_].store(false, std::memory_order_release);
+    pool_ = nullptr;
+    slot_ = -1;
+  }
+}
+
+SmartReplyPredictorPool::SmartReplyPredictorPool(int pool_size)
+    : in_use_(new std::atomic<bool>[pool_size]) {
+  for (int i = 0; i < pool_size; i++) {
+    in_use_[i].store(false, std::memory_order_relaxed);
+  }
+}
+
+/* static */
+std::unique_ptr<SmartReplyPredictorPool> SmartReplyPredictorPool::Create(
+    const ::tflite::FlatBufferModel& model, int pool_size,
+    bool use_fused_kernel) {
+  if (pool_size <= 0) {
+    return nullptr;
+  }
+  std::unique_ptr<SmartReplyPredictorPool> pool(
+      new SmartReplyPredictorPool(pool_size));
+  pool->predictors_.reserve(pool_size);
+  for (int i = 0; i < pool_size; i++) {
+    std::unique_ptr<SmartReplyPredictor> predictor =
+        SmartReplyPredictor::Create(model, use_fused_kernel);
+    if (!predictor) {
+      return nullptr;
+    }
+    pool->predictors_.push_back(std::move(predictor));
+  }
+  return pool;
+}
+
+SmartReplyPredictorPool::Lease SmartReplyPredictorPool::TryAcquire() {
+  const int num_slots = predictors_.size();
+  const int start =
+      next_slot_.fetch_add(1, std::memory_order_relaxed) % num_slots;
+  for (int i = 0; i < num_slots; i++) {
+    const int slot = (start + i) % num_slots;
+    // Cheap relaxed read first, so that busy slots are skipped without
+    // bouncing their cache line with a failed compare-exchange.
+    if (in_use_[slot].load(std::memory_order_relaxed)) {
+      continue;
+    }
+    bool expected = false;
+    if (in_use_[slot].compare_exchange_strong(expected, true,
+                                              std::memory_order_acquire,
+                                              std::memory_order_relaxed)) {
+      return Lease(this, slot);
+    }
+  }
+  return Lease();
+}
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
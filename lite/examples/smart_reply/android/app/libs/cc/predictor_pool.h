@@ -0,0 +1,92 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICTOR_POOL_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICTOR_POOL_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "cc/predictor.h"
+#include "tensorflow/lite/model.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+// A bounded pool of SmartReplyPredictor-s sharing one FlatBufferModel, so that
+// concurrent conversations neither rebuild an interpreter per request nor
+// share one interpreter across threads.
+//
+// Checkout and return are lock-free. When every predictor is checked out,
+// TryAcquire() returns an empty lease instead of blocking, and the caller
+// decides whether to retry, queue or reject the request.
+//
+// The model must outlive the pool, and the pool must outlive every lease.
+class SmartReplyPredictorPool {
+ public:
+  // Exclusive, movable handle on one predictor of the pool. The predictor is
+  // returned to the pool when the lease is destroyed.
+  class Lease {
+   public:
+    Lease() = default;
+    Lease(Lease&& other);
+    Lease& operator=(Lease&& other);
+    ~Lease();
+
+    // Returns false if the pool was exhausted when this lease was requested.
+    explicit operator bool() const { return pool_ != nullptr; }
+    SmartReplyPredictor* operator->() const;
+    SmartReplyPredictor& operator*() const;
+
+   private:
+    friend class SmartReplyPredictorPool;
+    Lease(SmartReplyPredictorPool* pool, int slot) : pool_(pool), slot_(slot) {}
+    void Release();
+
+    SmartReplyPredictorPool* pool_ = nullptr;
+    int slot_ = -1;
+  };
+
+  // Pre-builds `pool_size` predictors over `model`. Returns nullptr if
+  // `pool_size` is not positive or any predictor cannot be built.
+  // `use_fused_kernel` is passed to SmartReplyPredictor::Create().
+  static std::unique_ptr<SmartReplyPredictorPool> Create(
+      const ::tflite::FlatBufferModel& model, int pool_size,
+      bool use_fused_kernel = false);
+
+  // Checks out an idle predictor without blocking. Returns an empty lease if
+  // all predictors are in use.
+  Lease TryAcquire();
+
+  // Total number of predictors owned by the pool.
+  int size() const { return predictors_.size(); }
+
+ private:
+  explicit SmartReplyPredictorPool(int pool_size);
+
+  std::vector<std::unique_ptr<SmartReplyPredictor>> predictors_;
+  // in_use_[i] is true while predictors_[i] is checked out.
+  std::unique_ptr<std::atomic<bool>[]> in_use_;
+  // Slot at which the next checkout starts probing, to spread contention.
+  std::atomic<unsigned int> next_slot_{0};
+};
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICTOR_POOL_H_
@@ -0,0 +1,184 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/predictor_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <thread>  // NOLINT(build/c++11)
+
+#include <gtest/gtest.h>
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "tensorflow/lite/testing/util.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+namespace {
+
+const char kSmartReply[] = "cc/testdata/";  // NOLINT
+const char kModel[] = "smartreply.tflite";
+const char kSamples[] = "smartreply_samples.tsv";
+
+// Threads and passes over the sample file per thread of the stress test,
+// which checks correctness; throughput is measured by BM_PredictorPool in
+// smartreply_benchmark.
+const int kStressThreads = 4;
+const int kStressPasses = 2;
+
+string GetModelFilePath() { return absl::StrCat(kSmartReply, kModel); }
+
+string GetSamplesFilePath() { return absl::StrCat(kSmartReply, kSamples); }
+
+class PredictorPoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    model_ = tflite::FlatBufferModel::BuildFromFile(GetModelFilePath().c_str());
+    ASSERT_NE(model_.get(), nullptr);
+
+    string line;
+    std::ifstream fin(GetSamplesFilePath());
+    while (std::getline(fin, line)) {
+      const std::vector<string> fields = absl::StrSplit(line, '\t');
+      if (!fields.empty()) {
+        messages_.push_back(fields[0]);
+      }
+    }
+    ASSERT_FALSE(messages_.empty());
+  }
+
+  std::unique_ptr<::tflite::FlatBufferModel> model_;
+  std::vector<string> messages_;
+};
+
+TEST_F(PredictorPoolTest, CreateRejectsEmptyPool) {
+  EXPECT_EQ(SmartReplyPredictorPool::Create(*model_, 0), nullptr);
+}
+
+TEST_F(PredictorPoolTest, ExhaustedPoolReturnsEmptyLease) {
+  std::unique_ptr<SmartReplyPredictorPool> pool =
+      SmartReplyPredictorPool::Create(*model_, 2);
+  ASSERT_NE(pool.get(), nullptr);
+
+  SmartReplyPredictorPool::Lease first = pool->TryAcquire();
+  SmartReplyPredictorPool::Lease second = pool->TryAcquire();
+  ASSERT_TRUE(first);
+  ASSERT_TRUE(second);
+  EXPECT_NE(&*first, &*second);
+  EXPECT_FALSE(pool->TryAcquire());
+
+  // Returning a predictor makes it available again.
+  first = SmartReplyPredictorPool::Lease();
+  EXPECT_TRUE(pool->TryAcquire());
+}
+
+TEST_F(PredictorPoolTest, PooledPredictionsMatchOneShot) {
+  std::unique_ptr<SmartReplyPredictorPool> pool =
+      SmartReplyPredictorPool::Create(*model_, 1);
+  ASSERT_NE(pool.get(), nullptr);
+
+  for (const string &msg : messages_) {
+    std::vector<PredictorResponse> expected;
+    GetSegmentPredictions({msg}, *model_, /*config=*/{{}}, &expected);
+
+    SmartReplyPredictorPool::Lease lease = pool->TryAcquire();
+    ASSERT_TRUE(lease);
+    std::vector<PredictorResponse> predictions;
+    lease->GetSegmentPredictions({msg}, /*config=*/{{}}, &predictions);
+    ASSERT_EQ(predictions.size(), expected.size());
+    for (int i = 0; i < predictions.size(); i++) {
+      EXPECT_EQ(predictions[i].GetText(), expected[i].GetText());
+    }
+  }
+}
+
+TEST_F(PredictorPoolTest, ConcurrentLeasesAreExclusive) {
+  // Fewer predictors than threads, so that some requests find the pool
+  // exhausted.
+  std::unique_ptr<SmartReplyPredictorPool> pool =
+      SmartReplyPredictorPool::Create(*model_, 2);
+  ASSERT_NE(pool.get(), nullptr);
+  std::vector<const SmartReplyPredictor*> predictors;
+  {
+    std::vector<SmartReplyPredictorPool::Lease> leases;
+    for (int i = 0; i < pool->size(); i++) {
+      leases.push_back(pool->TryAcquire());
+      ASSERT_TRUE(leases.back());
+      predictors.push_back(&*leases.back());
+    }
+  }
+  std::vector<std::atomic<int>> in_use(predictors.size());
+  for (std::atomic<int> &flag : in_use) {
+    flag = 0;
+  }
+
+  std::atomic<int> shared(0);
+  std::atomic<int> failed(0);
+  std::atomic<int> succeeded(0);
+  std::atomic<int> rejected(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kStressThreads; t++) {
+    threads.emplace_back([&]() {
+      for (int pass = 0; pass < kStressPasses; pass++) {
+        for (const string &msg : messages_) {
+          SmartReplyPredictorPool::Lease lease = pool->TryAcquire();
+          if (!lease) {
+            rejected++;
+            continue;
+          }
+          const int slot =
+              std::find(predictors.begin(), predictors.end(), &*lease) -
+              predictors.begin();
+          if (slot == predictors.size() || in_use[slot].exchange(1) != 0) {
+            shared++;
+            continue;
+          }
+          std::vector<PredictorResponse> predictions;
+          lease->GetSegmentPredictions({msg}, /*config=*/{{}}, &predictions);
+          if (predictions.empty()) {
+            failed++;
+          } else {
+            succeeded++;
+          }
+          in_use[slot] = 0;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(shared.load(), 0);
+  EXPECT_EQ(failed.load(), 0);
+  EXPECT_GT(succeeded.load(), 0);
+  // Every request either succeeded or found the pool exhausted.
+  EXPECT_EQ(succeeded.load() + rejected.load(),
+            kStressThreads * kStressPasses *
+                static_cast<int>(messages_.size()));
+}
+
+}  // namespace
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+int main(int argc, char **argv) {
+  ::tflite::LogToStderr();
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
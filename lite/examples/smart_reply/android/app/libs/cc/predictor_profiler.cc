@@ -0,0 +1,92 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/predictor_profiler.h"
+
+#include <chrono>  // NOLINT(build/c++11)
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+int64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void PredictionCounters::Add(const PredictionProfile& profile) {
+  requests++;
+  segments += profile.num_segments;
+  cache_hits += profile.cache_hits;
+  split_sentence_us += profile.split_sentence_us;
+  model_us += profile.model_us;
+  merge_us += profile.merge_us;
+  backoff_us += profile.backoff_us;
+  total_us += profile.total_us;
+}
+
+void PredictionCounters::Add(const PredictionCounters& counters) {
+  requests += counters.requests;
+  segments += counters.segments;
+  cache_hits += counters.cache_hits;
+  split_sentence_us += counters.split_sentence_us;
+  model_us += counters.model_us;
+  merge_us += counters.merge_us;
+  backoff_us += counters.backoff_us;
+  total_us += counters.total_us;
+}
+
+SmartReplyProfiler::SmartReplyProfiler(int max_op_events)
+    : op_profiler_(max_op_events) {}
+
+void SmartReplyProfiler::BeginRequest() {
+  profile_ = PredictionProfile();
+  op_profiler_.Reset();
+  op_profiler_.StartProfiling();
+  request_start_us_ = NowMicros();
+}
+
+void SmartReplyProfiler::EndRequest() {
+  profile_.total_us = NowMicros() - request_start_us_;
+  op_profiler_.StopProfiling();
+  for (const ::tflite::profiling::ProfileEvent* event :
+       op_profiler_.GetProfileEvents()) {
+    if (event->event_type !=
+        ::tflite::Profiler::EventType::OPERATOR_INVOKE_EVENT) {
+      continue;
+    }
+    const std::string name(event->tag);
+    OpProfile* op = nullptr;
+    for (OpProfile& existing : profile_.ops) {
+      if (existing.name == name) {
+        op = &existing;
+        break;
+      }
+    }
+    if (op == nullptr) {
+      profile_.ops.emplace_back();
+      op = &profile_.ops.back();
+      op->name = name;
+    }
+    op->invocations++;
+    op->total_us += event->end_timestamp_us - event->begin_timestamp_us;
+  }
+  counters_.Add(profile_);
+}
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
@@ -0,0 +1,142 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICTOR_PROFILER_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICTOR_PROFILER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tensorflow/lite/profiling/buffered_profiler.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+// Time spent in one op of the model during a request, summed over segments.
+struct OpProfile {
+  // Profiling tag of the op, e.g. its custom name.
+  std::string name;
+  int64_t invocations = 0;
+  int64_t total_us = 0;
+};
+
+// Breakdown of one prediction request.
+struct PredictionProfile {
+  // Segments scored, and those served by the response cache.
+  int num_segments = 0;
+  int cache_hits = 0;
+
+  // Wall time of each stage. model_us covers every segment, including cache
+  // lookups; its split by op is in `ops`.
+  int64_t split_sentence_us = 0;
+  int64_t model_us = 0;
+  // Aggregation of the segment responses by label and selection of the best.
+  int64_t merge_us = 0;
+  int64_t backoff_us = 0;
+  int64_t total_us = 0;
+
+  // Ops of the model in order of first invocation.
+  std::vector<OpProfile> ops;
+};
+
+// Profiles summed over requests, e.g. to export as counters.
+struct PredictionCounters {
+  int64_t requests = 0;
+  int64_t segments = 0;
+  int64_t cache_hits = 0;
+  int64_t split_sentence_us = 0;
+  int64_t model_us = 0;
+  int64_t merge_us = 0;
+  int64_t backoff_us = 0;
+  int64_t total_us = 0;
+
+  void Add(const PredictionProfile& profile);
+  void Add(const PredictionCounters& counters);
+};
+
+// Collects a PredictionProfile per request when set in
+// SmartReplyConfig::profiler. Model ops are timed by a tflite BufferedProfiler
+// that the predictor attaches to its interpreter for the duration of the
+// request; the other stages are timed by the predictor itself.
+//
+// A profiler may be shared by several predictors, but not used by two
+// requests at once.
+class SmartReplyProfiler {
+ public:
+  // Op events past `max_op_events` in a request are dropped.
+  explicit SmartReplyProfiler(int max_op_events = 1024);
+
+  SmartReplyProfiler(const SmartReplyProfiler&) = delete;
+  SmartReplyProfiler& operator=(const SmartReplyProfiler&) = delete;
+
+  // Profile of the latest finished request.
+  const PredictionProfile& last_profile() const { return profile_; }
+
+  // Sum of the profiles of all requests since construction or the last
+  // ResetCounters().
+  const PredictionCounters& counters() const { return counters_; }
+  void ResetCounters() { counters_ = PredictionCounters(); }
+
+  // Starts a request, clearing the previous profile.
+  void BeginRequest();
+  // Ends a request: collects the op events and adds the profile to the
+  // counters.
+  void EndRequest();
+
+  // Profile of the current request, for the stage timers.
+  PredictionProfile* mutable_profile() { return &profile_; }
+
+  // Profiler to attach to the interpreter during the request.
+  ::tflite::Profiler* op_profiler() { return &op_profiler_; }
+
+ private:
+  ::tflite::profiling::BufferedProfiler op_profiler_;
+  int64_t request_start_us_ = 0;
+  PredictionProfile profile_;
+  PredictionCounters counters_;
+};
+
+// Microseconds on a monotonic clock.
+int64_t NowMicros();
+
+// Adds the lifetime of the timer to a stage of the profile of `profiler`.
+// Does nothing if `profiler` is null.
+class ScopedStageTimer {
+ public:
+  ScopedStageTimer(SmartReplyProfiler* profiler,
+                   int64_t PredictionProfile::*stage_us)
+      : profiler_(profiler),
+        stage_us_(stage_us),
+        start_us_(profiler ? NowMicros() : 0) {}
+
+  ~ScopedStageTimer() {
+    if (profiler_ != nullptr) {
+      profiler_->mutable_profile()->*stage_us_ += NowMicros() - start_us_;
+    }
+  }
+
+ private:
+  SmartReplyProfiler* profiler_;
+  int64_t PredictionProfile::*stage_us_;
+  int64_t start_us_;
+};
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_PREDICTOR_PROFILER_H_
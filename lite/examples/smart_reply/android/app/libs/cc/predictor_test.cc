@@ -15,12 +15,14 @@ limitations under the License.
 
 #include "cc/predictor.h"
 
+#include <algorithm>
 #include <fstream>
 #include <unordered_set>
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
 #include "tensorflow/core/platform/test.h"
 #include "tensorflow/lite/string_util.h"
@@ -55,6 +57,48 @@ MATCHER_P(IncludeAnyResponesIn, expected_response, "contains the response") {
   return has_expected_response;
 }
 
+std::vector<string> SplitToStrings(const string &input) {
+  SentenceSegments segments;
+  SplitSentence(input, &segments);
+  std::vector<string> result;
+  for (int i = 0; i < segments.size(); i++) {
+    result.push_back(absl::StrJoin(segments.segment(i), " "));
+  }
+  return result;
+}
+
+TEST(SplitSentenceTest, SplitsOnPunctuation) {
+  EXPECT_THAT(SplitToStrings("Hello, how are you?"),
+              ::testing::ElementsAre("Hello ,", "how are you ?"));
+  EXPECT_THAT(SplitToStrings("Wait... what?!  Really"),
+              ::testing::ElementsAre("Wait .", "what !", "Really"));
+  EXPECT_THAT(SplitToStrings("a,b , ,c"),
+              ::testing::ElementsAre("a ,b ,", ",c"));
+}
+
+TEST(SplitSentenceTest, HandlesTabsAndSpaces) {
+  EXPECT_THAT(SplitToStrings("  hi   there  "),
+              ::testing::ElementsAre(" hi there "));
+  EXPECT_THAT(SplitToStrings("a\t\tb\t\t"),
+              ::testing::ElementsAre("a", "", "b"));
+  EXPECT_THAT(SplitToStrings("ok. \t"), ::testing::ElementsAre("ok ."));
+  EXPECT_THAT(SplitToStrings(""), ::testing::ElementsAre(""));
+}
+
+TEST(SplitSentenceTest, SpansPointIntoInput) {
+  const string input = "Yes, sure. Call me!";
+  SentenceSegments segments;
+  SplitSentence(input, &segments);
+  SplitSentence(input, &segments);
+  ASSERT_EQ(segments.size(), 6);
+  for (int i = 0; i < segments.size(); i++) {
+    for (absl::string_view piece : segments.segment(i)) {
+      EXPECT_GE(piece.data(), input.data());
+      EXPECT_LE(piece.data() + piece.size(), input.data() + input.size());
+    }
+  }
+}
+
 class PredictorTest : public ::testing::Test {
  protected:
   PredictorTest() {}
@@ -87,6 +131,33 @@ TEST_F(PredictorTest, GetSegmentPredictions) {
       IncludeAnyResponesIn(std::unordered_set<string>({"Thanks very much"})));
 }
 
+TEST_F(PredictorTest, FusedKernelMatchesUnfused) {
+  std::unique_ptr<SmartReplyPredictor> unfused =
+      SmartReplyPredictor::Create(*model_);
+  std::unique_ptr<SmartReplyPredictor> fused =
+      SmartReplyPredictor::Create(*model_, /*use_fused_kernel=*/true);
+  ASSERT_NE(unfused.get(), nullptr);
+  ASSERT_NE(fused.get(), nullptr);
+
+  string line;
+  std::ifstream fin(GetSamplesFilePath());
+  while (std::getline(fin, line)) {
+    const std::vector<string> fields = absl::StrSplit(line, '\t');
+    if (fields.empty()) {
+      continue;
+    }
+    std::vector<PredictorResponse> expected;
+    unfused->GetSegmentPredictions({fields[0]}, /*config=*/{{}}, &expected);
+    std::vector<PredictorResponse> predictions;
+    fused->GetSegmentPredictions({fields[0]}, /*config=*/{{}}, &predictions);
+    ASSERT_EQ(predictions.size(), expected.size());
+    for (int i = 0; i < predictions.size(); i++) {
+      EXPECT_EQ(predictions[i].GetText(), expected[i].GetText());
+      EXPECT_EQ(predictions[i].GetScore(), expected[i].GetScore());
+    }
+  }
+}
+
 TEST_F(PredictorTest, TestTwoSentences) {
   std::vector<PredictorResponse> predictions;
 
@@ -120,6 +191,217 @@ TEST_F(PredictorTest, TestBackoff) {
   EXPECT_EQ(predictions[1].GetText(), "Ok");
 }
 
+TEST_F(PredictorTest, ReturnsBestNumResponse) {
+  std::unique_ptr<SmartReplyPredictor> predictor =
+      SmartReplyPredictor::Create(*model_);
+  ASSERT_NE(predictor.get(), nullptr);
+  const std::vector<string> input = {"Hello", "How are you?"};
+
+  std::vector<PredictorResponse> all;
+  SmartReplyConfig unlimited({});
+  unlimited.num_response = 1000;
+  predictor->GetSegmentPredictions(input, unlimited, &all);
+  ASSERT_GT(all.size(), 2);
+  for (int i = 1; i < all.size(); i++) {
+    EXPECT_GE(all[i - 1].GetScore(), all[i].GetScore());
+  }
+
+  std::vector<PredictorResponse> best;
+  SmartReplyConfig config({"Backoff"});
+  config.num_response = 2;
+  predictor->GetSegmentPredictions(input, config, &best);
+  ASSERT_EQ(best.size(), 2);
+  for (int i = 0; i < best.size(); i++) {
+    EXPECT_EQ(best[i].GetText(), all[i].GetText());
+    EXPECT_EQ(best[i].GetLabel(), all[i].GetLabel());
+    EXPECT_GE(best[i].GetLabel(), 0);
+    EXPECT_EQ(best[i].GetScore(), all[i].GetScore());
+  }
+
+  // Responses share the label texts and outlive the predictor.
+  predictor.reset();
+  EXPECT_EQ(best[0].GetText(), all[0].GetText());
+  EXPECT_FALSE(best[0].GetText().empty());
+}
+
+TEST_F(PredictorTest, ReusedPredictorMatchesOneShot) {
+  std::unique_ptr<SmartReplyPredictor> predictor =
+      SmartReplyPredictor::Create(*model_);
+  ASSERT_NE(predictor.get(), nullptr);
+
+  // Alternate short and long inputs so that the same interpreter sees
+  // different segment counts and string lengths.
+  const std::vector<std::vector<string>> inputs = {
+      {"Welcome"},
+      {"Hello", "How are you?"},
+      {"Welcome"},
+      {"any chance ur free tonight? let me know when you have time."},
+  };
+  for (const auto &input : inputs) {
+    std::vector<PredictorResponse> expected;
+    GetSegmentPredictions(input, *model_, /*config=*/{{}}, &expected);
+    std::vector<PredictorResponse> predictions;
+    predictor->GetSegmentPredictions(input, /*config=*/{{}}, &predictions);
+
+    ASSERT_EQ(predictions.size(), expected.size());
+    for (int i = 0; i < predictions.size(); i++) {
+      EXPECT_EQ(predictions[i].GetText(), expected[i].GetText());
+      EXPECT_FLOAT_EQ(predictions[i].GetScore(), expected[i].GetScore());
+    }
+  }
+}
+
+TEST_F(PredictorTest, CachedPredictionsMatchUncached) {
+  std::unique_ptr<SmartReplyPredictor> predictor =
+      SmartReplyPredictor::Create(*model_);
+  std::unique_ptr<SmartReplyPredictor> cached =
+      SmartReplyPredictor::Create(*model_);
+  ASSERT_NE(predictor.get(), nullptr);
+  ASSERT_NE(cached.get(), nullptr);
+  SmartReplyConfig config({});
+  config.response_cache_bytes = 1 << 20;
+
+  // Repeated and differently cased messages normalize to the same segments.
+  const std::vector<std::vector<string>> inputs = {
+      {"ok"}, {"Thanks!"}, {"OK"}, {"thanks!!", "ok"}, {"See you. Thanks!"},
+  };
+  for (int iter = 0; iter < 2; iter++) {
+    for (const auto &input : inputs) {
+      std::vector<PredictorResponse> expected;
+      predictor->GetSegmentPredictions(input, /*config=*/{{}}, &expected);
+      std::vector<PredictorResponse> predictions;
+      cached->GetSegmentPredictions(input, config, &predictions);
+
+      ASSERT_EQ(predictions.size(), expected.size());
+      for (int i = 0; i < predictions.size(); i++) {
+        EXPECT_EQ(predictions[i].GetText(), expected[i].GetText());
+        EXPECT_EQ(predictions[i].GetScore(), expected[i].GetScore());
+      }
+    }
+  }
+
+  const ResponseCacheStats stats = cached->response_cache_stats();
+  // "ok", "thanks !", "see you ." are the only distinct segments.
+  EXPECT_EQ(stats.misses, 3);
+  EXPECT_EQ(stats.hits, 11);
+  EXPECT_EQ(stats.evictions, 0);
+  EXPECT_EQ(stats.entries, 3);
+  EXPECT_EQ(predictor->response_cache_stats().misses, 0);
+}
+
+TEST_F(PredictorTest, ConversationMatchesFullRescoring) {
+  std::unique_ptr<SmartReplyPredictor> predictor =
+      SmartReplyPredictor::Create(*model_);
+  ASSERT_NE(predictor.get(), nullptr);
+  const std::vector<string> messages = {
+      "Hello", "How are you?", "any chance ur free tonight?", "Welcome",
+      "Thanks! See you soon."};
+  const int kWindow = 3;
+  SmartReplyConfig config({"Ok"});
+
+  SmartReplyConversation conversation(kWindow);
+  for (int i = 0; i < messages.size(); i++) {
+    predictor->AddMessage(messages[i], config, &conversation);
+    const int begin = std::max(0, i + 1 - kWindow);
+    ASSERT_EQ(conversation.num_messages(), i + 1 - begin);
+
+    std::vector<PredictorResponse> expected;
+    predictor->GetSegmentPredictions(
+        std::vector<string>(messages.begin() + begin,
+                            messages.begin() + i + 1),
+        config, &expected);
+    std::vector<PredictorResponse> predictions;
+    conversation.GetPredictions(config, &predictions);
+
+    ASSERT_EQ(predictions.size(), expected.size());
+    for (int j = 0; j < predictions.size(); j++) {
+      EXPECT_EQ(predictions[j].GetText(), expected[j].GetText());
+      EXPECT_EQ(predictions[j].GetScore(), expected[j].GetScore());
+    }
+  }
+
+  conversation.DropOldestMessage();
+  EXPECT_EQ(conversation.num_messages(), kWindow - 1);
+}
+
+TEST_F(PredictorTest, ConversationAcrossPredictors) {
+  std::unique_ptr<SmartReplyPredictor> first =
+      SmartReplyPredictor::Create(*model_);
+  std::unique_ptr<SmartReplyPredictor> second =
+      SmartReplyPredictor::Create(*model_);
+  ASSERT_NE(first.get(), nullptr);
+  ASSERT_NE(second.get(), nullptr);
+  SmartReplyConfig config({"Ok"});
+  // Let the predictors see responses in different orders.
+  std::vector<PredictorResponse> ignored;
+  second->GetSegmentPredictions({"Thanks! See you soon."}, config, &ignored);
+
+  const std::vector<string> messages = {"Hello", "How are you?",
+                                        "Thanks! See you soon."};
+  SmartReplyConversation conversation;
+  for (int i = 0; i < messages.size(); i++) {
+    (i % 2 == 0 ? first : second)
+        ->AddMessage(messages[i], config, &conversation);
+  }
+  std::vector<PredictorResponse> expected;
+  first->GetSegmentPredictions(messages, config, &expected);
+  std::vector<PredictorResponse> predictions;
+  conversation.GetPredictions(config, &predictions);
+
+  ASSERT_EQ(predictions.size(), expected.size());
+  for (int j = 0; j < predictions.size(); j++) {
+    EXPECT_EQ(predictions[j].GetText(), expected[j].GetText());
+    EXPECT_EQ(predictions[j].GetScore(), expected[j].GetScore());
+  }
+}
+
+TEST_F(PredictorTest, ProfilerReportsStagesAndOps) {
+  std::unique_ptr<SmartReplyPredictor> predictor =
+      SmartReplyPredictor::Create(*model_);
+  ASSERT_NE(predictor.get(), nullptr);
+  SmartReplyProfiler profiler;
+  SmartReplyConfig config({"Ok"});
+  config.response_cache_bytes = 1 << 20;
+  config.profiler = &profiler;
+
+  const std::vector<string> input = {"Hello", "How are you? Thanks!"};
+  std::vector<PredictorResponse> expected;
+  predictor->GetSegmentPredictions(input, /*config=*/{{"Ok"}}, &expected);
+  for (int iter = 0; iter < 2; iter++) {
+    std::vector<PredictorResponse> predictions;
+    predictor->GetSegmentPredictions(input, config, &predictions);
+    ASSERT_EQ(predictions.size(), expected.size());
+    for (int i = 0; i < predictions.size(); i++) {
+      EXPECT_EQ(predictions[i].GetText(), expected[i].GetText());
+      EXPECT_EQ(predictions[i].GetScore(), expected[i].GetScore());
+    }
+  }
+
+  // The second request is served by the cache, without running any op.
+  const PredictionProfile &profile = profiler.last_profile();
+  EXPECT_EQ(profile.num_segments, 3);
+  EXPECT_EQ(profile.cache_hits, 3);
+  EXPECT_TRUE(profile.ops.empty());
+  EXPECT_GE(profile.total_us, profile.split_sentence_us + profile.model_us +
+                                  profile.merge_us + profile.backoff_us);
+
+  const PredictionCounters &counters = profiler.counters();
+  EXPECT_EQ(counters.requests, 2);
+  EXPECT_EQ(counters.segments, 6);
+  EXPECT_EQ(counters.cache_hits, 3);
+
+  // Without the cache every segment runs the model ops.
+  config.response_cache_bytes = 0;
+  std::vector<PredictorResponse> predictions;
+  predictor->GetSegmentPredictions(input, config, &predictions);
+  ASSERT_FALSE(profile.ops.empty());
+  for (const OpProfile &op : profile.ops) {
+    EXPECT_EQ(op.invocations % 3, 0) << op.name;
+  }
+  profiler.ResetCounters();
+  EXPECT_EQ(profiler.counters().requests, 0);
+}
+
 TEST_F(PredictorTest, BatchTest) {
   int total_items = 0;
   int total_responses = 0;
@@ -0,0 +1,112 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Rewrites the weight and label tables of the PREDICT ops of a model into
+// their compact storage types.
+//
+// Usage:
+//   quantize_predict_weights <input.tflite> <output.tflite> [int8|float16]
+//
+// Float32 weights become int8 with a symmetric per-tensor scale of
+// max|w| / 127 (the default), or float16. int32 labels become int16 when all
+// of them fit. The resulting score error bounds are documented in
+// ops/predict.h; the largest error of each converted table is reported on
+// stderr.
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cc/predict_weight_quantizer.h"
+#include "tensorflow/lite/model.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+namespace {
+
+int Run(int argc, char** argv) {
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr,
+            "Usage: %s <input.tflite> <output.tflite> [int8|float16]\n",
+            argv[0]);
+    return 1;
+  }
+  const std::string weight_type = argc == 4 ? argv[3] : "int8";
+  if (weight_type != "int8" && weight_type != "float16") {
+    fprintf(stderr, "Unsupported weight type: %s\n", argv[3]);
+    return 1;
+  }
+
+  std::unique_ptr<FlatBufferModel> input =
+      FlatBufferModel::BuildFromFile(argv[1]);
+  if (!input) {
+    fprintf(stderr, "Failed to load model %s\n", argv[1]);
+    return 1;
+  }
+  std::unique_ptr<ModelT> model(input->GetModel()->UnPack());
+
+  std::vector<ConvertedTable> tables;
+  const int num_ops = QuantizePredictTables(
+      weight_type == "int8" ? PredictWeightType::kInt8
+                            : PredictWeightType::kFloat16,
+      model.get(), &tables);
+  if (num_ops == 0) {
+    fprintf(stderr, "No %s op in %s\n", kPredictOp, argv[1]);
+    return 1;
+  }
+  for (const ConvertedTable& table : tables) {
+    if (table.from == TensorType_INT32) {
+      fprintf(stderr,
+              table.to == TensorType_INT16
+                  ? "%s: int32 -> int16\n"
+                  : "%s: labels do not fit int16, kept int32\n",
+              table.name.c_str());
+    } else {
+      fprintf(stderr, "%s: float32 -> %s, max error %g\n", table.name.c_str(),
+              weight_type.c_str(), table.max_error);
+    }
+  }
+
+  flatbuffers::FlatBufferBuilder builder;
+  builder.Finish(Model::Pack(builder, model.get()), ModelIdentifier());
+  FILE* output = fopen(argv[2], "wb");
+  if (output == nullptr) {
+    fprintf(stderr, "Failed to open %s\n", argv[2]);
+    return 1;
+  }
+  const bool write_ok =
+      fwrite(builder.GetBufferPointer(), 1, builder.GetSize(), output) ==
+          builder.GetSize() &&
+      fclose(output) == 0;
+  if (!write_ok) {
+    fprintf(stderr, "Failed to write %s\n", argv[2]);
+    return 1;
+  }
+  fprintf(stderr, "%d %s ops, %zu -> %u bytes\n", num_ops, kPredictOp,
+          input->allocation()->bytes(), builder.GetSize());
+  return 0;
+}
+
+}  // namespace
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+int main(int argc, char** argv) {
+  return ::tflite::custom::smartreply::Run(argc, argv);
+}
@@ -0,0 +1,88 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/response_cache.h"
+
+#include <iterator>
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+// List node, hash slot and allocator bookkeeping of one entry.
+static const size_t kEntryOverhead = 96;
+
+ResponseCache::ResponseCache(size_t memory_budget)
+    : memory_budget_(memory_budget) {}
+
+/* static */
+size_t ResponseCache::EstimateBytes(absl::string_view key,
+                                    const SegmentResponses& responses) {
+  return kEntryOverhead + sizeof(Entry) + key.size() +
+         responses.labels.size() * sizeof(int) +
+         responses.scores.size() * sizeof(float);
+}
+
+const SegmentResponses* ResponseCache::Lookup(absl::string_view key) {
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    stats_.misses++;
+    return nullptr;
+  }
+  stats_.hits++;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return &it->second->responses;
+}
+
+bool ResponseCache::Insert(absl::string_view key,
+                           const SegmentResponses& responses) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    Erase(it->second);
+  }
+  const size_t bytes = EstimateBytes(key, responses);
+  if (bytes > memory_budget_) {
+    return false;
+  }
+  entries_.push_front(Entry{std::string(key), responses, bytes});
+  index_.emplace(entries_.front().key, entries_.begin());
+  stats_.entries++;
+  stats_.bytes += bytes;
+  EvictToBudget();
+  return true;
+}
+
+void ResponseCache::set_memory_budget(size_t memory_budget) {
+  memory_budget_ = memory_budget;
+  EvictToBudget();
+}
+
+void ResponseCache::Erase(EntryList::iterator entry) {
+  stats_.entries--;
+  stats_.bytes -= entry->bytes;
+  index_.erase(entry->key);
+  entries_.erase(entry);
+}
+
+void ResponseCache::EvictToBudget() {
+  while (stats_.bytes > memory_budget_) {
+    Erase(std::prev(entries_.end()));
+    stats_.evictions++;
+  }
+}
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
@@ -0,0 +1,110 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_RESPONSE_CACHE_H_
+#define TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_RESPONSE_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+
+// Weighted response labels the model produced for one segment, in output
+// order.
+struct SegmentResponses {
+  std::vector<int> labels;
+  std::vector<float> scores;
+
+  void Clear() {
+    labels.clear();
+    scores.clear();
+  }
+};
+
+// Counters of a ResponseCache.
+struct ResponseCacheStats {
+  int64_t hits = 0;
+  int64_t misses = 0;
+  int64_t evictions = 0;
+  // Current number of entries and their estimated footprint.
+  int entries = 0;
+  size_t bytes = 0;
+};
+
+// Bounded LRU cache of SegmentResponses keyed by normalized segment text.
+//
+// The footprint of each entry is estimated from its key, labels and scores
+// plus a fixed per-entry overhead. Least recently used entries are
+// evicted once the total exceeds the memory budget; an entry larger than the
+// whole budget is not cached at all.
+//
+// A ResponseCache is not thread-safe.
+class ResponseCache {
+ public:
+  explicit ResponseCache(size_t memory_budget);
+
+  ResponseCache(const ResponseCache&) = delete;
+  ResponseCache& operator=(const ResponseCache&) = delete;
+
+  // Returns the responses cached for `key` and marks them most recently used,
+  // or nullptr on a miss. The pointer is valid until the next Insert() or
+  // set_memory_budget().
+  const SegmentResponses* Lookup(absl::string_view key);
+
+  // Caches `responses` under `key`, replacing any previous entry, and evicts
+  // entries until the cache fits its budget. Returns false if the entry alone
+  // exceeds the budget and was not cached.
+  bool Insert(absl::string_view key, const SegmentResponses& responses);
+
+  // Changes the budget, evicting entries that no longer fit.
+  void set_memory_budget(size_t memory_budget);
+  size_t memory_budget() const { return memory_budget_; }
+
+  const ResponseCacheStats& stats() const { return stats_; }
+
+ private:
+  struct Entry {
+    std::string key;
+    SegmentResponses responses;
+    size_t bytes;
+  };
+  using EntryList = std::list<Entry>;
+
+  static size_t EstimateBytes(absl::string_view key,
+                              const SegmentResponses& responses);
+  void Erase(EntryList::iterator entry);
+  void EvictToBudget();
+
+  size_t memory_budget_;
+  // Most recently used first.
+  EntryList entries_;
+  // Keys point into the entries they index.
+  absl::flat_hash_map<absl::string_view, EntryList::iterator> index_;
+  ResponseCacheStats stats_;
+};
+
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+#endif  // TENSORFLOW_LITE_EXAMPLES_SMARTREPLY_RESPONSE_CACHE_H_
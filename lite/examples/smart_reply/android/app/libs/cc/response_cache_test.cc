@@ -0,0 +1,107 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "cc/response_cache.h"
+
+#include <string>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+namespace {
+
+SegmentResponses MakeResponses(int label, float score) {
+  SegmentResponses responses;
+  responses.labels.push_back(label);
+  responses.scores.push_back(score);
+  return responses;
+}
+
+TEST(ResponseCacheTest, HitsAndMisses) {
+  ResponseCache cache(1 << 20);
+  EXPECT_EQ(cache.Lookup("<S> ok <E>"), nullptr);
+  EXPECT_TRUE(cache.Insert("<S> ok <E>", MakeResponses(7, 0.5)));
+
+  const SegmentResponses* cached = cache.Lookup("<S> ok <E>");
+  ASSERT_NE(cached, nullptr);
+  EXPECT_THAT(cached->labels, ::testing::ElementsAre(7));
+  EXPECT_THAT(cached->scores, ::testing::ElementsAre(0.5));
+
+  EXPECT_EQ(cache.stats().hits, 1);
+  EXPECT_EQ(cache.stats().misses, 1);
+  EXPECT_EQ(cache.stats().evictions, 0);
+  EXPECT_EQ(cache.stats().entries, 1);
+  EXPECT_GT(cache.stats().bytes, 0);
+}
+
+TEST(ResponseCacheTest, InsertReplacesEntry) {
+  ResponseCache cache(1 << 20);
+  cache.Insert("key", MakeResponses(1, 0.1));
+  const size_t bytes = cache.stats().bytes;
+  cache.Insert("key", MakeResponses(2, 0.2));
+  EXPECT_EQ(cache.stats().entries, 1);
+  EXPECT_EQ(cache.stats().bytes, bytes);
+  EXPECT_THAT(cache.Lookup("key")->labels, ::testing::ElementsAre(2));
+}
+
+TEST(ResponseCacheTest, EvictsLeastRecentlyUsed) {
+  ResponseCache probe(1 << 20);
+  probe.Insert("a", MakeResponses(1, 1));
+  const size_t entry_bytes = probe.stats().bytes;
+
+  ResponseCache cache(2 * entry_bytes);
+  cache.Insert("a", MakeResponses(1, 1));
+  cache.Insert("b", MakeResponses(2, 2));
+  // Touch "a" so that "b" is the least recently used.
+  ASSERT_NE(cache.Lookup("a"), nullptr);
+  cache.Insert("c", MakeResponses(3, 3));
+
+  EXPECT_EQ(cache.stats().entries, 2);
+  EXPECT_EQ(cache.stats().evictions, 1);
+  EXPECT_NE(cache.Lookup("a"), nullptr);
+  EXPECT_EQ(cache.Lookup("b"), nullptr);
+  EXPECT_NE(cache.Lookup("c"), nullptr);
+}
+
+TEST(ResponseCacheTest, RespectsMemoryBudget) {
+  ResponseCache cache(1 << 20);
+  for (int i = 0; i < 100; i++) {
+    cache.Insert(std::to_string(i), MakeResponses(i, i));
+  }
+  EXPECT_EQ(cache.stats().entries, 100);
+
+  cache.set_memory_budget(cache.stats().bytes / 4);
+  EXPECT_LE(cache.stats().bytes, cache.memory_budget());
+  EXPECT_EQ(cache.stats().evictions, 100 - cache.stats().entries);
+  // The most recent entries survive.
+  EXPECT_NE(cache.Lookup("99"), nullptr);
+  EXPECT_EQ(cache.Lookup("0"), nullptr);
+
+  // An entry larger than the whole budget is not cached.
+  EXPECT_FALSE(cache.Insert(std::string(1 << 20, 'x'), MakeResponses(1, 1)));
+  EXPECT_EQ(cache.Lookup(std::string(1 << 20, 'x')), nullptr);
+
+  cache.set_memory_budget(0);
+  EXPECT_EQ(cache.stats().entries, 0);
+  EXPECT_EQ(cache.stats().bytes, 0);
+}
+
+}  // namespace
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
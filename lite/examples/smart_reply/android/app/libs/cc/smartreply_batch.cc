@@ -0,0 +1,345 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Offline batch scorer over TSV corpora.
+//
+// Usage:
+//   smartreply_batch <model.tflite> <input.tsv> <output.tsv> [num_threads]
+//
+// Each input line is a message, optionally followed by tab-separated expected
+// replies as in smartreply_samples.tsv. Each output line is the message
+// followed by its predicted replies and scores, tab-separated, in input order;
+// output line N is the result of input line N, blank lines giving blank lines.
+//
+// The input is memory-mapped and its lines are scored in chunks by a pool of
+// worker threads, each with its own SmartReplyPredictor. Finished chunks are
+// written in order as soon as all preceding chunks are written, and workers
+// stay at most kMaxChunksAheadPerThread chunks per thread ahead of the writer,
+// which bounds the memory held by pending output. Throughput,
+// per-stage time, and the trigger and coverage stats of
+// PredictorTest.BatchTest are reported on stderr.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
+#include <condition_variable>  // NOLINT(build/c++11)
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>  // NOLINT(build/c++11)
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "cc/predictor.h"
+#include "tensorflow/lite/model.h"
+
+namespace tflite {
+namespace custom {
+namespace smartreply {
+namespace {
+
+// Lines scored per unit of work handed to a worker.
+const int kChunkSize = 256;
+// Chunks per worker that may be scored ahead of the next chunk to write.
+const int kMaxChunksAheadPerThread = 2;
+
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+ public:
+  ~MappedFile() {
+    if (data_ != nullptr) munmap(data_, size_);
+  }
+
+  // Returns nullptr if the file cannot be mapped.
+  static std::unique_ptr<MappedFile> Open(const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return nullptr;
+    }
+    std::unique_ptr<MappedFile> file(new MappedFile);
+    file->size_ = st.st_size;
+    if (file->size_ > 0) {
+      void* data = mmap(nullptr, file->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+      }
+      file->data_ = data;
+      madvise(data, file->size_, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return file;
+  }
+
+  absl::string_view contents() const {
+    return absl::string_view(static_cast<const char*>(data_), size_);
+  }
+
+ private:
+  MappedFile() = default;
+
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Stats of PredictorTest.BatchTest, summed over lines.
+struct BatchStats {
+  int64_t items = 0;
+  int64_t responses = 0;
+  int64_t triggers = 0;
+  // Lines with expected replies, and those predicting at least one of them.
+  int64_t labeled = 0;
+  int64_t covered = 0;
+  Clock::duration predict_time = Clock::duration::zero();
+
+  void Add(const BatchStats& other) {
+    items += other.items;
+    responses += other.responses;
+    triggers += other.triggers;
+    labeled += other.labeled;
+    covered += other.covered;
+    predict_time += other.predict_time;
+  }
+};
+
+// Scores `lines` and appends one output line per input line to `output`.
+void ScoreChunk(SmartReplyPredictor* predictor,
+                const std::vector<absl::string_view>& lines,
+                const SmartReplyConfig& config, std::string* output,
+                BatchStats* stats) {
+  std::vector<std::string> input(1);
+  std::vector<PredictorResponse> predictions;
+  for (absl::string_view line : lines) {
+    if (line.empty()) {
+      output->push_back('\n');
+      continue;
+    }
+    const std::vector<absl::string_view> fields = absl::StrSplit(line, '\t');
+    input[0].assign(fields[0].data(), fields[0].size());
+    predictions.clear();
+    const Clock::time_point start = Clock::now();
+    predictor->GetSegmentPredictions(input, config, &predictions);
+    stats->predict_time += Clock::now() - start;
+
+    stats->items++;
+    stats->responses += predictions.size();
+    if (!predictions.empty()) {
+      stats->triggers++;
+    }
+    if (fields.size() > 1) {
+      stats->labeled++;
+      for (const PredictorResponse& prediction : predictions) {
+        if (std::find(fields.begin() + 1, fields.end(),
+                      prediction.GetText()) != fields.end()) {
+          stats->covered++;
+          break;
+        }
+      }
+    }
+
+    absl::StrAppend(output, fields[0]);
+    for (const PredictorResponse& prediction : predictions) {
+      absl::StrAppend(output, "\t", prediction.GetText(), "\t",
+                      prediction.GetScore());
+    }
+    output->push_back('\n');
+  }
+}
+
+int Run(int argc, char** argv) {
+  if (argc < 4 || argc > 5) {
+    fprintf(stderr,
+            "Usage: %s <model.tflite> <input.tsv> <output.tsv> "
+            "[num_threads]\n",
+            argv[0]);
+    return 1;
+  }
+  const int num_threads =
+      argc == 5 ? atoi(argv[4])
+                : std::max<int>(1, std::thread::hardware_concurrency());
+  if (num_threads <= 0) {
+    fprintf(stderr, "Invalid number of threads: %s\n", argv[4]);
+    return 1;
+  }
+  const Clock::time_point start = Clock::now();
+
+  // Load the model and one predictor per worker.
+  std::unique_ptr<FlatBufferModel> model =
+      FlatBufferModel::BuildFromFile(argv[1]);
+  if (!model) {
+    fprintf(stderr, "Failed to load model %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<std::unique_ptr<SmartReplyPredictor>> predictors;
+  for (int i = 0; i < num_threads; i++) {
+    predictors.push_back(SmartReplyPredictor::Create(*model));
+    if (!predictors.back()) {
+      return 1;
+    }
+  }
+  const Clock::time_point loaded = Clock::now();
+
+  // Map the input and index its lines.
+  std::unique_ptr<MappedFile> input = MappedFile::Open(argv[2]);
+  if (!input) {
+    fprintf(stderr, "Failed to map %s\n", argv[2]);
+    return 1;
+  }
+  FILE* output = fopen(argv[3], "w");
+  if (output == nullptr) {
+    fprintf(stderr, "Failed to open %s\n", argv[3]);
+    return 1;
+  }
+  // Blank lines are kept so that output lines match input lines; only the
+  // empty piece after a final newline is not a line.
+  std::vector<absl::string_view> lines =
+      absl::StrSplit(input->contents(), '\n');
+  if (lines.back().empty()) {
+    lines.pop_back();
+  }
+  const int num_chunks = (lines.size() + kChunkSize - 1) / kChunkSize;
+  const Clock::time_point indexed = Clock::now();
+
+  // Workers claim chunks in order; the main thread writes them in order.
+  const int max_chunks_ahead = kMaxChunksAheadPerThread * num_threads;
+  std::vector<std::string> chunk_outputs(num_chunks);
+  std::vector<bool> chunk_done(num_chunks, false);
+  std::mutex mu;
+  std::condition_variable chunk_finished;
+  std::condition_variable chunk_written;
+  // Guarded by `mu`.
+  int next_write = 0;
+  bool aborted = false;
+  std::atomic<int> next_chunk(0);
+  std::vector<BatchStats> thread_stats(num_threads);
+  const SmartReplyConfig config({});
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; t++) {
+    workers.emplace_back([&, t]() {
+      std::vector<absl::string_view> chunk_lines;
+      for (int chunk = next_chunk++; chunk < num_chunks;
+           chunk = next_chunk++) {
+        {
+          std::unique_lock<std::mutex> lock(mu);
+          chunk_written.wait(lock, [&]() {
+            return aborted || chunk < next_write + max_chunks_ahead;
+          });
+          if (aborted) return;
+        }
+        const int begin = chunk * kChunkSize;
+        const int end = std::min<int>(begin + kChunkSize, lines.size());
+        chunk_lines.assign(lines.begin() + begin, lines.begin() + end);
+        std::string chunk_output;
+        ScoreChunk(predictors[t].get(), chunk_lines, config, &chunk_output,
+                   &thread_stats[t]);
+        std::lock_guard<std::mutex> lock(mu);
+        chunk_outputs[chunk] = std::move(chunk_output);
+        chunk_done[chunk] = true;
+        chunk_finished.notify_one();
+      }
+    });
+  }
+
+  Clock::duration write_time = Clock::duration::zero();
+  bool write_ok = true;
+  for (int chunk = 0; chunk < num_chunks && write_ok; chunk++) {
+    std::string chunk_output;
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      chunk_finished.wait(lock, [&]() { return chunk_done[chunk]; });
+      chunk_output.swap(chunk_outputs[chunk]);
+      next_write = chunk + 1;
+    }
+    chunk_written.notify_all();
+    const Clock::time_point write_start = Clock::now();
+    write_ok = fwrite(chunk_output.data(), 1, chunk_output.size(), output) ==
+               chunk_output.size();
+    write_time += Clock::now() - write_start;
+  }
+  if (!write_ok) {
+    // Stop the workers before their next chunk.
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      aborted = true;
+    }
+    chunk_written.notify_all();
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  write_ok = fclose(output) == 0 && write_ok;
+  const Clock::time_point done = Clock::now();
+  if (!write_ok) {
+    fprintf(stderr, "Failed to write %s\n", argv[3]);
+    return 1;
+  }
+
+  BatchStats stats;
+  for (const BatchStats& s : thread_stats) {
+    stats.Add(s);
+  }
+  const double score_seconds = Seconds(done - indexed);
+  fprintf(stderr, "messages: %lld, threads: %d, %.0f messages/sec\n",
+          static_cast<long long>(stats.items), num_threads,
+          stats.items / std::max(score_seconds, 1e-9));
+  fprintf(stderr,
+          "stages: load %.3fs, index %.3fs, score %.3fs (predict %.3fs "
+          "summed over threads), write %.3fs, total %.3fs\n",
+          Seconds(loaded - start), Seconds(indexed - loaded), score_seconds,
+          Seconds(stats.predict_time), Seconds(write_time),
+          Seconds(done - start));
+  fprintf(stderr,
+          "triggers: %lld/%lld (%.2f%%), responses per trigger: %.2f, "
+          "coverage: %lld/%lld (%.2f%%)\n",
+          static_cast<long long>(stats.triggers),
+          static_cast<long long>(stats.items),
+          100.0 * stats.triggers / std::max<int64_t>(stats.items, 1),
+          static_cast<double>(stats.responses) /
+              std::max<int64_t>(stats.triggers, 1),
+          static_cast<long long>(stats.covered),
+          static_cast<long long>(stats.labeled),
+          100.0 * stats.covered / std::max<int64_t>(stats.labeled, 1));
+  return 0;
+}
+
+}  // namespace
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+int main(int argc, char** argv) {
+  return ::tflite::custom::smartreply::Run(argc, argv);
+}
@@ -0,0 +1,577 @@
+/* Copyright 2019 The TensorFlow Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks of the SmartReply custom ops and of the end-to-end predictor.
+//
+// Besides the timings of Google Benchmark, every case reports the p50, p95 and
+// p99 latency of a single call, heap allocations per call and throughput as
+// counters. For machine-readable output, run with --benchmark_format=json, or
+// with --benchmark_out=<file> --benchmark_out_format=json.
+//
+// Latencies are measured around each call with std::chrono::steady_clock, so
+// they include its overhead of a few tens of nanoseconds.
+//
+// Cases suffixed with Reference run the implementation an op replaced, with
+// the same arguments as the op's case, so one run shows the speedup.
+
+#include <algorithm>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "benchmark/benchmark.h"
+#include "cc/predictor.h"
+#include "cc/predictor_pool.h"
+#include "re2/re2.h"
+#include "tensorflow/lite/interpreter.h"
+#include "tensorflow/lite/model.h"
+#include "tensorflow/lite/string_util.h"
+#include <farmhash.h>
+
+// Heap allocations of the calling thread, counted by the replaced global
+// operator new below, so that threaded cases count only their own calls.
+static thread_local int64_t g_num_allocations = 0;
+
+void* operator new(size_t size) {
+  g_num_allocations++;
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+namespace tflite {
+namespace ops {
+namespace custom {
+TfLiteRegistration* Register_NORMALIZE();
+TfLiteRegistration* Register_EXTRACT_FEATURES();
+TfLiteRegistration* Register_PREDICT();
+}  // namespace custom
+}  // namespace ops
+
+namespace custom {
+namespace smartreply {
+namespace {
+
+const char kSmartReply[] = "cc/testdata/";  // NOLINT
+const char kModel[] = "smartreply.tflite";
+const char kSamples[] = "smartreply_samples.tsv";
+
+// Number of model keys and items per key of the PREDICT benchmark.
+const int kNumModelKeys = 100000;
+const int kItemsPerKey = 3;
+
+// Records the latency and allocations of every benchmarked call, and reports
+// them as counters when destroyed.
+class CallRecorder {
+ public:
+  explicit CallRecorder(benchmark::State* state) : state_(state) {
+    latencies_ns_.reserve(1 << 16);
+  }
+
+  ~CallRecorder() {
+    const int num_calls = latencies_ns_.size();
+    if (num_calls == 0) {
+      return;
+    }
+    std::sort(latencies_ns_.begin(), latencies_ns_.end());
+    auto percentile = [this, num_calls](double p) {
+      return static_cast<double>(
+          latencies_ns_[std::min<int>(num_calls - 1, p * num_calls)]);
+    };
+    // Averaged over the threads of threaded cases, whose rates add up.
+    const auto average = [](double value) {
+      return benchmark::Counter(value, benchmark::Counter::kAvgThreads);
+    };
+    state_->counters["p50_ns"] = average(percentile(0.50));
+    state_->counters["p95_ns"] = average(percentile(0.95));
+    state_->counters["p99_ns"] = average(percentile(0.99));
+    state_->counters["allocs_per_call"] =
+        average(static_cast<double>(num_allocations_) / num_calls);
+    state_->counters["calls_per_second"] =
+        benchmark::Counter(num_calls, benchmark::Counter::kIsRate);
+  }
+
+  // Runs `call` once, recording its latency and allocations.
+  template <typename Call>
+  void Record(Call&& call) {
+    const int64_t allocations = g_num_allocations;
+    const auto start = std::chrono::steady_clock::now();
+    call();
+    const auto end = std::chrono::steady_clock::now();
+    num_allocations_ += g_num_allocations - allocations;
+    latencies_ns_.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+  }
+
+ private:
+  benchmark::State* state_;
+  std::vector<int64_t> latencies_ns_;
+  int64_t num_allocations_ = 0;
+};
+
+// Random words of 2 to 8 lowercase letters, with some punctuation.
+std::vector<std::string> RandomWords(int count, std::mt19937* rng) {
+  static const char kPunctuation[] = "?!.,'";
+  std::vector<std::string> words;
+  for (int i = 0; i < count; i++) {
+    std::string word;
+    for (int len = 2 + (*rng)() % 7; len > 0; len--) {
+      word += static_cast<char>('a' + (*rng)() % 26);
+    }
+    if ((*rng)() % 8 == 0) {
+      word += kPunctuation[(*rng)() % (sizeof(kPunctuation) - 1)];
+    }
+    words.push_back(word);
+  }
+  return words;
+}
+
+std::vector<std::string> ReadSampleMessages() {
+  std::vector<std::string> messages;
+  std::string line;
+  std::ifstream fin(absl::StrCat(kSmartReply, kSamples));
+  while (std::getline(fin, line)) {
+    const std::vector<std::string> fields = absl::StrSplit(line, '\t');
+    if (!fields.empty()) {
+      messages.push_back(fields[0]);
+    }
+  }
+  return messages;
+}
+
+// Interpreter running a single custom op. Inputs are non-constant unless set
+// with SetConstValues().
+class SingleOp {
+ public:
+  SingleOp(TfLiteRegistration* registration,
+           const std::vector<TfLiteType>& input_types,
+           const std::vector<TfLiteType>& output_types,
+           const std::vector<char>& options = {}) {
+    const int num_inputs = input_types.size();
+    const int num_outputs = output_types.size();
+    interpreter_.AddTensors(num_inputs + num_outputs);
+    std::vector<int> inputs, outputs;
+    for (int i = 0; i < num_inputs; i++) {
+      interpreter_.SetTensorParametersReadWrite(i, input_types[i], "", {1},
+                                                TfLiteQuantizationParams());
+      inputs.push_back(i);
+    }
+    for (int i = 0; i < num_outputs; i++) {
+      interpreter_.SetTensorParametersReadWrite(
+          num_inputs + i, output_types[i], "", {1}, TfLiteQuantizationParams());
+      outputs.push_back(num_inputs + i);
+    }
+    interpreter_.SetInputs(inputs);
+    interpreter_.SetOutputs(outputs);
+    interpreter_.AddNodeWithParameters(inputs, outputs, options.data(),
+                                       options.size(), nullptr, registration);
+  }
+
+  void SetStrings(int input, const std::vector<std::string>& strings) {
+    pending_.push_back([this, input, strings]() {
+      DynamicBuffer buf;
+      for (const std::string& s : strings) {
+        buf.AddString(s.data(), s.size());
+      }
+      buf.WriteToTensorAsVector(interpreter_.tensor(input));
+    });
+  }
+
+  template <typename T>
+  void SetValues(int input, const std::vector<int>& shape,
+                 const std::vector<T>& values) {
+    interpreter_.ResizeInputTensor(input, shape);
+    pending_.push_back([this, input, values]() {
+      memcpy(interpreter_.typed_tensor<T>(input), values.data(),
+             values.size() * sizeof(T));
+    });
+  }
+
+  // Makes `input` a constant tensor backed by `values`, which must outlive
+  // the op, as the tensors of a model loaded from a file.
+  template <typename T>
+  void SetConstValues(int input, TfLiteType type, const std::vector<int>& shape,
+                      const std::vector<T>& values) {
+    interpreter_.SetTensorParametersReadOnly(
+        input, type, "", shape, TfLiteQuantizationParams(),
+        reinterpret_cast<const char*>(values.data()),
+        values.size() * sizeof(T));
+  }
+
+  // Allocates tensors and writes the inputs set before.
+  bool Allocate() {
+    if (interpreter_.AllocateTensors() != kTfLiteOk) {
+      return false;
+    }
+    for (const auto& set : pending_) set();
+    pending_.clear();
+    return true;
+  }
+
+  Interpreter* interpreter() { return &interpreter_; }
+
+ private:
+  Interpreter interpreter_;
+  std::vector<std::function<void()>> pending_;
+};
+
+// Normalizes a sentence of state.range(0) words.
+void BM_Normalize(benchmark::State& state) {
+  std::mt19937 rng(42);
+  const std::vector<std::string> words = RandomWords(state.range(0), &rng);
+  SingleOp op(::tflite::ops::custom::Register_NORMALIZE(), {kTfLiteString},
+              {kTfLiteString});
+  std::string sentence;
+  for (const std::string& word : words) {
+    absl::StrAppend(&sentence, sentence.empty() ? "" : " ", word);
+  }
+  op.SetStrings(0, {sentence});
+  if (!op.Allocate()) {
+    state.SkipWithError("AllocateTensors failed");
+    return;
+  }
+  CallRecorder recorder(&state);
+  for (auto _ : state) {
+    recorder.Record([&]() { op.interpreter()->Invoke(); });
+  }
+  state.SetBytesProcessed(state.iterations() * sentence.size());
+}
+BENCHMARK(BM_Normalize)->Arg(4)->Arg(16)->Arg(64)->Arg(256);
+
+// The RE2 pipeline NORMALIZE used before Normalizer, as in normalize_test.
+std::string RegexNormalize(const std::string& input) {
+  static const std::map<std::string, std::string>* kRegexTransforms =
+      new std::map<std::string, std::string>({
+          {"([^\\s]+)n't", "\\1 not"},
+          {"([^\\s]+)'nt", "\\1 not"},
+          {"([^\\s]+)'ll", "\\1 will"},
+          {"([^\\s]+)'re", "\\1 are"},
+          {"([^\\s]+)'ve", "\\1 have"},
+          {"i'm", "i am"},
+      });
+
+  std::string result(absl::AsciiStrToLower(input));
+  absl::StripAsciiWhitespace(&result);
+  RE2::GlobalReplace(&result, "[.*()\"]", "");
+  RE2::GlobalReplace(&result, "\\s('t|'nt|n't|'d|'ll|'s|'m|'ve|'re)([\\s,;:/])",
+                     "\\1\\2");
+  RE2::GlobalReplace(&result, "\\s('t|'nt|n't|'d|'ll|'s|'m|'ve|'re)$", "\\1");
+  for (auto iter = kRegexTransforms->begin(); iter != kRegexTransforms->end();
+       iter++) {
+    RE2::GlobalReplace(&result, iter->first, iter->second);
+  }
+  RE2::GlobalReplace(&result, "([?])+", "\\1");
+  RE2::GlobalReplace(&result, "([!])+", "\\1");
+  RE2::GlobalReplace(&result, "([^?!]+)([?!])", "\\1 \\2 ");
+  RE2::GlobalReplace(&result, "([?!])([?!])", "\\1 \\2");
+  RE2::GlobalReplace(&result, "[\\s,:;\\-&'\"]+$", "");
+  RE2::GlobalReplace(&result, "^[\\s,:;\\-&'\"]+", "");
+  absl::StripAsciiWhitespace(&result);
+  if (result.length() <= 300) {
+    absl::StrAppend(&result, " <E>");
+  } else {
+    result = result.substr(0, 300);
+  }
+  return absl::StrCat("<S> ", result);
+}
+
+// Same as BM_Normalize, with RegexNormalize() called directly rather than
+// through an interpreter.
+void BM_NormalizeRegex(benchmark::State& state) {
+  std::mt19937 rng(42);
+  const std::vector<std::string> words = RandomWords(state.range(0), &rng);
+  std::string sentence;
+  for (const std::string& word : words) {
+    absl::StrAppend(&sentence, sentence.empty() ? "" : " ", word);
+  }
+  CallRecorder recorder(&state);
+  for (auto _ : state) {
+    recorder.Record(
+        [&]() { benchmark::DoNotOptimize(RegexNormalize(sentence)); });
+  }
+  state.SetBytesProcessed(state.iterations() * sentence.size());
+}
+BENCHMARK(BM_NormalizeRegex)->Arg(4)->Arg(16)->Arg(64)->Arg(256);
+
+// Returns `count` random ngrams of one to three words.
+std::vector<std::string> RandomNgrams(int count) {
+  std::mt19937 rng(42);
+  const std::vector<std::string> words = RandomWords(1000, &rng);
+  std::vector<std::string> ngrams;
+  for (int i = 0; i < count; i++) {
+    std::string ngram = words[rng() % words.size()];
+    for (int j = rng() % 3; j > 0; j--) {
+      absl::StrAppend(&ngram, " ", words[rng() % words.size()]);
+    }
+    ngrams.push_back(ngram);
+  }
+  return ngrams;
+}
+
+// Extracts the features of state.range(0) ngrams of one to three words.
+void BM_ExtractFeatures(benchmark::State& state) {
+  const std::vector<std::string> ngrams = RandomNgrams(state.range(0));
+  SingleOp op(::tflite::ops::custom::Register_EXTRACT_FEATURES(),
+              {kTfLiteString}, {kTfLiteInt32, kTfLiteFloat32});
+  op.SetStrings(0, ngrams);
+  if (!op.Allocate()) {
+    state.SkipWithError("AllocateTensors failed");
+    return;
+  }
+  CallRecorder recorder(&state);
+  for (auto _ : state) {
+    recorder.Record([&]() { op.interpreter()->Invoke(); });
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ExtractFeatures)->Arg(8)->Arg(64)->Arg(512)->Arg(4096);
+
+// Same as BM_ExtractFeatures, with the per-ngram loop EXTRACT_FEATURES used
+// before batching, called directly rather than through an interpreter.
+void BM_ExtractFeaturesReference(benchmark::State& state) {
+  const std::vector<std::string> ngrams = RandomNgrams(state.range(0));
+  const std::vector<std::string> blacklist = {"<S>", "<E>", "<S> <E>"};
+  std::vector<int32_t> features(ngrams.size());
+  std::vector<float> weights(ngrams.size());
+  CallRecorder recorder(&state);
+  for (auto _ : state) {
+    recorder.Record([&]() {
+      for (int i = 0; i < ngrams.size(); i++) {
+        const std::string& ngram = ngrams[i];
+        if (std::find(blacklist.begin(), blacklist.end(), ngram) !=
+            blacklist.end()) {
+          features[i] = 0;
+          weights[i] = 0;
+          continue;
+        }
+        features[i] =
+            ::util::Fingerprint64(ngram.data(), ngram.size()) % 1000000;
+        weights[i] = std::count(ngram.begin(), ngram.end(), ' ') + 1;
+      }
+      benchmark::DoNotOptimize(features.data());
+      benchmark::DoNotOptimize(weights.data());
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ExtractFeaturesReference)->Arg(8)->Arg(64)->Arg(512)->Arg(4096);
+
+// A PREDICT model of kNumModelKeys keys with kItemsPerKey labels each, and
+// features of which half are keys.
+struct PredictTables {
+  std::vector<int32_t> keys;
+  std::vector<int32_t> labels;
+  std::vector<float> weights;
+  std::vector<int32_t> features;
+};
+
+PredictTables RandomPredictTables(int num_features) {
+  std::mt19937 rng(42);
+  PredictTables tables;
+  tables.keys.resize(kNumModelKeys);
+  tables.labels.resize(kNumModelKeys * kItemsPerKey);
+  tables.weights.resize(kNumModelKeys * kItemsPerKey);
+  for (int i = 0; i < kNumModelKeys; i++) {
+    tables.keys[i] = 2 * i;
+  }
+  for (int i = 0; i < tables.labels.size(); i++) {
+    tables.labels[i] = rng() % 1000;
+    tables.weights[i] = (rng() % 1000) / 1000.0f;
+  }
+  tables.features.resize(num_features);
+  for (int32_t& feature : tables.features) {
+    feature = rng() % (2 * kNumModelKeys);
+  }
+  return tables;
+}
+
+// Returns a PREDICT op on `tables`. With `constant_tables`, the keys, labels
+// and weights are constant tensors, as in a converted model, and are indexed
+// once when tensors are allocated; otherwise every Invoke() binary searches
+// the sorted keys.
+std::unique_ptr<SingleOp> PredictOp(const PredictTables& tables,
+                                    bool constant_tables) {
+  const int32_t num_output = 5;
+  const float threshold = 0.001;
+  std::vector<char> options(8);
+  memcpy(options.data(), &num_output, sizeof(num_output));
+  memcpy(options.data() + sizeof(num_output), &threshold, sizeof(threshold));
+  auto op = absl::make_unique<SingleOp>(
+      ::tflite::ops::custom::Register_PREDICT(),
+      std::vector<TfLiteType>{kTfLiteInt32, kTfLiteInt32, kTfLiteInt32,
+                              kTfLiteFloat32},
+      std::vector<TfLiteType>{kTfLiteInt32, kTfLiteFloat32}, options);
+  op->SetValues<int32_t>(0, {static_cast<int>(tables.features.size())},
+                         tables.features);
+  if (constant_tables) {
+    op->SetConstValues(1, kTfLiteInt32, {kNumModelKeys}, tables.keys);
+    op->SetConstValues(2, kTfLiteInt32, {kNumModelKeys, kItemsPerKey},
+                       tables.labels);
+    op->SetConstValues(3, kTfLiteFloat32, {kNumModelKeys, kItemsPerKey},
+                       tables.weights);
+  } else {
+    op->SetValues<int32_t>(1, {kNumModelKeys}, tables.keys);
+    op->SetValues<int32_t>(2, {kNumModelKeys, kItemsPerKey}, tables.labels);
+    op->SetValues<float>(3, {kNumModelKeys, kItemsPerKey}, tables.weights);
+  }
+  if (!op->Allocate()) {
+    return nullptr;
+  }
+  return op;
+}
+
+// Looks up state.range(0) features, half of them hits, in a constant table of
+// kNumModelKeys keys indexed beforehand.
+void BM_Predict(benchmark::State& state) {
+  const PredictTables tables = RandomPredictTables(state.range(0));
+  std::unique_ptr<SingleOp> op = PredictOp(tables, /*constant_tables=*/true);
+  if (!op) {
+    state.SkipWithError("AllocateTensors failed");
+    return;
+  }
+  CallRecorder recorder(&state);
+  for (auto _ : state) {
+    recorder.Record([&]() { op->interpreter()->Invoke(); });
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Predict)->Arg(8)->Arg(64)->Arg(512)->Arg(4096);
+
+// Same as BM_Predict on non-constant tables, which PREDICT does not index:
+// each feature is a binary search of the kNumModelKeys sorted keys.
+void BM_PredictUnindexed(benchmark::State& state) {
+  const PredictTables tables = RandomPredictTables(state.range(0));
+  std::unique_ptr<SingleOp> op = PredictOp(tables, /*constant_tables=*/false);
+  if (!op) {
+    state.SkipWithError("AllocateTensors failed");
+    return;
+  }
+  CallRecorder recorder(&state);
+  for (auto _ : state) {
+    recorder.Record([&]() { op->interpreter()->Invoke(); });
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PredictUnindexed)->Arg(8)->Arg(64)->Arg(512)->Arg(4096);
+
+// Predicts replies to every sample message with one SmartReplyPredictor.
+// state.range(0) enables the fused kernel.
+void BM_GetSegmentPredictions(benchmark::State& state) {
+  const std::vector<std::string> messages = ReadSampleMessages();
+  std::unique_ptr<FlatBufferModel> model =
+      FlatBufferModel::BuildFromFile(absl::StrCat(kSmartReply, kModel).c_str());
+  if (!model || messages.empty()) {
+    state.SkipWithError("Failed to load the model or samples");
+    return;
+  }
+  std::unique_ptr<SmartReplyPredictor> predictor =
+      SmartReplyPredictor::Create(*model, state.range(0) != 0);
+  if (!predictor) {
+    state.SkipWithError("Failed to create the predictor");
+    return;
+  }
+  const SmartReplyConfig config({});
+  std::vector<std::string> input(1);
+  std::vector<PredictorResponse> predictions;
+  int next = 0;
+  CallRecorder recorder(&state);
+  for (auto _ : state) {
+    input[0] = messages[next];
+    next = (next + 1) % messages.size();
+    predictions.clear();
+    recorder.Record(
+        [&]() { predictor->GetSegmentPredictions(input, config, &predictions); });
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetSegmentPredictions)->Arg(0)->Arg(1);
+
+// Predicts replies to the sample messages from each of state.threads threads,
+// leasing a predictor of a shared SmartReplyPredictorPool of one predictor per
+// thread for every message, as concurrent conversations do. The summed
+// items_per_second over the thread counts shows how throughput scales.
+void BM_PredictorPool(benchmark::State& state) {
+  struct Shared {
+    std::vector<std::string> messages;
+    std::unique_ptr<FlatBufferModel> model;
+    std::unique_ptr<SmartReplyPredictorPool> pool;
+  };
+  static Shared* shared = new Shared;
+  // The timing loop starts on all threads once the first one is set up.
+  if (state.thread_index == 0) {
+    if (!shared->model) {
+      shared->messages = ReadSampleMessages();
+      shared->model = FlatBufferModel::BuildFromFile(
+          absl::StrCat(kSmartReply, kModel).c_str());
+    }
+    shared->pool.reset();
+    if (shared->model) {
+      shared->pool =
+          SmartReplyPredictorPool::Create(*shared->model, state.threads);
+    }
+  }
+  const SmartReplyConfig config({});
+  std::vector<std::string> input(1);
+  std::vector<PredictorResponse> predictions;
+  int next = state.thread_index;
+  CallRecorder recorder(&state);
+  for (auto _ : state) {
+    if (!shared->pool || shared->messages.empty()) {
+      state.SkipWithError("Failed to load the model, samples or pool");
+      break;
+    }
+    input[0] = shared->messages[next++ % shared->messages.size()];
+    predictions.clear();
+    recorder.Record([&]() {
+      SmartReplyPredictorPool::Lease lease = shared->pool->TryAcquire();
+      while (!lease) {
+        std::this_thread::yield();
+        lease = shared->pool->TryAcquire();
+      }
+      lease->GetSegmentPredictions(input, config, &predictions);
+    });
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PredictorPool)
+    ->ThreadRange(1, std::max(1u, std::thread::hardware_concurrency()))
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace smartreply
+}  // namespace custom
+}  // namespace tflite
+
+BENCHMARK_MAIN();
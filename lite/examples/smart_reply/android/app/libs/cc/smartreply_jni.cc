@@ -14,37 +14,122 @@ limitations under the License.
 ==============================================================================*/
 
 #include <jni.h>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>  // NOLINT(build/c++11)
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "cc/batch_buffer.h"
 #include "cc/predictor.h"
+#include "cc/predictor_pool.h"
+#include "cc/predictor_profiler.h"
 #include "tensorflow/lite/model.h"
 
+const char kIllegalArgumentException[] = "java/lang/IllegalArgumentException";
 const char kIllegalStateException[] = "java/lang/IllegalStateException";
+const char kRejectedExecutionException[] =
+    "java/util/concurrent/RejectedExecutionException";
 const char kSmartReply[] = "org/tensorflow/lite/examples/smartreply/SmartReply";
 
-using tflite::custom::smartreply::GetSegmentPredictions;
+using tflite::custom::smartreply::AppendBatchResponse;
+using tflite::custom::smartreply::ParseBatchRequest;
+using tflite::custom::smartreply::PredictionCounters;
 using tflite::custom::smartreply::PredictorResponse;
+using tflite::custom::smartreply::SmartReplyConfig;
+using tflite::custom::smartreply::SmartReplyPredictorPool;
+using tflite::custom::smartreply::SmartReplyProfiler;
+
+// Number of interpreters pre-built per loaded model, i.e. the maximum number
+// of concurrent predictJNI calls served before callers get backpressure.
+const int kPredictorPoolSize = 4;
+
+// Classes and methods resolved once in JNI_OnLoad. The classes are global
+// references, so the IDs stay valid until the library is unloaded.
+struct JNICache {
+  jclass illegal_argument_exception;
+  jclass illegal_state_exception;
+  jclass rejected_execution_exception;
+  jclass smart_reply_class;
+  jmethodID smart_reply_ctor;
+};
+
+JNICache jni_cache;
+
+jclass FindGlobalClass(JNIEnv* env, const char* name) {
+  jclass local = env->FindClass(name);
+  if (local == nullptr) {
+    return nullptr;
+  }
+  jclass global = reinterpret_cast<jclass>(env->NewGlobalRef(local));
+  env->DeleteLocalRef(local);
+  return global;
+}
+
+extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* /*reserved*/) {
+  JNIEnv* env;
+  if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+    return JNI_ERR;
+  }
+  jni_cache.illegal_argument_exception =
+      FindGlobalClass(env, kIllegalArgumentException);
+  jni_cache.illegal_state_exception =
+      FindGlobalClass(env, kIllegalStateException);
+  jni_cache.rejected_execution_exception =
+      FindGlobalClass(env, kRejectedExecutionException);
+  jni_cache.smart_reply_class = FindGlobalClass(env, kSmartReply);
+  if (jni_cache.illegal_argument_exception == nullptr ||
+      jni_cache.illegal_state_exception == nullptr ||
+      jni_cache.rejected_execution_exception == nullptr ||
+      jni_cache.smart_reply_class == nullptr) {
+    return JNI_ERR;
+  }
+  jni_cache.smart_reply_ctor = env->GetMethodID(
+      jni_cache.smart_reply_class, "<init>", "(Ljava/lang/String;F)V");
+  if (jni_cache.smart_reply_ctor == nullptr) {
+    return JNI_ERR;
+  }
+  return JNI_VERSION_1_6;
+}
+
+extern "C" JNIEXPORT void JNICALL JNI_OnUnload(JavaVM* vm,
+                                               void* /*reserved*/) {
+  JNIEnv* env;
+  if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+    return;
+  }
+  env->DeleteGlobalRef(jni_cache.illegal_argument_exception);
+  env->DeleteGlobalRef(jni_cache.illegal_state_exception);
+  env->DeleteGlobalRef(jni_cache.rejected_execution_exception);
+  env->DeleteGlobalRef(jni_cache.smart_reply_class);
+  jni_cache = JNICache();
+}
 
 template <typename T>
 T CheckNotNull(JNIEnv* env, T&& t) {
   if (t == nullptr) {
-    env->ThrowNew(env->FindClass(kIllegalStateException), "");
+    env->ThrowNew(jni_cache.illegal_state_exception, "");
     return nullptr;
   }
   return std::forward<T>(t);
 }
 
+// Copies each string of `string_array` straight into a std::string, without
+// the intermediate buffer of GetStringUTFChars.
 std::vector<std::string> jniStringArrayToVector(JNIEnv* env,
                                                 jobjectArray string_array) {
   int count = env->GetArrayLength(string_array);
-  std::vector<std::string> result;
+  std::vector<std::string> result(count);
   for (int i = 0; i < count; i++) {
     auto jstr =
         reinterpret_cast<jstring>(env->GetObjectArrayElement(string_array, i));
-    const char* raw_str = env->GetStringUTFChars(jstr, JNI_FALSE);
-    result.emplace_back(std::string(raw_str));
-    env->ReleaseStringUTFChars(jstr, raw_str);
+    // The region is NUL-terminated, which lands on the terminator of the
+    // std::string.
+    result[i].resize(env->GetStringUTFLength(jstr));
+    env->GetStringUTFRegion(jstr, 0, env->GetStringLength(jstr), &result[i][0]);
+    env->DeleteLocalRef(jstr);
   }
   return result;
 }
@@ -52,8 +137,34 @@ std::vector<std::string> jniStringArrayToVector(JNIEnv* env,
 struct JNIStorage {
   std::vector<std::string> backoff_list;
   std::unique_ptr<::tflite::FlatBufferModel> model;
+  // Declared after `model` so that it is destroyed first.
+  std::unique_ptr<SmartReplyPredictorPool> predictor_pool;
+
+  // Predictions are profiled while `profiling` is set, each with its own
+  // profiler, and their profiles summed in `profile_counters`.
+  std::atomic<bool> profiling{false};
+  std::mutex profile_mu;
+  PredictionCounters profile_counters;
 };
 
+// Returns a profiler for one prediction call if profiling is enabled.
+std::unique_ptr<SmartReplyProfiler> MaybeProfile(JNIStorage* storage,
+                                                 SmartReplyConfig* config) {
+  if (!storage->profiling.load(std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  std::unique_ptr<SmartReplyProfiler> profiler(new SmartReplyProfiler);
+  config->profiler = profiler.get();
+  return profiler;
+}
+
+void RecordProfile(JNIStorage* storage, const SmartReplyProfiler* profiler) {
+  if (profiler != nullptr) {
+    std::lock_guard<std::mutex> lock(storage->profile_mu);
+    storage->profile_counters.Add(profiler->counters());
+  }
+}
+
 extern "C" JNIEXPORT jlong JNICALL
 Java_org_tensorflow_lite_examples_smartreply_SmartReplyClient_loadJNI(
     JNIEnv* env, jobject thiz, jobject model_buffer,
@@ -69,7 +180,14 @@ Java_org_tensorflow_lite_examples_smartreply_SmartReplyClient_loadJNI(
 
   if (!storage->model) {
     delete storage;
-    env->ThrowNew(env->FindClass(kIllegalStateException), "");
+    env->ThrowNew(jni_cache.illegal_state_exception, "");
+    return 0;
+  }
+  storage->predictor_pool =
+      SmartReplyPredictorPool::Create(*storage->model, kPredictorPoolSize);
+  if (!storage->predictor_pool) {
+    delete storage;
+    env->ThrowNew(jni_cache.illegal_state_exception, "");
     return 0;
   }
   return reinterpret_cast<jlong>(storage);
@@ -87,22 +205,25 @@ Java_org_tensorflow_lite_examples_smartreply_SmartReplyClient_predictJNI(
     return nullptr;
   }
   std::vector<PredictorResponse> responses;
-  GetSegmentPredictions(jniStringArrayToVector(env, input_text),
-                        *storage->model, {storage->backoff_list}, &responses);
+  SmartReplyConfig config(storage->backoff_list);
+  std::unique_ptr<SmartReplyProfiler> profiler = MaybeProfile(storage, &config);
+  {
+    SmartReplyPredictorPool::Lease predictor =
+        storage->predictor_pool->TryAcquire();
+    if (!predictor) {
+      env->ThrowNew(jni_cache.rejected_execution_exception,
+                    "All SmartReply predictors are busy");
+      return nullptr;
+    }
+    predictor->GetSegmentPredictions(jniStringArrayToVector(env, input_text),
+                                     config, &responses);
+  }
+  RecordProfile(storage, profiler.get());
 
   // Create a SmartReply[] to return back to Java
-  jclass smart_reply_class = CheckNotNull(env, env->FindClass(kSmartReply));
-  if (env->ExceptionCheck()) {
-    return nullptr;
-  }
-  jmethodID smart_reply_ctor = CheckNotNull(
-      env,
-      env->GetMethodID(smart_reply_class, "<init>", "(Ljava/lang/String;F)V"));
-  if (env->ExceptionCheck()) {
-    return nullptr;
-  }
   jobjectArray array = CheckNotNull(
-      env, env->NewObjectArray(responses.size(), smart_reply_class, nullptr));
+      env, env->NewObjectArray(responses.size(), jni_cache.smart_reply_class,
+                               nullptr));
   if (env->ExceptionCheck()) {
     return nullptr;
   }
@@ -112,10 +233,111 @@ Java_org_tensorflow_lite_examples_smartreply_SmartReplyClient_predictJNI(
     if (env->ExceptionCheck()) {
       return nullptr;
     }
-    jobject reply = env->NewObject(smart_reply_class, smart_reply_ctor, text,
-                                   responses[i].GetScore());
+    jobject reply =
+        env->NewObject(jni_cache.smart_reply_class, jni_cache.smart_reply_ctor,
+                       text, responses[i].GetScore());
     env->SetObjectArrayElement(array, i, reply);
+    env->DeleteLocalRef(reply);
+    env->DeleteLocalRef(text);
+  }
+  return array;
+}
+
+// Predicts replies for a batch of conversations encoded in the direct buffer
+// `input` (see batch_buffer.h), holding one predictor for the whole batch.
+// The response is written to the direct buffer `output`.
+//
+// Returns the size of the response. If it exceeds the capacity of `output`,
+// nothing is written and the caller retries with a large enough buffer.
+extern "C" JNIEXPORT jint JNICALL
+Java_org_tensorflow_lite_examples_smartreply_SmartReplyClient_predictBatchJNI(
+    JNIEnv* env, jobject /*thiz*/, jlong storage_ptr, jobject input,
+    jint input_length, jobject output) {
+  if (storage_ptr == 0) {
+    return 0;
+  }
+  JNIStorage* storage = reinterpret_cast<JNIStorage*>(storage_ptr);
+  const char* input_data =
+      static_cast<const char*>(env->GetDirectBufferAddress(input));
+  char* output_data = static_cast<char*>(env->GetDirectBufferAddress(output));
+  if (input_data == nullptr || output_data == nullptr || input_length < 0 ||
+      input_length > env->GetDirectBufferCapacity(input)) {
+    env->ThrowNew(jni_cache.illegal_argument_exception,
+                  "Batch buffers must be direct ByteBuffers");
+    return 0;
+  }
+
+  std::vector<std::vector<std::string>> conversations;
+  if (!ParseBatchRequest(absl::string_view(input_data, input_length),
+                         &conversations)) {
+    env->ThrowNew(jni_cache.illegal_argument_exception,
+                  "Malformed SmartReply batch request");
+    return 0;
+  }
+
+  std::string response;
+  SmartReplyConfig config(storage->backoff_list);
+  std::unique_ptr<SmartReplyProfiler> profiler = MaybeProfile(storage, &config);
+  {
+    SmartReplyPredictorPool::Lease predictor =
+        storage->predictor_pool->TryAcquire();
+    if (!predictor) {
+      env->ThrowNew(jni_cache.rejected_execution_exception,
+                    "All SmartReply predictors are busy");
+      return 0;
+    }
+    std::vector<PredictorResponse> responses;
+    for (const std::vector<std::string>& conversation : conversations) {
+      responses.clear();
+      predictor->GetSegmentPredictions(conversation, config, &responses);
+      AppendBatchResponse(responses, &response);
+    }
+  }
+  RecordProfile(storage, profiler.get());
+
+  if (response.size() <= env->GetDirectBufferCapacity(output)) {
+    memcpy(output_data, response.data(), response.size());
+  }
+  return response.size();
+}
+
+// Enables or disables profiling of predictions. Enabling resets the counters.
+extern "C" JNIEXPORT void JNICALL
+Java_org_tensorflow_lite_examples_smartreply_SmartReplyClient_setProfilingJNI(
+    JNIEnv* env, jobject /*thiz*/, jlong storage_ptr, jboolean enabled) {
+  if (storage_ptr == 0) {
+    return;
+  }
+  JNIStorage* storage = reinterpret_cast<JNIStorage*>(storage_ptr);
+  if (enabled) {
+    std::lock_guard<std::mutex> lock(storage->profile_mu);
+    storage->profile_counters = PredictionCounters();
+  }
+  storage->profiling.store(enabled, std::memory_order_relaxed);
+}
+
+// Returns the profile counters as {requests, segments, cache hits, and the
+// split sentence, model, merge, backoff and total microseconds}.
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_org_tensorflow_lite_examples_smartreply_SmartReplyClient_getProfileCountersJNI(
+    JNIEnv* env, jobject /*thiz*/, jlong storage_ptr) {
+  PredictionCounters counters;
+  if (storage_ptr != 0) {
+    JNIStorage* storage = reinterpret_cast<JNIStorage*>(storage_ptr);
+    std::lock_guard<std::mutex> lock(storage->profile_mu);
+    counters = storage->profile_counters;
+  }
+  const jlong values[] = {
+      counters.requests,          counters.segments, counters.cache_hits,
+      counters.split_sentence_us, counters.model_us, counters.merge_us,
+      counters.backoff_us,        counters.total_us,
+  };
+  const int num_values = sizeof(values) / sizeof(values[0]);
+  jlongArray array = CheckNotNull(env, env->NewLongArray(num_values));
+  if (env->ExceptionCheck()) {
+    return nullptr;
   }
+  env->SetLongArrayRegion(array, 0, num_values, values);
   return array;
 }
 
@@ -24,10 +24,15 @@ import java.io.BufferedReader;
 import java.io.FileInputStream;
 import java.io.IOException;
 import java.io.InputStreamReader;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 import java.nio.MappedByteBuffer;
 import java.nio.channels.FileChannel;
+import java.nio.charset.StandardCharsets;
 import java.util.ArrayList;
 import java.util.List;
+import java.util.concurrent.locks.ReadWriteLock;
+import java.util.concurrent.locks.ReentrantReadWriteLock;
 
 /** Interface to load TfLite model and provide predictions. */
 public class SmartReplyClient implements AutoCloseable {
@@ -35,8 +40,13 @@ public class SmartReplyClient implements AutoCloseable {
   private static final String MODEL_PATH = "smartreply.tflite";
   private static final String BACKOFF_PATH = "backoff_response.txt";
   private static final String JNI_LIB = "smartreply_jni";
+  // Initial guess of the encoded size of the replies to one conversation.
+  private static final int BATCH_BYTES_PER_CONVERSATION = 512;
 
   private final Context context;
+  // Predictions only need the native storage to stay alive, so they share the read lock and may
+  // run concurrently on the native predictor pool. Loading and closing take the write lock.
+  private final ReadWriteLock storageLock = new ReentrantReadWriteLock();
   private long storage;
   private MappedByteBuffer model;
 
@@ -57,6 +67,7 @@ public class SmartReplyClient implements AutoCloseable {
       isLibraryLoaded = true;
     }
 
+    storageLock.writeLock().lock();
     try {
       model = loadModelFile();
       String[] backoff = loadBackoffList();
@@ -64,16 +75,144 @@ public class SmartReplyClient implements AutoCloseable {
     } catch (IOException e) {
       Log.e(TAG, "Fail to load model", e);
       return;
+    } finally {
+      storageLock.writeLock().unlock();
     }
   }
 
+  /**
+   * Predicts replies for the given conversation. Safe to call from several threads at once.
+   *
+   * @throws java.util.concurrent.RejectedExecutionException if every native predictor is busy.
+   */
   @WorkerThread
-  public synchronized SmartReply[] predict(String[] input) {
-    if (storage != 0) {
-      return predictJNI(storage, input);
-    } else {
-      return new SmartReply[] {};
+  public SmartReply[] predict(String[] input) {
+    storageLock.readLock().lock();
+    try {
+      if (storage != 0) {
+        return predictJNI(storage, input);
+      } else {
+        return new SmartReply[] {};
+      }
+    } finally {
+      storageLock.readLock().unlock();
+    }
+  }
+
+  /**
+   * Predicts replies for many conversations in a single native call. Safe to call from several
+   * threads at once.
+   *
+   * @throws java.util.concurrent.RejectedExecutionException if every native predictor is busy.
+   */
+  @WorkerThread
+  public SmartReply[][] predictBatch(String[][] conversations) {
+    ByteBuffer request = encodeBatchRequest(conversations);
+    ByteBuffer response =
+        ByteBuffer.allocateDirect(BATCH_BYTES_PER_CONVERSATION * (conversations.length + 1))
+            .order(ByteOrder.nativeOrder());
+    storageLock.readLock().lock();
+    try {
+      if (storage == 0) {
+        return new SmartReply[conversations.length][0];
+      }
+      int size = predictBatchJNI(storage, request, request.limit(), response);
+      if (size > response.capacity()) {
+        // Rare: the replies did not fit the initial guess.
+        response = ByteBuffer.allocateDirect(size).order(ByteOrder.nativeOrder());
+        size = predictBatchJNI(storage, request, request.limit(), response);
+      }
+      response.limit(size);
+    } finally {
+      storageLock.readLock().unlock();
+    }
+    return decodeBatchResponse(response, conversations.length);
+  }
+
+  /** Prediction time counters, summed over the predictions profiled so far. */
+  public static final class ProfileCounters {
+    public final long requests;
+    public final long segments;
+    public final long cacheHits;
+    public final long splitSentenceMicros;
+    public final long modelMicros;
+    public final long mergeMicros;
+    public final long backoffMicros;
+    public final long totalMicros;
+
+    // Takes the values in the order of getProfileCountersJNI.
+    private ProfileCounters(long[] values) {
+      requests = values[0];
+      segments = values[1];
+      cacheHits = values[2];
+      splitSentenceMicros = values[3];
+      modelMicros = values[4];
+      mergeMicros = values[5];
+      backoffMicros = values[6];
+      totalMicros = values[7];
+    }
+  }
+
+  /** Enables or disables profiling of predictions. Enabling resets the counters. */
+  public void setProfilingEnabled(boolean enabled) {
+    storageLock.readLock().lock();
+    try {
+      if (storage != 0) {
+        setProfilingJNI(storage, enabled);
+      }
+    } finally {
+      storageLock.readLock().unlock();
+    }
+  }
+
+  /** Returns the counters of the predictions profiled since profiling was enabled. */
+  public ProfileCounters getProfileCounters() {
+    storageLock.readLock().lock();
+    try {
+      return new ProfileCounters(getProfileCountersJNI(storage));
+    } finally {
+      storageLock.readLock().unlock();
+    }
+  }
+
+  // Encodes conversations in the batch request format of cc/batch_buffer.h.
+  private static ByteBuffer encodeBatchRequest(String[][] conversations) {
+    byte[][][] messages = new byte[conversations.length][][];
+    int size = 4;
+    for (int i = 0; i < conversations.length; i++) {
+      messages[i] = new byte[conversations[i].length][];
+      size += 4;
+      for (int j = 0; j < conversations[i].length; j++) {
+        messages[i][j] = conversations[i][j].getBytes(StandardCharsets.UTF_8);
+        size += 4 + messages[i][j].length;
+      }
+    }
+    ByteBuffer request = ByteBuffer.allocateDirect(size).order(ByteOrder.nativeOrder());
+    request.putInt(messages.length);
+    for (byte[][] conversation : messages) {
+      request.putInt(conversation.length);
+      for (byte[] message : conversation) {
+        request.putInt(message.length);
+        request.put(message);
+      }
+    }
+    request.flip();
+    return request;
+  }
+
+  // Decodes the batch response format of cc/batch_buffer.h.
+  private static SmartReply[][] decodeBatchResponse(ByteBuffer response, int numConversations) {
+    SmartReply[][] replies = new SmartReply[numConversations][];
+    for (int i = 0; i < numConversations; i++) {
+      replies[i] = new SmartReply[response.getInt()];
+      for (int j = 0; j < replies[i].length; j++) {
+        float score = response.getFloat();
+        byte[] text = new byte[response.getInt()];
+        response.get(text);
+        replies[i][j] = new SmartReply(new String(text, StandardCharsets.UTF_8), score);
+      }
     }
+    return replies;
   }
 
   @WorkerThread
@@ -83,9 +222,14 @@ public class SmartReplyClient implements AutoCloseable {
 
   @Override
   public synchronized void close() {
-    if (storage != 0) {
-      unloadJNI(storage);
-      storage = 0;
+    storageLock.writeLock().lock();
+    try {
+      if (storage != 0) {
+        unloadJNI(storage);
+        storage = 0;
+      }
+    } finally {
+      storageLock.writeLock().unlock();
     }
   }
 
@@ -122,6 +266,16 @@ public class SmartReplyClient implements AutoCloseable {
   @Keep
   private native SmartReply[] predictJNI(long storage, String[] text);
 
+  @Keep
+  private native int predictBatchJNI(
+      long storage, ByteBuffer request, int requestLength, ByteBuffer response);
+
+  @Keep
+  private native void setProfilingJNI(long storage, boolean enabled);
+
+  @Keep
+  private native long[] getProfileCountersJNI(long storage);
+
   @Keep
   private native void unloadJNI(long storage);
 }